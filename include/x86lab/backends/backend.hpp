@@ -0,0 +1,121 @@
+#pragma once
+#include <x86lab/vm.hpp>
+
+// Backends run the vCpu of a Vm. The Vm owns the guest's physical memory and
+// implements everything that only needs to read it (snapshots, instruction
+// fetching, ...), while the backend holds the state of the vCpu and executes
+// the instructions.
+namespace X86Lab {
+
+// Interface of a backend. Each backend is created with the guest's physical
+// memory, mapped at guest physical address 0, and is destroyed before the
+// memory is released.
+class Vm::Backend {
+public:
+    // Virtual destructor to ensure calling derived destructors.
+    virtual ~Backend() = 0;
+
+    // Get the current values of the registers on the vCpu.
+    // @return: The values of the registers.
+    State::Registers getRegisters() const;
+
+    // Set the values of the registers on the vCpu. The values of the segment
+    // selectors are ignored, see Vm::setRegisters().
+    // @param regs: The values to write.
+    void setRegisters(State::Registers const& regs);
+
+    // Get the current extended state of the vCpu.
+    // @return: The extended state.
+    State::ExtendedState getExtendedState() const;
+
+    // Set the extended state of the vCpu.
+    // @param state: The extended state to write.
+    void setExtendedState(State::ExtendedState const& state);
+
+    // Get the current registers and extended state of the vCpu at once.
+    // @return: The values of the registers and the extended state.
+    std::pair<State::Registers, State::ExtendedState> getCpuState() const;
+
+    // Get the current value of the instruction pointer.
+    // @return: The value of rip.
+    u64 instructionPointer() const;
+
+    // Get the current code segment, including its hidden part.
+    // @return: The code segment.
+    State::ExtendedState::Segment codeSegment() const;
+
+    // Translate a linear address using the vCpu's current paging mode.
+    // @param linearAddr: The linear address to translate.
+    // @return: The physical address, or an empty optional if the address is
+    // not mapped.
+    std::optional<u64> translate(u64 const linearAddr) const;
+
+    // Execute a single instruction.
+    // @return: The OperatingState after executing the instruction.
+    OperatingState step();
+
+    // Execute instructions until reaching the instruction at the given
+    // address.
+    // @param rip: The address of the instruction to stop at, relative to the
+    // current code segment.
+    // @return: The OperatingState after reaching the instruction or stopping
+    // for any other reason.
+    OperatingState runUntil(u64 const rip);
+
+    // Get the effects of the last step() or runUntil().
+    // @return: The effects if this backend records them, an empty optional
+    // otherwise.
+    std::optional<StepEffects> lastStepEffects() const;
+
+    // Invalidate the translations cached by the vCpu, including the paging
+    // structure caches, e.g. after modifying the page tables from the host.
+    void invalidateTranslations();
+
+    // Check if the memory types set by the guest, see Vm::setMemoryType(),
+    // apply to its accesses.
+    // @return: true if the memory types are honored, false if all the
+    // accesses are write-back regardless of the page tables.
+    bool honorsMemoryTypes() const;
+
+private:
+    // Implementation of getRegisters, to be defined by sub-class.
+    virtual State::Registers doGetRegisters() const = 0;
+
+    // Implementation of setRegisters, to be defined by sub-class.
+    virtual void doSetRegisters(State::Registers const& regs) = 0;
+
+    // Implementation of getExtendedState, to be defined by sub-class.
+    virtual State::ExtendedState doGetExtendedState() const = 0;
+
+    // Implementation of setExtendedState, to be defined by sub-class.
+    virtual void doSetExtendedState(State::ExtendedState const& state) = 0;
+
+    // Implementation of getCpuState, to be defined by sub-class.
+    virtual std::pair<State::Registers, State::ExtendedState>
+        doGetCpuState() const = 0;
+
+    // Implementation of instructionPointer, to be defined by sub-class.
+    virtual u64 doInstructionPointer() const = 0;
+
+    // Implementation of codeSegment, to be defined by sub-class.
+    virtual State::ExtendedState::Segment doCodeSegment() const = 0;
+
+    // Implementation of translate, to be defined by sub-class.
+    virtual std::optional<u64> doTranslate(u64 const linearAddr) const = 0;
+
+    // Implementation of step, to be defined by sub-class.
+    virtual OperatingState doStep() = 0;
+
+    // Implementation of runUntil, to be defined by sub-class.
+    virtual OperatingState doRunUntil(u64 const rip) = 0;
+
+    // Implementation of lastStepEffects, to be defined by sub-class.
+    virtual std::optional<StepEffects> doLastStepEffects() const = 0;
+
+    // Implementation of invalidateTranslations, to be defined by sub-class.
+    virtual void doInvalidateTranslations() = 0;
+
+    // Implementation of honorsMemoryTypes, to be defined by sub-class.
+    virtual bool doHonorsMemoryTypes() const = 0;
+};
+}
@@ -0,0 +1,136 @@
+#pragma once
+#include <x86lab/backends/backend.hpp>
+
+namespace X86Lab::Backends {
+
+// Backend interpreting the guest's instructions in-process, without KVM. This
+// avoids a VM entry/exit and the register ioctls on every step and works on
+// hosts without access to /dev/kvm. The memory written by each instruction is
+// recorded as it executes, see Vm::StepEffects.
+// Only the general-purpose integer instructions are supported: data movement,
+// arithmetic and logic, shifts and rotates, multiplications and divisions,
+// stack operations, near control flow, flag manipulation and string
+// instructions. Executing any other instruction (x87, SIMD, system
+// instructions, far control flow, segment loads outside of real mode, ...)
+// stops the vCpu with OperatingState::SingleStepError, before any of its
+// effects. Exceptions are not delivered: an instruction raising one stops the
+// vCpu with OperatingState::Shutdown if no IDT is loaded, as a triple fault
+// would under KVM, or SingleStepError otherwise.
+// Paging is supported in all modes, and the accessed and dirty bits are set in
+// the page tables. Segment limits and page protections are not enforced.
+class Emulator : public Vm::Backend {
+public:
+    // Create an emulator. The initial state of the vCpu is the same as KVM's
+    // after a reset, e.g. real mode.
+    // @param memory: The guest's physical memory.
+    // @param memorySize: The size of the guest's physical memory in bytes.
+    Emulator(u8 * const memory, u64 const memorySize);
+
+private:
+    // Implementation of getRegisters.
+    virtual Vm::State::Registers doGetRegisters() const;
+
+    // Implementation of setRegisters.
+    virtual void doSetRegisters(Vm::State::Registers const& regs);
+
+    // Implementation of getExtendedState.
+    virtual Vm::State::ExtendedState doGetExtendedState() const;
+
+    // Implementation of setExtendedState.
+    virtual void doSetExtendedState(Vm::State::ExtendedState const& state);
+
+    // Implementation of getCpuState.
+    virtual std::pair<Vm::State::Registers, Vm::State::ExtendedState>
+        doGetCpuState() const;
+
+    // Implementation of instructionPointer.
+    virtual u64 doInstructionPointer() const;
+
+    // Implementation of codeSegment.
+    virtual Vm::State::ExtendedState::Segment doCodeSegment() const;
+
+    // Implementation of translate.
+    virtual std::optional<u64> doTranslate(u64 const linearAddr) const;
+
+    // Implementation of step.
+    virtual Vm::OperatingState doStep();
+
+    // Implementation of runUntil.
+    virtual Vm::OperatingState doRunUntil(u64 const rip);
+
+    // Implementation of lastStepEffects.
+    virtual std::optional<Vm::StepEffects> doLastStepEffects() const;
+
+    // Implementation of invalidateTranslations. The emulator walks the page
+    // tables on every access, hence this is a no-op.
+    virtual void doInvalidateTranslations();
+
+    // Implementation of honorsMemoryTypes. The emulator has no caches, memory
+    // types are ignored.
+    virtual bool doHonorsMemoryTypes() const;
+
+    // Decodes and executes a single instruction, defined in emulator.cpp.
+    class Instruction;
+
+    // Execute the instruction pointed by rip. Its memory writes are appended to
+    // m_effects.
+    // @return: The OperatingState after executing the instruction.
+    Vm::OperatingState execute();
+
+    // The page table entries used to translate a linear address, see walk().
+    struct PageWalk {
+        // The physical address the linear address translates to.
+        u64 physAddr;
+        // The physical addresses of the entries that were used, from the root
+        // of the hierarchy to the leaf. PAE's PDPTEs are not included since
+        // they do not have accessed and dirty bits.
+        static constexpr u8 MaxEntries = 4;
+        u64 entries[MaxEntries];
+        u8 numEntries;
+        // The size of each entry in bytes.
+        u8 entrySize;
+    };
+
+    // Translate a linear address using the current paging mode, without
+    // modifying the page tables.
+    // @param linearAddr: The linear address to translate.
+    // @return: The result of the walk, or an empty optional if the address is
+    // not mapped.
+    std::optional<PageWalk> walk(u64 const linearAddr) const;
+
+    // Translate a linear address accessed by the current instruction and set
+    // the accessed bits, and the dirty bit on writes, of the entries used. The
+    // entries modified are recorded in m_effects.
+    // @param linearAddr: The linear address to translate.
+    // @param write: If true, the address is written to.
+    // @return: The physical address, or an empty optional if the address is
+    // not mapped.
+    std::optional<u64> translateAccess(u64 const linearAddr, bool const write);
+
+    // Pointer to the guest's physical memory.
+    u8 * const m_memory;
+
+    // The size of the guest's physical memory in bytes.
+    u64 const m_memorySize;
+
+    // The general purpose registers in the order of their encoding, e.g. rax,
+    // rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, ..., r15.
+    static constexpr u8 NumGprs = 16;
+    u64 m_gprs[NumGprs];
+
+    // Instruction pointer and flags.
+    u64 m_rip;
+    u64 m_rflags;
+
+    // All the other registers. The general purpose registers, rip, rflags and
+    // segment selectors in there are stale, the values above and in
+    // m_extendedState are used instead.
+    Vm::State::Registers m_regs;
+
+    // The extended state, including the segment registers.
+    Vm::State::ExtendedState m_extendedState;
+
+    // The effects of the last step() or runUntil().
+    Vm::StepEffects m_effects;
+};
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <x86lab/backends/backend.hpp>
+
+namespace X86Lab::Backends {
+
+// Backend running the vCpu under KVM. Each step is a VM entry/exit with
+// single-stepping enabled.
+class Kvm : public Vm::Backend {
+public:
+    // Create the KVM VM and its vCpu and map the guest's physical memory.
+    // @param memory: The guest's physical memory.
+    // @param memorySize: The size of the guest's physical memory in bytes.
+    // @throws: A KvmError is thrown in case of any error related to the KVM
+    // initialization.
+    Kvm(void * const memory, u64 const memorySize);
+
+    // Release the KVM resources.
+    ~Kvm();
+
+private:
+    // Implementation of getRegisters.
+    virtual Vm::State::Registers doGetRegisters() const;
+
+    // Implementation of setRegisters.
+    virtual void doSetRegisters(Vm::State::Registers const& regs);
+
+    // Implementation of getExtendedState.
+    virtual Vm::State::ExtendedState doGetExtendedState() const;
+
+    // Implementation of setExtendedState.
+    virtual void doSetExtendedState(Vm::State::ExtendedState const& state);
+
+    // Implementation of getCpuState.
+    virtual std::pair<Vm::State::Registers, Vm::State::ExtendedState>
+        doGetCpuState() const;
+
+    // Implementation of instructionPointer.
+    virtual u64 doInstructionPointer() const;
+
+    // Implementation of codeSegment.
+    virtual Vm::State::ExtendedState::Segment doCodeSegment() const;
+
+    // Implementation of translate.
+    virtual std::optional<u64> doTranslate(u64 const linearAddr) const;
+
+    // Implementation of step.
+    virtual Vm::OperatingState doStep();
+
+    // Implementation of runUntil.
+    virtual Vm::OperatingState doRunUntil(u64 const rip);
+
+    // Implementation of lastStepEffects. KVM does not report the effects of
+    // the instructions, hence this always returns an empty optional.
+    virtual std::optional<Vm::StepEffects> doLastStepEffects() const;
+
+    // Implementation of invalidateTranslations.
+    virtual void doInvalidateTranslations();
+
+    // Implementation of honorsMemoryTypes. Depends on whether the host allows
+    // to disable the "ignore guest PAT" quirk, see Util::Kvm::honorGuestPat().
+    virtual bool doHonorsMemoryTypes() const;
+
+    // Run the vCpu with the given debug configuration until the next exit.
+    // Implementation of doStep() and doRunUntil().
+    // @param dbg: The guest debug configuration to run with.
+    // @return: The OperatingState of the vCpu after the run.
+    // @throws: KvmError in case of any KVM ioctl error.
+    Vm::OperatingState run(kvm_guest_debug const& dbg);
+
+    // Read the extended state of the vCpu, re-using the special registers
+    // already read by the caller.
+    // @param sregs: The current special registers of the vCpu.
+    // @return: The extended state.
+    Vm::State::ExtendedState extendedState(kvm_sregs const& sregs) const;
+
+    // File descriptor for the KVM.
+    int const m_vmFd;
+
+    // File descriptor for the vCpu.
+    int const m_vcpuFd;
+
+    // Reference to the kvm_run structure associated with the vCpu. For now we
+    // only read the kvm_run structure to get information on the exit reason,
+    // hence use const reference.
+    kvm_run const& m_kvmRun;
+
+    // true if KVM honors the memory types set by the guest.
+    bool m_honorsGuestPat;
+};
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <x86lab/snapshot.hpp>
+#include <x86lab/util.hpp>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace X86Lab {
+// The dynamic data-dependency graph of the instructions executed over a
+// history, and its critical path. Each executed instruction is a node which
+// depends on the instructions that last wrote the registers and memory it
+// reads, e.g. the def-use chains of the execution. Only true dependencies are
+// kept: re-using a register or a memory location does not create a dependency
+// since the cpu renames registers and forwards stores. Likewise, zeroing idioms
+// such as xor eax, eax do not depend on their operands.
+// Counting one cycle per instruction, the critical path is the longest chain
+// of dependent instructions, e.g. the lower bound of the execution time on an
+// infinitely wide cpu. Speeding up a kernel bound by its latency requires
+// breaking this chain.
+// Memory is tracked at the granularity of a byte, by linear address. Control
+// dependencies are ignored, branches are assumed to be predicted.
+class DependencyGraph {
+public:
+    // The data accessed by the instruction executed at a step.
+    struct Step {
+        // The address of the instruction.
+        u64 rip;
+        // The registers read, resp. written, named after the full register
+        // they are part of, see Disassembler::Instruction.
+        std::vector<std::string> regsRead;
+        std::vector<std::string> regsWritten;
+        // The linear memory ranges read, resp. written, as pairs <address,
+        // size>.
+        std::vector<std::pair<u64, u64>> memRead;
+        std::vector<std::pair<u64, u64>> memWritten;
+    };
+
+    // A node of the graph, e.g. the instruction executed at a step.
+    struct Node {
+        // The step at which the instruction executes, e.g. rip points to the
+        // instruction in the snapshot of this step.
+        u64 step;
+        // The address of the instruction.
+        u64 rip;
+        // The steps of the instructions this one depends on, in ascending
+        // order.
+        std::vector<u64> dependencies;
+        // The number of instructions in the longest chain of dependent
+        // instructions ending with this one, including it.
+        u64 depth;
+    };
+
+    // Build the graph from the accesses of each step.
+    // @param steps: The accesses of the instruction executed at each step, in
+    // order, e.g. steps[i] is executed at step i.
+    // @param cancelled: If not nullptr, the construction is abandoned once
+    // this flag is set, e.g. by another thread.
+    // @throws: An Error if the construction was cancelled.
+    DependencyGraph(
+        std::vector<Step> const& steps,
+        std::shared_ptr<std::atomic<bool> const> const cancelled = nullptr);
+
+    // Build the graph of the instructions executed over a history. The
+    // instructions are decoded from the memory of each snapshot, see
+    // Disassembler, and the effective addresses of their memory operands
+    // computed from its registers. Decoding is spread across the threads of
+    // the pool. Instructions that cannot be decoded have no dependency.
+    // A rep-prefixed string instruction can execute several iterations in a
+    // single step, its memory ranges cover all of them as given by the
+    // decrease of rcx.
+    // @param last: The last snapshot of the history. The history is made of
+    // its chain of bases, as with HistoryQuery. The instruction at the last
+    // step has not executed yet, hence is not part of the graph.
+    // @param cancelled: If not nullptr, the analysis is abandoned once this
+    // flag is set, e.g. when the history it covers is discarded.
+    // @param pool: The pool running the decoding.
+    // @return: The graph.
+    // @throws: An Error if the disassembler cannot be initialized or if the
+    // analysis was cancelled.
+    static DependencyGraph fromHistory(
+        std::shared_ptr<Snapshot const> const last,
+        std::shared_ptr<std::atomic<bool> const> const cancelled = nullptr,
+        Util::ThreadPool& pool = Util::ThreadPool::shared());
+
+    // Get all the nodes of the graph.
+    // @return: The nodes, one per step, in order.
+    std::vector<Node> const& nodes() const;
+
+    // Get the critical path of the graph. Among chains of equal length, the
+    // one ending first is selected.
+    // @return: The steps of the instructions on the critical path, in
+    // ascending order. Empty if the graph is empty.
+    std::vector<u64> const& criticalPath() const;
+
+    // Get the instructions on the critical path, e.g. to highlight them.
+    // @return: Maps the address of each instruction on the critical path to
+    // the number of times it appears on it.
+    std::map<u64, u64> const& criticalInstructions() const;
+
+private:
+    // The nodes, one per step.
+    std::vector<Node> m_nodes;
+    // The steps on the critical path, in ascending order.
+    std::vector<u64> m_criticalPath;
+    // The number of occurrences of each instruction on the critical path.
+    std::map<u64, u64> m_criticalInstructions;
+};
+}
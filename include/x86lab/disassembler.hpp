@@ -0,0 +1,128 @@
+#pragma once
+#include <x86lab/vm.hpp>
+#include <capstone/capstone.h>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace X86Lab {
+// Decode guest instructions using Capstone. Used to reason about the code
+// being run, e.g. to find where the current basic block ends.
+class Disassembler {
+public:
+    // A memory operand of an instruction.
+    struct MemoryOperand {
+        // The registers used to compute the address, as named by Capstone,
+        // e.g. "eax" with an address-size override. Empty if not used. An
+        // empty segment means the default segment.
+        std::string segment;
+        std::string base;
+        std::string index;
+        // The scale applied to the index.
+        u64 scale;
+        // The displacement.
+        int64_t disp;
+        // The size of the access in bytes.
+        u64 size;
+        // True if the operand is read, resp. written. Operands which access
+        // is not reported by Capstone are assumed to be read.
+        bool read;
+        bool write;
+    };
+
+    // A decoded instruction.
+    struct Instruction {
+        // The address of the instruction.
+        u64 address;
+        // The length of the instruction in bytes.
+        u64 size;
+        // The mnemonic of the instruction, e.g. "mov".
+        std::string mnemonic;
+        // The operands of the instruction, e.g. "rax, rbx".
+        std::string operands;
+        // True if this instruction ends a basic block, e.g. it can change the
+        // control flow (jumps, calls, returns, interrupts) or stops the cpu
+        // (hlt).
+        bool endsBlock;
+        // True if this instruction may write memory, either through an
+        // explicit memory operand or implicitly (stack, string and system
+        // instructions). This is conservative: false guarantees that the
+        // instruction does not write memory, unless it raises an exception.
+        // The accessed and dirty bits set by the cpu in the page tables when
+        // translating the instruction's accesses are not writes in that
+        // sense, any instruction may set them.
+        bool mayWriteMemory;
+        // The registers read, resp. written, by this instruction, explicitly
+        // or implicitly (e.g. rflags for adc, rsp for push). Each register is
+        // named after the full register it is part of, e.g. "rax" for al or
+        // "zmm1" for xmm1. rip is not reported.
+        std::vector<std::string> regsRead;
+        std::vector<std::string> regsWritten;
+        // The explicit memory operands. The operands of lea and nop, which do
+        // not access memory, are not reported.
+        std::vector<MemoryOperand> memoryOperands;
+    };
+
+    // Create a disassembler for the given cpu mode.
+    // @param mode: The cpu mode to decode the instructions in.
+    // @throws: An Error if Capstone cannot be initialized.
+    Disassembler(Vm::CpuMode const mode);
+
+    ~Disassembler();
+
+    // Disassemblers are not copyable as they own the Capstone handle.
+    Disassembler(Disassembler const&) = delete;
+    Disassembler& operator=(Disassembler const&) = delete;
+
+    // Decode instructions until reaching the end of the current basic block,
+    // e.g. until and including the first instruction for which endsBlock is
+    // true.
+    // @param code: The bytes to decode.
+    // @param address: The address of the first byte of code.
+    // @return: The decoded instructions, in order. If no instruction ending the
+    // block is found in `code` then this contains all the instructions that
+    // could be decoded, which might be none.
+    std::vector<Instruction> decodeBlock(std::vector<u8> const& code,
+                                         u64 const address) const;
+
+    // Decode a single instruction.
+    // @param code: The bytes to decode.
+    // @param address: The address of the first byte of code.
+    // @return: The instruction starting at the first byte of `code`, or an
+    // empty optional if it cannot be decoded.
+    std::optional<Instruction> decode(std::vector<u8> const& code,
+                                      u64 const address) const;
+
+    // Decode the instruction pointed by rip in a Vm to find out if it can
+    // write memory. If it cannot, the snapshot taken after executing it can
+    // re-use the memory of the previous snapshot, save for the accessed and
+    // dirty bits of the page tables, see Snapshot::afterStep(). The Vm must be
+    // in the cpu mode of this disassembler.
+    // @param vm: The Vm about to execute the instruction.
+    // @return: If the instruction cannot write memory, the expected value of
+    // rip after executing it. Empty optional if it may write memory, if it
+    // changes the control flow or if it cannot be decoded.
+    std::optional<u64> registerOnlyNextRip(Vm const& vm) const;
+
+private:
+    // Build an Instruction from an instruction decoded by Capstone.
+    // @param insn: The decoded instruction, including its details.
+    // @return: The Instruction.
+    Instruction makeInstruction(cs_insn const& insn) const;
+
+    // Check if an instruction decoded by Capstone may write memory.
+    // @param insn: The decoded instruction, including its details.
+    // @return: false if the instruction cannot write memory, true otherwise.
+    // The accessed and dirty bits of the page tables are not considered, see
+    // Instruction::mayWriteMemory.
+    bool mayWriteMemory(cs_insn const& insn) const;
+
+    // Get the name of a register.
+    // @param reg: The Capstone identifier of the register.
+    // @return: The name of the register, empty for X86_REG_INVALID.
+    std::string registerName(unsigned int const reg) const;
+
+    // The Capstone handle.
+    csh m_handle;
+};
+}
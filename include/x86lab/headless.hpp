@@ -0,0 +1,135 @@
+#pragma once
+#include <x86lab/vm.hpp>
+#include <x86lab/code.hpp>
+#include <x86lab/snapshot.hpp>
+#include <x86lab/disassembler.hpp>
+#include <map>
+#include <vector>
+
+namespace X86Lab {
+// Run code on a Vm without any user interface. This is the entry point for
+// tools embedding libx86lab that need to run many snippets in-process instead
+// of invoking the x86lab executable for each of them.
+class HeadlessRunner {
+public:
+    // What is executed by a single step.
+    enum class Granularity {
+        // Each step executes a single instruction.
+        Instruction,
+        // Each step executes a basic block, e.g. all the instructions up to
+        // and including the next branch. The instructions before the branch
+        // run natively, hence recording a trace is much faster than stepping
+        // each instruction.
+        BasicBlock,
+    };
+
+    // Configuration of a HeadlessRunner.
+    struct Config {
+        // Default configuration: 64-bit long mode, 4 pages of memory, run
+        // until the Vm is no longer runnable, step one instruction at a time,
+        // record the full history and run under KVM.
+        Config();
+
+        // The cpu mode the Vm starts in.
+        Vm::CpuMode startMode;
+        // The size of the Vm's physical memory in bytes.
+        u64 memorySize;
+        // Where to place the Vm on the host.
+        Vm::Placement placement;
+        // The maximum number of steps executed by a call to run().
+        u64 maxSteps;
+        // What is executed by a single step.
+        Granularity granularity;
+        // If true, a Snapshot is taken after each step and can be accessed
+        // through history(). If false, only the initial snapshot is recorded
+        // which makes stepping considerably cheaper.
+        bool recordHistory;
+        // If true, rep-prefixed string instructions run to completion in a
+        // single step instead of one step per iteration.
+        bool repStringStepping;
+        // The backend running the Vm's vCpu.
+        Vm::BackendType backend;
+    };
+
+    // Create a Vm and load the code in it.
+    // @param code: The code to run.
+    // @param config: The configuration of the runner.
+    // @throws: Any exception thrown by the Vm's constructor.
+    HeadlessRunner(std::shared_ptr<Code const> const code,
+                   Config const& config = Config());
+
+    // A basic block executed in Granularity::BasicBlock.
+    struct BasicBlock {
+        // The address of the first instruction of the block.
+        u64 start;
+        // The number of instructions in the block, including the branch ending
+        // it. This assumes that the block ran to completion, e.g. no exception
+        // was raised in the middle of the block.
+        u64 numInstructions;
+    };
+
+    // Execute the code until the Vm is no longer runnable or until maxSteps
+    // steps have been executed in this call.
+    // @return: The OperatingState of the Vm after the last step.
+    // @throws: KvmError in case of any KVM ioctl error.
+    Vm::OperatingState run();
+
+    // Execute a single instruction, or a single basic block with
+    // Granularity::BasicBlock. This is a no-op if the Vm is not runnable.
+    // With repStringStepping, a rep-prefixed string instruction is executed
+    // entirely.
+    // @return: The OperatingState of the Vm after the step.
+    // @throws: KvmError in case of any KVM ioctl error.
+    Vm::OperatingState step();
+
+    // Get the number of steps executed so far.
+    u64 numSteps() const;
+
+    // Get the Vm running the code.
+    Vm const& vm() const;
+
+    // Get the recorded history. Entry 0 is the initial state of the Vm, entry
+    // i is the state after executing the ith step. If recordHistory is false
+    // then this only contains the initial state.
+    std::vector<std::shared_ptr<Snapshot>> const& history() const;
+
+    // Get the sequence of basic blocks executed so far in
+    // Granularity::BasicBlock. Entry i is the block executed by the ith step,
+    // starting at 0. The blocks are recorded even if recordHistory is false.
+    std::vector<BasicBlock> const& blocks() const;
+
+    // Reconstruct the address of each instruction executed in a basic block by
+    // decoding the code from the snapshot taken before that block. Requires
+    // recordHistory.
+    // @param blockIndex: The index of the block in blocks().
+    // @return: The address of each instruction of the block, in order.
+    // @throws: An Error if the history was not recorded.
+    std::vector<u64> blockInstructions(u64 const blockIndex) const;
+
+private:
+    // The maximum number of bytes decoded when looking for the end of a basic
+    // block. Longer blocks are split.
+    static constexpr u64 maxBlockBytes = 256;
+
+    // Implementation of step() for Granularity::BasicBlock. Run the
+    // instructions before the next branch natively using a hardware
+    // breakpoint, then single-step the branch.
+    // @return: The OperatingState of the Vm after the block.
+    Vm::OperatingState stepBasicBlock();
+
+    // Get the disassembler for a cpu mode, creating it if needed.
+    // @param mode: The cpu mode.
+    // @return: The disassembler for this mode.
+    Disassembler const& disassembler(Vm::CpuMode const mode) const;
+
+    Config m_config;
+    std::shared_ptr<Code const> m_code;
+    std::unique_ptr<Vm> m_vm;
+    u64 m_numSteps;
+    std::vector<std::shared_ptr<Snapshot>> m_history;
+    std::vector<BasicBlock> m_blocks;
+    // Disassemblers created so far, created lazily by disassembler().
+    mutable std::map<Vm::CpuMode, std::unique_ptr<Disassembler>>
+        m_disassemblers;
+};
+}
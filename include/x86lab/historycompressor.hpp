@@ -0,0 +1,62 @@
+#pragma once
+#include <x86lab/snapshot.hpp>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace X86Lab {
+// Compress the memory of cold snapshots, e.g. snapshots far behind the one
+// being viewed, on a background thread. See Snapshot::compressMemory().
+class HistoryCompressor {
+public:
+    // Start the background thread.
+    HistoryCompressor();
+
+    // Stop the background thread. Snapshots still in the queue are not
+    // compressed.
+    ~HistoryCompressor();
+
+    HistoryCompressor(HistoryCompressor const&) = delete;
+    HistoryCompressor& operator=(HistoryCompressor const&) = delete;
+
+    // Queue a snapshot for compression.
+    // @param snapshot: The snapshot to compress.
+    // @param live: The latest snapshot at the time of the call. Memory still
+    // used by this snapshot is not compressed so that creating new snapshots
+    // never needs to decompress anything.
+    void enqueue(std::shared_ptr<Snapshot const> const snapshot,
+                 std::shared_ptr<Snapshot const> const live);
+
+    // Wait until all the queued snapshots have been compressed.
+    void waitIdle();
+
+    // Get the stats of all the compressions done so far.
+    // @return: The accumulated stats.
+    Snapshot::CompressionStats stats() const;
+
+private:
+    // Main loop of the background thread.
+    void run();
+
+    // A snapshot waiting for compression and the live snapshot at the time it
+    // was queued.
+    using Work = std::pair<std::shared_ptr<Snapshot const>,
+                           std::shared_ptr<Snapshot const>>;
+
+    // Protects all the fields below.
+    mutable std::mutex m_mutex;
+    // Signaled when work is queued or when stopping.
+    std::condition_variable m_workCond;
+    // Signaled when the queue becomes empty and no work is in progress.
+    std::condition_variable m_idleCond;
+    std::deque<Work> m_queue;
+    bool m_busy;
+    bool m_stop;
+    Snapshot::CompressionStats m_stats;
+
+    // The background thread. Declared last so that it is started after all
+    // the other fields are initialized.
+    std::thread m_thread;
+};
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <x86lab/snapshot.hpp>
+#include <x86lab/util.hpp>
+#include <functional>
+#include <map>
+#include <type_traits>
+#include <vector>
+
+namespace X86Lab {
+// Run analyses over a whole execution history, e.g. "all the steps at which
+// rsp went below X" or "every value taken by the variable at address A", as
+// map-reduce jobs distributed across a ThreadPool. Snapshots are immutable once
+// created, hence many threads can read them concurrently. The history is split
+// into contiguous ranges of steps, each mapped by a single thread in ascending
+// order of step so that the values derived from a snapshot, e.g. its mapped
+// regions, are re-used from its base as when stepping through the history.
+// The partial results of the ranges are then reduced in order, hence the
+// result does not depend on the number of threads.
+class HistoryQuery {
+public:
+    // Create a query engine over the history leading to a snapshot.
+    // @param last: The last snapshot of the history. The history is the chain
+    // of bases from the root snapshot, step 0, up to this snapshot. Cannot be
+    // nullptr.
+    // @param pool: The pool running the jobs.
+    HistoryQuery(std::shared_ptr<Snapshot const> const last,
+                 Util::ThreadPool& pool = Util::ThreadPool::shared());
+
+    // @return: The number of steps in the history, including step 0.
+    u64 size() const;
+
+    // Get the snapshot at a given step.
+    // @param step: The step. Must be < size().
+    // @return: The snapshot after the given step.
+    Snapshot const& snapshot(u64 const step) const;
+
+    // Run a map-reduce job over the history.
+    // @param init: The initial value of the partial result of each range of
+    // steps, which must be the identity of reduce, e.g. 0 for a sum.
+    // @param map: Called for each step with the partial result of the range
+    // containing the step, the step and its snapshot. Called concurrently on
+    // different partial results.
+    // @param reduce: Called on the calling thread to merge the partial result
+    // of each range, in ascending order of steps, into the result.
+    // @return: The result.
+    // @throws: The first exception thrown by map.
+    template<typename T>
+    T mapReduce(
+        T const& init,
+        std::type_identity_t<
+            std::function<void(T&, u64, Snapshot const&)>> const& map,
+        std::type_identity_t<std::function<void(T&, T&&)>> const& reduce)
+        const {
+        std::vector<std::pair<u64, u64>> const ranges(splitSteps());
+        std::vector<T> partials(ranges.size(), init);
+        m_pool->parallelFor(ranges.size(), [&](u64 const i) {
+            for (u64 step(ranges[i].first); step < ranges[i].second; ++step) {
+                map(partials[i], step, *m_snapshots[step]);
+            }
+        });
+        T result(init);
+        for (T& partial : partials) {
+            reduce(result, std::move(partial));
+        }
+        return result;
+    }
+
+    // Find all the steps satisfying a predicate.
+    // @param predicate: Called concurrently with each step and its snapshot.
+    // @return: The steps for which the predicate returned true, in ascending
+    // order.
+    std::vector<u64> findSteps(
+        std::function<bool(u64, Snapshot const&)> const& predicate) const;
+
+    // Collect the distinct values taken by a range of linear memory. The range
+    // is only read at the steps where it may have changed, e.g. when its
+    // physical memory or its mapping is not shared with the previous step.
+    // @param offset: The linear address of the range.
+    // @param size: The size of the range in bytes.
+    // @return: Each value mapped to the first step at which the range had this
+    // value. Values are shorter than size when part of the range is not
+    // mapped, see Snapshot::readLinearMemory().
+    // @throws: An Error if the page tables of a step cannot be walked, see
+    // Snapshot::mappedRegions().
+    std::map<std::vector<u8>, u64> distinctValues(u64 const offset,
+                                                  u64 const size) const;
+
+    // Find all the steps that changed the translation of linear addresses,
+    // e.g. the steps writing the page tables or loading cr3. See
+    // Snapshot::pagingChangedSinceBase().
+    // @return: The steps, in ascending order.
+    // @throws: An Error if the page tables of a step cannot be walked, see
+    // Snapshot::mappedRegions().
+    std::vector<u64> pagingChanges() const;
+
+private:
+    // The minimum number of steps mapped by a single task.
+    static constexpr u64 MinStepsPerTask = 256;
+    // The number of tasks per thread of the pool, so that threads finishing
+    // early can pick up the remaining work.
+    static constexpr u64 TasksPerThread = 4;
+
+    // Split the history into contiguous ranges of steps, one per task.
+    // @return: The ranges, as pairs of first and last step excluded, in
+    // ascending order.
+    std::vector<std::pair<u64, u64>> splitSteps() const;
+
+    // Keeps the whole chain of snapshots alive.
+    std::shared_ptr<Snapshot const> m_last;
+    // The snapshots of the chain, indexed by step.
+    std::vector<Snapshot const*> m_snapshots;
+    Util::ThreadPool* m_pool;
+};
+}
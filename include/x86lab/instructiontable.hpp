@@ -0,0 +1,185 @@
+#pragma once
+#include <x86lab/vm.hpp>
+#include <istream>
+#include <string>
+#include <vector>
+
+namespace X86Lab {
+// Measure the latency and throughput of instruction forms on the host cpu by
+// running generated microbenchmarks natively in a Vm. Each form is measured
+// twice: once as a chain of dependent instances, giving its latency, and once
+// as a stream of independent instances, giving its reciprocal throughput.
+class InstructionTable {
+public:
+    // The registers an instruction form operates on.
+    enum class RegisterClass {
+        Gpr64,
+        Xmm,
+        Ymm,
+    };
+
+    // An instruction form to measure.
+    struct Form {
+        // The name of the form in the table, e.g. "add r64, r64".
+        std::string name;
+        // The source of a single instance of the instruction, in which "{dst}"
+        // and "{src}" are replaced by registers of regClass, e.g.
+        // "add {dst}, {src}". dst is read and written, src is only read.
+        std::string pattern;
+        // The class of the registers replacing {dst} and {src}.
+        RegisterClass regClass;
+        // Check if the host supports the instruction, see Util::Extension.
+        // nullptr if the instruction is always supported.
+        bool (*isSupported)();
+    };
+
+    // Parse a list of instruction forms. Each line contains the register class
+    // (r64, xmm or ymm), the required extension (- for none, sse, sse2, sse3,
+    // ssse3, sse4.1, sse4.2, avx, avx2 or avx512) and the pattern, e.g.:
+    //      xmm sse addps {dst}, {src}
+    // Empty lines and lines starting with # are ignored. The name of each form
+    // is its pattern in which the registers are replaced by their class.
+    // @param stream: The stream to read the list from.
+    // @return: The forms, in the order of the list.
+    // @throws: An Error if a line is invalid.
+    static std::vector<Form> parseForms(std::istream& stream);
+
+    // The clocks used to time the benchmarks.
+    enum class Clock {
+        // The time-stamp counter, read by the guest with rdtsc. The TSC ticks
+        // at a constant rate which differs from the core clock under frequency
+        // scaling.
+        Tsc,
+        // The core cycles spent in the guest, counted by the host's PMU through
+        // perf_event_open().
+        CoreCycles,
+    };
+
+    // Configuration of an InstructionTable.
+    struct Config {
+        // Default configuration: time with the TSC, 64 instances per loop
+        // iteration, 1000 iterations, 5 repetitions, 3 attempts.
+        Config();
+
+        // The clock timing the benchmarks.
+        Clock clock;
+        // The number of instances of the instruction in the body of the loop.
+        u64 unroll;
+        // The number of loop iterations of the short run. Each benchmark runs
+        // once with this many iterations and once with twice as many, the
+        // difference between both cancels the fixed cost of entering the Vm
+        // and of setting up the benchmark.
+        u64 iterations;
+        // The number of times each run is repeated, the fastest is kept.
+        u64 repetitions;
+        // The number of times a benchmark is attempted when its long run is
+        // not slower than its short run, e.g. because of an interrupt on the
+        // host, before the form is reported as noisy.
+        u64 attempts;
+        // Where to place the Vm on the host.
+        Vm::Placement placement;
+    };
+
+    // A row of the table.
+    struct Entry {
+        // The name of the form.
+        std::string name;
+        // false if the host does not support the form or if executing it in
+        // the Vm failed, in which case latency and throughput are 0.
+        bool supported;
+        // true if the form is supported but none of the attempts to measure
+        // it gave consistent runs, in which case latency and throughput are 0.
+        bool noisy;
+        // The number of clock ticks between the start of an instance and the
+        // start of a dependent instance.
+        double latency;
+        // The average number of clock ticks per instance when instances are
+        // independent, e.g. the reciprocal throughput.
+        double throughput;
+    };
+
+    // Create an InstructionTable.
+    // @param config: The configuration.
+    // @throws: An Error if the clock cannot be opened.
+    InstructionTable(Config const& config = Config());
+
+    // Close the clock.
+    ~InstructionTable();
+
+    InstructionTable(InstructionTable const&) = delete;
+    InstructionTable& operator=(InstructionTable const&) = delete;
+
+    // Measure an instruction form.
+    // @param form: The form to measure.
+    // @return: The entry of the table for this form.
+    // @throws: An Error if the benchmarks cannot be assembled or run.
+    Entry measure(Form const& form) const;
+
+    // Measure a list of instruction forms.
+    // @param forms: The forms to measure.
+    // @return: One entry per form, in the same order.
+    // @throws: An Error if the benchmarks cannot be assembled or run.
+    std::vector<Entry> measure(std::vector<Form> const& forms) const;
+
+    // The benchmarks run for each form.
+    enum class Benchmark {
+        // Each instance reads the result of the previous one.
+        Latency,
+        // Consecutive instances are independent.
+        Throughput,
+    };
+
+    // Generate the source of a benchmark. The code expects the number of
+    // iterations in rcx and returns the number of TSC ticks spent in the loop
+    // in rax before halting. rax, rcx, rdx, r15 and rsp are reserved, hence
+    // patterns must not use them. The other general purpose registers start
+    // at 1, the vector registers at 1.0 in the precision of the instruction.
+    // @param form: The form to benchmark.
+    // @param benchmark: The kind of benchmark.
+    // @param unroll: The number of instances in the body of the loop.
+    // @return: The NASM source of the benchmark.
+    static std::string benchmarkSource(Form const& form,
+                                       Benchmark const benchmark,
+                                       u64 const unroll);
+
+    // Format entries as a text table.
+    // @param entries: The entries of the table.
+    // @param clock: The clock the entries were measured with.
+    // @return: The table, one line per entry after a header.
+    static std::string format(std::vector<Entry> const& entries,
+                              Clock const clock);
+
+private:
+    // The result of a benchmark, see run().
+    struct Result {
+        // false if the Vm did not halt normally, e.g. the instruction raised
+        // an exception.
+        bool halted;
+        // The number of ticks per instance, empty optional if the Vm did not
+        // halt or if all the attempts were too noisy.
+        std::optional<double> ticks;
+    };
+
+    // Run a benchmark and measure the number of ticks per instance. The
+    // benchmark is attempted again, up to Config::attempts times, while its
+    // runs are too noisy to tell anything.
+    // @param form: The form to benchmark.
+    // @param benchmark: The kind of benchmark.
+    // @return: The result of the benchmark.
+    Result run(Form const& form, Benchmark const benchmark) const;
+
+    // Load a benchmark in a Vm and run it once.
+    // @param vm: The Vm to run the benchmark in.
+    // @param code: The benchmark.
+    // @param iterations: The number of loop iterations.
+    // @return: The number of ticks of the configured clock, empty optional if
+    // the Vm did not halt.
+    std::optional<u64> runOnce(Vm& vm,
+                               Code const& code,
+                               u64 const iterations) const;
+
+    Config m_config;
+    // The perf event counting guest cycles, -1 when timing with the TSC.
+    int m_cyclesFd;
+};
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include <x86lab/snapshot.hpp>
+#include <map>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace X86Lab {
+// Index of the loops executed over the history and of the steps at which each
+// of their iterations starts, built incrementally from the sequence of
+// registers. In loop-heavy traces this allows navigating the history one
+// iteration at a time, or directly to the Nth iteration, with a lookup instead
+// of stepping through every instruction.
+// Loops are detected from their back-edges: a step jumping to an address that
+// is lower than or equal to the address of the instruction it executed,
+// without changing rsp. The latter excludes calls, returns and interrupts. The
+// target of the back-edge is the header of the loop and its source the latch.
+// A loop is exited when the execution leaves the addresses between its header
+// and latch in the same stack frame, or returns from that frame. This is a
+// heuristic: loops whose body is not contiguous, e.g. with out-of-line blocks,
+// are seen as exited and entered again, and the iterations of a loop in a
+// recursive function are not told apart between the levels of recursion.
+class LoopIndex {
+public:
+    // An execution of a loop from its entry to its exit.
+    struct Activation {
+        // The index, in Loop::iterationStarts, of the first iteration of the
+        // activation.
+        u64 firstIteration;
+        // The number of iterations of the activation.
+        u64 numIterations;
+        // The step at which the loop exited, the step following the last
+        // iteration. Empty if the loop did not exit yet.
+        std::optional<u64> end;
+    };
+
+    // A loop, identified by its header.
+    struct Loop {
+        // The address of the first instruction of the loop, the target of its
+        // back-edges.
+        u64 header;
+        // The highest address of an instruction jumping back to the header.
+        u64 latch;
+        // The step at which each iteration starts, e.g. the header is
+        // executed next, in ascending order. Iterations of all the
+        // activations are numbered consecutively.
+        std::vector<u64> iterationStarts;
+        // The activations of the loop, in ascending order of steps.
+        std::vector<Activation> activations;
+    };
+
+    // The iteration of a loop containing a step, see iterationAt().
+    struct Iteration {
+        // The index of the loop in loops().
+        u64 loop;
+        // The index of the iteration in Loop::iterationStarts.
+        u64 index;
+        // The index of the activation containing the iteration in
+        // Loop::activations.
+        u64 activation;
+        // The index of the iteration within its activation, e.g. 0 for the
+        // first iteration after entering the loop.
+        u64 activationIndex;
+        // The first step of the iteration.
+        u64 start;
+        // The first step after the iteration, empty if the iteration is still
+        // running at the end of the history.
+        std::optional<u64> end;
+    };
+
+    // Create an empty index.
+    LoopIndex();
+
+    // Append the values of the registers at the next step. The first call
+    // appends step 0.
+    // @param regs: The values of the registers.
+    void append(Snapshot::Registers const& regs);
+
+    // @return: The number of steps in the history.
+    u64 size() const;
+
+    // Get all the loops detected so far.
+    // @return: The loops, in the order they were detected.
+    std::vector<Loop> const& loops() const;
+
+    // Find the innermost iteration containing a step, e.g. the iteration that
+    // started last among the iterations of all the loops containing it.
+    // @param step: The step. Must be < size().
+    // @return: The iteration, empty if the step is not part of a loop.
+    std::optional<Iteration> iterationAt(u64 const step) const;
+
+    // Get the number of bytes used by the index, e.g. to account for the
+    // memory used by the history. Only the entries are counted, not the
+    // overhead of the containers.
+    // @return: The size of the index in bytes.
+    u64 storageBytes() const;
+
+private:
+    // Get an iteration of a loop.
+    // @param loopIndex: The index of the loop in m_loops.
+    // @param index: The index of the iteration. Must be < the number of
+    // iterations of the loop.
+    // @return: The iteration, with its end.
+    Iteration iteration(u64 const loopIndex, u64 const index) const;
+
+    // Exit the innermost active loop.
+    // @param step: The step at which the loop exited.
+    void exitInnermost(u64 const step);
+
+    // The loops, in order of detection.
+    std::vector<Loop> m_loops;
+    // Maps the header of each loop to its index in m_loops.
+    std::map<u64, u64> m_loopByHeader;
+
+    // A loop being executed.
+    struct ActiveLoop {
+        // The index of the loop in m_loops.
+        u64 loop;
+        // The value of rsp in the loop's frame, updated at each back-edge.
+        u64 rsp;
+    };
+    // The loops being executed, innermost last.
+    std::vector<ActiveLoop> m_active;
+
+    // The last step at which each address was executed next, used to find the
+    // start of the first iteration of a loop once its first back-edge is
+    // taken.
+    std::unordered_map<u64, u64> m_lastVisit;
+
+    // The number of steps appended so far.
+    u64 m_size;
+    // The total number of iterations and activations of all the loops.
+    u64 m_numIterations;
+    u64 m_numActivations;
+    // The registers of the last step appended.
+    Snapshot::Registers m_prevRegs;
+};
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include <x86lab/vm.hpp>
+#include <x86lab/code.hpp>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace X86Lab {
+// Characterize the memory hierarchy of the host by running benchmarks natively
+// in a Vm: load-to-use latency by chasing pointers through a randomized chain,
+// read, write and copy bandwidth, and the reach of the TLB. Each benchmark is
+// run over working sets of increasing sizes, the resulting curves show the
+// size and the performance of each level of the hierarchy.
+// The guest's memory is mapped with the requested page size through page
+// tables built for the benchmarks, the Vm's own identity mapping is not used.
+// With 2MiB or 1GiB pages, the host is asked to back the guest's memory with
+// transparent huge pages, which are at most 2MiB.
+class MemoryProfile {
+public:
+    // Configuration of a MemoryProfile.
+    struct Config {
+        // Default configuration: 4KiB pages, working sets from 1KiB to
+        // 256MiB, TLB reach up to 16384 pages.
+        Config();
+
+        // The size of the guest's pages mapping the working sets: 4KiB, 2MiB
+        // or 1GiB.
+        u64 pageSize;
+        // The size of the smallest working set, a power of two of at least
+        // 1KiB.
+        u64 minSize;
+        // The size of the largest working set, a power of two. The Vm has
+        // this much memory, it is only populated as the benchmarks touch it.
+        u64 maxSize;
+        // The largest number of pages touched by the TLB benchmark, a power of
+        // two. Limited by the number of pages in maxSize.
+        u64 maxTlbPages;
+        // The minimum number of loads timed per latency measurement.
+        u64 minLoads;
+        // The minimum number of bytes moved per bandwidth measurement. Small
+        // working sets are traversed several times.
+        u64 minBytes;
+        // The memory type of the working sets, e.g. to compare streaming
+        // stores into write-combining and write-back memory. Write-back by
+        // default.
+        Vm::MemoryType memoryType;
+        // Where to place the Vm on the host. Huge pages are requested if
+        // pageSize is larger than 4KiB.
+        Vm::Placement placement;
+    };
+
+    // A point of a curve.
+    struct Point {
+        // The size of the working set in bytes. For the TLB benchmark, the
+        // number of pages.
+        u64 size;
+        // The latency in nanoseconds or the bandwidth in GB/s.
+        double value;
+    };
+
+    // The curves measured by run().
+    struct Results {
+        // The page size the working sets were mapped with.
+        u64 pageSize;
+        // The size of the host pages backing the working sets once measured:
+        // 2MiB if the host backed all of them with huge pages, 4KiB otherwise.
+        // Under nested paging, the TLB caches translations of the smaller of
+        // the guest's and the host's pages, hence a TLB curve measured with a
+        // pageSize larger than hostPageSize has the reach of hostPageSize.
+        u64 hostPageSize;
+        // The memory type requested for the working sets.
+        Vm::MemoryType memoryType;
+        // false if the host ignored memoryType, in which case the working
+        // sets were write-back, see Vm::honorsMemoryTypes().
+        bool memoryTypeHonored;
+        // The frequency of the TSC used to time the benchmarks, in GHz.
+        double tscFrequency;
+        // Nanoseconds per load when chasing pointers randomly through a
+        // working set, one pointer per cache line.
+        std::vector<Point> latency;
+        // GB/s when reading, writing and copying a working set sequentially.
+        // Copies move half of the working set into the other half. Streaming
+        // writes use non-temporal stores.
+        std::vector<Point> readBandwidth;
+        std::vector<Point> writeBandwidth;
+        std::vector<Point> streamingWriteBandwidth;
+        std::vector<Point> copyBandwidth;
+        // Nanoseconds per load when chasing pointers randomly through a number
+        // of pages, one pointer per page at a random offset in the page. The
+        // latency increases when the pages no longer fit in the TLB.
+        std::vector<Point> tlbLatency;
+    };
+
+    // Create a MemoryProfile and its Vm.
+    // @param config: The configuration.
+    // @throws: An Error if the configuration is invalid or the page size is
+    // not supported by the host.
+    // @throws: Any exception thrown by the Vm's constructor.
+    MemoryProfile(Config const& config = Config());
+
+    // Run all the benchmarks.
+    // @param progress: If set, called with a description of each benchmark
+    // before running it.
+    // @return: The curves.
+    // @throws: An Error if a benchmark cannot be assembled or does not run to
+    // completion.
+    Results run(std::function<void(std::string const&)> const& progress =
+                    nullptr);
+
+    // Format results as CSV, one line per point with the columns benchmark,
+    // page_size, size, value and unit.
+    // @param results: The results to format.
+    // @return: The CSV, including a header line.
+    static std::string toCsv(Results const& results);
+
+private:
+    // The benchmarks, each assembled once.
+    enum class Benchmark {
+        PointerChase,
+        Read,
+        Write,
+        StreamingWrite,
+        Copy,
+    };
+
+    // Generate the source of a benchmark. Each benchmark traverses its working
+    // set once to warm it up, then returns the number of TSC ticks spent in
+    // the timed part in rax before halting.
+    // @param benchmark: The benchmark.
+    // @return: The NASM source of the benchmark.
+    static std::string benchmarkSource(Benchmark const benchmark);
+
+    // Build the page tables identity mapping the code and the working sets
+    // with the configured page size and write them in the Vm's memory, right
+    // after the working sets.
+    // @return: The physical offset of the PML4.
+    u64 buildPageTables();
+
+    // Write a chain of pointers in the working set. The chain visits each node
+    // exactly once, in a random order, before looping back to the first node.
+    // @param nodes: The linear addresses of the nodes.
+    // @return: The address of the first node.
+    u64 writeChain(std::vector<u64> const& nodes);
+
+    // Run a benchmark.
+    // @param benchmark: The benchmark to run.
+    // @param setParams: Called to set the parameters of the benchmark in the
+    // registers before running it.
+    // @return: The number of TSC ticks of the timed part.
+    // @throws: An Error if the benchmark did not halt.
+    u64 runBenchmark(
+        Benchmark const benchmark,
+        std::function<void(Vm::State::Registers&)> const& setParams);
+
+    // Measure the latency of chasing a chain of pointers.
+    // @param nodes: The linear addresses of the nodes of the chain.
+    // @return: The latency of a load in nanoseconds.
+    double measureLatency(std::vector<u64> const& nodes);
+
+    // Measure the bandwidth of a sequential benchmark.
+    // @param benchmark: Read, Write, StreamingWrite or Copy.
+    // @param size: The size of the working set in bytes.
+    // @return: The bandwidth in GB/s.
+    double measureBandwidth(Benchmark const benchmark, u64 const size);
+
+    Config m_config;
+    // The linear and physical address of the working sets.
+    u64 m_bufferAddr;
+    // The size of the memory available for the working sets.
+    u64 m_bufferSize;
+    // The frequency of the TSC in GHz.
+    double m_tscFrequency;
+    std::unique_ptr<Vm> m_vm;
+    // The code of each benchmark, assembled lazily.
+    std::map<Benchmark, std::unique_ptr<Code const>> m_code;
+};
+}
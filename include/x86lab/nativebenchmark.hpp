@@ -0,0 +1,39 @@
+#pragma once
+#include <x86lab/vm.hpp>
+#include <x86lab/code.hpp>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace X86Lab {
+// Helpers shared by the micro-benchmarks running generated code natively in a
+// Vm, e.g. InstructionTable and MemoryProfile. Benchmarks time themselves with
+// the TSC and return the elapsed ticks in rax before halting.
+namespace NativeBenchmark {
+// Assemble the source of a benchmark.
+// @param source: The assembly source of the benchmark.
+// @return: The assembled code.
+// @throws: Error if the temporary source file cannot be written or if the
+// source does not assemble.
+std::unique_ptr<Code const> assemble(std::string const& source);
+
+// Get the source reading the TSC once all previous instructions completed.
+// @param start: If true, the TSC is saved into r15 at the start of the timed
+// part, otherwise the ticks elapsed since the start are computed in rax.
+// @return: The assembly source, one instruction per line.
+std::string readTsc(bool const start);
+
+// Load and run a benchmark in a Vm.
+// @param vm: The Vm to run the benchmark in.
+// @param code: The benchmark.
+// @param setParams: Set the parameters of the benchmark into the registers of
+// the vCpu before running it.
+// @return: The value of rax when the Vm halted, empty if it stopped for any
+// other reason.
+std::optional<u64> run(
+    Vm& vm,
+    Code const& code,
+    std::function<void(Vm::State::Registers&)> const& setParams);
+}
+}
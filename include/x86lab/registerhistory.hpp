@@ -0,0 +1,124 @@
+#pragma once
+#include <x86lab/snapshot.hpp>
+#include <array>
+#include <map>
+#include <optional>
+#include <vector>
+
+namespace X86Lab {
+// Columnar index of the values taken by the scalar registers over the
+// execution history. Each register is stored in its own column, independently
+// of the other registers, so that questions like "how did rax evolve" or "when
+// did r8 first become greater than X" only touch the data of that register
+// instead of the full Registers struct of every Snapshot in the history.
+// Each column is run-length encoded: a new entry is only added when the value
+// of the register changes. Most registers are untouched by most instructions,
+// hence columns are typically orders of magnitude smaller than the history.
+// The values of the runs are stored contiguously and un-encoded so that
+// searching a column is a linear, vectorizable scan.
+class RegisterHistory {
+public:
+    // The registers tracked by the history.
+    enum class Register {
+        Rax, Rbx, Rcx, Rdx, Rdi, Rsi, Rsp, Rbp,
+        R8, R9, R10, R11, R12, R13, R14, R15,
+        Rip, Rflags,
+        Cs, Ds, Es, Fs, Gs, Ss,
+        Cr0, Cr2, Cr3, Cr4, Cr8, Efer,
+    };
+    // The number of values in the Register enum.
+    static constexpr u64 NumRegisters = static_cast<u64>(Register::Efer) + 1;
+
+    // Maps each Register to its name, e.g. "rax". Can be used for dropdown
+    // construction.
+    static std::map<Register, std::string> const registerNames;
+
+    // Comparisons supported by findFirst().
+    enum class Comparison {
+        Equal,
+        NotEqual,
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+    };
+
+    // Maps each Comparison to its operator, e.g. ">=".
+    static std::map<Comparison, std::string> const comparisonNames;
+
+    // Create an empty history.
+    RegisterHistory();
+
+    // Append the values of the registers at the next step. The first call
+    // appends step 0.
+    // @param regs: The values of the registers.
+    void append(Snapshot::Registers const& regs);
+
+    // @return: The number of steps in the history.
+    u64 size() const;
+
+    // Get the value of a register at a given step.
+    // @param reg: The register.
+    // @param step: The step. Must be < size().
+    // @return: The value of the register after the given step.
+    u64 value(Register const reg, u64 const step) const;
+
+    // Find the first step, at or after fromStep, at which the value of a
+    // register satisfies a comparison against a value. For instance
+    // findFirst(R8, Greater, X) is the first step where r8 > X.
+    // @param reg: The register.
+    // @param cmp: The comparison to use, the register is on the left-hand side.
+    // @param value: The value to compare the register against.
+    // @param fromStep: The step to start searching from.
+    // @return: The first step satisfying the condition if any, otherwise an
+    // empty optional.
+    std::optional<u64> findFirst(Register const reg,
+                                 Comparison const cmp,
+                                 u64 const value,
+                                 u64 const fromStep = 0) const;
+
+    // Sample the value of a register over a range of steps, e.g. for plotting.
+    // @param reg: The register.
+    // @param first: The first step of the range.
+    // @param last: The last step of the range, inclusive. Must be < size().
+    // @param maxSamples: The maximum number of samples to return. If the range
+    // contains more steps than that, the samples are evenly spaced.
+    // @return: The sampled values, in order.
+    std::vector<u64> sample(Register const reg,
+                            u64 const first,
+                            u64 const last,
+                            u64 const maxSamples) const;
+
+    // Get the number of runs in the column of a register, e.g. the number of
+    // times its value changed plus one.
+    // @param reg: The register.
+    // @return: The number of entries in the column.
+    u64 numRuns(Register const reg) const;
+
+    // Get the number of bytes used by the columns, e.g. to account for the
+    // memory used by the history.
+    // @return: The size of the runs of all the columns in bytes.
+    u64 storageBytes() const;
+
+private:
+    // A run-length encoded column. Entry i indicates that the register has
+    // value values[i] from step starts[i] until step starts[i+1] excluded.
+    // Both vectors always have the same size.
+    struct Column {
+        std::vector<u64> starts;
+        std::vector<u64> values;
+    };
+
+    // Get the index of the run containing a step in a column.
+    // @param column: The column.
+    // @param step: The step. Must be < size().
+    // @return: The index of the run in column.starts and column.values.
+    static u64 runIndex(Column const& column, u64 const step);
+
+    // The number of steps appended so far.
+    u64 m_size;
+
+    // One column per register, indexed by the Register enum.
+    std::array<Column, NumRegisters> m_columns;
+};
+}
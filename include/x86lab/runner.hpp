@@ -1,6 +1,16 @@
 #pragma once
 #include <x86lab/vm.hpp>
+#include <x86lab/registerhistory.hpp>
+#include <x86lab/disassembler.hpp>
+#include <x86lab/historycompressor.hpp>
+#include <x86lab/workingsethistory.hpp>
+#include <x86lab/memoryprofile.hpp>
+#include <x86lab/loopindex.hpp>
+#include <x86lab/dependencygraph.hpp>
 #include <x86lab/ui/ui.hpp>
+#include <atomic>
+#include <future>
+#include <map>
 #include <vector>
 
 namespace X86Lab {
@@ -13,9 +23,27 @@ public:
     // then this also takes care of loading the given code.
     // @param code: The code to run on the Vm.
     // @param ui: The UI to use as input/output.
+    // @param repStringStepping: If true, rep-prefixed string instructions are
+    // executed entirely in a single step, recording a single snapshot. This
+    // can be toggled by the UI with Action::ToggleRepStringStepping.
+    // @param workingSetTracking: If true, the working set of the guest is
+    // scanned after each step. This can be toggled by the UI with
+    // Action::ToggleWorkingSetTracking.
+    // @param historyQuota: If non-zero, the maximum number of bytes of
+    // history: the snapshots, their extended states and the indices built
+    // from them, see historyBytes(). Once reached, stepping forward past the
+    // latest snapshot is refused until the VM is reset. Memory is accounted
+    // before compression.
     Runner(std::shared_ptr<Vm> const vm,
            std::shared_ptr<Code const> const code,
-           std::shared_ptr<Ui::Backend> const ui);
+           std::shared_ptr<Ui::Backend> const ui,
+           bool const repStringStepping = false,
+           bool const workingSetTracking = false,
+           u64 const historyQuota = 0);
+
+    // Cancel the background analyses of the history, which is discarded. The
+    // last Ui::State referencing an analysis waits for it to stop.
+    ~Runner();
 
     // Value returned by run() to indicate why the run() function returned.
     enum class ReturnReason {
@@ -39,6 +67,17 @@ public:
     // @return: The reason for the return.
     ReturnReason run();
 
+    // Check if rep-string stepping is enabled. This can be used to carry the
+    // setting over to the next Runner after a reset.
+    // @return: true if rep-prefixed string instructions are executed in a
+    // single step.
+    bool repStringStepping() const;
+
+    // Check if working set tracking is enabled. This can be used to carry the
+    // setting over to the next Runner after a reset.
+    // @return: true if the working set is scanned after each step.
+    bool workingSetTracking() const;
+
 private:
     std::shared_ptr<Vm> m_vm;
     std::shared_ptr<Code const> m_code;
@@ -55,11 +94,98 @@ private:
     // index == history.size() then this is the lastest state of the VM.
     u64 m_historyIndex;
 
+    // The maximum number of bytes of snapshots in m_history, 0 if unlimited.
+    u64 m_historyQuota;
+    // The number of bytes of snapshots in m_history, see
+    // Snapshot::storageStats(), including the extended states they do not
+    // share with their base.
+    u64 m_historyBytes;
+
+    // Columnar copy of the registers of each snapshot in m_history, kept in
+    // sync with m_history. Shared with the UI through Ui::State to answer
+    // per-register queries without touching the snapshots.
+    std::shared_ptr<RegisterHistory> m_registerHistory;
+
+    // The loops executed so far, kept in sync with m_history. Shared with the
+    // UI through Ui::State.
+    std::shared_ptr<LoopIndex> m_loopIndex;
+
+    // If true, rep-prefixed string instructions run to completion in a single
+    // step. Otherwise each iteration is a step, as with KVM single-stepping.
+    bool m_repStringStepping;
+
+    // If true, the working set of the guest is scanned after each step and
+    // appended to m_workingSetHistory.
+    bool m_workingSetTracking;
+
+    // If true, the memory of the Vm was modified outside of a step since the
+    // last snapshot, e.g. by scanning the working set. The next snapshot must
+    // then copy the memory instead of relying on the writes of the step.
+    bool m_fullSnapshotPending;
+
+    // The working set sampled after each step while tracking was enabled.
+    // Shared with the UI through Ui::State.
+    std::shared_ptr<WorkingSetHistory> m_workingSetHistory;
+
+    // The results of the last memory profile, running in the background until
+    // ready. Shared with the UI through Ui::State.
+    std::shared_future<std::shared_ptr<MemoryProfile::Results const>>
+        m_memoryProfile;
+
+    // The result of the last dependency analysis, running in the background
+    // until ready. Shared with the UI through Ui::State.
+    std::shared_future<std::shared_ptr<DependencyGraph const>>
+        m_dependencyGraph;
+    // Set upon destruction to cancel the dependency analysis, if running.
+    std::shared_ptr<std::atomic<bool>> m_analysisCancelled;
+
+    // Snapshots that are at least this many steps behind the current
+    // snapshot are compressed in the background.
+    static constexpr u64 ColdDistance = 1024;
+
+    // The maximum number of steps executed by the iteration actions to reach
+    // an iteration that was not executed yet.
+    static constexpr u64 MaxIterationSteps = 1 << 20;
+
+    // Compresses the memory of cold snapshots in the background.
+    std::unique_ptr<HistoryCompressor> m_compressor;
+
+    // Index in m_history of the next snapshot to be compressed. All the
+    // snapshots before it have been queued for compression.
+    u64 m_nextToCompress;
+
+    // Disassemblers used to decode the next instruction before stepping,
+    // one per cpu mode, created lazily.
+    std::map<Vm::CpuMode, std::unique_ptr<Disassembler>> m_disassemblers;
+
     // Update the UI with the latest state of the VM.
     void updateUi();
 
+    // Get the memory used by the history, counted against the quota: the
+    // snapshots and the RegisterHistory, LoopIndex and WorkingSetHistory
+    // built from them.
+    // @return: The size of the history in bytes.
+    u64 historyBytes() const;
+
+    // Decode the next instruction to find out if it can write memory, see
+    // Disassembler::registerOnlyNextRip().
+    // @return: If the next instruction cannot write memory, the expected value
+    // of rip after executing it. Empty optional if it may write memory or
+    // cannot be decoded.
+    std::optional<u64> registerOnlyNextRip();
+
     // Get a new snapshot of the VM state and update the lastSnapshot pointer.
-    void updateLastSnapshot();
+    // @param registerOnlyNextRip: The value returned by registerOnlyNextRip()
+    // before executing the last instruction, see Snapshot::afterStep().
+    void updateLastSnapshot(std::optional<u64> const registerOnlyNextRip =
+                                std::nullopt);
+
+    // Scan the working set of the Vm if tracking is enabled and append it to
+    // m_workingSetHistory. Must be called after executing a step but before
+    // taking its snapshot, so that the snapshot contains the cleared accessed
+    // and dirty bits: snapshots re-using the memory of their base remain
+    // consistent with the page tables.
+    void trackWorkingSet();
 
     // Process the next action.
     // @param action: The action to process.
@@ -70,5 +196,32 @@ private:
 
     // Process an Action::ReverseStep request.
     void doReverseStep();
+
+    // Process an Action::ProfileMemory request. The profile runs in the
+    // background with the placement of the Vm, only one at a time.
+    // @param pageSize: The page size of the working sets, 0 for the default.
+    void doProfileMemory(u64 const pageSize);
+
+    // Process an Action::AnalyzeDependencies request. The analysis covers the
+    // whole history and runs in the background, only one at a time.
+    void doAnalyzeDependencies();
+
+    // Process an Action::NextIteration, Action::PreviousIteration or
+    // Action::JumpToIteration request.
+    // @param action: The action.
+    // @param argument: The argument of the action, see
+    // Ui::Backend::actionArgument().
+    void doIterationAction(Ui::Action const action, u64 const argument);
+
+    // Go to the start of an iteration of a loop. If the iteration was not
+    // executed yet and the loop is still running at the latest step, the Vm
+    // is stepped until the iteration starts, the loop exits, the Vm stops or
+    // MaxIterationSteps steps were executed. If the iteration cannot be
+    // reached, the current step is unchanged.
+    // @param loop: The index of the loop in LoopIndex::loops().
+    // @param first: The index, in LoopIndex::Loop::iterationStarts, of the
+    // iteration counted as 0, e.g. the first iteration of an activation.
+    // @param index: The index of the iteration, relative to first.
+    void goToIteration(u64 const loop, u64 const first, u64 const index);
 };
 }
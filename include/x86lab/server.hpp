@@ -0,0 +1,103 @@
+#pragma once
+#include <x86lab/vm.hpp>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace X86Lab {
+// Host many x86Lab sessions in a single process, e.g. for a training lab in
+// which many people explore snippets at once. Clients connect to a Unix socket
+// and send commands, one per line. The first line must be "load <file>",
+// naming the assembly file to run within the server's source directory. The
+// following lines are commands of a restricted Ui::Cli, their output and the
+// logs of the session are sent back to the client. Each session has its own
+// Vm, Code and Runner and runs in its own thread, so that a session stepping
+// does not block the others, while a single epoll loop does the I/O of all the
+// connections.
+class Server {
+public:
+    // Configuration of a Server.
+    struct Config {
+        // Default configuration: up to 64 sessions, each with 256MiB of
+        // history and 4 pages of guest memory, loading files from the
+        // current directory.
+        Config();
+
+        // The maximum number of concurrent sessions. Clients connecting past
+        // this limit are sent an error and disconnected.
+        u64 maxSessions;
+        // The maximum number of bytes of history of each session, 0 for no
+        // limit. See the historyQuota parameter of Runner::Runner().
+        u64 historyQuota;
+        // The size of the physical memory of each session's Vm in bytes.
+        u64 memorySize;
+        // Where to place the Vms on the host.
+        Vm::Placement placement;
+        // The backend running the vCpus.
+        Vm::BackendType backend;
+        // The directory clients load their files from. Paths are relative to
+        // it and files outside of it, including through symbolic links, are
+        // refused.
+        std::string sourceDirectory;
+    };
+
+    // Create a Server listening on a Unix socket. No session is accepted
+    // until run() is called.
+    // @param socketPath: The path of the socket. Any file at this path is
+    // replaced.
+    // @param config: The configuration.
+    // @throws: An Error if the socket or the event loop cannot be created.
+    Server(std::string const& socketPath, Config const& config = Config());
+
+    // Disconnect all the clients, wait for the sessions to finish their
+    // current step and remove the socket.
+    ~Server();
+
+    Server(Server const&) = delete;
+    Server& operator=(Server const&) = delete;
+
+    // Run the event loop, accepting clients and serving their sessions, until
+    // stop() is called.
+    // @throws: An Error if waiting for events fails.
+    void run();
+
+    // Make run() return. Can be called from any thread, as well as from a
+    // signal handler.
+    void stop();
+
+    // Get the number of sessions currently hosted.
+    // @return: The number of sessions, including the ones whose client
+    // disconnected but which did not terminate yet.
+    u64 numSessions() const;
+
+private:
+    // A session: a client, and the thread running its Vm.
+    class Session;
+
+    // Accept all the pending connections, creating a session for each.
+    void acceptClients();
+
+    // Send the pending output of all the sessions to their client and destroy
+    // the sessions that terminated.
+    void serviceSessions();
+
+    // The path of the socket, removed upon destruction.
+    std::string m_socketPath;
+    Config m_config;
+    // The listening socket.
+    int m_listenFd;
+    // The epoll instance of the event loop.
+    int m_epollFd;
+    // An eventfd waking the event loop up, written by sessions with new output
+    // and by stop().
+    int m_wakeFd;
+    // Set by stop().
+    std::atomic<bool> m_stopRequested;
+    // The sessions indexed by the file descriptor of their connection. Only
+    // accessed by the thread running the event loop.
+    std::map<int, std::unique_ptr<Session>> m_sessions;
+    // The size of m_sessions, readable from any thread.
+    std::atomic<u64> m_numSessions;
+};
+}
@@ -6,6 +6,8 @@
 namespace X86Lab {
 // Opaque type performing the actual memory snapshot deduplication.
 class BlockTree;
+// Opaque type caching the values derived from the state of a snapshot.
+struct DerivedState;
 
 // A snapshot of the VM state. Each snapshot is built on a previous snapshot,
 // called a base. The goal of snapshots is to explore the state of the machine
@@ -24,6 +26,63 @@ public:
     Snapshot(std::shared_ptr<Snapshot> const base,
              std::unique_ptr<Vm::State> state);
 
+    // Construct a snapshot which memory and extended state are identical to
+    // the ones of its base. See the constructor below.
+    // @param base: The base snapshot to build on top of. Cannot be nullptr.
+    // @param regs: The value of the registers in this new snapshot.
+    Snapshot(std::shared_ptr<Snapshot> const base,
+             Vm::State::Registers const& regs);
+
+    // Construct a snapshot which memory is identical to the memory of its
+    // base, e.g. after executing an instruction that cannot write memory. This
+    // avoids copying the memory of the Vm and building a new BlockTree, the
+    // tree of the base is shared instead.
+    // @param base: The base snapshot to build on top of. Cannot be nullptr.
+    // @param regs: The value of the registers in this new snapshot.
+    // @param extendedState: The extended state in this new snapshot.
+    Snapshot(std::shared_ptr<Snapshot> const base,
+             Vm::State::Registers const& regs,
+             Vm::State::ExtendedState const& extendedState);
+
+    // The content of ranges of physical memory, as pairs of offset and data.
+    using PhysicalData = std::vector<std::pair<u64, std::vector<u8>>>;
+
+    // Construct a snapshot which memory differs from the memory of its base
+    // only in known ranges, e.g. the writes reported by Vm::lastStepEffects().
+    // Only the nodes of the base's BlockTree covering those ranges are
+    // rebuilt, the rest of the memory is neither copied nor compared.
+    // @param base: The base snapshot to build on top of. Cannot be nullptr.
+    // @param regs: The value of the registers in this new snapshot.
+    // @param extendedState: The extended state in this new snapshot.
+    // @param writes: The content of the ranges written since the base. Ranges
+    // may overlap, in which case the last one takes precedence. Data outside
+    // of the physical memory is ignored.
+    Snapshot(std::shared_ptr<Snapshot> const base,
+             Vm::State::Registers const& regs,
+             Vm::State::ExtendedState const& extendedState,
+             PhysicalData const& writes);
+
+    // Create the snapshot following the execution of an instruction, storing
+    // only what the instruction may have changed: the registers alone if it
+    // did not write memory, the ranges it wrote if the backend records them,
+    // a full copy of the state of the Vm otherwise.
+    // Under KVM, a register-only snapshot misses the accessed and dirty bits
+    // set by the cpu in the page tables while executing the instruction. They
+    // appear in the next snapshot copying the memory, hence diffing snapshots
+    // may attribute them to a later step. This does not affect the working
+    // set history: each scan clears the bits set by the step before the
+    // snapshot is taken, see Vm::scanWorkingSet().
+    // @param base: The snapshot taken before executing the instruction.
+    // @param vm: The Vm, after executing the instruction.
+    // @param registerOnlyNextRip: The value of
+    // Disassembler::registerOnlyNextRip() before executing the instruction.
+    // Only used if the backend does not record the effects of a step.
+    // @return: The new snapshot.
+    static std::shared_ptr<Snapshot> afterStep(
+        std::shared_ptr<Snapshot> const base,
+        Vm const& vm,
+        std::optional<u64> const registerOnlyNextRip);
+
     // Get the base of this snapshot.
     // @return: The base of this snapshot. If the snapshot has no base then this
     // returns nullptr.
@@ -42,6 +101,13 @@ public:
     // @return: A ref on the Vm::Registers associated to this snapshot.
     Registers const& registers() const;
 
+    // Get the extended state of the vCpu in this snapshot (FPU, hidden part of
+    // the segment registers, debug registers, MSRs, ...). This state rarely
+    // changes, hence a snapshot shares the ExtendedState of its base when
+    // they are equal: the returned reference is then the same as the base's.
+    // @return: A ref on the ExtendedState associated to this snapshot.
+    Vm::State::ExtendedState const& extendedState() const;
+
     // Read from the snapshot of the VM's physical memory. Reading outside the
     // physical memory's boundary leads to reading zeroes.
     // @param offset: The offset to read from.
@@ -50,6 +116,60 @@ public:
     // spanning `size` bytes.
     std::vector<u8> readPhysicalMemory(u64 const offset, u64 const size) const;
 
+    // Get the size of the VM's physical memory in this snapshot.
+    // @return: The size in bytes.
+    u64 physicalMemorySize() const;
+
+    // Find the physical memory that may differ between this snapshot and
+    // another snapshot of the same history, without reading it. Snapshots
+    // share the nodes of their BlockTree for the memory that did not change,
+    // hence only the nodes that differ are visited.
+    // @param other: The snapshot to compare against, typically an ancestor or
+    // a descendant of this snapshot.
+    // @return: The ranges, as pairs of offset and size, in ascending order of
+    // offset. The memory outside of those ranges is identical in both
+    // snapshots. Ranges are at least 64 bytes and might not have changed,
+    // e.g. when another part of the same leaf changed.
+    std::vector<std::pair<u64, u64>> changedPhysicalRanges(
+        Snapshot const& other) const;
+
+    // Check if a range of physical memory is identical in this snapshot and in
+    // its base, without reading it.
+    // @param offset: The physical offset of the range.
+    // @param size: The size of the range in bytes.
+    // @return: true if the range is shared with the base. false if this
+    // snapshot has no base or if the range may have changed, e.g. when another
+    // part of the same leaf changed.
+    bool sharesPhysicalRangeWithBase(u64 const offset, u64 const size) const;
+
+    // A change of the value of a memory range, see physicalMemoryHistory().
+    struct MemoryWrite {
+        MemoryWrite(u64 const step, u64 const rip, std::vector<u8> const& value)
+            : step(step), rip(rip), value(value) {}
+        // The step at which the range took this value, e.g. the number of
+        // snapshots between the root snapshot and the snapshot in which the
+        // value first appears. 0 for the initial value of the range.
+        u64 step;
+        // The address of the instruction that wrote the value, e.g. the rip
+        // of the snapshot before `step`. 0 for the initial value.
+        u64 rip;
+        // The value of the range from this step on.
+        std::vector<u8> value;
+    };
+
+    // Get every value taken by a range of physical memory from the root
+    // snapshot up to this snapshot, along with the step that wrote each value.
+    // Consecutive snapshots share the nodes of their BlockTree for the memory
+    // that did not change, hence most snapshots are skipped without reading any
+    // memory. Note that writes that did not change the value of the range
+    // cannot be observed and are therefore not reported.
+    // @param offset: The physical offset of the range.
+    // @param size: The size of the range in bytes.
+    // @return: The values of the range in ascending order of step. The first
+    // element is always the initial value of the range, at step 0.
+    std::vector<MemoryWrite> physicalMemoryHistory(u64 const offset,
+                                                   u64 const size) const;
+
     // Read from the snapshot of the VM's linear memory. If the entire requested
     // range is not mapped to physical memory or if the start offset `offset` is
     // not mapped, then the resulting vector is empty. If only part of the range
@@ -63,16 +183,180 @@ public:
     // not fully mapped.
     std::vector<u8> readLinearMemory(u64 const offset, u64 const size) const;
 
+    // Statistics about the memory allocated to store a snapshot, e.g. the part
+    // of its memory that is not shared with its base. Used to evaluate how
+    // efficiently the history is stored.
+    struct StorageStats {
+        // Number of nodes allocated, including intermediate nodes and leaves
+        // that point to the data of a leaf of the base or to memory that was
+        // never populated.
+        u64 numNodes;
+        // Number of leaves holding their own copy of the data.
+        u64 numLeaves;
+        // Total number of bytes copied into those leaves.
+        u64 leafBytes;
+        // Number of bytes that actually changed since the base, counted by
+        // blocks of 64 bytes. leafBytes - changedBytes is the number of bytes
+        // copied even though they did not change.
+        u64 changedBytes;
+
+        StorageStats& operator+=(StorageStats const& other);
+    };
+
+    // Get statistics about the memory allocated for this snapshot.
+    // @return: The stats. All zeroes if the memory is entirely shared with the
+    // base.
+    StorageStats storageStats() const;
+
+    // Statistics about the compression of the memory of snapshots.
+    struct CompressionStats {
+        // Number of leaves of BlockTree that were compressed.
+        u64 numLeaves;
+        // Size of those leaves before compression.
+        u64 rawBytes;
+        // Size of those leaves after compression.
+        u64 compressedBytes;
+
+        CompressionStats& operator+=(CompressionStats const& other);
+    };
+
+    // Compress the memory allocated for this snapshot that is no longer used
+    // by another snapshot, typically the latest snapshot of the history. The
+    // compressed memory is transparently decompressed when read, hence this
+    // is meant for snapshots that are rarely read. This can be called from any
+    // thread, concurrently with reads and with the creation of new snapshots.
+    // @param live: Memory used by this snapshot is never compressed.
+    // @return: The stats of the compression.
+    CompressionStats compressMemory(Snapshot const& live) const;
+
+    // The values below are derived from the registers and memory of the
+    // snapshot. They are computed lazily, upon the first call, and cached.
+    // The value of the base is re-used, without reading any memory, if the
+    // base has already computed it and neither the registers nor the memory it
+    // was derived from changed since the base, which is the common case when
+    // stepping through the history. These can be called from any thread.
+
     // Get the enabled mode on the cpu in this snapshot.
     // @return: The Vm::CpuMode indicating the current cpu mode.
     Vm::CpuMode cpuMode() const;
 
+    // The descriptor tables, see descriptorTable().
+    enum class DescriptorTable {
+        Gdt,
+        Idt,
+    };
+
+    // Get the content of a descriptor table, as pointed by the GDTR or IDTR.
+    // @param table: The table to read.
+    // @return: The raw content of the table, up to its limit. Shorter than the
+    // table if part of it is not mapped in linear memory.
+    std::vector<u8> const& descriptorTable(DescriptorTable const table) const;
+
+    // The maximum number of stack frames returned by stackFrames().
+    static constexpr u64 MaxStackFrames = 1024;
+
+    // Get the start offsets of the stack frames, found by following the chain
+    // of saved RBPs from the current RBP. The chain stops at the first saved
+    // RBP that is below RSP, which would not be a valid frame, or that is not
+    // mapped. Code that does not maintain frame pointers leads to garbage
+    // frames.
+    // @return: The linear addresses of the start of each frame, starting from
+    // the current frame. At most MaxStackFrames frames.
+    std::vector<u64> const& stackFrames() const;
+
+    // A contiguous range of linear memory mapped to contiguous physical
+    // memory.
+    struct MappedRegion {
+        // The linear address of the start of the region.
+        u64 linearAddress;
+        // The physical offset the region is mapped to.
+        u64 physicalOffset;
+        // The size of the region in bytes.
+        u64 size;
+
+        bool operator==(MappedRegion const&) const = default;
+    };
+
+    // The maximum number of present page table entries walked by
+    // mappedRegions(). Tables referencing themselves or each other map a
+    // linear page per path through them, e.g. a PML4 whose entries all point
+    // to itself maps 512^4 pages.
+    static constexpr u64 MaxPageTableEntries = 1 << 22;
+
+    // Get the regions of linear memory that are mapped to physical memory,
+    // according to the page tables. If paging is disabled then the entire
+    // physical memory is identity mapped.
+    // @return: The regions, in ascending order of linear address.
+    // @throws: An Error if the page tables have more than MaxPageTableEntries
+    // present entries, counting the entries of a table once per path to it.
+    std::vector<MappedRegion> const& mappedRegions() const;
+
+    // Check if the translation of linear addresses changed since the base
+    // snapshot, e.g. because the last instruction wrote the page tables or
+    // the registers controlling paging. The page tables are only compared
+    // where they may differ from the base's.
+    // @return: true if the paging registers differ from the base's or if an
+    // entry of the page tables walked by the base's mappedRegions() changed,
+    // ignoring the accessed and dirty bits. false if this snapshot has no
+    // base.
+    // @throws: An Error if the base's mappedRegions() throws.
+    bool pagingChangedSinceBase() const;
+
 private:
+    // Physical memory ranges, as pairs of offset and size.
+    using PhysicalRanges = std::vector<std::pair<u64, u64>>;
+
+    // Check if some physical memory ranges are unchanged since the base
+    // snapshot, without reading them.
+    // @param ranges: The ranges to check.
+    // @return: true if this snapshot has a base and none of the ranges
+    // changed since the base. false otherwise, in which case the ranges may or
+    // may not have changed.
+    bool unchangedSinceBase(PhysicalRanges const& ranges) const;
+
+    // Read linear memory, recording the physical memory being read, including
+    // the page table entries. See readLinearMemory().
+    // @param offset: The linear offset to read from.
+    // @param size: The number of bytes to read.
+    // @param reads: The physical ranges read are appended to this vector.
+    // @return: The data, as returned by readLinearMemory().
+    std::vector<u8> readLinearMemory(u64 const offset,
+                                     u64 const size,
+                                     PhysicalRanges& reads) const;
+
+    // Compute the value returned by cpuMode().
+    // @param reads: The physical ranges read are appended to this vector.
+    // @return: The cpu mode.
+    Vm::CpuMode computeCpuMode(PhysicalRanges& reads) const;
+
+    // Compute the value returned by stackFrames().
+    // @param reads: The physical ranges read are appended to this vector.
+    // @return: The start offsets of the stack frames.
+    std::vector<u64> computeStackFrames(PhysicalRanges& reads) const;
+
+    // Compute the value returned by mappedRegions().
+    // @param reads: The physical ranges read are appended to this vector.
+    // @return: The mapped regions.
+    std::vector<MappedRegion> computeMappedRegions(PhysicalRanges& reads) const;
+
+    // Get the extended state to be stored in a new snapshot.
+    // @param base: The base of the new snapshot, can be nullptr.
+    // @param extendedState: The extended state of the new snapshot.
+    // @return: The ExtendedState of the base if it is equal to extendedState,
+    // a new copy of extendedState otherwise.
+    static std::shared_ptr<Vm::State::ExtendedState const> shareExtendedState(
+        std::shared_ptr<Snapshot> const& base,
+        Vm::State::ExtendedState const& extendedState);
+
     // The snapshot this snapshot is built on top of.
     std::shared_ptr<Snapshot> m_baseSnapshot;
     // The value of all the register at that snapshot.
     Vm::State::Registers m_regs;
+    // The extended state at that snapshot, shared with the base if unchanged.
+    std::shared_ptr<Vm::State::ExtendedState const> m_extendedState;
     // Underlying BlockTree holding the snapshot of memory.
     std::shared_ptr<BlockTree> m_blockTree;
+    // The cached values derived from the registers and memory.
+    std::shared_ptr<DerivedState> m_derived;
 };
 }
@@ -1,13 +1,89 @@
 #pragma once
 #include <x86lab/ui/ui.hpp>
+#include <atomic>
+#include <functional>
+#include <optional>
 
 namespace X86Lab::Ui {
 
-// Implementation of Manager for "raw" output in stdout. Each update prints out
-// the current value of the registers. The code is stepped through until the Vm
-// is no longer runnable.
+// Implementation of Backend for scripting and batch automation. Commands are
+// read line by line from a script file or stdin, one command per line. Blank
+// lines and lines starting with '#' are ignored. The supported commands are:
+//  - step [N]: Execute the next N instructions (default 1).
+//  - rstep [N]: Step backward N instructions (default 1).
+//  - until <reg><op><value> [N]: Execute instructions until the condition on
+//  the register holds, or at most N instructions. <op> is one of ==, !=, <,
+//  <=, >, >=. For instance: until rip==0x40.
+//  - reg <name>: Print the value of a register, e.g. reg rax.
+//  - regs: Print the value of all the general purpose and control registers.
+//  - mem <addr> <len>: Hexdump len bytes of linear memory starting at addr.
+//  len cannot exceed the size of the physical memory.
+//  - snapshot save <file>: Write the physical memory of the current snapshot
+//  to <file>.
+//  - memstats: Print statistics about the memory used to store the history up
+//  to the current snapshot, see Snapshot::StorageStats.
+//  - query <reg><op><value>: Print all the steps, up to the current step, at
+//  which the condition on the register holds, see HistoryQuery.
+//  - query values <addr> <len>: Print the distinct values taken by len bytes
+//  of linear memory starting at addr and the first step of each.
+//  - query paging: Print the steps that changed the page tables or the
+//  registers controlling paging.
+//  - loops: Print a summary of the loops executed so far, see LoopIndex, and
+//  the iteration containing the current step.
+//  - iter next|prev [N]: Go to the start of the next/previous iteration of the
+//  innermost loop containing the current step, N times (default 1).
+//  - iter <k>: Go to the start of the kth iteration, counting from 0, of the
+//  innermost loop containing the current step, within its current activation.
+//  - print on|off: Enable/disable printing the registers after each step. Off
+//  by default so that batches of steps run at full speed.
+//  - repstring on|off: Enable/disable executing rep-prefixed string
+//  instructions entirely in a single step. Off by default.
+//  - workingset on|off: Enable/disable scanning the guest's working set after
+//  each step. Off by default.
+//  - workingset report: Print the number of samples and of distinct pages
+//  accessed and written up to the current step.
+//  - memprofile run: Characterize the memory hierarchy of the host, see
+//  MemoryProfile. This takes a while.
+//  - memprofile save <file>: Write the results of the last memory profile to
+//  <file> as CSV.
+//  - critpath run: Start the analysis of the dependencies between the
+//  instructions executed so far, see DependencyGraph.
+//  - critpath report: Wait for the last analysis and print the length of the
+//  critical path and the number of times each instruction appears on it.
+//  - reset: Reset the VM.
+//  - quit: Exit. This is implied when reaching the end of the input.
+// Output of the commands goes to stdout, errors and logs go to stderr, unless
+// other streams are given to the constructor. Restricted Clis, e.g. serving a
+// remote client, refuse the snapshot and memprofile commands, which write
+// files or run benchmarks on the host.
 class Cli : public Backend {
+public:
+    // Create a Cli reading commands from the given script.
+    // @param scriptPath: Path to the script to read the commands from. "-"
+    // reads the commands from stdin.
+    Cli(std::string const& scriptPath);
+
+    // Create a Cli reading commands from a stream, e.g. a connection to a
+    // client. The streams must outlive the Cli.
+    // @param input: The stream to read the commands from.
+    // @param output: The stream the output of the commands is written to.
+    // @param log: The stream errors and logs are written to.
+    // @param restricted: If true, the commands acting on the host are
+    // refused, and the commands reading memory read at most
+    // MaxRestrictedLength bytes.
+    Cli(std::istream& input,
+        std::ostream& output,
+        std::ostream& log,
+        bool const restricted = false);
+
+    // Stop the current batch of steps, if any, before its next step. Can be
+    // called from any thread, e.g. when the client disconnects.
+    void cancel();
+
 private:
+    // Implementation of init.
+    virtual bool doInit();
+
     // Implementation of waitForNextAction.
     virtual Action doWaitForNextAction();
 
@@ -17,9 +93,63 @@ private:
     // Implementation of log.
     virtual void doLog(std::string const& msg);
 
-    // True if the last call to update indicated that the VM was still runnable.
-    // This is used to know when to terminate and send an Action::Quit in the
-    // next call to doWaitForNextAction.
-    bool m_isVmRunnable{true};
+    // Parse and execute a single command. Commands that require stepping the
+    // Vm only set the pending batch, which is consumed by
+    // doWaitForNextAction.
+    // @param line: The line containing the command.
+    // @return: The action to return to the Runner, None if the command did not
+    // require any action from the Runner.
+    // @throws: A std::invalid_argument in case the command is malformed.
+    Action execute(std::string const& line);
+
+    // Print the values of the general purpose and control registers.
+    void printRegisters() const;
+
+    // Write formatted output to the output stream.
+    // @param format: The printf-style format.
+    void print(char const * const format, ...) const
+        __attribute__((format(printf, 2, 3)));
+
+    // Stop the current batch of steps, if any.
+    void cancelBatch();
+
+    // Path to the script, "-" for stdin.
+    std::string m_scriptPath;
+    // The stream the commands are read from.
+    std::unique_ptr<std::istream> m_scriptFile;
+    // Points to either m_scriptFile, std::cin or the stream given to the
+    // constructor.
+    std::istream* m_input;
+    // The streams the output of the commands and the logs are written to.
+    std::ostream* m_output;
+    std::ostream* m_log;
+
+    // If true, the commands acting on the host are refused.
+    bool m_restricted;
+    // The longest range of memory read by mem or query values when
+    // m_restricted is true. The process might be shared with other sessions.
+    static constexpr u64 MaxRestrictedLength = 1 << 20;
+
+    // The latest state received through doUpdate.
+    State m_state;
+
+    // The action to be repeated for the current batch, Step or ReverseStep.
+    Action m_batchAction;
+    // The number of times m_batchAction remains to be returned.
+    u64 m_batchRemaining;
+    // If set, the current batch stops as soon as this condition holds.
+    std::optional<std::function<bool(Snapshot::Registers const&)>>
+        m_batchUntil;
+    // Set by cancel(), the current batch stops before its next step.
+    std::atomic<bool> m_cancelRequested;
+
+    // If true, the registers are printed after every step.
+    bool m_printEachStep;
+
+    // Whether rep-string stepping is currently enabled in the Runner.
+    bool m_repStringStepping;
+
+    // Whether working set tracking is currently enabled in the Runner.
+    bool m_workingSetTracking;
 };
 }
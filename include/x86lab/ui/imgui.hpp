@@ -3,8 +3,12 @@
 #include "imgui_impl_sdl.h"
 #include "imgui_impl_sdlrenderer.h"
 
+#include <functional>
 #include <set>
 
+// Holds the bitmap of the MemoryMapWindow, defined in SDL.h.
+struct SDL_Texture;
+
 namespace X86Lab::Ui {
 
 // Ui::Backend implementation using Dear ImGui running with SDL renderer.
@@ -154,6 +158,12 @@ private:
         // @return: The last requested action, None if the user did not
         // clic/request any button/action.
         Action clickedAction() const;
+
+        // Get the argument of the last action requested by the user, see
+        // Backend::actionArgument().
+        // @return: The iteration to jump to for an Action::JumpToIteration,
+        // 0 for other actions.
+        u64 clickedActionArgument() const;
     private:
         // Don't draw the title on the config bar as this is not a window.
         static constexpr ImGuiWindowFlags defaultFlags =
@@ -171,12 +181,26 @@ private:
         // cpu mode in main.cpp. Currently there is nothing enforcing this!
         Vm::CpuMode m_startCpuMode;
 
+        // The current value of the rep-string stepping checkbox. Must be the
+        // same as the default in main.cpp, toggling the checkbox emits a
+        // ToggleRepStringStepping action.
+        bool m_repStringStepping;
+
+        // The current value of the working set tracking checkbox. Toggling the
+        // checkbox emits a ToggleWorkingSetTracking action.
+        bool m_workingSetTracking;
+
+        // The iteration entered in the "Go to iteration" input.
+        u64 m_iterationTarget;
+
         // Override.
         virtual void doDraw(State const& state);
     };
 
     // Show the code being run in the VM. Simple layout printing each line of
-    // the source file and highlighting the current instruction.
+    // the source file and highlighting the current instruction, as well as
+    // the instructions on the critical path once the dependencies have been
+    // analyzed, see DependencyGraph.
     class CodeWindow : public Window {
     public:
         // Default title for a CodeWindow.
@@ -187,6 +211,12 @@ private:
     private:
         // Background color of the current line / instruction.
         static constexpr ImVec4 currLineBgColor = ImVec4(0.18, 0.18, 0.2, 1);
+        // Background color of the lines / instructions on the critical path.
+        static constexpr ImVec4 critPathBgColor = ImVec4(0.3, 0.12, 0.12, 1);
+
+        // Fill the background of the current row of a table.
+        // @param color: The color of the background.
+        void drawRowBackground(ImVec4 const& color) const;
 
         // The disassembled code, indexed by the address of each instruction.
         // Each pair contains the bytes and mnemonic of the instruction.
@@ -257,18 +287,8 @@ private:
         // Color of the addresses in the table.
         static constexpr ImVec4 addrColor = ImVec4(0.5f, 0.5f, 0.5f, 1.0f);
 
-        // Keep track of the start offset of the last maxHistory stack frames.
-        // Re-computed everytime the state of the VM changes. This set is meant
-        // to avoid recomputing the frame offsets everytime the screen is
-        // refresh while the VM state stays un-changed.
-        std::set<u64> m_stackFrameStartOffsets;
-        // Re-compute the m_stackFrameStartOffsets. Called everytime the
-        // VM's state changes.
-        void updateStackFrameStartOffsets(State const& state);
-        // The value of RBP and RSP in the previous call to doDraw(). This is
-        // used to detect when the set of stack frames is changing which
-        // usually coincides with RBP or RSP changing.
-        u64 m_previousRbp;
+        // The value of RSP in the previous call to doDraw(). This is used to
+        // reset the scroll after each push / pop.
         u64 m_previousRsp;
 
         // Override.
@@ -356,6 +376,28 @@ private:
         // Draw the tab showing the state of the IDT entries.
         void doDrawIdt(State const& state);
 
+        // Draw the tab showing the timeline of a register over the execution
+        // history and allowing to search for the first step satisfying a
+        // condition on that register.
+        void doDrawHistory(State const& state);
+
+        // Draw the tab showing every value taken by a physical memory location
+        // up to the current step, along with the step and instruction that
+        // wrote each value.
+        void doDrawMemoryHistory(State const& state);
+
+        // Draw the tab showing the footprint of the working set over a range
+        // of steps and a heatmap of the pages touched by each step.
+        void doDrawWorkingSet(State const& state);
+
+        // Draw the tab showing the curves of the last memory profile, one plot
+        // per benchmark followed by the table of all the points.
+        void doDrawMemoryProfile(State const& state);
+
+        // Draw the tab summarizing the loops executed so far, one row per
+        // loop, highlighting the loop containing the current step.
+        void doDrawLoops(State const& state);
+
         // Helper function for drawing an IDT using a specific type as entry.
         // This creates an ImGui table where each row represent an entry in the
         // IDT. The EntryType template parameter indicates how the IDT should be
@@ -372,8 +414,10 @@ private:
         //  each column. This is used to print the header row of the table that
         //  will contain the entries.
         //  - A method draw() which draws the entry in the current table.
+        // @param table: The descriptor table to draw.
+        // @param state: The state to draw the table from.
         template<typename EntryType>
-        void doDrawTable(Vm::State::Registers::Table const& table,
+        void doDrawTable(Snapshot::DescriptorTable const table,
                          State const& state);
 
         // The dropdown used to select the display format of general purpose
@@ -387,6 +431,46 @@ private:
         // SSE/AVX dropdown for granularity and display format.
         std::unique_ptr<Dropdown<Granularity>> m_sseAvxGranularityDropdown;
         std::unique_ptr<Dropdown<DisplayFormat>> m_sseAvxFormatDropdown;
+
+        // The maximum number of points in the timeline plot of the history tab.
+        // Longer histories are sampled down to this number of points.
+        static constexpr u64 maxHistoryPlotPoints = 1024;
+
+        // History tab: dropdowns selecting the register and the comparison to
+        // use in the search.
+        std::unique_ptr<Dropdown<RegisterHistory::Register>>
+            m_historyRegDropdown;
+        std::unique_ptr<Dropdown<RegisterHistory::Comparison>>
+            m_historyCmpDropdown;
+        // History tab: the value to compare the register against.
+        u64 m_historyQueryValue;
+        // History tab: the result of the last search, shown until the next
+        // search.
+        std::string m_historyQueryResult;
+
+        // Memory history tab: the physical address to query.
+        u64 m_memHistoryAddr;
+        // Memory history tab: the size of the location to query.
+        std::unique_ptr<Dropdown<Granularity>> m_memHistorySizeDropdown;
+        // Memory history tab: the result of the last query, kept until the
+        // next query.
+        std::vector<Snapshot::MemoryWrite> m_memHistoryWrites;
+        // Memory history tab: summary of the last query.
+        std::string m_memHistorySummary;
+
+        // Working set tab: the range of steps to compute the footprint of.
+        u64 m_workingSetFirstStep;
+        u64 m_workingSetLastStep;
+        // Working set tab: the footprint of the range, kept until the next
+        // computation.
+        std::string m_workingSetSummary;
+        // Working set tab: the minimum size of a cell of the heatmap in
+        // pixels. Each cell covers a range of pages for a single sample.
+        static constexpr float heatmapCellSize = 4.0f;
+        // Working set tab: colors of the pages that were only read and of the
+        // pages that were written.
+        static constexpr ImVec4 readColor = ImVec4(0.2f, 0.6f, 1.0f, 1.0f);
+        static constexpr ImVec4 writeColor = ImVec4(1.0f, 0.35f, 0.2f, 1.0f);
     };
 
     // Display the content of the VM's physical memory.
@@ -440,11 +524,128 @@ private:
         virtual void doDraw(State const& state);
     };
 
+    // Render the VM's physical memory as a bitmap, one pixel per byte or per
+    // cache line, colored by value or by how recently it was last written
+    // over the history. This shows the access patterns over megabytes of
+    // memory that a hex dump cannot.
+    // The bitmap is kept in an SDL texture across frames. When the shown
+    // snapshot changes, only the memory in the leaves of the BlockTree that
+    // differ from the previously shown snapshot is read, and only the rows of
+    // the texture containing it are updated.
+    class MemoryMapWindow : public Window {
+    public:
+        // Create the window.
+        // @param renderer: The renderer used to create the texture.
+        MemoryMapWindow(SDL_Renderer * const renderer);
+
+        ~MemoryMapWindow();
+    private:
+        static constexpr char const * defaultTitle = "Memory map";
+
+        static constexpr ImGuiWindowFlags windowFlags =
+            Imgui::defaultWindowFlags;
+
+        // The amount of memory represented by a pixel.
+        enum class CellSize {
+            Byte,
+            CacheLine,
+        };
+
+        // What the color of a pixel represents.
+        enum class Coloring {
+            // The value of the byte, or the average value of the cache line.
+            // Zeroes are black, printable ASCII green, other values below 0x80
+            // blue and the values above red.
+            Value,
+            // The number of steps since the last write to the byte or cache
+            // line, on a logarithmic scale from bright (current step) to dark.
+            // Memory never written since the initial state is grey.
+            Recency,
+        };
+
+        // Size of a cache line in bytes.
+        static constexpr u64 cacheLineSize = 64;
+        // The minimum number of pixels per row of the texture. Rows are
+        // widened for large memories to keep the texture's height reasonable.
+        static constexpr u64 minTextureWidth = 256;
+        static constexpr u64 maxTextureHeight = 4096;
+        // Color of the memory never written in the Recency coloring.
+        static constexpr u32 neverWrittenColor = IM_COL32(48, 48, 48, 255);
+
+        // Dropdowns selecting the cell size and coloring.
+        std::unique_ptr<Dropdown<CellSize>> m_cellSizeDropdown;
+        std::unique_ptr<Dropdown<Coloring>> m_coloringDropdown;
+
+        // The renderer the texture is created with.
+        SDL_Renderer * const m_renderer;
+        // The texture holding the bitmap, one pixel per cell. nullptr until
+        // the first snapshot is drawn.
+        SDL_Texture * m_texture;
+        // Width and height of the texture in pixels.
+        u64 m_textureWidth;
+        u64 m_textureHeight;
+
+        // The cell size and coloring of the current texture.
+        CellSize m_cellSize;
+        Coloring m_coloring;
+
+        // The snapshot m_values and m_lastWrite are computed for, and its
+        // step. nullptr if they must be computed from scratch.
+        std::shared_ptr<Snapshot const> m_snapshot;
+        u64 m_step;
+        // The size of the physical memory of m_snapshot.
+        u64 m_memSize;
+
+        // For each cell, its value: the byte or the average of the cache line.
+        std::vector<u8> m_values;
+        // For each cell, the step of the last write to it up to m_step, 0 if
+        // never written.
+        std::vector<u64> m_lastWrite;
+        // The color of each pixel of the texture, row by row.
+        std::vector<u32> m_pixels;
+        // The rows of the texture that must be re-colored and uploaded,
+        // [first, end).
+        u64 m_dirtyRowsBegin;
+        u64 m_dirtyRowsEnd;
+
+        // Update m_values and m_lastWrite to a new snapshot of the history.
+        // @param snapshot: The new snapshot.
+        // @param step: The step of the new snapshot.
+        void update(std::shared_ptr<Snapshot const> const snapshot,
+                    u64 const step);
+
+        // Re-read the values of the cells covering a physical range of the
+        // current snapshot and mark their rows as dirty.
+        // @param offset: The offset of the range.
+        // @param size: The size of the range in bytes.
+        void readCells(u64 const offset, u64 const size);
+
+        // Find the cells of a range which content differs between a snapshot
+        // and its base.
+        // @param snapshot: The snapshot.
+        // @param offset: The offset of the range.
+        // @param size: The size of the range in bytes.
+        // @param callback: Called with the index of each cell that differs.
+        void forEachChangedCell(Snapshot const& snapshot,
+                                u64 const offset,
+                                u64 const size,
+                                std::function<void(u64)> const& callback) const;
+
+        // Compute the color of a cell.
+        // @param cell: The index of the cell.
+        // @return: The color, as IM_COL32.
+        u32 cellColor(u64 const cell) const;
+
+        // Override.
+        virtual void doDraw(State const& state);
+    };
+
     // The set of windows making up the interface of x86Lab.
     std::unique_ptr<ConfigBar> m_configBar;
     std::unique_ptr<CodeWindow> m_codeWindow;
     std::unique_ptr<StackWindow> m_stackWindow;
     std::unique_ptr<CpuStateWindow> m_cpuStateWindow;
     std::unique_ptr<MemoryWindow> m_memoryWindow;
+    std::unique_ptr<MemoryMapWindow> m_memoryMapWindow;
 };
 }
@@ -2,6 +2,12 @@
 #include <x86lab/vm.hpp>
 #include <x86lab/code.hpp>
 #include <x86lab/snapshot.hpp>
+#include <x86lab/registerhistory.hpp>
+#include <x86lab/workingsethistory.hpp>
+#include <x86lab/memoryprofile.hpp>
+#include <x86lab/loopindex.hpp>
+#include <x86lab/dependencygraph.hpp>
+#include <future>
 #include <string>
 #include <memory>
 
@@ -31,6 +37,30 @@ enum class Action {
     Reset32,
     // Reset the VM into 64-bit protected mode.
     Reset64,
+    // Toggle completing rep-prefixed string instructions in a single step
+    // instead of one step per iteration.
+    ToggleRepStringStepping,
+    // Toggle scanning the guest's working set after each step, see
+    // Vm::scanWorkingSet().
+    ToggleWorkingSetTracking,
+    // Characterize the memory hierarchy of the host, see MemoryProfile.
+    ProfileMemory,
+    // Go to the start of the next iteration of the innermost loop containing
+    // the current step, see LoopIndex. Runs the VM if that iteration was not
+    // executed yet.
+    NextIteration,
+    // Go to the start of the previous iteration of the innermost loop
+    // containing the current step.
+    PreviousIteration,
+    // Go to the start of an iteration of the innermost loop containing the
+    // current step, within the activation of the loop containing the current
+    // step. The index of the iteration, counting from 0 at the entry of the
+    // loop, is given by Backend::actionArgument().
+    JumpToIteration,
+    // Build the dependency graph of the instructions executed so far and
+    // compute its critical path, see DependencyGraph. The analysis runs in the
+    // background.
+    AnalyzeDependencies,
 };
 
 // State represent anything that needs to be displayed on the UI implementation.
@@ -47,9 +77,28 @@ public:
     // @param runState: The VM's runnable state.
     // @param code: The code that is currently loaded and running on the Vm.
     // @param snapshot: The latest snapshot of the VM.
+    // @param registerHistory: The columnar history of the registers, up to the
+    // latest executed step.
+    // @param historyIndex: The index of the snapshot in the history.
+    // @param workingSetHistory: The working set sampled after each step while
+    // tracking is enabled.
+    // @param memoryProfile: The results of the last memory profile, see
+    // Action::ProfileMemory. Might not be ready yet.
+    // @param loopIndex: The loops executed up to the latest executed step.
+    // @param dependencyGraph: The result of the last dependency analysis, see
+    // Action::AnalyzeDependencies. Might not be ready yet.
     State(Vm::OperatingState const runState,
           std::shared_ptr<Code const> const code, 
-          std::shared_ptr<Snapshot const> const snapshot);
+          std::shared_ptr<Snapshot const> const snapshot,
+          std::shared_ptr<RegisterHistory const> const registerHistory,
+          u64 const historyIndex,
+          std::shared_ptr<WorkingSetHistory const> const workingSetHistory =
+              nullptr,
+          std::shared_future<std::shared_ptr<MemoryProfile::Results const>>
+              const memoryProfile = {},
+          std::shared_ptr<LoopIndex const> const loopIndex = nullptr,
+          std::shared_future<std::shared_ptr<DependencyGraph const>> const
+              dependencyGraph = {});
 
     // @return: true if the VM is runnable, false otherwise.
     bool isVmRunnable() const;
@@ -78,6 +127,48 @@ public:
     // Get a pointer on the full snapshot associated to this State.
     std::shared_ptr<Snapshot const> snapshot() const;
 
+    // Get the columnar history of the registers. This covers all the steps
+    // executed so far, including the ones after historyIndex() when reverse
+    // stepping.
+    // @return: The register history, nullptr for a default State.
+    std::shared_ptr<RegisterHistory const> registerHistory() const;
+
+    // Get the index of the snapshot of this State in the execution history,
+    // e.g. the number of steps executed to reach it.
+    u64 historyIndex() const;
+
+    // Get the history of the working set. This covers all the steps executed
+    // so far, including the ones after historyIndex() when reverse stepping.
+    // @return: The working set history, nullptr if not available.
+    std::shared_ptr<WorkingSetHistory const> workingSetHistory() const;
+
+    // Get the results of the last memory profile, see Action::ProfileMemory.
+    // @param wait: If true, wait for the profile to complete.
+    // @return: The results, nullptr if the memory was never profiled, if the
+    // profile is still running or if it failed.
+    std::shared_ptr<MemoryProfile::Results const> memoryProfile(
+        bool const wait = false) const;
+
+    // @return: true if a memory profile is running in the background.
+    bool memoryProfileRunning() const;
+
+    // Get the index of the loops executed so far. This covers all the steps
+    // executed so far, including the ones after historyIndex() when reverse
+    // stepping.
+    // @return: The loop index, nullptr if not available.
+    std::shared_ptr<LoopIndex const> loopIndex() const;
+
+    // Get the result of the last dependency analysis, see
+    // Action::AnalyzeDependencies.
+    // @param wait: If true, wait for the analysis to complete.
+    // @return: The dependency graph, nullptr if no analysis was requested, if
+    // it is still running or if it failed.
+    std::shared_ptr<DependencyGraph const> dependencyGraph(
+        bool const wait = false) const;
+
+    // @return: true if a dependency analysis is running in the background.
+    bool dependencyAnalysisRunning() const;
+
     // Get the address at which the code was loaded in the VM's memory.
     // @return: The linear address of the first byte of code.
     u64 codeLinearAddr() const;
@@ -89,6 +180,14 @@ private:
     Vm::OperatingState m_runState;
     std::shared_ptr<Code const> m_loadedCode;
     std::shared_ptr<Snapshot const> m_latestSnapshot;
+    std::shared_ptr<RegisterHistory const> m_registerHistory;
+    u64 m_historyIndex;
+    std::shared_ptr<WorkingSetHistory const> m_workingSetHistory;
+    std::shared_future<std::shared_ptr<MemoryProfile::Results const>>
+        m_memoryProfile;
+    std::shared_ptr<LoopIndex const> m_loopIndex;
+    std::shared_future<std::shared_ptr<DependencyGraph const>>
+        m_dependencyGraph;
 };
 
 // Backend implementation of the user interface. This is meant to be derived in
@@ -114,7 +213,21 @@ public:
     // @param msg: The message to be printed.
     void log(std::string const& msg);
 
+    // Get the argument of the last action returned by waitForNextAction(),
+    // e.g. the iteration of an Action::JumpToIteration.
+    // @return: The argument, 0 if the action has none.
+    u64 actionArgument() const;
+
+protected:
+    // Set the argument of the action about to be returned by
+    // doWaitForNextAction(). Reset to 0 before each call.
+    // @param argument: The argument.
+    void setActionArgument(u64 const argument);
+
 private:
+    // The argument of the last action.
+    u64 m_actionArgument = 0;
+
     // Implementation of init, to be defined by sub-class.
     virtual bool doInit() = 0;
 
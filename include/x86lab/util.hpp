@@ -8,7 +8,13 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <fstream>
+#include <functional>
 #include <memory>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 // Shorthand for the uintX_t types.
 using u8 = uint8_t;
@@ -221,6 +227,76 @@ private:
     std::string m_absPath;
 };
 
+// A fixed set of worker threads used to split large operations, e.g. building
+// snapshots of multi-GiB guests, across the host's cores.
+class ThreadPool {
+public:
+    // Create a thread pool.
+    // @param numThreads: The number of threads working on a parallelFor(),
+    // including the calling thread. Hence numThreads - 1 workers are created.
+    ThreadPool(u64 const numThreads);
+
+    // Stop and join the workers.
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    // Get the pool shared by the whole process, using all the host's cpus.
+    // @return: The shared pool.
+    static ThreadPool& shared();
+
+    // Get the number of threads working on a parallelFor().
+    // @return: The number of workers + 1 for the calling thread.
+    u64 numThreads() const;
+
+    // Call func(i) for each i in [0; count) across the workers and the calling
+    // thread, and wait for all the calls to complete. Calls made from within
+    // a task run sequentially on the calling thread. Concurrent calls from
+    // different threads are serialized.
+    // @param count: The number of calls.
+    // @param func: The function to call.
+    // @throws: The first exception thrown by func, after all the calls
+    // completed.
+    void parallelFor(u64 const count, std::function<void(u64)> const& func);
+
+private:
+    // Main loop of a worker: wait for a job and process its tasks.
+    void workerLoop();
+
+    // Process the tasks of the current job until there are none left.
+    void processTasks();
+
+    std::vector<std::thread> m_workers;
+    // Serializes parallelFor() calls.
+    std::mutex m_jobMutex;
+
+    // Protect all the fields below.
+    std::mutex m_mutex;
+    // Signaled when a new job is available or when stopping.
+    std::condition_variable m_jobCond;
+    // Signaled when all the tasks of the current job completed.
+    std::condition_variable m_doneCond;
+    // Incremented for each new job so that workers can tell jobs apart.
+    u64 m_jobId;
+    bool m_stop;
+    // The current job.
+    std::function<void(u64)> const * m_func;
+    u64 m_count;
+    // Index of the next task to be processed.
+    u64 m_next;
+    // Number of tasks that completed.
+    u64 m_numDone;
+    // The first exception thrown by a task of the current job.
+    std::exception_ptr m_exception;
+};
+
+// Copy memory using the shared ThreadPool for large copies.
+// @param dest: The destination buffer.
+// @param src: The source buffer.
+// @param size: The number of bytes to copy.
+void parallelMemcpy(void * const dest, void const * const src, u64 const size);
+
 // Functions related to x86 extension support.
 namespace Extension {
 // Check extension support on the current cpu.
@@ -235,6 +311,62 @@ bool hasSse4_2();
 bool hasAvx();
 bool hasAvx2();
 bool hasAvx512();
+// 1GiB pages in 4-level paging.
+bool hasPage1Gb();
+}
+
+// Functions controlling where threads and memory are placed on the host. These
+// are used to get reproducible measurements on multi-socket hosts.
+namespace Host {
+// Pin the calling thread to a single host cpu.
+// @param cpu: The index of the host cpu to pin the calling thread to.
+// @throws: An Error in case the affinity of the thread cannot be changed.
+void pinCurrentThread(u32 const cpu);
+
+// Bind a memory range to a NUMA node. Pages in the range that are not yet
+// populated are allocated on that node upon first touch, already populated
+// pages are migrated to the node.
+// @param addr: The start address of the range, must be PAGE_SIZE aligned.
+// @param size: The size of the range in bytes.
+// @param node: The index of the NUMA node to bind the memory to.
+// @throws: An Error in case of mbind failure.
+void bindMemory(void * const addr, u64 const size, u32 const node);
+
+// Populate all the pages in a memory range so that no page fault is incurred
+// upon first access.
+// @param addr: The start address of the range, must be PAGE_SIZE aligned.
+// @param size: The size of the range in bytes.
+void prefault(void * const addr, u64 const size);
+
+// Find which pages of a memory range have been populated, e.g. are either
+// present in RAM or swapped out. A page that was never touched is not
+// populated and, for anonymous memory, reads as zeroes. This uses
+// /proc/self/pagemap; if it is not available all pages are reported as
+// populated.
+// @param addr: The start address of the range, must be PAGE_SIZE aligned.
+// @param size: The size of the range in bytes.
+// @return: For each page of the range, in order, true if it is populated.
+std::vector<bool> populatedPages(void const * const addr, u64 const size);
+
+// Find which pages of a file hold data, as opposed to holes that read as
+// zeroes. This complements populatedPages() for file-backed memory, which
+// pages are not reported by the page tables until accessed through the
+// mapping. If the file system cannot report holes all pages are reported as
+// populated.
+// @param fd: A file descriptor on the file.
+// @param size: The size of the range to inspect, from the start of the file.
+// @return: For each page of the range, in order, true if it holds data.
+std::vector<bool> populatedFilePages(int const fd, u64 const size);
+
+// Find how much memory of a range is backed by huge pages, either transparent
+// huge pages or pages mapped by a single PMD. This uses /proc/self/smaps which
+// only reports whole mappings, hence all the huge pages of the mappings
+// overlapping the range are counted.
+// @param addr: The start address of the range.
+// @param size: The size of the range in bytes.
+// @return: The number of bytes backed by huge pages, 0 if /proc/self/smaps is
+// not available.
+u64 hugePageBytes(void const * const addr, u64 const size);
 }
 
 // Collection of helper functions to interact with the KVM API.
@@ -283,6 +415,15 @@ kvm_run& getVcpuRunStruct(int const vcpuFd);
 // @throws: An Error in case of error.
 void disableMsrFiltering(int const vmFd);
 
+// Make KVM honor the memory types set by the guest through its PAT and page
+// tables instead of forcing write-back, by disabling the "ignore guest PAT"
+// quirk. Must be called before the guest's memory is accessed.
+// @param vmFd: The VM's file descriptor.
+// @return: true if the quirk was disabled, false if the host's KVM does not
+// allow it, in which case guest memory types may be ignored.
+// @throws: A KvmError in case of error.
+bool honorGuestPat(int const vmFd);
+
 // Setup the CPUID on the guest vcpu to mirror the host's capabilities.
 // @param vcpuFd: The virtual CPU's file descriptor to set the CPUID caps to.
 // @throws: An Error in case of error.
@@ -314,6 +455,15 @@ kvm_sregs getSRegs(int const vcpuFd);
 // @throws: A KvmError in case of error.
 void setSRegs(int const vcpuFd, kvm_sregs const& regs);
 
+// Translate a guest linear address to a guest physical address using the
+// current paging configuration of a vcpu (KVM_TRANSLATE).
+// @param vcpuFd: The file descriptor of the target vcpu.
+// @param linearAddr: The linear address to translate.
+// @return: The kvm_translation for this address. The translation is only valid
+// if the `valid` field is non-zero.
+// @throws: A KvmError in case of error.
+kvm_translation translate(int const vcpuFd, u64 const linearAddr);
+
 // Get the maximum number of memory slots supported by the vm.
 // @param vmFd: The file descriptor for the vm.
 // @return: The maximum number of memory slots supported by vmFd.
@@ -332,6 +482,35 @@ kvm_fpu getFpu(int const vcpuFd);
 // @throws: A KvmError in case of error.
 void setFpu(int const vcpuFd, kvm_fpu const& fpu);
 
+// Get the debug registers of a vcpu. This calls the KVM_GET_DEBUGREGS ioctl.
+// @param vcpuFd: The file descriptor of the target vcpu.
+// @return: A kvm_debugregs containing the current debug registers.
+// @throws: A KvmError in case of error.
+kvm_debugregs getDebugRegs(int const vcpuFd);
+
+// Set the debug registers of a vcpu. This calls the KVM_SET_DEBUGREGS ioctl.
+// @param vcpuFd: The file descriptor of the target vcpu.
+// @param debugRegs: The debug registers to set on the vcpu.
+// @throws: A KvmError in case of error.
+void setDebugRegs(int const vcpuFd, kvm_debugregs const& debugRegs);
+
+// Read MSRs of a vcpu. This calls the KVM_GET_MSRS ioctl.
+// @param vcpuFd: The file descriptor of the target vcpu.
+// @param indices: The indices of the MSRs to read.
+// @return: The value of each MSR, in the order of `indices`.
+// @throws: A KvmError in case of error or if any of the MSRs cannot be read.
+std::vector<u64> getMsrs(int const vcpuFd, std::vector<u32> const& indices);
+
+// Write MSRs of a vcpu. This calls the KVM_SET_MSRS ioctl.
+// @param vcpuFd: The file descriptor of the target vcpu.
+// @param indices: The indices of the MSRs to write.
+// @param values: The value to write in each MSR, in the order of `indices`.
+// @throws: A KvmError in case of error or if any of the MSRs cannot be
+// written.
+void setMsrs(int const vcpuFd,
+             std::vector<u32> const& indices,
+             std::vector<u64> const& values);
+
 // Memory layout of the XSAVE area returned by KVM_GET_XSAVE. This is used to
 // fish the register values we are interested in, without having to compute the
 // specific offsets needed within kvm_xsave.region[].
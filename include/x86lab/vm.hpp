@@ -1,18 +1,23 @@
 #pragma once
 #include <x86lab/util.hpp>
 #include <x86lab/code.hpp>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <vector>
 #include <utility>
+#include <optional>
+#include <thread>
 
 namespace X86Lab {
 
 constexpr size_t PAGE_SIZE(4096);
 
-// Encapsulate state related to a KVM and allows interactions with it.
-// As of now under X86Lab, KVMs always have a single vCpu since the goal is to
-// analyze a small piece of assembly.
+// Encapsulate the state of a virtual machine and allows interactions with it.
+// As of now under X86Lab, VMs always have a single vCpu since the goal is to
+// analyze a small piece of assembly. The Vm owns the guest's physical memory
+// while running the vCpu is delegated to a Backend, see
+// x86lab/backends/backend.hpp.
 class Vm {
 public:
     // Contains a snapshot of the internal state of a VM (registers, memory,
@@ -62,7 +67,7 @@ public:
             // XMM registers.
             vec128 xmm[NumXmmRegs];
 
-            // TODO: Include floating point registers.
+            // The x87 FPU registers are part of ExtendedState.
 
             // YMM registers.
             // FIXME: YMM regs are aliased to their XMM reg for the bottom 128
@@ -92,28 +97,183 @@ public:
             bool operator==(Registers const&) const = default;
         };
 
+        // The architectural state of the vCpu that is not part of Registers:
+        // the x87 FPU, the hidden part of the segment registers, the debug
+        // registers, MSRs and XCR0. Together with Registers, this is enough to
+        // restore the state of the vCpu. Most of this state rarely changes,
+        // hence it is kept apart from Registers so that snapshots can share it
+        // with their base, see Snapshot::extendedState().
+        struct ExtendedState {
+            // A x87 register, in the 80-bit extended precision format.
+            struct X87Reg {
+                u64 mantissa;
+                u16 signExponent;
+
+                bool operator==(X87Reg const&) const = default;
+            };
+
+            // State of the x87 FPU.
+            struct Fpu {
+                static constexpr u8 NumRegs = 8;
+                // The registers, in stack order: st[0] is ST(0).
+                X87Reg st[NumRegs];
+                // Control and status words.
+                u16 fcw;
+                u16 fsw;
+                // Abridged tag word: bit i is set if physical register i is
+                // not empty.
+                u8 ftw;
+                // The opcode, instruction pointer and data pointer of the last
+                // non-control x87 instruction.
+                u16 lastOpcode;
+                u64 lastIp;
+                u64 lastDp;
+
+                bool operator==(Fpu const&) const = default;
+            };
+            Fpu fpu;
+
+            // A segment register, including the hidden part loaded from its
+            // descriptor.
+            struct Segment {
+                // Default constructor - all fields are set to 0.
+                Segment();
+
+                // Build a Segment from KVM's representation.
+                // @param seg: The segment register as reported by KVM.
+                Segment(kvm_segment const& seg);
+
+                u64 base;
+                u32 limit;
+                u16 selector;
+                u8 type;
+                u8 dpl;
+                bool present;
+                // The D/B, S, L, G and AVL bits of the descriptor.
+                bool db;
+                bool s;
+                bool l;
+                bool g;
+                bool avl;
+                // Set if the segment register holds a null selector.
+                bool unusable;
+
+                bool operator==(Segment const&) const = default;
+            };
+            Segment cs; Segment ds; Segment es;
+            Segment fs; Segment gs; Segment ss;
+            // Task register and LDTR.
+            Segment tr; Segment ldt;
+
+            // Debug registers DR0-3, DR6 and DR7.
+            static constexpr u8 NumDrRegs = 4;
+            u64 dr[NumDrRegs];
+            u64 dr6;
+            u64 dr7;
+
+            // The MSRs captured, other than EFER which is part of Registers.
+            // The timestamp counter is not captured on purpose: it changes on
+            // every step, hence would defeat the sharing with the base.
+            static constexpr u32 Msrs[] = {
+                0x174,      // IA32_SYSENTER_CS
+                0x175,      // IA32_SYSENTER_ESP
+                0x176,      // IA32_SYSENTER_EIP
+                0x1a0,      // IA32_MISC_ENABLE
+                0x277,      // IA32_PAT
+                0xc0000081, // STAR
+                0xc0000082, // LSTAR
+                0xc0000083, // CSTAR
+                0xc0000084, // SFMASK
+                0xc0000100, // FS.base
+                0xc0000101, // GS.base
+                0xc0000102, // KernelGSbase
+            };
+            static constexpr u8 NumMsrs = sizeof(Msrs) / sizeof(Msrs[0]);
+            // The value of each MSR, in the order of Msrs.
+            u64 msrs[NumMsrs];
+
+            // The XCR0 extended control register.
+            u64 xcr0;
+
+            // Default constructor - all the state is set to 0.
+            ExtendedState();
+
+            // Build an ExtendedState from KVM's data structures.
+            // @param fpu: The state of the FPU.
+            // @param sregs: The value of special registers.
+            // @param debugRegs: The value of the debug registers.
+            // @param msrs: The value of each MSR, in the order of Msrs.
+            // @param xcr0: The value of XCR0.
+            ExtendedState(kvm_fpu const& fpu,
+                          kvm_sregs const& sregs,
+                          kvm_debugregs const& debugRegs,
+                          std::vector<u64> const& msrs,
+                          u64 const xcr0);
+
+            bool operator==(ExtendedState const&) const = default;
+        };
+
         // Snapshot of the VM's physical memory.
         struct Memory {
+            // Frees the buffer of a Memory. Buffers are either allocated with
+            // new[], which is what a default-constructed Deleter frees, or
+            // mapped by Vm::getState().
+            struct Deleter {
+                // Deleter of a buffer allocated with new[]. Implicit so that a
+                // std::unique_ptr<u8[]> converts to a Buffer.
+                Deleter(std::default_delete<u8[]> const& = {});
+
+                // Deleter of a buffer mapped with mmap.
+                // @param mappedSize: The size of the mapping in bytes.
+                Deleter(u64 const mappedSize);
+
+                // Free a buffer.
+                // @param ptr: The buffer.
+                void operator()(u8 * const ptr) const;
+
+                // The size of the mapping, 0 if the buffer was allocated with
+                // new[].
+                u64 mappedSize;
+            };
+            using Buffer = std::unique_ptr<u8[], Deleter>;
+
             // Pointer to the memory snapshot, this is a _copy_ of the full
             // physical memory, changing this as no effect on the running VM.
-            std::unique_ptr<u8[]> data;
+            // Pages that are not populated are zeroes, as in the VM.
+            Buffer data;
             // The size of the memory snapshot (and data) in bytes.
             u64 size;
+            // For each page of the memory, true if the page has been populated
+            // in the VM. Pages that were never populated are all zeroes. An
+            // empty vector means that all the pages are populated.
+            std::vector<bool> populated = {};
         };
 
         // Get the value of the registers of this snapshot.
         Registers const& registers() const;
 
+        // Get the extended state of this snapshot.
+        ExtendedState const& extendedState() const;
+
         // Get the physical memory dump of this snapshot.
         Memory const& memory() const;
 
-        // Build a State snapshot.
+        // Build a State snapshot with a zeroed extended state.
         // @param regs: The register values.
         // @param mem: The dump of the physical memory.
         State(Registers const& regs, Memory && mem);
 
+        // Build a State snapshot.
+        // @param regs: The register values.
+        // @param extendedState: The extended state.
+        // @param mem: The dump of the physical memory.
+        State(Registers const& regs,
+              ExtendedState const& extendedState,
+              Memory && mem);
+
     private:
         Registers m_regs;
+        ExtendedState m_extendedState;
         Memory m_mem;
     };
 
@@ -149,23 +309,97 @@ public:
         LongMode,
     };
 
-    // Creates a KVM with the given amount of memory.
+    // Controls where the Vm is placed on the host. The default placement lets
+    // the host's scheduler and allocator decide. Pinning the vCpu and binding
+    // the guest's memory to a NUMA node makes measurements reproducible on
+    // multi-socket hosts.
+    struct Placement {
+        // Default placement: no pinning, no NUMA binding, no prefaulting and
+        // no huge pages.
+        Placement();
+
+        // If set, the index of the host cpu the vCpu is pinned to. The pinning
+        // applies to any thread calling step().
+        std::optional<u32> cpu;
+        // If set, the NUMA node from which the guest's physical memory is
+        // allocated.
+        std::optional<u32> numaNode;
+        // If true, all the guest's physical memory is populated when the Vm is
+        // created, so that no page fault occurs while running the guest.
+        bool prefault;
+        // If true, the guest's physical memory is mapped at a 2MiB aligned
+        // address and the host is asked to back it with transparent huge
+        // pages. This is only a hint, see hugePageBytes().
+        bool hugePages;
+
+        // Get a human-readable description of this placement, e.g. to be
+        // recorded alongside measurements.
+        // @return: A string of the form "cpu=<cpu> node=<node> prefault=<0|1>
+        // hugepages=<0|1>" where unset values are printed as "any".
+        std::string toString() const;
+    };
+
+    // The available backends to run the vCpu.
+    enum class BackendType {
+        // Run the vCpu under KVM, one VM entry/exit per step. Requires access
+        // to /dev/kvm.
+        Kvm,
+        // Interpret the guest's instructions in-process. Only a subset of the
+        // integer instructions is supported, see Backends::Emulator.
+        Emulator,
+    };
+
+    // Interface implemented by the backends, see x86lab/backends/backend.hpp.
+    class Backend;
+
+    // Creates a VM with the given amount of memory.
     // @param startMode: The mode in which to start the Vm in.
     // @param memorySize: The amount of physical memory in number of bytes. This
     // value is rounded-up to the next multiple of PAGE_SIZE if it is not
     // already the case. Note: In case the Vm is started in LongMode, more
     // physical memory is allocated than requested to hold the page table
     // structure. Hence there might be a few more pages than requested.
+    // @param placement: Where to place the vCpu and guest memory on the host.
+    // @param backend: The backend running the vCpu.
     // @throws: A KvmError is thrown in case of any error related to the KVM
     // initialization.
     // @throws: A MmapError is thrown in case of any error related to
     // mmap'ing.
-    Vm(CpuMode const startMode, u64 const memorySize);
+    // @throws: An Error if the requested placement cannot be honored.
+    Vm(CpuMode const startMode,
+       u64 const memorySize,
+       Placement const& placement = Placement(),
+       BackendType const backend = BackendType::Kvm);
 
     // Destroy the VM. This deallocates all mmaped physical memory and releases
-    // KVM resources.
+    // the backend's resources.
     ~Vm();
 
+    // Create a copy of this Vm that runs independently from it, e.g. to run
+    // many variants of a snippet from a state prepared once. The clone has its
+    // own vCpu, initialized with the registers and extended state of this Vm,
+    // and the same operating state. Its physical memory is a private
+    // copy-on-write mapping of this Vm's memory: a page is only copied once
+    // either Vm writes it, hence cloning costs almost nothing regardless of
+    // the size of the guest.
+    // Since the clones map the memory as it was when they were created, this
+    // Vm copies its populated pages into a memory file upon its first clone,
+    // and maps that file copy-on-write as well. Cloning again after this Vm
+    // ran or wrote its memory copies its populated pages once more, the clones
+    // that follow are cheap again.
+    // Each clone can be stepped from its own thread and be destroyed before or
+    // after this Vm. This Vm must not run while it is being cloned.
+    // @param placement: Where to place the clone on the host. Note that
+    // prefaulting the clone copies all of its memory.
+    // @return: The clone, running on the same type of backend as this Vm.
+    // @throws: A KvmError is thrown in case of any error related to the KVM
+    // initialization.
+    // @throws: A MmapError is thrown in case of any error related to
+    // mmap'ing.
+    // @throws: An Error if the memory cannot be copied or the requested
+    // placement cannot be honored.
+    std::unique_ptr<Vm> clone(Placement const& placement = Placement());
+
     // Load code in the Vm. The code is placed at address 0 and rip is reset to
     // 0, e.g. pointing to the first instruction, rsp is set to point at the
     // very top of the physical memory. After this function returns, the
@@ -173,6 +407,68 @@ public:
     // @param code: The Code to be loaded.
     void loadCode(Code const& code);
 
+    // Write to the guest's physical memory, e.g. to set up the data operated on
+    // by the code before running it.
+    // @param offset: The physical offset to write to.
+    // @param data: The data to write.
+    // @param size: The number of bytes to write.
+    // @throws: An Error if the range is not entirely within the physical
+    // memory requested when creating the Vm.
+    void writePhysicalMemory(u64 const offset,
+                             void const * const data,
+                             u64 const size);
+
+    // Read the guest's physical memory, including the page tables created by
+    // the Vm. Reading outside of the physical memory reads zeroes.
+    // @param offset: The physical offset to read from.
+    // @param size: The number of bytes to read.
+    // @return: The data read.
+    std::vector<u8> readPhysicalMemory(u64 const offset, u64 const size) const;
+
+    // The memory types that can be assigned to guest memory, see
+    // setMemoryType(). The value of each type is its index in the guest's PAT,
+    // which the Vm programs with PatValue when creating the vCpu.
+    enum class MemoryType {
+        WriteBack = 0,
+        WriteThrough = 1,
+        UncacheableMinus = 2,
+        Uncacheable = 3,
+        WriteCombining = 4,
+        WriteProtected = 5,
+    };
+
+    // The value of the guest's IA32_PAT MSR. The first four entries are the
+    // power-up defaults, hence page table entries without the PAT bit keep
+    // their usual meaning. The entries 4 and 5 hold WC and WP.
+    static constexpr u64 PatValue = 0x0007050100070406ULL;
+
+    // Set the memory type of a range of the guest's physical memory, e.g. to
+    // compare streaming stores into write-combining memory with write-back
+    // memory. The type is applied through the PAT, PCD and PWT bits of every
+    // leaf entry mapping the range in the page tables currently used by the
+    // vCpu. The guest must not change its PAT. Under KVM, the host only honors
+    // the guest's memory types if it does not force write-back, see
+    // Util::Kvm::honorGuestPat(). The emulator ignores memory types.
+    // @param offset: The physical offset of the range, PAGE_SIZE aligned.
+    // @param size: The size of the range in bytes, multiple of PAGE_SIZE.
+    // @param type: The memory type of the range.
+    // @throws: An Error if the range is not aligned, not entirely within the
+    // physical memory requested when creating the Vm, or only covers part of
+    // a large page, or if the vCpu does not use 4-level paging.
+    void setMemoryType(u64 const offset, u64 const size, MemoryType const type);
+
+    // Check if the memory types set with setMemoryType() apply to the guest's
+    // accesses. Otherwise the guest's memory is always write-back.
+    // @return: true if the backend honors the memory types.
+    bool honorsMemoryTypes() const;
+
+    // Get how much of the guest's physical memory is currently backed by huge
+    // pages on the host, see Placement::hugePages. The kernel only allocates
+    // huge pages upon first touch, if the host allows it, or later when
+    // collapsing populated pages.
+    // @return: The number of bytes, see Util::Host::hugePageBytes().
+    u64 hugePageBytes() const;
+
     // Get a copy of this VM's state. Note that this is an expensive operation
     // since it creates a full copy of the VM's physical memory.
     // @return: An instance of State containing the full state of this Vm.
@@ -192,6 +488,25 @@ public:
     // @throws: KvmError in case of any KVM ioctl error.
     void setRegisters(State::Registers const& registerValues);
 
+    // Get the current extended state of the vCpu.
+    // @return: The ExtendedState as of the time after the last instruction was
+    // executed.
+    // @throws: KvmError in case of any KVM ioctl error.
+    State::ExtendedState getExtendedState() const;
+
+    // Set the extended state of the vCpu. Contrary to setRegisters(), this
+    // sets the segment registers, including their hidden part.
+    // @param state: The extended state to write.
+    // @throws: KvmError in case of any KVM ioctl error.
+    void setExtendedState(State::ExtendedState const& state);
+
+    // Get the registers and the extended state of the vCpu at once. This is
+    // cheaper than calling getRegisters() and getExtendedState() as the state
+    // they have in common is only read once.
+    // @return: The values of the registers and the extended state.
+    // @throws: KvmError in case of any KVM ioctl error.
+    std::pair<State::Registers, State::ExtendedState> getCpuState() const;
+
     // State of the KVM.
     enum class OperatingState {
         // The KVM is runnable.
@@ -216,7 +531,113 @@ public:
     // @throws: KvmError in case of any KVM ioctl error.
     OperatingState step();
 
+    // Execute instructions in the KVM until reaching the instruction at the
+    // given address. Under KVM this uses a hardware breakpoint instead of
+    // single stepping, hence the instructions in between run natively.
+    // @param rip: The address of the instruction to stop at, relative to the
+    // current code segment.
+    // @return: The OperatingState of the KVM after reaching the instruction or
+    // stopping for any other reason (e.g. halt, shutdown).
+    // @throws: KvmError in case of any KVM ioctl error.
+    OperatingState runUntil(u64 const rip);
+
+    // Get the current value of the instruction pointer. This is cheaper than
+    // getRegisters().rip.
+    // @return: The value of rip.
+    // @throws: KvmError in case of any KVM ioctl error.
+    u64 instructionPointer() const;
+
+    // Get the mode the vCpu is currently executing in, as indicated by the
+    // current code segment.
+    // @return: The current CpuMode.
+    // @throws: KvmError in case of any KVM ioctl error.
+    CpuMode cpuMode() const;
+
+    // Read the guest memory starting at the instruction pointed by rip. The
+    // linear addresses are translated through the guest's page tables.
+    // @param maxLen: The maximum number of bytes to read.
+    // @return: The bytes read. This contains less than maxLen bytes if the
+    // range crosses into unmapped memory.
+    // @throws: KvmError in case of any KVM ioctl error.
+    std::vector<u8> readInstructionBytes(u64 const maxLen) const;
+
+    // The maximum length of an x86 instruction in bytes.
+    static constexpr u64 MaxInstructionLength = 15;
+
+    // Check if the instruction pointed by rip is a string instruction (movs,
+    // cmps, stos, lods or scas) with a rep, repe or repne prefix.
+    // @return: The length of the instruction in bytes if this is the case, an
+    // empty optional otherwise.
+    // @throws: KvmError in case of any KVM ioctl error.
+    std::optional<u64> repStringInstructionLength() const;
+
+    // Get the placement of this Vm on the host.
+    // @return: The Placement the Vm was created with.
+    Placement const& placement() const;
+
+    // The effects of the instructions executed by a step() or runUntil() on
+    // the guest's physical memory, as recorded by backends executing the
+    // instructions in-process.
+    struct StepEffects {
+        // The physical ranges written, as pairs <offset, size>, in the order
+        // of the writes. This includes the page table entries which accessed
+        // or dirty bits were set.
+        std::vector<std::pair<u64, u64>> memoryWrites;
+    };
+
+    // Get the effects of the last step() or runUntil().
+    // @return: The effects if the backend records them, an empty optional
+    // otherwise, e.g. under KVM.
+    std::optional<StepEffects> lastStepEffects() const;
+
+    // The physical pages touched by the guest, as reported by the accessed
+    // and dirty bits of its page tables. Contrary to tracking the writes, this
+    // includes the pages that are only read, e.g. the real memory footprint of
+    // the code.
+    struct WorkingSet {
+        // For each physical page, true if it was accessed, e.g. read, written
+        // or executed.
+        std::vector<bool> accessed;
+        // For each physical page, true if it was written. Dirty pages are
+        // always accessed as well.
+        std::vector<bool> dirty;
+
+        // @return: The number of accessed pages.
+        u64 numAccessed() const;
+
+        // @return: The number of dirty pages.
+        u64 numDirty() const;
+    };
+
+    // Scan the accessed and dirty bits of the guest's current page tables and
+    // clear them, so that the next scan reports the pages touched in between.
+    // The translations cached by the backend are invalidated after clearing
+    // the bits, otherwise the vCpu would not set them again. Subtrees of the
+    // page tables which accessed bit is not set are skipped. Only 4-level
+    // paging, as used in long mode, is supported. The pages of a large page
+    // are all reported as touched when its bits are set.
+    // Note that this writes to the page tables, as the vCpu does when setting
+    // the bits.
+    // @return: The pages touched since the last scan, or since paging was
+    // enabled. Empty optional if 4-level paging is not enabled.
+    // @throws: KvmError in case of any KVM ioctl error.
+    std::optional<WorkingSet> scanWorkingSet();
+
 private:
+    // Create a clone of a Vm, see clone().
+    // @param parent: The Vm to clone. Its memory must be frozen, see
+    // freezeMemory().
+    // @param placement: Where to place the clone on the host.
+    Vm(Vm const& parent, Placement const& placement);
+
+    // Create the backend running the vCpu on top of m_memory.
+    // @return: The backend, of type m_backendType.
+    std::unique_ptr<Backend> createBackend();
+
+    // Pin the calling thread to the cpu requested in m_placement, if any. This
+    // is a no-op if the calling thread has already been pinned.
+    void pinVcpuThread();
+
     // Set the registers to their initial value depending on the mode. This
     // function also takes care of setting the vCpu for the desired mode.
     // @param mode: The starting mode of the vCpu. This defines the initial
@@ -224,12 +645,16 @@ private:
     void setRegistersInitialValue(CpuMode const mode);
 
     // Setup the control registers to enable the requested cpu mode.
-    // @param sregs: The kvm_sregs structure containing the control registers
-    // that need to be initialized for the cpu mode.
+    // @param regs: The registers containing the control registers that need to
+    // be initialized for the cpu mode.
+    // @param extendedState: The extended state containing XCR0, which is
+    // initialized for the features enabled in the control registers.
     // @param mode: The mode to enable on the vcpu.
     // Note: In the case mode == CpuMode::LongMode, this function also sets up
     // the page tables to have identity mapping.
-    void enableCpuMode(kvm_sregs& sregs, CpuMode const mode);
+    void enableCpuMode(State::Registers& regs,
+                       State::ExtendedState& extendedState,
+                       CpuMode const mode);
 
     // Only used when the VM is started in Long Mode, this setup the page table
     // structure to identity map the entire physical memory in virtual memory.
@@ -240,20 +665,48 @@ private:
     // Allocate the physical memory for the guest.
     // @param memorySize: The size of the memory to allocate in bytes.
     // @return: The address where the guest's physical memory has been mmap'ed
-    // in this process address space. The allocated memory is zero'ed. The
-    // allocated guest physical address space is allocated at offset 0.
+    // in this process address space. The allocated memory is zero'ed. It is
+    // mapped at guest physical address 0 by the backend.
     void *createPhysicalMemory(u64 const numFrames);
 
-    // File descriptor for the KVM.
-    int const m_vmFd;
-
-    // File descriptor for the vCpu.
-    int const m_vcpuFd;
-
-    // Reference to the kvm_run structure associated with the vCpu. For now we
-    // only read the kvm_run structure to get information on the exit reason,
-    // hence use const reference.
-    kvm_run const& m_kvmRun;
+    // Map the guest's physical memory copy-on-write from a file, which is never
+    // written, or from anonymous memory. The memory is bound to the NUMA node
+    // requested in m_placement, if any, and mapped at a 2MiB aligned address
+    // when huge pages are requested.
+    // @param fd: The file holding the memory, -1 for anonymous memory.
+    // @param addr: If not nullptr, the mapping replaces the memory mapped at
+    // this address.
+    // @return: The address of the mapping.
+    void *mapPhysicalMemory(int const fd, void * const addr);
+
+    // Make sure that the content of m_memoryFd is the guest's physical memory
+    // and that it is no longer written, so that clones can map it
+    // copy-on-write. Unless the memory is already frozen, its populated pages
+    // are copied to a new memory file. m_memory becomes a copy-on-write mapping
+    // of that file.
+    // @throws: An Error if the memory cannot be copied.
+    void freezeMemory();
+
+    // Walk the page tables currently used by the vCpu, calling a function on
+    // each present entry. Tables outside of the guest's physical memory are
+    // skipped as the vCpu would fault walking through them. Each table is
+    // walked once, at the level it is first reached at, hence each entry is
+    // visited at most once. Only 4-level paging, as used in long mode, is
+    // supported.
+    // @param visit: Called with a reference to the entry, which can be written,
+    // the level of its table, 4 for the PML4, and whether it is a leaf, in
+    // which case it maps 4KiB, 2MiB or 1GiB for level 1, 2 and 3
+    // respectively. For non-leaf entries, returns whether to walk the table
+    // below it. The return value is ignored for leaves.
+    // @return: false if the vCpu does not use 4-level paging, in which case
+    // nothing is visited.
+    bool walkPageTables(
+        std::function<bool(u64&, u8 const, bool const)> const& visit);
+
+    // Find which pages of the guest's physical memory have been populated,
+    // see Util::Host::populatedPages().
+    // @return: For each page, true if it is populated.
+    std::vector<bool> populatedPages() const;
 
     // The total size of the guest's physical memory in bytes.
     u64 m_physicalMemorySize;
@@ -279,7 +732,30 @@ private:
     // Pointer to start of physical memory on the host (e.g. userspace).
     void *m_memory;
 
-    // The current OperatingState of the KVM.
+    // The memory file that m_memory is a copy-on-write mapping of, which is
+    // never written. -1 until the first clone, m_memory is anonymous memory
+    // until then.
+    int m_memoryFd;
+    // True if m_memory is a copy-on-write mapping that was not written since
+    // it was mapped, e.g. the content of m_memoryFd is still the guest's
+    // memory. Conservatively reset by any operation that can write the
+    // memory.
+    bool m_memoryFrozen;
+
+    // The type of m_backend.
+    BackendType m_backendType;
+
+    // The backend running the vCpu on top of m_memory.
+    std::unique_ptr<Backend> m_backend;
+
+    // The current OperatingState of the Vm.
     OperatingState m_currState;
+
+    // Where the vCpu and the guest's memory are placed on the host.
+    Placement m_placement;
+
+    // The last thread that was pinned by pinVcpuThread(). Used to avoid calling
+    // into the kernel on every step.
+    std::thread::id m_pinnedThread;
 };
 }
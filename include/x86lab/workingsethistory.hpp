@@ -0,0 +1,79 @@
+#pragma once
+#include <x86lab/vm.hpp>
+#include <vector>
+
+namespace X86Lab {
+// History of the guest's working set over the execution, as sampled by
+// Vm::scanWorkingSet(). Each sample covers the pages touched since the previous
+// one, hence the footprint of a range of steps is the union of the samples
+// taken in that range. Samples only store the indices of the touched pages:
+// a few instructions typically touch a handful of pages out of the whole
+// physical memory.
+class WorkingSetHistory {
+public:
+    // The pages touched since the previous sample.
+    struct Sample {
+        // The step after which the working set was scanned.
+        u64 step;
+        // The indices of the accessed physical pages, in ascending order.
+        std::vector<u64> accessed;
+        // The indices of the dirty physical pages, in ascending order. This is
+        // a subset of accessed.
+        std::vector<u64> dirty;
+    };
+
+    // The pages touched over a range of steps.
+    struct Footprint {
+        // The number of samples in the range.
+        u64 numSamples;
+        // The number of distinct pages accessed in the range.
+        u64 numAccessed;
+        // The number of distinct pages written in the range.
+        u64 numDirty;
+    };
+
+    // Create an empty history.
+    // @param numPages: The number of physical pages of the guest.
+    WorkingSetHistory(u64 const numPages);
+
+    // Append a sample.
+    // @param step: The step after which the working set was scanned. Must be
+    // greater than the step of the previous sample.
+    // @param workingSet: The working set returned by Vm::scanWorkingSet(). Must
+    // have numPages() pages.
+    void append(u64 const step, Vm::WorkingSet const& workingSet);
+
+    // @return: The number of samples.
+    u64 size() const;
+
+    // @return: The number of physical pages of the guest.
+    u64 numPages() const;
+
+    // Get a sample.
+    // @param index: The index of the sample. Must be < size().
+    // @return: The sample.
+    Sample const& sample(u64 const index) const;
+
+    // Compute the footprint of a range of steps, e.g. a region of the code or
+    // a whole run.
+    // @param firstStep: The first step of the range.
+    // @param lastStep: The last step of the range, inclusive.
+    // @return: The union of the samples taken in the range.
+    Footprint footprint(u64 const firstStep, u64 const lastStep) const;
+
+    // Get the number of bytes used by the samples, e.g. to account for the
+    // memory used by the history.
+    // @return: The size of the samples and of their page indices in bytes.
+    u64 storageBytes() const;
+
+private:
+    // The number of physical pages of the guest.
+    u64 m_numPages;
+
+    // The total number of page indices in the samples, accessed and dirty.
+    u64 m_numIndices;
+
+    // The samples, in ascending order of step.
+    std::vector<Sample> m_samples;
+};
+}
@@ -0,0 +1,24 @@
+// Public API of libx86lab. Tools embedding x86Lab should only include this
+// header and link against libx86lab.a or libx86lab.so.
+#pragma once
+#include <x86lab/util.hpp>
+#include <x86lab/code.hpp>
+#include <x86lab/vm.hpp>
+#include <x86lab/snapshot.hpp>
+#include <x86lab/registerhistory.hpp>
+#include <x86lab/workingsethistory.hpp>
+#include <x86lab/disassembler.hpp>
+#include <x86lab/headless.hpp>
+#include <x86lab/instructiontable.hpp>
+#include <x86lab/memoryprofile.hpp>
+#include <x86lab/server.hpp>
+#include <x86lab/historyquery.hpp>
+#include <x86lab/loopindex.hpp>
+#include <x86lab/dependencygraph.hpp>
+
+namespace X86Lab {
+// Version of the library API. The major version is bumped on any change
+// breaking source compatibility of the headers included above.
+constexpr u32 ApiVersionMajor = 1;
+constexpr u32 ApiVersionMinor = 13;
+}
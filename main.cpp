@@ -6,7 +6,14 @@
 #include <x86lab/ui/tui.hpp>
 #include <x86lab/ui/imgui.hpp>
 #include <x86lab/runner.hpp>
+#include <x86lab/instructiontable.hpp>
+#include <x86lab/memoryprofile.hpp>
+#include <x86lab/server.hpp>
 #include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <csignal>
 
 using namespace X86Lab;
 
@@ -17,14 +24,124 @@ static void help() {
     std::cerr << "    x86lab [options] <file>" << std::endl << std::endl;
     std::cerr << "Options:" << std::endl;
     std::cerr << "    --help This message" << std::endl;
+    std::cerr << "    --cpu <n> Pin the vCpu to host cpu <n>" << std::endl;
+    std::cerr << "    --numa-node <n> Allocate guest memory on NUMA node <n>"
+        << std::endl;
+    std::cerr << "    --prefault Populate guest memory upon VM creation" <<
+        std::endl;
+    std::cerr << "    --emulator Run the vCpu in the built-in emulator instead "
+        "of KVM, only a subset of the integer instructions is supported" <<
+        std::endl;
+    std::cerr << "    --script <script> Run without GUI, reading commands from "
+        "<script> (- for stdin)" << std::endl;
+    std::cerr << "    --instruction-table Measure the latency and throughput "
+        "of the instruction forms listed in <file> and print them as a table"
+        << std::endl;
+    std::cerr << "    --core-cycles With --instruction-table, count core "
+        "cycles with the PMU instead of TSC ticks" << std::endl;
+    std::cerr << "    --memory-profile Characterize the memory hierarchy of "
+        "the host and write the curves to <file> as CSV" << std::endl;
+    std::cerr << "    --page-size <n> With --memory-profile, map the working "
+        "sets with pages of <n> bytes: 4096 (default), 2097152 or 1073741824"
+        << std::endl;
+    std::cerr << "    --max-size-mib <n> With --memory-profile, size of the "
+        "largest working set in MiB, a power of two (default 256)"
+        << std::endl;
+    std::cerr << "    --memory-type <type> With --memory-profile, memory type "
+        "of the working sets: wb (default), wt, uc-, uc, wc or wp"
+        << std::endl;
+    std::cerr << "    --server Host sessions for many clients connecting to "
+        "the Unix socket <file>, see README.md" << std::endl;
+    std::cerr << "    --max-sessions <n> With --server, maximum number of "
+        "concurrent sessions (default 64)" << std::endl;
+    std::cerr << "    --history-quota-mib <n> With --server, maximum size of "
+        "the history of each session in MiB, 0 for no limit (default 256)"
+        << std::endl;
+    std::cerr << "    --source-dir <dir> With --server, directory the clients "
+        "load their files from (default: the current directory)" << std::endl;
     std::cerr << "<file> is a file path to an assembly file that must be "
         "compatible with the NASM assembler. Any NASM directive within this "
         "file is valid and accepted" << std::endl;
 }
 
-static void run(std::string const& fileName) {
+// Measure the instruction forms listed in a file and print the resulting table
+// on stdout.
+// @param fileName: The path to the list of forms, see
+// InstructionTable::parseForms().
+// @param config: The configuration of the InstructionTable.
+static void printInstructionTable(std::string const& fileName,
+                                  InstructionTable::Config const& config) {
+    std::ifstream file(fileName);
+    if (!file) {
+        throw X86Lab::Error("Cannot open " + fileName, errno);
+    }
+    std::vector<InstructionTable::Form> const forms(
+        InstructionTable::parseForms(file));
+    InstructionTable const table(config);
+    std::vector<InstructionTable::Entry> entries;
+    for (InstructionTable::Form const& form : forms) {
+        std::cerr << "Measuring " << form.name << std::endl;
+        entries.push_back(table.measure(form));
+    }
+    std::cout << InstructionTable::format(entries, config.clock);
+}
+
+// Profile the memory hierarchy of the host and write the resulting curves to a
+// file.
+// @param fileName: The path of the CSV file to write.
+// @param config: The configuration of the MemoryProfile.
+static void writeMemoryProfile(std::string const& fileName,
+                               MemoryProfile::Config const& config) {
+    MemoryProfile profile(config);
+    MemoryProfile::Results const results(profile.run(
+        [](std::string const& desc) { std::cerr << desc << std::endl; }));
+    if (!results.memoryTypeHonored) {
+        std::cerr << "Warning: the host ignores guest memory types, the "
+            "working sets were write-back" << std::endl;
+    }
+    if (results.hostPageSize < results.pageSize) {
+        std::cerr << "Warning: the host backed the working sets with "
+            << results.hostPageSize << " bytes pages, the TLB reach is "
+            "limited by these pages" << std::endl;
+    }
+    std::ofstream file(fileName);
+    file << MemoryProfile::toCsv(results);
+    if (!file) {
+        throw X86Lab::Error("Cannot write " + fileName, errno);
+    }
+}
+
+// The server run by serve(), stopped upon SIGINT and SIGTERM.
+static Server* runningServer(nullptr);
+
+// Host sessions until interrupted.
+// @param socketPath: The path of the socket to listen on.
+// @param config: The configuration of the Server.
+static void serve(std::string const& socketPath,
+                  Server::Config const& config) {
+    Server server(socketPath, config);
+    runningServer = &server;
+    auto const stop([](int) { runningServer->stop(); });
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+    std::cerr << "Listening on " << socketPath << std::endl;
+    server.run();
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+    runningServer = nullptr;
+}
+
+static void run(std::string const& fileName,
+                Vm::Placement const& placement,
+                Vm::BackendType const backend,
+                std::optional<std::string> const& scriptPath) {
     // Run code in `fileName` starting directly in 64 bits mode.
-    std::shared_ptr<Ui::Backend> ui(new Ui::Imgui());
+    std::shared_ptr<Ui::Backend> ui;
+    if (scriptPath) {
+        ui = std::shared_ptr<Ui::Backend>(new Ui::Cli(*scriptPath));
+    } else {
+        ui = std::shared_ptr<Ui::Backend>(new Ui::Imgui());
+    }
 
     // Initilize UI.
     if (!ui->init()) {
@@ -39,6 +156,10 @@ static void run(std::string const& fileName) {
     // Create the VM and load the code in memory.
 
     bool exitRequested(false);
+    // Rep-string stepping and working set tracking are toggled through the
+    // interface and kept across resets.
+    bool repStringStepping(false);
+    bool workingSetTracking(false);
     // By default the VM starts in 64-bit long mode. This can be changed through
     // the interface. Changing the start CPU mode resets the VM.
     // FIXME: To avoid any issue when running the example code, hardcode the
@@ -54,15 +175,21 @@ static void run(std::string const& fileName) {
         // resetting the state of the CPU and memory.
 
         // FIXME: We need a way to specify the size of the VM.
-        std::shared_ptr<Vm> vm(new Vm(startCpuMode, 4 * X86Lab::PAGE_SIZE));
+        std::shared_ptr<Vm> vm(new Vm(startCpuMode,
+                                      4 * X86Lab::PAGE_SIZE,
+                                      placement,
+                                      backend));
+        ui->log("VM placement: " + placement.toString());
 
         vm->loadCode(*code);
         ui->log("Code loaded");
 
         // Runner instances are a bit ephemeral, as soon as their run() return
         // they cannot be used anymore.
-        Runner runner(vm, code, ui);
+        Runner runner(vm, code, ui, repStringStepping, workingSetTracking);
         Runner::ReturnReason const retReason(runner.run());
+        repStringStepping = runner.repStringStepping();
+        workingSetTracking = runner.workingSetTracking();
 
         if (retReason == Runner::ReturnReason::Quit) {
             exitRequested = true;
@@ -83,11 +210,90 @@ int main(int argc, char **argv) {
         std::exit(1);
     }
 
+    Vm::Placement placement;
+    Vm::BackendType backend(Vm::BackendType::Kvm);
+    std::optional<std::string> scriptPath;
+    bool instructionTable(false);
+    InstructionTable::Config instructionTableConfig;
+    bool memoryProfile(false);
+    MemoryProfile::Config memoryProfileConfig;
+    bool server(false);
+    Server::Config serverConfig;
+    // Get the value of the option at argv[i], exit if it is missing.
+    auto const optionValue([&](int const i) {
+        if (i >= argc - 1) {
+            std::cerr << "Error, missing value for " << argv[i - 1] <<
+                std::endl;
+            help();
+            std::exit(1);
+        }
+        return std::string(argv[i]);
+    });
+    // Parse the value of the option at argv[i], exit on failure.
+    auto const parseValue([&](int const i) {
+        std::string const value(optionValue(i));
+        try {
+            return static_cast<u32>(std::stoul(value));
+        } catch (std::exception const&) {
+            std::cerr << "Error, invalid value " << argv[i] << std::endl;
+            help();
+            std::exit(1);
+        }
+    });
+
     for (int i(1); i < argc - 1; ++i) {
         std::string const arg(argv[i]);
         if (arg == "--help") {
             help();
             std::exit(0);
+        } else if (arg == "--cpu") {
+            placement.cpu = parseValue(++i);
+        } else if (arg == "--numa-node") {
+            placement.numaNode = parseValue(++i);
+        } else if (arg == "--prefault") {
+            placement.prefault = true;
+        } else if (arg == "--emulator") {
+            backend = Vm::BackendType::Emulator;
+        } else if (arg == "--script") {
+            scriptPath = optionValue(++i);
+        } else if (arg == "--instruction-table") {
+            instructionTable = true;
+        } else if (arg == "--core-cycles") {
+            instructionTableConfig.clock = InstructionTable::Clock::CoreCycles;
+        } else if (arg == "--memory-profile") {
+            memoryProfile = true;
+        } else if (arg == "--page-size") {
+            memoryProfileConfig.pageSize = parseValue(++i);
+        } else if (arg == "--memory-type") {
+            static std::map<std::string, Vm::MemoryType> const types({
+                {"wb", Vm::MemoryType::WriteBack},
+                {"wt", Vm::MemoryType::WriteThrough},
+                {"uc-", Vm::MemoryType::UncacheableMinus},
+                {"uc", Vm::MemoryType::Uncacheable},
+                {"wc", Vm::MemoryType::WriteCombining},
+                {"wp", Vm::MemoryType::WriteProtected},
+            });
+            std::string const type(optionValue(++i));
+            std::map<std::string, Vm::MemoryType>::const_iterator const it(
+                types.find(type));
+            if (it == types.end()) {
+                std::cerr << "Error, invalid memory type " << type
+                          << std::endl;
+                help();
+                std::exit(1);
+            }
+            memoryProfileConfig.memoryType = it->second;
+        } else if (arg == "--server") {
+            server = true;
+        } else if (arg == "--max-sessions") {
+            serverConfig.maxSessions = parseValue(++i);
+        } else if (arg == "--history-quota-mib") {
+            serverConfig.historyQuota = static_cast<u64>(parseValue(++i)) << 20;
+        } else if (arg == "--source-dir") {
+            serverConfig.sourceDirectory = optionValue(++i);
+        } else if (arg == "--max-size-mib") {
+            memoryProfileConfig.maxSize = static_cast<u64>(parseValue(++i))
+                << 20;
         } else {
             std::cerr << "Error, invalid argument " << arg << std::endl;
             help();
@@ -95,10 +301,31 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (instructionTable && backend == Vm::BackendType::Emulator) {
+        // The benchmarks time the host cpu, the emulator would only measure
+        // itself.
+        std::cerr << "Error, --instruction-table cannot be used with "
+                  << "--emulator" << std::endl;
+        help();
+        std::exit(1);
+    }
+
     std::string const fileName(argv[argc - 1]);
 
     try {
-        run(fileName);
+        if (instructionTable) {
+            instructionTableConfig.placement = placement;
+            printInstructionTable(fileName, instructionTableConfig);
+        } else if (server) {
+            serverConfig.placement = placement;
+            serverConfig.backend = backend;
+            serve(fileName, serverConfig);
+        } else if (memoryProfile) {
+            memoryProfileConfig.placement = placement;
+            writeMemoryProfile(fileName, memoryProfileConfig);
+        } else {
+            run(fileName, placement, backend, scriptPath);
+        }
     } catch (Error const& error) {
         std::string const msg(error.what());
         std::perror(("Error: " + msg).c_str());
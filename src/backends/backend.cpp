@@ -0,0 +1,59 @@
+#include <x86lab/backends/backend.hpp>
+
+namespace X86Lab {
+
+Vm::Backend::~Backend() {}
+
+Vm::State::Registers Vm::Backend::getRegisters() const {
+    return doGetRegisters();
+}
+
+void Vm::Backend::setRegisters(State::Registers const& regs) {
+    doSetRegisters(regs);
+}
+
+Vm::State::ExtendedState Vm::Backend::getExtendedState() const {
+    return doGetExtendedState();
+}
+
+void Vm::Backend::setExtendedState(State::ExtendedState const& state) {
+    doSetExtendedState(state);
+}
+
+std::pair<Vm::State::Registers, Vm::State::ExtendedState>
+Vm::Backend::getCpuState() const {
+    return doGetCpuState();
+}
+
+u64 Vm::Backend::instructionPointer() const {
+    return doInstructionPointer();
+}
+
+Vm::State::ExtendedState::Segment Vm::Backend::codeSegment() const {
+    return doCodeSegment();
+}
+
+std::optional<u64> Vm::Backend::translate(u64 const linearAddr) const {
+    return doTranslate(linearAddr);
+}
+
+Vm::OperatingState Vm::Backend::step() {
+    return doStep();
+}
+
+Vm::OperatingState Vm::Backend::runUntil(u64 const rip) {
+    return doRunUntil(rip);
+}
+
+std::optional<Vm::StepEffects> Vm::Backend::lastStepEffects() const {
+    return doLastStepEffects();
+}
+
+void Vm::Backend::invalidateTranslations() {
+    doInvalidateTranslations();
+}
+
+bool Vm::Backend::honorsMemoryTypes() const {
+    return doHonorsMemoryTypes();
+}
+}
@@ -0,0 +1,1625 @@
+#include <x86lab/backends/emulator.hpp>
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+namespace X86Lab::Backends {
+
+// Bits of rflags.
+static constexpr u64 CF(1 << 0);
+static constexpr u64 PF(1 << 2);
+static constexpr u64 AF(1 << 4);
+static constexpr u64 ZF(1 << 6);
+static constexpr u64 SF(1 << 7);
+static constexpr u64 IF(1 << 9);
+static constexpr u64 DF(1 << 10);
+static constexpr u64 OF(1 << 11);
+// The status flags, written by arithmetic instructions.
+static constexpr u64 StatusFlags(CF | PF | AF | ZF | SF | OF);
+// The flags that can be modified by popf in ring 0: the status flags, TF, IF,
+// DF, IOPL, NT, AC and ID.
+static constexpr u64 PopfMask(StatusFlags | (1 << 8) | IF | DF | (3 << 12) |
+                              (1 << 14) | (1 << 18) | (1 << 21));
+
+// Bits of the control registers and EFER used by the emulator.
+static constexpr u64 Cr0Pe(1 << 0);
+static constexpr u64 Cr0Pg(1ULL << 31);
+static constexpr u64 Cr4Pse(1 << 4);
+static constexpr u64 Cr4Pae(1 << 5);
+static constexpr u64 EferLma(1 << 10);
+
+// Bits of the page table entries used by the emulator.
+static constexpr u64 PtePresent(1 << 0);
+static constexpr u64 PteAccessed(1 << 5);
+static constexpr u64 PteDirty(1 << 6);
+static constexpr u64 PteLarge(1 << 7);
+
+// Get the index of an MSR in ExtendedState::msrs.
+// @param msr: The MSR.
+// @return: The index of the MSR in ExtendedState::Msrs.
+static constexpr u8 msrIndex(u32 const msr) {
+    u8 i(0);
+    while (i < Vm::State::ExtendedState::NumMsrs &&
+           Vm::State::ExtendedState::Msrs[i] != msr) {
+        ++i;
+    }
+    return i;
+}
+static constexpr u8 PatMsrIdx(msrIndex(0x277));
+static constexpr u8 MiscEnableMsrIdx(msrIndex(0x1a0));
+static constexpr u8 FsBaseMsrIdx(msrIndex(0xc0000100));
+static constexpr u8 GsBaseMsrIdx(msrIndex(0xc0000101));
+static_assert(FsBaseMsrIdx < Vm::State::ExtendedState::NumMsrs &&
+              GsBaseMsrIdx < Vm::State::ExtendedState::NumMsrs);
+
+// Indices of the general purpose registers in Emulator::m_gprs, following
+// their encoding. R8 to R15 use indices 8 to 15.
+enum Gpr : u8 { Rax, Rcx, Rdx, Rbx, Rsp, Rbp, Rsi, Rdi };
+
+// Indices of the segment registers, following their encoding.
+enum Seg : u8 { Es, Cs, Ss, Ds, Fs, Gs, NumSegs };
+
+// Thrown to stop the emulation of an instruction, caught in execute().
+struct EmulationStop {
+    // The state the vCpu stops in.
+    Vm::OperatingState state;
+};
+
+// Get the mask of the bits of a value of the given size.
+// @param size: The size in bytes, 1, 2, 4 or 8.
+// @return: The mask.
+static u64 sizeMask(u8 const size) {
+    return size == 8 ? ~0ULL : (1ULL << (size * 8)) - 1;
+}
+
+// Sign-extend a value.
+// @param value: The value to sign extend.
+// @param size: The size of the value in bytes, 1, 2, 4 or 8.
+// @return: The sign-extended value.
+static u64 signExtend(u64 const value, u8 const size) {
+    u8 const shift(64 - size * 8);
+    return static_cast<u64>(static_cast<int64_t>(value << shift) >> shift);
+}
+
+Emulator::Emulator(u8 * const memory, u64 const memorySize) :
+    m_memory(memory),
+    m_memorySize(memorySize),
+    m_gprs{},
+    m_rip(0xfff0),
+    m_rflags(0x2),
+    m_regs(),
+    m_extendedState(),
+    m_effects() {
+    // Mimic the state KVM puts the vCpu in upon creation, which follows the
+    // state after a reset in Intel's manual vol. 3 "Table 10-1. IA-32 and
+    // Intel 64 Processor States Following Power-up, Reset, or INIT".
+    m_regs.cr0 = 0x60000010;
+    m_regs.idt.limit = 0xffff;
+    m_regs.gdt.limit = 0xffff;
+    m_regs.mxcsr = 0x1f80;
+
+    Vm::State::ExtendedState::Segment data;
+    data.limit = 0xffff;
+    data.type = 0x3;
+    data.present = true;
+    data.s = true;
+    m_extendedState.ds = data;
+    m_extendedState.es = data;
+    m_extendedState.fs = data;
+    m_extendedState.gs = data;
+    m_extendedState.ss = data;
+    m_extendedState.cs = data;
+    m_extendedState.cs.selector = 0xf000;
+    m_extendedState.cs.base = 0xffff0000;
+    m_extendedState.cs.type = 0xb;
+    m_extendedState.tr.limit = 0xffff;
+    m_extendedState.tr.type = 0xb;
+    m_extendedState.tr.present = true;
+    m_extendedState.ldt.limit = 0xffff;
+    m_extendedState.ldt.type = 0x2;
+    m_extendedState.ldt.present = true;
+
+    m_extendedState.fpu.fcw = 0x37f;
+    m_extendedState.dr6 = 0xffff0ff0;
+    m_extendedState.dr7 = 0x400;
+    m_extendedState.msrs[PatMsrIdx] = 0x0007040600070406ULL;
+    // BTS and PEBS unavailable.
+    m_extendedState.msrs[MiscEnableMsrIdx] = (1 << 11) | (1 << 12);
+    m_extendedState.xcr0 = 0x1;
+}
+
+Vm::State::Registers Emulator::doGetRegisters() const {
+    Vm::State::Registers regs(m_regs);
+    regs.rax = m_gprs[Rax]; regs.rcx = m_gprs[Rcx];
+    regs.rdx = m_gprs[Rdx]; regs.rbx = m_gprs[Rbx];
+    regs.rsp = m_gprs[Rsp]; regs.rbp = m_gprs[Rbp];
+    regs.rsi = m_gprs[Rsi]; regs.rdi = m_gprs[Rdi];
+    regs.r8  = m_gprs[8];   regs.r9  = m_gprs[9];
+    regs.r10 = m_gprs[10];  regs.r11 = m_gprs[11];
+    regs.r12 = m_gprs[12];  regs.r13 = m_gprs[13];
+    regs.r14 = m_gprs[14];  regs.r15 = m_gprs[15];
+    regs.rip = m_rip;
+    regs.rflags = m_rflags;
+    regs.cs = m_extendedState.cs.selector;
+    regs.ds = m_extendedState.ds.selector;
+    regs.es = m_extendedState.es.selector;
+    regs.fs = m_extendedState.fs.selector;
+    regs.gs = m_extendedState.gs.selector;
+    regs.ss = m_extendedState.ss.selector;
+    return regs;
+}
+
+void Emulator::doSetRegisters(Vm::State::Registers const& regs) {
+    m_regs = regs;
+    m_gprs[Rax] = regs.rax; m_gprs[Rcx] = regs.rcx;
+    m_gprs[Rdx] = regs.rdx; m_gprs[Rbx] = regs.rbx;
+    m_gprs[Rsp] = regs.rsp; m_gprs[Rbp] = regs.rbp;
+    m_gprs[Rsi] = regs.rsi; m_gprs[Rdi] = regs.rdi;
+    m_gprs[8]   = regs.r8;  m_gprs[9]   = regs.r9;
+    m_gprs[10]  = regs.r10; m_gprs[11]  = regs.r11;
+    m_gprs[12]  = regs.r12; m_gprs[13]  = regs.r13;
+    m_gprs[14]  = regs.r14; m_gprs[15]  = regs.r15;
+    m_rip = regs.rip;
+    // Bit 1 of rflags is reserved and always set.
+    m_rflags = regs.rflags | 0x2;
+}
+
+Vm::State::ExtendedState Emulator::doGetExtendedState() const {
+    Vm::State::ExtendedState state(m_extendedState);
+    state.msrs[FsBaseMsrIdx] = m_extendedState.fs.base;
+    state.msrs[GsBaseMsrIdx] = m_extendedState.gs.base;
+    return state;
+}
+
+std::pair<Vm::State::Registers, Vm::State::ExtendedState>
+Emulator::doGetCpuState() const {
+    return std::make_pair(doGetRegisters(), doGetExtendedState());
+}
+
+void Emulator::doSetExtendedState(Vm::State::ExtendedState const& state) {
+    m_extendedState = state;
+    // As with KVM, the MSRs are written after the segment registers, hence
+    // their value prevails.
+    m_extendedState.fs.base = state.msrs[FsBaseMsrIdx];
+    m_extendedState.gs.base = state.msrs[GsBaseMsrIdx];
+}
+
+u64 Emulator::doInstructionPointer() const {
+    return m_rip;
+}
+
+Vm::State::ExtendedState::Segment Emulator::doCodeSegment() const {
+    return m_extendedState.cs;
+}
+
+std::optional<u64> Emulator::doTranslate(u64 const linearAddr) const {
+    std::optional<PageWalk> const pageWalk(walk(linearAddr));
+    if (!pageWalk) {
+        return std::nullopt;
+    }
+    return pageWalk->physAddr;
+}
+
+Vm::OperatingState Emulator::doStep() {
+    m_effects.memoryWrites.clear();
+    return execute();
+}
+
+Vm::OperatingState Emulator::doRunUntil(u64 const rip) {
+    m_effects.memoryWrites.clear();
+    Vm::OperatingState state;
+    do {
+        state = execute();
+    } while (state == Vm::OperatingState::Runnable && m_rip != rip);
+    return state;
+}
+
+std::optional<Vm::StepEffects> Emulator::doLastStepEffects() const {
+    return m_effects;
+}
+
+void Emulator::doInvalidateTranslations() {}
+
+bool Emulator::doHonorsMemoryTypes() const {
+    return false;
+}
+
+std::optional<Emulator::PageWalk> Emulator::walk(u64 const linearAddr) const {
+    PageWalk res{};
+    if (!(m_regs.cr0 & Cr0Pg)) {
+        res.physAddr = linearAddr & 0xffffffff;
+        return res;
+    }
+
+    // Read a page table entry. Entries outside of the physical memory are
+    // considered not present.
+    auto const readEntry([&](u64 const addr, u8 const size) {
+        u64 entry(0);
+        if (size <= m_memorySize && addr <= m_memorySize - size) {
+            std::memcpy(&entry, m_memory + addr, size);
+        }
+        return entry;
+    });
+
+    if (!(m_regs.efer & EferLma) && !(m_regs.cr4 & Cr4Pae)) {
+        // 32-bit paging: 2 levels of 1024 4-byte entries, the page directory
+        // can map 4MiB pages if CR4.PSE is set.
+        res.entrySize = 4;
+        u64 const pdeAddr((m_regs.cr3 & 0xfffff000) +
+                          ((linearAddr >> 22) & 0x3ff) * 4);
+        u64 const pde(readEntry(pdeAddr, 4));
+        if (!(pde & PtePresent)) {
+            return std::nullopt;
+        }
+        res.entries[res.numEntries++] = pdeAddr;
+        if ((m_regs.cr4 & Cr4Pse) && (pde & PteLarge)) {
+            res.physAddr = (pde & 0xffc00000) | (linearAddr & 0x3fffff);
+            return res;
+        }
+        u64 const pteAddr((pde & 0xfffff000) + ((linearAddr >> 12) & 0x3ff) * 4);
+        u64 const pte(readEntry(pteAddr, 4));
+        if (!(pte & PtePresent)) {
+            return std::nullopt;
+        }
+        res.entries[res.numEntries++] = pteAddr;
+        res.physAddr = (pte & 0xfffff000) | (linearAddr & 0xfff);
+        return res;
+    }
+
+    // 4-level paging or PAE paging: tables of 512 8-byte entries.
+    res.entrySize = 8;
+    u64 const addrMask(0x000ffffffffff000ULL);
+    u64 table;
+    u8 level;
+    if (m_regs.efer & EferLma) {
+        table = m_regs.cr3 & addrMask;
+        level = 4;
+    } else {
+        // PAE paging starts with 4 PDPTEs, selected by bits 31:30.
+        u64 const pdpte(readEntry((m_regs.cr3 & 0xffffffe0) +
+                                  ((linearAddr >> 30) & 0x3) * 8, 8));
+        if (!(pdpte & PtePresent)) {
+            return std::nullopt;
+        }
+        table = pdpte & addrMask;
+        level = 2;
+    }
+    for (; 0 < level; --level) {
+        u8 const shift(12 + 9 * (level - 1));
+        u64 const entryAddr(table + ((linearAddr >> shift) & 0x1ff) * 8);
+        u64 const entry(readEntry(entryAddr, 8));
+        if (!(entry & PtePresent)) {
+            return std::nullopt;
+        }
+        res.entries[res.numEntries++] = entryAddr;
+        // Entries at level 2 and 3 can map 2MiB and 1GiB pages respectively.
+        if (level == 1 || (level <= 3 && (entry & PteLarge))) {
+            u64 const pageMask((1ULL << shift) - 1);
+            res.physAddr = (entry & addrMask & ~pageMask) |
+                           (linearAddr & pageMask);
+            return res;
+        }
+        table = entry & addrMask;
+    }
+    // Unreachable, the loop always returns at level 1.
+    return std::nullopt;
+}
+
+std::optional<u64> Emulator::translateAccess(u64 const linearAddr,
+                                             bool const write) {
+    std::optional<PageWalk> const pageWalk(walk(linearAddr));
+    if (!pageWalk) {
+        return std::nullopt;
+    }
+    for (u8 i(0); i < pageWalk->numEntries; ++i) {
+        bool const isLeaf(i == pageWalk->numEntries - 1);
+        u64 const bits(PteAccessed | ((write && isLeaf) ? PteDirty : 0));
+        u64 const addr(pageWalk->entries[i]);
+        u64 entry(0);
+        std::memcpy(&entry, m_memory + addr, pageWalk->entrySize);
+        if ((entry & bits) != bits) {
+            entry |= bits;
+            std::memcpy(m_memory + addr, &entry, pageWalk->entrySize);
+            m_effects.memoryWrites.emplace_back(addr, pageWalk->entrySize);
+        }
+    }
+    return pageWalk->physAddr;
+}
+
+class Emulator::Instruction {
+public:
+    // Fetch and decode the instruction pointed by rip. This has no side effect
+    // other than setting the accessed bits of the page tables mapping the
+    // instruction.
+    // @param emulator: The emulator executing the instruction.
+    // @throws: EmulationStop if the instruction cannot be fetched or is not
+    // supported.
+    Instruction(Emulator& emulator);
+
+    // Execute the instruction and update rip.
+    // @return: The OperatingState after executing the instruction.
+    // @throws: EmulationStop if the instruction faults.
+    Vm::OperatingState execute();
+
+private:
+    // The maximum length of an instruction in bytes.
+    static constexpr u8 MaxLength = 15;
+
+    // The kind of immediate following the opcode and ModRM.
+    enum class Immediate {
+        // No immediate.
+        None,
+        // A byte, sign-extended.
+        Byte,
+        // A word, zero-extended.
+        Word,
+        // A word or dword depending on the operand size, sign-extended.
+        Z,
+        // An immediate of the operand size.
+        V,
+        // An offset of the address size.
+        Offset,
+    };
+
+    // Stop the emulation of the instruction.
+    // @param state: The state the vCpu stops in.
+    [[noreturn]] void stop(Vm::OperatingState const state) const;
+
+    // Stop the emulation because the instruction raised an exception. Since
+    // exceptions are not delivered, the vCpu shuts down if there is no IDT,
+    // as it would under KVM, and stops with an error otherwise.
+    [[noreturn]] void fault() const;
+
+    // Stop the emulation because the instruction is not supported.
+    [[noreturn]] void unsupported() const;
+
+    // Fetch the next bytes of the instruction.
+    // @param size: The number of bytes to fetch, up to 8.
+    // @return: The bytes, as a little-endian value.
+    u64 fetch(u8 const size);
+
+    // Decode the ModRM byte and the memory operand it encodes, if any.
+    void decodeModrm();
+
+    // Get a segment register.
+    // @param seg: The index of the segment register, see Seg.
+    // @return: The segment register.
+    Vm::State::ExtendedState::Segment& segment(u8 const seg) const;
+
+    // Compute a linear address.
+    // @param seg: The segment of the address.
+    // @param offset: The offset within the segment.
+    // @return: The linear address.
+    u64 linear(u8 const seg, u64 const offset) const;
+
+    // Read or write memory. All the pages accessed are translated before
+    // accessing any of them.
+    // @param seg: The segment of the address.
+    // @param offset: The offset within the segment.
+    // @param size: The number of bytes to access.
+    // @param data: The data read or the data to write.
+    // @param write: If true, write data into memory, otherwise read memory
+    // into data.
+    void access(u8 const seg,
+                u64 const offset,
+                u8 const size,
+                u8 * const data,
+                bool const write);
+
+    // Read memory.
+    // @param seg: The segment of the address.
+    // @param offset: The offset within the segment.
+    // @param size: The size of the value to read, up to 8 bytes.
+    // @return: The value read.
+    u64 readMem(u8 const seg, u64 const offset, u8 const size);
+
+    // Write memory.
+    // @param seg: The segment of the address.
+    // @param offset: The offset within the segment.
+    // @param size: The size of the value to write, up to 8 bytes.
+    // @param value: The value to write.
+    void writeMem(u8 const seg, u64 const offset, u8 const size, u64 value);
+
+    // Read a general purpose register.
+    // @param idx: The index of the register, following its encoding.
+    // @param size: The size of the register to read.
+    // @return: The value of the register.
+    u64 readReg(u8 const idx, u8 const size) const;
+
+    // Write a general purpose register, zero-extending 32-bit writes in 64-bit
+    // mode.
+    // @param idx: The index of the register, following its encoding.
+    // @param size: The size of the register to write.
+    // @param value: The value to write.
+    void writeReg(u8 const idx, u8 const size, u64 const value);
+
+    // Read the operand encoded in ModRM's r/m field.
+    // @param size: The size of the operand.
+    // @return: The value of the operand.
+    u64 readRm(u8 const size);
+
+    // Write the operand encoded in ModRM's r/m field.
+    // @param size: The size of the operand.
+    // @param value: The value to write.
+    void writeRm(u8 const size, u64 const value);
+
+    // The size of the stack pointer.
+    // @return: The size of the stack pointer in bytes.
+    u8 stackAddrSize() const;
+
+    // The operand size of the instructions defaulting to 64-bit operands in
+    // 64-bit mode, e.g. push, pop, near call and ret.
+    // @return: The operand size in bytes.
+    u8 stackOpSize() const;
+
+    // Push a value onto the stack.
+    // @param value: The value to push.
+    // @param size: The size of the value.
+    void push(u64 const value, u8 const size);
+
+    // Pop a value from the stack.
+    // @param size: The size of the value.
+    // @return: The value popped.
+    u64 pop(u8 const size);
+
+    // Branch to an address.
+    // @param target: The address to branch to.
+    void jump(u64 const target);
+
+    // Update the flags.
+    // @param mask: The flags to update.
+    // @param values: The new value of the flags in mask.
+    void setFlags(u64 const mask, u64 const values);
+
+    // Evaluate a condition code.
+    // @param cc: The condition code, as encoded in jcc, setcc and cmovcc.
+    // @return: True if the condition is met.
+    bool condition(u8 const cc) const;
+
+    // Compute one of the ALU operations encoded in the opcode of the legacy
+    // arithmetic instructions and group 1 and update the flags.
+    // @param op: The operation: add, or, adc, sbb, and, sub, xor or cmp.
+    // @param dst: The destination operand.
+    // @param src: The source operand.
+    // @param size: The size of the operands.
+    // @return: The result of the operation.
+    u64 alu(u8 const op, u64 dst, u64 src, u8 const size);
+
+    // Compute one of the shifts and rotations of group 2 and update the
+    // flags.
+    // @param op: The operation: rol, ror, rcl, rcr, shl, shr, sal or sar.
+    // @param dst: The operand to shift.
+    // @param count: The shift count, masked as per the operand size.
+    // @param size: The size of the operand.
+    // @return: The result of the operation.
+    u64 shift(u8 const op, u64 dst, u8 count, u8 const size);
+
+    // Compute a truncated signed multiplication and set CF and OF if the
+    // result was truncated.
+    // @param a: The first operand.
+    // @param b: The second operand.
+    // @param size: The size of the operands and result.
+    // @return: The truncated result.
+    u64 imul(u64 const a, u64 const b, u8 const size);
+
+    // Execute one iteration of a string instruction.
+    void string();
+
+    // Execute the instructions of group 3 (test, not, neg, mul, imul, div,
+    // idiv).
+    // @param size: The size of the operands.
+    void group3(u8 const size);
+
+    // The emulator executing the instruction.
+    Emulator& m_emu;
+    // True if the vCpu is in 64-bit mode.
+    bool const m_long64;
+
+    // The bytes fetched so far, which might be more than the length of the
+    // instruction.
+    u8 m_bytes[MaxLength];
+    u8 m_numFetched;
+    // The number of bytes decoded so far, the length of the instruction once
+    // decoded.
+    u8 m_length;
+
+    // Prefixes.
+    bool m_opSizeOverride;
+    bool m_addrSizeOverride;
+    // 0xf2, 0xf3 or 0 if none.
+    u8 m_rep;
+    std::optional<u8> m_segOverride;
+    // The REX prefix, 0 if none.
+    u8 m_rex;
+
+    // The opcode, two-byte opcodes are 0x100 | <second byte>.
+    u16 m_opcode;
+    // Operand and address sizes in bytes.
+    u8 m_opSize;
+    u8 m_addrSize;
+
+    // The fields of the ModRM byte, extended with the REX prefix.
+    u8 m_mod;
+    u8 m_reg;
+    u8 m_rm;
+    // The memory operand encoded in the ModRM byte, if m_mod != 3, or the
+    // offset of the moffs forms.
+    u8 m_memSeg;
+    u64 m_memOffset;
+
+    // The immediate or relative offset.
+    u64 m_imm;
+
+    // The address of the next instruction, updated by branches.
+    u64 m_nextRip;
+};
+
+Emulator::Instruction::Instruction(Emulator& emulator) :
+    m_emu(emulator),
+    m_long64(!!(emulator.m_regs.efer & EferLma) &&
+             emulator.m_extendedState.cs.l),
+    m_bytes{},
+    m_numFetched(0),
+    m_length(0),
+    m_opSizeOverride(false),
+    m_addrSizeOverride(false),
+    m_rep(0),
+    m_segOverride(),
+    m_rex(0),
+    m_opcode(0),
+    m_opSize(0),
+    m_addrSize(0),
+    m_mod(3),
+    m_reg(0),
+    m_rm(0),
+    m_memSeg(Ds),
+    m_memOffset(0),
+    m_imm(0),
+    m_nextRip(0) {
+    // Legacy prefixes, in any order.
+    u8 byte;
+    while (true) {
+        byte = fetch(1);
+        switch (byte) {
+            case 0x66: m_opSizeOverride = true; continue;
+            case 0x67: m_addrSizeOverride = true; continue;
+            // Lock prefix, meaningless with a single vCpu.
+            case 0xf0: continue;
+            case 0xf2: case 0xf3: m_rep = byte; continue;
+            case 0x26: m_segOverride = Es; continue;
+            case 0x2e: m_segOverride = Cs; continue;
+            case 0x36: m_segOverride = Ss; continue;
+            case 0x3e: m_segOverride = Ds; continue;
+            case 0x64: m_segOverride = Fs; continue;
+            case 0x65: m_segOverride = Gs; continue;
+        }
+        break;
+    }
+    if (m_long64 && (byte & 0xf0) == 0x40) {
+        m_rex = byte;
+        byte = fetch(1);
+    }
+    m_opcode = (byte == 0x0f) ? (0x100 | fetch(1)) : byte;
+
+    bool const db(m_emu.m_extendedState.cs.db);
+    if (m_long64) {
+        m_opSize = (m_rex & 0x8) ? 8 : (m_opSizeOverride ? 2 : 4);
+        m_addrSize = m_addrSizeOverride ? 4 : 8;
+    } else {
+        m_opSize = (db != m_opSizeOverride) ? 4 : 2;
+        m_addrSize = (db != m_addrSizeOverride) ? 4 : 2;
+    }
+
+    // Find out if the instruction is supported, and its ModRM and immediate.
+    u16 const op(m_opcode);
+    bool modrm(false);
+    Immediate imm(Immediate::None);
+    if (op < 0x40 && (op & 0x7) < 6) {
+        // ALU operations: Eb,Gb / Ev,Gv / Gb,Eb / Gv,Ev / AL,Ib / rAX,Iz.
+        modrm = (op & 0x7) < 4;
+        imm = ((op & 0x7) == 4) ? Immediate::Byte :
+              ((op & 0x7) == 5) ? Immediate::Z : Immediate::None;
+    } else if ((0x40 <= op && op <= 0x4f && !m_long64) ||
+               (0x50 <= op && op <= 0x5f) ||
+               (0x90 <= op && op <= 0x99) ||
+               (0x9c <= op && op <= 0x9f) ||
+               (0xa4 <= op && op <= 0xa7) ||
+               (0xaa <= op && op <= 0xaf) ||
+               op == 0xc3 || op == 0xc9 || op == 0xf4 || op == 0xf5 ||
+               (0xf8 <= op && op <= 0xfd) ||
+               op == 0x10b ||
+               (0x1c8 <= op && op <= 0x1cf && m_opSize != 2)) {
+        // No operand other than implicit registers.
+    } else if ((0x70 <= op && op <= 0x7f) || op == 0x6a || op == 0xa8 ||
+               (0xb0 <= op && op <= 0xb7) || (0xe0 <= op && op <= 0xe3) ||
+               op == 0xeb) {
+        imm = Immediate::Byte;
+    } else if (op == 0x68 || op == 0xa9 || op == 0xe8 || op == 0xe9 ||
+               (0x180 <= op && op <= 0x18f)) {
+        imm = Immediate::Z;
+    } else if (0xb8 <= op && op <= 0xbf) {
+        imm = Immediate::V;
+    } else if (0xa0 <= op && op <= 0xa3) {
+        imm = Immediate::Offset;
+    } else if (op == 0xc2) {
+        imm = Immediate::Word;
+    } else if ((op == 0x63 && m_long64) ||
+               (0x84 <= op && op <= 0x8f) ||
+               (0xd0 <= op && op <= 0xd3) ||
+               op == 0xf6 || op == 0xf7 || op == 0xfe || op == 0xff ||
+               op == 0x11f ||
+               (0x140 <= op && op <= 0x14f) ||
+               (0x190 <= op && op <= 0x19f) ||
+               op == 0x1af || op == 0x1b6 || op == 0x1b7 || op == 0x1be ||
+               op == 0x1bf ||
+               ((op == 0x1bc || op == 0x1bd) && m_rep != 0xf3)) {
+        modrm = true;
+    } else if (op == 0x69 || op == 0x81 || op == 0xc7) {
+        modrm = true;
+        imm = Immediate::Z;
+    } else if (op == 0x6b || op == 0x80 || op == 0x83 || op == 0xc0 ||
+               op == 0xc1 || op == 0xc6 || (op == 0x82 && !m_long64)) {
+        modrm = true;
+        imm = Immediate::Byte;
+    } else {
+        unsupported();
+    }
+
+    if (modrm) {
+        decodeModrm();
+        u8 const reg(m_reg & 0x7);
+        // Check the encodings of the opcode extensions and the operands.
+        if ((op == 0x8f || op == 0xc6 || op == 0xc7) && reg != 0) {
+            unsupported();
+        } else if (op == 0x8c && 6 <= reg) {
+            fault();
+        } else if (op == 0x8e) {
+            // Loading segment registers is only supported in real mode where
+            // it does not involve descriptors. CS cannot be loaded with mov.
+            if (!!(m_emu.m_regs.cr0 & Cr0Pe)) {
+                unsupported();
+            } else if (6 <= reg || reg == Cs) {
+                fault();
+            }
+        } else if (op == 0xfe && 1 < reg) {
+            unsupported();
+        } else if (op == 0xff && (reg == 3 || reg == 5 || reg == 7)) {
+            unsupported();
+        } else if (op == 0x8d && m_mod == 3) {
+            fault();
+        }
+        if ((op == 0xf6 || op == 0xf7) && reg < 2) {
+            imm = (op == 0xf6) ? Immediate::Byte : Immediate::Z;
+        }
+    }
+
+    switch (imm) {
+        case Immediate::None:
+            break;
+        case Immediate::Byte:
+            m_imm = signExtend(fetch(1), 1);
+            break;
+        case Immediate::Word:
+            m_imm = fetch(2);
+            break;
+        case Immediate::Z: {
+            u8 const size(m_opSize == 2 ? 2 : 4);
+            m_imm = signExtend(fetch(size), size);
+            break;
+        }
+        case Immediate::V:
+            m_imm = fetch(m_opSize);
+            break;
+        case Immediate::Offset:
+            m_imm = fetch(m_addrSize);
+            m_memSeg = m_segOverride.value_or(Ds);
+            m_memOffset = m_imm;
+            break;
+    }
+
+    u64 const ripMask(m_long64 ? ~0ULL :
+                      (m_emu.m_extendedState.cs.db ? 0xffffffff : 0xffff));
+    m_nextRip = (m_emu.m_rip + m_length) & ripMask;
+}
+
+void Emulator::Instruction::decodeModrm() {
+    u8 const modrm(fetch(1));
+    m_mod = modrm >> 6;
+    m_reg = ((modrm >> 3) & 0x7) | ((m_rex & 0x4) << 1);
+    m_rm = (modrm & 0x7) | ((m_rex & 0x1) << 3);
+    if (m_mod == 3) {
+        return;
+    }
+
+    u64 offset(0);
+    bool ripRelative(false);
+    if (m_addrSize == 2) {
+        // 16-bit addressing forms, BP-based forms default to SS.
+        u8 const rm(modrm & 0x7);
+        if (rm == 6 && m_mod == 0) {
+            offset = fetch(2);
+        } else {
+            static constexpr u8 Base[8] = {Rbx, Rbx, Rbp, Rbp, Rsi, Rdi, Rbp, Rbx};
+            static constexpr u8 Index[8] = {Rsi, Rdi, Rsi, Rdi, 0, 0, 0, 0};
+            offset = m_emu.m_gprs[Base[rm]];
+            if (rm < 4) {
+                offset += m_emu.m_gprs[Index[rm]];
+            }
+            if (Base[rm] == Rbp) {
+                m_memSeg = Ss;
+            }
+        }
+        if (m_mod == 1) {
+            offset += signExtend(fetch(1), 1);
+        } else if (m_mod == 2) {
+            offset += fetch(2);
+        }
+    } else {
+        if ((modrm & 0x7) == 4) {
+            u8 const sib(fetch(1));
+            u8 const scale(sib >> 6);
+            u8 const index(((sib >> 3) & 0x7) | ((m_rex & 0x2) << 2));
+            u8 const base((sib & 0x7) | ((m_rex & 0x1) << 3));
+            // An index of 4 (without REX.X) means no index.
+            if (index != Rsp) {
+                offset += m_emu.m_gprs[index] << scale;
+            }
+            if ((base & 0x7) == 5 && m_mod == 0) {
+                offset += signExtend(fetch(4), 4);
+            } else {
+                offset += m_emu.m_gprs[base];
+                if (base == Rsp || base == Rbp) {
+                    m_memSeg = Ss;
+                }
+            }
+        } else if ((modrm & 0x7) == 5 && m_mod == 0) {
+            // Disp32, which is relative to the next instruction in 64-bit mode.
+            offset = signExtend(fetch(4), 4);
+            ripRelative = m_long64;
+        } else {
+            offset = m_emu.m_gprs[m_rm];
+            if (m_rm == Rbp) {
+                m_memSeg = Ss;
+            }
+        }
+        if (m_mod == 1) {
+            offset += signExtend(fetch(1), 1);
+        } else if (m_mod == 2) {
+            offset += signExtend(fetch(4), 4);
+        }
+    }
+
+    if (ripRelative) {
+        // The immediate, if any, is not decoded yet. Its size can be inferred
+        // from the opcode though.
+        u8 immSize(0);
+        u16 const op(m_opcode);
+        u8 const reg(m_reg & 0x7);
+        if (op == 0x69 || op == 0x81 || op == 0xc7 || (op == 0xf7 && reg < 2)) {
+            immSize = (m_opSize == 2) ? 2 : 4;
+        } else if (op == 0x6b || op == 0x80 || op == 0x83 || op == 0xc0 ||
+                   op == 0xc1 || op == 0xc6 || (op == 0xf6 && reg < 2)) {
+            immSize = 1;
+        }
+        offset += m_emu.m_rip + m_length + immSize;
+    }
+    m_memOffset = offset & sizeMask(m_addrSize);
+    if (m_segOverride) {
+        m_memSeg = *m_segOverride;
+    }
+}
+
+void Emulator::Instruction::stop(Vm::OperatingState const state) const {
+    throw EmulationStop({.state = state});
+}
+
+void Emulator::Instruction::fault() const {
+    if (!m_emu.m_regs.idt.limit) {
+        stop(Vm::OperatingState::Shutdown);
+    } else {
+        stop(Vm::OperatingState::SingleStepError);
+    }
+}
+
+void Emulator::Instruction::unsupported() const {
+    stop(Vm::OperatingState::SingleStepError);
+}
+
+u64 Emulator::Instruction::fetch(u8 const size) {
+    u64 value(0);
+    for (u8 i(0); i < size; ++i) {
+        if (m_length == MaxLength) {
+            // Instructions longer than 15 bytes raise #GP.
+            fault();
+        } else if (m_length == m_numFetched) {
+            // Fetch the remaining bytes of the current page at once.
+            u64 const linearAddr(linear(Cs, m_emu.m_rip + m_length));
+            std::optional<u64> const physAddr(
+                m_emu.translateAccess(linearAddr, false));
+            if (!physAddr) {
+                fault();
+            } else if (m_emu.m_memorySize <= *physAddr) {
+                unsupported();
+            }
+            u64 const toPageEnd(PAGE_SIZE - (linearAddr % PAGE_SIZE));
+            u64 const len(std::min<u64>({static_cast<u64>(MaxLength - m_numFetched),
+                                         toPageEnd,
+                                         m_emu.m_memorySize - *physAddr}));
+            std::memcpy(m_bytes + m_numFetched, m_emu.m_memory + *physAddr, len);
+            m_numFetched += len;
+        }
+        value |= static_cast<u64>(m_bytes[m_length++]) << (i * 8);
+    }
+    return value;
+}
+
+Vm::State::ExtendedState::Segment& Emulator::Instruction::segment(
+    u8 const seg) const {
+    Vm::State::ExtendedState& state(m_emu.m_extendedState);
+    Vm::State::ExtendedState::Segment * const segs[NumSegs] = {
+        &state.es, &state.cs, &state.ss, &state.ds, &state.fs, &state.gs,
+    };
+    return *segs[seg];
+}
+
+u64 Emulator::Instruction::linear(u8 const seg, u64 const offset) const {
+    if (m_long64) {
+        // Only FS and GS have a base in 64-bit mode.
+        return (seg == Fs || seg == Gs) ? segment(seg).base + offset : offset;
+    } else {
+        return (segment(seg).base + offset) & 0xffffffff;
+    }
+}
+
+void Emulator::Instruction::access(u8 const seg,
+                                   u64 const offset,
+                                   u8 const size,
+                                   u8 * const data,
+                                   bool const write) {
+    // An access spans at most two pages.
+    u64 const linearAddr(linear(seg, offset));
+    u64 const firstLen(
+        std::min<u64>(size, PAGE_SIZE - (linearAddr % PAGE_SIZE)));
+    u64 const linearAddrs[2] = {linearAddr, linearAddr + firstLen};
+    u64 const lens[2] = {firstLen, size - firstLen};
+    u64 physAddrs[2] = {0, 0};
+    for (u8 i(0); i < 2 && !!lens[i]; ++i) {
+        std::optional<u64> const physAddr(
+            m_emu.translateAccess(linearAddrs[i], write));
+        if (!physAddr) {
+            fault();
+        } else if (m_emu.m_memorySize < lens[i] ||
+                   m_emu.m_memorySize - lens[i] < *physAddr) {
+            // Under KVM this would be an MMIO exit.
+            unsupported();
+        }
+        physAddrs[i] = *physAddr;
+    }
+    u8 * ptr(data);
+    for (u8 i(0); i < 2 && !!lens[i]; ++i) {
+        if (write) {
+            std::memcpy(m_emu.m_memory + physAddrs[i], ptr, lens[i]);
+            m_emu.m_effects.memoryWrites.emplace_back(physAddrs[i], lens[i]);
+        } else {
+            std::memcpy(ptr, m_emu.m_memory + physAddrs[i], lens[i]);
+        }
+        ptr += lens[i];
+    }
+}
+
+u64 Emulator::Instruction::readMem(u8 const seg,
+                                   u64 const offset,
+                                   u8 const size) {
+    u64 value(0);
+    access(seg, offset, size, reinterpret_cast<u8*>(&value), false);
+    return value;
+}
+
+void Emulator::Instruction::writeMem(u8 const seg,
+                                     u64 const offset,
+                                     u8 const size,
+                                     u64 value) {
+    access(seg, offset, size, reinterpret_cast<u8*>(&value), true);
+}
+
+u64 Emulator::Instruction::readReg(u8 const idx, u8 const size) const {
+    if (size == 1 && !m_rex && 4 <= idx && idx < 8) {
+        // AH, CH, DH and BH.
+        return (m_emu.m_gprs[idx - 4] >> 8) & 0xff;
+    }
+    return m_emu.m_gprs[idx] & sizeMask(size);
+}
+
+void Emulator::Instruction::writeReg(u8 const idx,
+                                     u8 const size,
+                                     u64 const value) {
+    if (size == 1 && !m_rex && 4 <= idx && idx < 8) {
+        u64& reg(m_emu.m_gprs[idx - 4]);
+        reg = (reg & ~0xff00ULL) | ((value & 0xff) << 8);
+    } else if (size == 4 && m_long64) {
+        m_emu.m_gprs[idx] = value & 0xffffffff;
+    } else {
+        u64& reg(m_emu.m_gprs[idx]);
+        reg = (reg & ~sizeMask(size)) | (value & sizeMask(size));
+    }
+}
+
+u64 Emulator::Instruction::readRm(u8 const size) {
+    if (m_mod == 3) {
+        return readReg(m_rm, size);
+    } else {
+        return readMem(m_memSeg, m_memOffset, size);
+    }
+}
+
+void Emulator::Instruction::writeRm(u8 const size, u64 const value) {
+    if (m_mod == 3) {
+        writeReg(m_rm, size, value);
+    } else {
+        writeMem(m_memSeg, m_memOffset, size, value);
+    }
+}
+
+u8 Emulator::Instruction::stackAddrSize() const {
+    if (m_long64) {
+        return 8;
+    } else {
+        return m_emu.m_extendedState.ss.db ? 4 : 2;
+    }
+}
+
+u8 Emulator::Instruction::stackOpSize() const {
+    if (m_long64) {
+        return m_opSizeOverride ? 2 : 8;
+    } else {
+        return m_opSize;
+    }
+}
+
+void Emulator::Instruction::push(u64 const value, u8 const size) {
+    u8 const addrSize(stackAddrSize());
+    u64 const rsp((m_emu.m_gprs[Rsp] - size) & sizeMask(addrSize));
+    writeMem(Ss, rsp, size, value);
+    writeReg(Rsp, addrSize, rsp);
+}
+
+u64 Emulator::Instruction::pop(u8 const size) {
+    u8 const addrSize(stackAddrSize());
+    u64 const rsp(m_emu.m_gprs[Rsp] & sizeMask(addrSize));
+    u64 const value(readMem(Ss, rsp, size));
+    writeReg(Rsp, addrSize, rsp + size);
+    return value;
+}
+
+void Emulator::Instruction::jump(u64 const target) {
+    m_nextRip = m_long64 ? target : (target & sizeMask(m_opSize));
+}
+
+void Emulator::Instruction::setFlags(u64 const mask, u64 const values) {
+    m_emu.m_rflags = (m_emu.m_rflags & ~mask) | (values & mask);
+}
+
+bool Emulator::Instruction::condition(u8 const cc) const {
+    u64 const flags(m_emu.m_rflags);
+    bool const sfNeOf(!(flags & SF) != !(flags & OF));
+    bool res;
+    switch (cc >> 1) {
+        case 0: res = !!(flags & OF); break;
+        case 1: res = !!(flags & CF); break;
+        case 2: res = !!(flags & ZF); break;
+        case 3: res = !!(flags & (CF | ZF)); break;
+        case 4: res = !!(flags & SF); break;
+        case 5: res = !!(flags & PF); break;
+        case 6: res = sfNeOf; break;
+        default: res = !!(flags & ZF) || sfNeOf; break;
+    }
+    // Odd condition codes are the negation of the even ones.
+    return (cc & 1) ? !res : res;
+}
+
+// Compute the SF, ZF and PF flags of a result.
+// @param res: The result.
+// @param size: The size of the result.
+// @return: The value of the flags.
+static u64 resultFlags(u64 const res, u8 const size) {
+    u64 flags(0);
+    if (!(res & sizeMask(size))) {
+        flags |= ZF;
+    }
+    if ((res >> (size * 8 - 1)) & 1) {
+        flags |= SF;
+    }
+    if (!(std::popcount(static_cast<u8>(res)) & 1)) {
+        flags |= PF;
+    }
+    return flags;
+}
+
+u64 Emulator::Instruction::alu(u8 const op, u64 dst, u64 src, u8 const size) {
+    u64 const mask(sizeMask(size));
+    u8 const msb(size * 8 - 1);
+    dst &= mask;
+    src &= mask;
+    u64 const carry(!!(m_emu.m_rflags & CF) && (op == 2 || op == 3));
+    u64 res;
+    u64 flags(0);
+    if (op == 0 || op == 2) {
+        // add, adc.
+        u128 const full(static_cast<u128>(dst) + src + carry);
+        res = static_cast<u64>(full) & mask;
+        flags |= (full > mask) ? CF : 0;
+        flags |= (((dst ^ res) & (src ^ res)) >> msb) & 1 ? OF : 0;
+        flags |= (dst ^ src ^ res) & AF;
+    } else if (op == 3 || op == 5 || op == 7) {
+        // sbb, sub, cmp.
+        res = (dst - src - carry) & mask;
+        flags |= (dst < static_cast<u128>(src) + carry) ? CF : 0;
+        flags |= (((dst ^ src) & (dst ^ res)) >> msb) & 1 ? OF : 0;
+        flags |= (dst ^ src ^ res) & AF;
+    } else {
+        // or, and, xor. CF and OF are cleared, AF is undefined and cleared.
+        res = (op == 1) ? (dst | src) : (op == 4) ? (dst & src) : (dst ^ src);
+    }
+    setFlags(StatusFlags, flags | resultFlags(res, size));
+    return res;
+}
+
+u64 Emulator::Instruction::shift(u8 const op, u64 dst, u8 count, u8 const size) {
+    u8 const bits(size * 8);
+    u64 const mask(sizeMask(size));
+    auto const msb([&](u64 const value) { return (value >> (bits - 1)) & 1; });
+    dst &= mask;
+    count &= (size == 8) ? 0x3f : 0x1f;
+    if (op == 2 || op == 3) {
+        // Rotations through carry rotate size + 1 bits.
+        count %= bits + 1;
+    }
+    if (!count) {
+        // The flags are not modified.
+        return dst;
+    }
+
+    u64 res;
+    u64 cf(!!(m_emu.m_rflags & CF));
+    u64 of;
+    switch (op) {
+        case 0: {
+            u8 const c(count % bits);
+            res = !c ? dst : ((dst << c) | (dst >> (bits - c))) & mask;
+            cf = res & 1;
+            of = msb(res) ^ cf;
+            break;
+        }
+        case 1: {
+            u8 const c(count % bits);
+            res = !c ? dst : ((dst >> c) | (dst << (bits - c))) & mask;
+            cf = msb(res);
+            of = msb(res) ^ ((res >> (bits - 2)) & 1);
+            break;
+        }
+        case 2:
+            res = dst;
+            for (u8 i(0); i < count; ++i) {
+                u64 const out(msb(res));
+                res = ((res << 1) | cf) & mask;
+                cf = out;
+            }
+            of = msb(res) ^ cf;
+            break;
+        case 3:
+            of = msb(dst) ^ cf;
+            res = dst;
+            for (u8 i(0); i < count; ++i) {
+                u64 const out(res & 1);
+                res = (res >> 1) | (cf << (bits - 1));
+                cf = out;
+            }
+            break;
+        case 4:
+        case 6:
+            cf = ((dst << (count - 1)) >> (bits - 1)) & 1;
+            res = (dst << count) & mask;
+            of = msb(res) ^ cf;
+            break;
+        case 5:
+            cf = (dst >> (count - 1)) & 1;
+            res = dst >> count;
+            of = msb(dst);
+            break;
+        default: {
+            int64_t const sdst(static_cast<int64_t>(signExtend(dst, size)));
+            cf = (sdst >> (count - 1)) & 1;
+            res = static_cast<u64>(sdst >> count) & mask;
+            of = 0;
+            break;
+        }
+    }
+    u64 const flags((cf ? CF : 0) | (of ? OF : 0));
+    if (op < 4) {
+        // Rotations only modify CF and OF.
+        setFlags(CF | OF, flags);
+    } else {
+        setFlags(StatusFlags, flags | resultFlags(res, size));
+    }
+    return res;
+}
+
+u64 Emulator::Instruction::imul(u64 const a, u64 const b, u8 const size) {
+    __int128 const full(static_cast<__int128>(
+        static_cast<int64_t>(signExtend(a, size))) *
+        static_cast<int64_t>(signExtend(b, size)));
+    u64 const res(static_cast<u64>(full) & sizeMask(size));
+    bool const truncated(full != static_cast<int64_t>(signExtend(res, size)));
+    setFlags(CF | OF, truncated ? (CF | OF) : 0);
+    return res;
+}
+
+void Emulator::Instruction::string() {
+    u8 const size((m_opcode & 1) ? m_opSize : 1);
+    if (!!m_rep && !readReg(Rcx, m_addrSize)) {
+        // Nothing to do, the instruction completes.
+        return;
+    }
+
+    u8 const srcSeg(m_segOverride.value_or(Ds));
+    u64 const src(readReg(Rsi, m_addrSize));
+    u64 const dst(readReg(Rdi, m_addrSize));
+    u64 const delta((m_emu.m_rflags & DF) ? -size : size);
+    bool const isCompare(m_opcode == 0xa6 || m_opcode == 0xa7 ||
+                         m_opcode == 0xae || m_opcode == 0xaf);
+    switch (m_opcode & ~1) {
+        case 0xa4:
+            writeMem(Es, dst, size, readMem(srcSeg, src, size));
+            writeReg(Rsi, m_addrSize, src + delta);
+            writeReg(Rdi, m_addrSize, dst + delta);
+            break;
+        case 0xa6:
+            alu(7, readMem(srcSeg, src, size), readMem(Es, dst, size), size);
+            writeReg(Rsi, m_addrSize, src + delta);
+            writeReg(Rdi, m_addrSize, dst + delta);
+            break;
+        case 0xaa:
+            writeMem(Es, dst, size, readReg(Rax, size));
+            writeReg(Rdi, m_addrSize, dst + delta);
+            break;
+        case 0xac:
+            writeReg(Rax, size, readMem(srcSeg, src, size));
+            writeReg(Rsi, m_addrSize, src + delta);
+            break;
+        default:
+            alu(7, readReg(Rax, size), readMem(Es, dst, size), size);
+            writeReg(Rdi, m_addrSize, dst + delta);
+            break;
+    }
+
+    if (!!m_rep) {
+        u64 const count(readReg(Rcx, m_addrSize) - 1);
+        writeReg(Rcx, m_addrSize, count);
+        bool done(!(count & sizeMask(m_addrSize)));
+        if (isCompare) {
+            // repe stops when ZF is cleared, repne when ZF is set.
+            done = done || (m_rep == 0xf3) != !!(m_emu.m_rflags & ZF);
+        }
+        if (!done) {
+            // As with single-stepping on a real cpu, each iteration is a
+            // separate step.
+            m_nextRip = m_emu.m_rip;
+        }
+    }
+}
+
+void Emulator::Instruction::group3(u8 const size) {
+    u8 const bits(size * 8);
+    u64 const mask(sizeMask(size));
+    u64 const operand(readRm(size));
+    switch (m_reg & 0x7) {
+        case 0:
+        case 1:
+            alu(4, operand, m_imm, size);
+            break;
+        case 2:
+            writeRm(size, ~operand);
+            break;
+        case 3:
+            writeRm(size, alu(5, 0, operand, size));
+            break;
+        case 4:
+        case 5: {
+            // mul and imul. SF, ZF, AF and PF are undefined and left unchanged.
+            u64 const a(readReg(Rax, size));
+            u128 res;
+            bool overflow;
+            if ((m_reg & 0x7) == 4) {
+                res = static_cast<u128>(a) * operand;
+                overflow = !!(res >> bits);
+            } else {
+                __int128 const full(static_cast<__int128>(
+                    static_cast<int64_t>(signExtend(a, size))) *
+                    static_cast<int64_t>(signExtend(operand, size)));
+                res = static_cast<u128>(full);
+                overflow = full != static_cast<int64_t>(
+                    signExtend(static_cast<u64>(res) & mask, size));
+            }
+            if (size == 1) {
+                writeReg(Rax, 2, static_cast<u64>(res));
+            } else {
+                writeReg(Rax, size, static_cast<u64>(res));
+                writeReg(Rdx, size, static_cast<u64>(res >> bits));
+            }
+            setFlags(CF | OF, overflow ? (CF | OF) : 0);
+            break;
+        }
+        default: {
+            // div and idiv, all the flags are undefined and left unchanged.
+            if (!operand) {
+                // #DE.
+                fault();
+            }
+            u128 const dividend(size == 1 ? readReg(Rax, 2) :
+                ((static_cast<u128>(readReg(Rdx, size)) << bits) |
+                 readReg(Rax, size)));
+            u64 quotient;
+            u64 remainder;
+            if ((m_reg & 0x7) == 6) {
+                u128 const q(dividend / operand);
+                if (q > mask) {
+                    fault();
+                }
+                quotient = static_cast<u64>(q);
+                remainder = static_cast<u64>(dividend % operand);
+            } else {
+                u8 const shift(128 - 2 * bits);
+                __int128 const sdividend(
+                    static_cast<__int128>(dividend << shift) >> shift);
+                __int128 const sdivisor(
+                    static_cast<int64_t>(signExtend(operand, size)));
+                if (sdivisor == -1 &&
+                    dividend == (static_cast<u128>(1) << (2 * bits - 1))) {
+                    // The quotient overflows, this also avoids an overflow
+                    // on the host.
+                    fault();
+                }
+                __int128 const q(sdividend / sdivisor);
+                __int128 const max(static_cast<__int128>(mask >> 1));
+                if (q > max || q < -max - 1) {
+                    fault();
+                }
+                quotient = static_cast<u64>(q);
+                remainder = static_cast<u64>(sdividend % sdivisor);
+            }
+            if (size == 1) {
+                writeReg(Rax, 2, ((remainder & 0xff) << 8) | (quotient & 0xff));
+            } else {
+                writeReg(Rax, size, quotient);
+                writeReg(Rdx, size, remainder);
+            }
+            break;
+        }
+    }
+}
+
+Vm::OperatingState Emulator::Instruction::execute() {
+    u16 const op(m_opcode);
+    u8 const byteOrOpSize((op & 1) ? m_opSize : 1);
+    u8 const rexB((m_rex & 0x1) << 3);
+    Vm::OperatingState state(Vm::OperatingState::Runnable);
+
+    if (op < 0x40) {
+        u8 const aluOp(op >> 3);
+        u8 const size(byteOrOpSize);
+        if ((op & 0x7) < 2) {
+            u64 const res(alu(aluOp, readRm(size), readReg(m_reg, size), size));
+            if (aluOp != 7) {
+                writeRm(size, res);
+            }
+        } else if ((op & 0x7) < 4) {
+            u64 const res(alu(aluOp, readReg(m_reg, size), readRm(size), size));
+            if (aluOp != 7) {
+                writeReg(m_reg, size, res);
+            }
+        } else {
+            u64 const res(alu(aluOp, readReg(Rax, size), m_imm, size));
+            if (aluOp != 7) {
+                writeReg(Rax, size, res);
+            }
+        }
+    } else if (op < 0x50) {
+        // inc and dec, which preserve CF.
+        u8 const idx(op & 0x7);
+        u64 const cf(m_emu.m_rflags & CF);
+        u64 const res(alu((op < 0x48) ? 0 : 5, readReg(idx, m_opSize), 1,
+                          m_opSize));
+        setFlags(CF, cf);
+        writeReg(idx, m_opSize, res);
+    } else if (op < 0x58) {
+        u8 const size(stackOpSize());
+        push(readReg((op & 0x7) | rexB, size), size);
+    } else if (op < 0x60) {
+        u8 const size(stackOpSize());
+        writeReg((op & 0x7) | rexB, size, pop(size));
+    } else if ((0x70 <= op && op <= 0x7f) || (0x180 <= op && op <= 0x18f)) {
+        if (condition(op & 0xf)) {
+            jump(m_nextRip + m_imm);
+        }
+    } else if (0x80 <= op && op <= 0x83) {
+        u8 const size(byteOrOpSize);
+        u64 const res(alu(m_reg & 0x7, readRm(size), m_imm, size));
+        if ((m_reg & 0x7) != 7) {
+            writeRm(size, res);
+        }
+    } else if (0x91 <= op && op <= 0x97) {
+        u8 const idx((op & 0x7) | rexB);
+        u64 const value(readReg(idx, m_opSize));
+        writeReg(idx, m_opSize, readReg(Rax, m_opSize));
+        writeReg(Rax, m_opSize, value);
+    } else if (0xa4 <= op && op <= 0xaf && op != 0xa8 && op != 0xa9) {
+        string();
+    } else if (0xb0 <= op && op <= 0xb7) {
+        writeReg((op & 0x7) | rexB, 1, m_imm);
+    } else if (0xb8 <= op && op <= 0xbf) {
+        writeReg((op & 0x7) | rexB, m_opSize, m_imm);
+    } else if (op == 0xc0 || op == 0xc1 || (0xd0 <= op && op <= 0xd3)) {
+        // Group 2.
+        u8 const size(byteOrOpSize);
+        u8 const count((op <= 0xc1) ? m_imm :
+                       (op <= 0xd1) ? 1 : readReg(Rcx, 1));
+        writeRm(size, shift(m_reg & 0x7, readRm(size), count, size));
+    } else if (0x140 <= op && op <= 0x14f) {
+        // The source is read even if the condition is false, and the
+        // destination is zero-extended in any case.
+        u64 const value(readRm(m_opSize));
+        writeReg(m_reg, m_opSize,
+                 condition(op & 0xf) ? value : readReg(m_reg, m_opSize));
+    } else if (0x190 <= op && op <= 0x19f) {
+        writeRm(1, condition(op & 0xf) ? 1 : 0);
+    } else if (0x1c8 <= op && op <= 0x1cf) {
+        u8 const idx((op & 0x7) | rexB);
+        u64 const value(readReg(idx, m_opSize));
+        writeReg(idx, m_opSize, (m_opSize == 8) ? __builtin_bswap64(value) :
+                                __builtin_bswap32(static_cast<u32>(value)));
+    } else {
+        switch (op) {
+            case 0x63:
+                writeReg(m_reg, m_opSize, (m_opSize == 8) ?
+                         signExtend(readRm(4), 4) : readRm(4));
+                break;
+            case 0x68:
+            case 0x6a:
+                push(m_imm, stackOpSize());
+                break;
+            case 0x69:
+            case 0x6b:
+                writeReg(m_reg, m_opSize, imul(readRm(m_opSize), m_imm, m_opSize));
+                break;
+            case 0x84:
+            case 0x85:
+                alu(4, readRm(byteOrOpSize), readReg(m_reg, byteOrOpSize),
+                    byteOrOpSize);
+                break;
+            case 0x86:
+            case 0x87: {
+                u8 const size(byteOrOpSize);
+                u64 const value(readRm(size));
+                writeRm(size, readReg(m_reg, size));
+                writeReg(m_reg, size, value);
+                break;
+            }
+            case 0x88:
+            case 0x89:
+                writeRm(byteOrOpSize, readReg(m_reg, byteOrOpSize));
+                break;
+            case 0x8a:
+            case 0x8b:
+                writeReg(m_reg, byteOrOpSize, readRm(byteOrOpSize));
+                break;
+            case 0x8c:
+                // Memory destinations are always 16-bit.
+                writeRm((m_mod == 3) ? m_opSize : 2,
+                        segment(m_reg & 0x7).selector);
+                break;
+            case 0x8d:
+                writeReg(m_reg, m_opSize, m_memOffset);
+                break;
+            case 0x8e: {
+                // Real mode only, the base is always selector * 16.
+                u16 const selector(readRm(2));
+                Vm::State::ExtendedState::Segment& seg(segment(m_reg & 0x7));
+                seg.selector = selector;
+                seg.base = static_cast<u64>(selector) << 4;
+                break;
+            }
+            case 0x8f: {
+                u8 const size(stackOpSize());
+                writeRm(size, pop(size));
+                break;
+            }
+            case 0x90:
+                // nop, unless REX.B makes it xchg r8, rax.
+                if (!!rexB) {
+                    u64 const value(readReg(8, m_opSize));
+                    writeReg(8, m_opSize, readReg(Rax, m_opSize));
+                    writeReg(Rax, m_opSize, value);
+                }
+                break;
+            case 0x98: {
+                u8 const half(m_opSize / 2);
+                writeReg(Rax, m_opSize, signExtend(readReg(Rax, half), half));
+                break;
+            }
+            case 0x99: {
+                u64 const sign((readReg(Rax, m_opSize) >> (m_opSize * 8 - 1)) & 1);
+                writeReg(Rdx, m_opSize, sign ? ~0ULL : 0);
+                break;
+            }
+            case 0x9c:
+                // VM and RF are cleared in the pushed image.
+                push(m_emu.m_rflags & ~0x30000ULL, stackOpSize());
+                break;
+            case 0x9d: {
+                u8 const size(stackOpSize());
+                setFlags(PopfMask & sizeMask(size), pop(size));
+                break;
+            }
+            case 0x9e:
+                setFlags(SF | ZF | AF | PF | CF, readReg(Rsp, 1));
+                break;
+            case 0x9f:
+                // AH is encoded as 4 without REX.
+                writeReg(Rsp, 1, m_emu.m_rflags & 0xff);
+                break;
+            case 0xa0:
+            case 0xa1:
+                writeReg(Rax, byteOrOpSize,
+                         readMem(m_memSeg, m_memOffset, byteOrOpSize));
+                break;
+            case 0xa2:
+            case 0xa3:
+                writeMem(m_memSeg, m_memOffset, byteOrOpSize,
+                         readReg(Rax, byteOrOpSize));
+                break;
+            case 0xa8:
+            case 0xa9:
+                alu(4, readReg(Rax, byteOrOpSize), m_imm, byteOrOpSize);
+                break;
+            case 0xc2:
+            case 0xc3: {
+                u64 const target(pop(stackOpSize()));
+                if (op == 0xc2) {
+                    u8 const addrSize(stackAddrSize());
+                    writeReg(Rsp, addrSize, m_emu.m_gprs[Rsp] + m_imm);
+                }
+                jump(target);
+                break;
+            }
+            case 0xc6:
+            case 0xc7:
+                writeRm(byteOrOpSize, m_imm);
+                break;
+            case 0xc9: {
+                u8 const size(stackOpSize());
+                writeReg(Rsp, stackAddrSize(), m_emu.m_gprs[Rbp]);
+                writeReg(Rbp, size, pop(size));
+                break;
+            }
+            case 0xe0:
+            case 0xe1:
+            case 0xe2: {
+                // loopne, loope and loop.
+                u64 const count((readReg(Rcx, m_addrSize) - 1) &
+                                sizeMask(m_addrSize));
+                writeReg(Rcx, m_addrSize, count);
+                bool const zf(!!(m_emu.m_rflags & ZF));
+                if (!!count && (op == 0xe2 || zf == (op == 0xe1))) {
+                    jump(m_nextRip + m_imm);
+                }
+                break;
+            }
+            case 0xe3:
+                if (!readReg(Rcx, m_addrSize)) {
+                    jump(m_nextRip + m_imm);
+                }
+                break;
+            case 0xe8:
+                push(m_nextRip, stackOpSize());
+                jump(m_nextRip + m_imm);
+                break;
+            case 0xe9:
+            case 0xeb:
+                jump(m_nextRip + m_imm);
+                break;
+            case 0xf4:
+                // As with KVM, rip points after the hlt.
+                state = Vm::OperatingState::Halted;
+                break;
+            case 0xf5:
+                m_emu.m_rflags ^= CF;
+                break;
+            case 0xf6:
+            case 0xf7:
+                group3(byteOrOpSize);
+                break;
+            case 0xf8: setFlags(CF, 0); break;
+            case 0xf9: setFlags(CF, CF); break;
+            case 0xfa: setFlags(IF, 0); break;
+            case 0xfb: setFlags(IF, IF); break;
+            case 0xfc: setFlags(DF, 0); break;
+            case 0xfd: setFlags(DF, DF); break;
+            case 0xfe:
+            case 0xff: {
+                u8 const reg(m_reg & 0x7);
+                if (reg < 2) {
+                    u8 const size(byteOrOpSize);
+                    u64 const cf(m_emu.m_rflags & CF);
+                    u64 const res(alu(reg ? 5 : 0, readRm(size), 1, size));
+                    setFlags(CF, cf);
+                    writeRm(size, res);
+                } else {
+                    u8 const size(stackOpSize());
+                    u64 const value(readRm(size));
+                    if (reg == 2) {
+                        push(m_nextRip, size);
+                        jump(value);
+                    } else if (reg == 4) {
+                        jump(value);
+                    } else {
+                        push(value, size);
+                    }
+                }
+                break;
+            }
+            case 0x10b:
+                // ud2, #UD.
+                fault();
+            case 0x11f:
+                // Multi-byte nop.
+                break;
+            case 0x1af:
+                writeReg(m_reg, m_opSize,
+                         imul(readReg(m_reg, m_opSize), readRm(m_opSize),
+                              m_opSize));
+                break;
+            case 0x1b6:
+            case 0x1b7:
+                writeReg(m_reg, m_opSize, readRm((op == 0x1b6) ? 1 : 2));
+                break;
+            case 0x1bc:
+            case 0x1bd: {
+                // bsf and bsr. The destination is left unchanged if the source
+                // is zero. Other flags than ZF are undefined and left
+                // unchanged.
+                u64 const value(readRm(m_opSize));
+                if (!value) {
+                    setFlags(ZF, ZF);
+                } else {
+                    setFlags(ZF, 0);
+                    writeReg(m_reg, m_opSize, (op == 0x1bc) ?
+                             std::countr_zero(value) :
+                             63 - std::countl_zero(value));
+                }
+                break;
+            }
+            case 0x1be:
+            case 0x1bf: {
+                u8 const size((op == 0x1be) ? 1 : 2);
+                writeReg(m_reg, m_opSize, signExtend(readRm(size), size));
+                break;
+            }
+            default:
+                // All the supported opcodes are handled above.
+                unsupported();
+        }
+    }
+
+    m_emu.m_rip = m_nextRip;
+    return state;
+}
+
+Vm::OperatingState Emulator::execute() {
+    try {
+        Instruction instruction(*this);
+        return instruction.execute();
+    } catch (EmulationStop const& stop) {
+        return stop.state;
+    }
+}
+}
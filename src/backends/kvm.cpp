@@ -0,0 +1,298 @@
+#include <x86lab/backends/kvm.hpp>
+#include <cstring>
+
+namespace X86Lab::Backends {
+
+Kvm::Kvm(void * const memory, u64 const memorySize) :
+    m_vmFd(Util::Kvm::createVm()),
+    m_vcpuFd(Util::Kvm::createVcpu(m_vmFd)),
+    m_kvmRun(Util::Kvm::getVcpuRunStruct(m_vcpuFd)),
+    m_honorsGuestPat(false) {
+    // Map the memory to the guest.
+    kvm_userspace_memory_region const kvmMap({
+        // Only using a single slot. It does not matter much which one we
+        // choose.
+        .slot = 0,
+        .flags = 0,
+        .guest_phys_addr = 0,
+        .memory_size = memorySize,
+        .userspace_addr = reinterpret_cast<u64>(memory),
+    });
+    if (::ioctl(m_vmFd, KVM_SET_USER_MEMORY_REGION, &kvmMap) == -1) {
+        throw KvmError("Failed to map memory to guest", errno);
+    }
+
+    // We require some Kvm extension to implement some of the features of this
+    // class. Check that all extension are supported on the host's KVM API now
+    // instead of doing it at every corresponding KVM_* ioctl later.
+    Util::Kvm::requiresExension(m_vmFd, KVM_CAP_X86_MSR_FILTER);
+    Util::Kvm::requiresExension(m_vmFd, KVM_CAP_NR_MEMSLOTS);
+    Util::Kvm::requiresExension(m_vmFd, KVM_CAP_XSAVE);
+    Util::Kvm::requiresExension(m_vmFd, KVM_CAP_XCRS);
+
+    // Disable any MSR access filtering. KVM's doc indicate that if this is not
+    // done then the default behaviour is used. However it's not really clear if
+    // the default behaviour allows access to MSRs or not. Hence disable it here
+    // completely.
+    Util::Kvm::disableMsrFiltering(m_vmFd);
+
+    // Let the guest select the memory type of its pages, see
+    // Vm::setMemoryType(). This is best effort, older hosts always use
+    // write-back.
+    m_honorsGuestPat = Util::Kvm::honorGuestPat(m_vmFd);
+
+    // Setup access to CPUID information. We don't want to "hide" anything from
+    // the guest, having CPUID instruction available can always be useful.
+    Util::Kvm::setupCpuid(m_vcpuFd);
+}
+
+Kvm::~Kvm() {
+    // FIXME: The kvm_run structure is an mmap on the m_vcpuFd. Unmap it before
+    // closing the m_vcpuFd. This could be solved using a custom type returned
+    // by getVcpuRunStruct, with RAII doing the munmap in its destructor.
+    if (::close(m_vcpuFd) == -1) {
+        std::perror("Cannot close KVM Vcpu file descriptor:");
+    } else if (::close(m_vmFd) == -1) {
+        std::perror("Cannot close KVM VM file descriptor:");
+    }
+}
+
+Vm::State::Registers Kvm::doGetRegisters() const {
+    kvm_regs const regs(Util::Kvm::getRegs(m_vcpuFd));
+    kvm_sregs const sregs(Util::Kvm::getSRegs(m_vcpuFd));
+    std::unique_ptr<Util::Kvm::XSaveArea> const xsave(
+        Util::Kvm::getXSave(m_vcpuFd));
+    return Vm::State::Registers(regs, sregs, *xsave);
+}
+
+void Kvm::doSetRegisters(Vm::State::Registers const& registerValues) {
+    kvm_regs const regs({
+        .rax    = registerValues.rax, .rbx    = registerValues.rbx,
+        .rcx    = registerValues.rcx, .rdx    = registerValues.rdx,
+        .rsi    = registerValues.rsi, .rdi    = registerValues.rdi,
+        .rsp    = registerValues.rsp, .rbp    = registerValues.rbp,
+        .r8     = registerValues.r8,  .r9     = registerValues.r9,
+        .r10    = registerValues.r10, .r11    = registerValues.r11,
+        .r12    = registerValues.r12, .r13    = registerValues.r13,
+        .r14    = registerValues.r14, .r15    = registerValues.r15,
+        .rip    = registerValues.rip, .rflags = registerValues.rflags,
+    });
+    Util::Kvm::setRegs(m_vcpuFd, regs);
+
+    // State::Registers doesn't quite contain all the values that kvm_sregs has.
+    // Hence for those missing values, we read the current kvm_sregs to re-use
+    // them in the call to KVM_SET_SREGS.
+    kvm_sregs sregs(Util::Kvm::getSRegs(m_vcpuFd));
+
+    // Set the control registers, efer and the IDT/GDT. Segment registers are
+    // left untouched since setting those using setRegisters is not supported.
+    sregs.cr0 = registerValues.cr0;
+    sregs.cr2 = registerValues.cr2;
+    sregs.cr3 = registerValues.cr3;
+    sregs.cr4 = registerValues.cr4;
+    sregs.cr8 = registerValues.cr8;
+    sregs.efer = registerValues.efer;
+    sregs.idt.base = registerValues.idt.base;
+    sregs.idt.limit = registerValues.idt.limit;
+    sregs.gdt.base = registerValues.gdt.base;
+    sregs.gdt.limit = registerValues.gdt.limit;
+
+    Util::Kvm::setSRegs(m_vcpuFd, sregs);
+
+
+    std::unique_ptr<Util::Kvm::XSaveArea> xsave(Util::Kvm::getXSave(m_vcpuFd));
+    // Set the MMX registers.
+    for (u8 i(0); i < Vm::State::Registers::NumMmxRegs; ++i) {
+        xsave->mmx[i] = registerValues.mmx[i];
+    }
+
+    // MXCSR_MASK indicates the writable bits in MXCSR.
+    xsave->mxcsr = registerValues.mxcsr & xsave->mxcsrMask;
+
+    // ZMM registers. This also sets the YMM and XMM registers.
+    for (u8 i(0); i < Vm::State::Registers::NumZmmRegs; ++i) {
+        xsave->zmm[i] = registerValues.zmm[i];
+    }
+    for (u8 i(0); i < Vm::State::Registers::NumKRegs; ++i) {
+        xsave->k[i] = registerValues.k[i];
+    }
+
+    Util::Kvm::setXSave(m_vcpuFd, *xsave);
+}
+
+Vm::State::ExtendedState Kvm::doGetExtendedState() const {
+    return extendedState(Util::Kvm::getSRegs(m_vcpuFd));
+}
+
+std::pair<Vm::State::Registers, Vm::State::ExtendedState>
+Kvm::doGetCpuState() const {
+    // The special registers are needed by both, read them only once.
+    kvm_regs const regs(Util::Kvm::getRegs(m_vcpuFd));
+    kvm_sregs const sregs(Util::Kvm::getSRegs(m_vcpuFd));
+    std::unique_ptr<Util::Kvm::XSaveArea> const xsave(
+        Util::Kvm::getXSave(m_vcpuFd));
+    return std::make_pair(Vm::State::Registers(regs, sregs, *xsave),
+                          extendedState(sregs));
+}
+
+Vm::State::ExtendedState Kvm::extendedState(kvm_sregs const& sregs) const {
+    kvm_fpu const fpu(Util::Kvm::getFpu(m_vcpuFd));
+    kvm_debugregs const debugRegs(Util::Kvm::getDebugRegs(m_vcpuFd));
+    std::vector<u32> const indices(std::begin(Vm::State::ExtendedState::Msrs),
+                                   std::end(Vm::State::ExtendedState::Msrs));
+    std::vector<u64> const msrs(Util::Kvm::getMsrs(m_vcpuFd, indices));
+    u64 const xcr0(Util::Kvm::getXcr0(m_vcpuFd));
+    return Vm::State::ExtendedState(fpu, sregs, debugRegs, msrs, xcr0);
+}
+
+// Convert an ExtendedState::Segment into a kvm_segment.
+// @param seg: The segment to convert.
+// @return: The converted segment.
+static kvm_segment toKvmSegment(Vm::State::ExtendedState::Segment const& seg) {
+    return kvm_segment({
+        .base = seg.base,
+        .limit = seg.limit,
+        .selector = seg.selector,
+        .type = seg.type,
+        .present = seg.present,
+        .dpl = seg.dpl,
+        .db = seg.db,
+        .s = seg.s,
+        .l = seg.l,
+        .g = seg.g,
+        .avl = seg.avl,
+        .unusable = seg.unusable,
+        .padding = 0,
+    });
+}
+
+void Kvm::doSetExtendedState(Vm::State::ExtendedState const& state) {
+    // Read the current FPU state so that the SSE state it also contains is
+    // preserved.
+    kvm_fpu fpu(Util::Kvm::getFpu(m_vcpuFd));
+    for (u8 i(0); i < Vm::State::ExtendedState::Fpu::NumRegs; ++i) {
+        std::memset(fpu.fpr[i], 0x0, sizeof(fpu.fpr[i]));
+        std::memcpy(fpu.fpr[i], &state.fpu.st[i].mantissa, sizeof(u64));
+        std::memcpy(fpu.fpr[i] + 8, &state.fpu.st[i].signExponent, sizeof(u16));
+    }
+    fpu.fcw = state.fpu.fcw;
+    fpu.fsw = state.fpu.fsw;
+    fpu.ftwx = state.fpu.ftw;
+    fpu.last_opcode = state.fpu.lastOpcode;
+    fpu.last_ip = state.fpu.lastIp;
+    fpu.last_dp = state.fpu.lastDp;
+    Util::Kvm::setFpu(m_vcpuFd, fpu);
+
+    kvm_sregs sregs(Util::Kvm::getSRegs(m_vcpuFd));
+    sregs.cs = toKvmSegment(state.cs);
+    sregs.ds = toKvmSegment(state.ds);
+    sregs.es = toKvmSegment(state.es);
+    sregs.fs = toKvmSegment(state.fs);
+    sregs.gs = toKvmSegment(state.gs);
+    sregs.ss = toKvmSegment(state.ss);
+    sregs.tr = toKvmSegment(state.tr);
+    sregs.ldt = toKvmSegment(state.ldt);
+    Util::Kvm::setSRegs(m_vcpuFd, sregs);
+
+    kvm_debugregs debugRegs(Util::Kvm::getDebugRegs(m_vcpuFd));
+    for (u8 i(0); i < Vm::State::ExtendedState::NumDrRegs; ++i) {
+        debugRegs.db[i] = state.dr[i];
+    }
+    debugRegs.dr6 = state.dr6;
+    debugRegs.dr7 = state.dr7;
+    Util::Kvm::setDebugRegs(m_vcpuFd, debugRegs);
+
+    std::vector<u32> const indices(std::begin(Vm::State::ExtendedState::Msrs),
+                                   std::end(Vm::State::ExtendedState::Msrs));
+    std::vector<u64> const values(std::begin(state.msrs),
+                                  std::end(state.msrs));
+    Util::Kvm::setMsrs(m_vcpuFd, indices, values);
+
+    Util::Kvm::setXcr0(m_vcpuFd, state.xcr0);
+}
+
+u64 Kvm::doInstructionPointer() const {
+    return Util::Kvm::getRegs(m_vcpuFd).rip;
+}
+
+Vm::State::ExtendedState::Segment Kvm::doCodeSegment() const {
+    return Vm::State::ExtendedState::Segment(Util::Kvm::getSRegs(m_vcpuFd).cs);
+}
+
+std::optional<u64> Kvm::doTranslate(u64 const linearAddr) const {
+    kvm_translation const tr(Util::Kvm::translate(m_vcpuFd, linearAddr));
+    if (!tr.valid) {
+        return std::nullopt;
+    }
+    return tr.physical_address;
+}
+
+Vm::OperatingState Kvm::doStep() {
+    kvm_guest_debug dbg{};
+    dbg.control = KVM_GUESTDBG_ENABLE | KVM_GUESTDBG_SINGLESTEP;
+    return run(dbg);
+}
+
+Vm::OperatingState Kvm::doRunUntil(u64 const rip) {
+    // Hardware breakpoints are on linear addresses.
+    kvm_sregs const sregs(Util::Kvm::getSRegs(m_vcpuFd));
+    kvm_guest_debug dbg{};
+    dbg.control = KVM_GUESTDBG_ENABLE | KVM_GUESTDBG_USE_HW_BP;
+    dbg.arch.debugreg[0] = sregs.cs.base + rip;
+    // DR7: Locally enable breakpoint 0, R/W0 = 00 and LEN0 = 00, e.g. break on
+    // instruction execution.
+    dbg.arch.debugreg[7] = 0x1;
+    return run(dbg);
+}
+
+std::optional<Vm::StepEffects> Kvm::doLastStepEffects() const {
+    return std::nullopt;
+}
+
+void Kvm::doInvalidateTranslations() {
+    // Toggling CR4.PGE invalidates all the TLB entries, including the global
+    // ones, and the paging structure caches. KVM_SET_SREGS resets the MMU
+    // and flushes the guest's TLB when a paging-related bit of CR4 changes,
+    // hence toggle it twice to go back to the original value.
+    kvm_sregs sregs(Util::Kvm::getSRegs(m_vcpuFd));
+    u64 const pge(1 << 7);
+    sregs.cr4 ^= pge;
+    Util::Kvm::setSRegs(m_vcpuFd, sregs);
+    sregs.cr4 ^= pge;
+    Util::Kvm::setSRegs(m_vcpuFd, sregs);
+}
+
+bool Kvm::doHonorsMemoryTypes() const {
+    return m_honorsGuestPat;
+}
+
+Vm::OperatingState Kvm::run(kvm_guest_debug const& dbg) {
+    // Enable debug on guest vcpu in order to be able to do single
+    // stepping.
+    // The documentation is sparse on this, but it seems that single
+    // stepping gets disabled everytime registers are set using
+    // KVM_SET_REGS. Hence do it right before the call to KVM_RUN.
+    if (::ioctl(m_vcpuFd, KVM_SET_GUEST_DEBUG, &dbg) == -1) {
+        throw KvmError("Cannot set guest debug", errno);
+    }
+
+    if (::ioctl(m_vcpuFd, KVM_RUN, NULL) != 0) {
+        throw KvmError("Cannot run VM", errno);
+    }
+
+    if (m_kvmRun.exit_reason == KVM_EXIT_DEBUG) {
+        // The execution stopped after one step or on the breakpoint, we are
+        // still runnable.
+        return Vm::OperatingState::Runnable;
+    } else if (m_kvmRun.exit_reason == KVM_EXIT_SHUTDOWN) {
+        // Execution stopped the host. This is most likely a triple-fault hehe.
+        return Vm::OperatingState::Shutdown;
+    } else if (m_kvmRun.exit_reason == KVM_EXIT_HLT) {
+        // The single step executed a halt instruction.
+        return Vm::OperatingState::Halted;
+    } else {
+        // For now consider everything else as an error.
+        return Vm::OperatingState::SingleStepError;
+    }
+}
+}
@@ -0,0 +1,461 @@
+#include <x86lab/dependencygraph.hpp>
+#include <x86lab/disassembler.hpp>
+#include <x86lab/historyquery.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <set>
+#include <unordered_map>
+
+namespace X86Lab {
+
+// Throw if an analysis was cancelled.
+// @param cancelled: The cancellation flag of the analysis, nullptr if it
+// cannot be cancelled.
+// @throws: An Error if the flag is set.
+static void checkCancelled(
+    std::shared_ptr<std::atomic<bool> const> const& cancelled) {
+    if (!!cancelled && cancelled->load(std::memory_order_relaxed)) {
+        throw Error("Dependency analysis cancelled", ECANCELED);
+    }
+}
+
+// Split a range of memory into ranges that do not wrap around the end of the
+// address space.
+// @param addr: The address of the range.
+// @param size: The size of the range in bytes.
+// @param func: Called with the first and last address of each part of the
+// range, in order. Not called if the range is empty.
+static void forEachPart(u64 const addr,
+                        u64 const size,
+                        std::function<void(u64, u64)> const& func) {
+    if (!size) {
+        return;
+    }
+    u64 const last(addr + (size - 1));
+    if (last < addr) {
+        func(addr, ~0ULL);
+        func(0, last);
+    } else {
+        func(addr, last);
+    }
+}
+
+// The last step that wrote each byte of memory, as disjoint intervals so that
+// the cost of an access does not depend on its size, e.g. a rep stos over a
+// large buffer.
+class MemoryWriters {
+public:
+    // Call a function on each step that last wrote a byte of a range.
+    // @param first: The first address of the range.
+    // @param last: The last address of the range, included.
+    // @param func: Called with the steps, possibly more than once each.
+    void forEachWriter(u64 const first,
+                       u64 const last,
+                       std::function<void(u64)> const& func) const {
+        auto it(m_intervals.upper_bound(first));
+        if (it != m_intervals.begin() &&
+            first <= std::prev(it)->second.first) {
+            --it;
+        }
+        for (; it != m_intervals.end() && it->first <= last; ++it) {
+            func(it->second.second);
+        }
+    }
+
+    // Record the write of a range.
+    // @param first: The first address of the range.
+    // @param last: The last address of the range, included.
+    // @param writer: The step writing the range.
+    void write(u64 const first, u64 const last, u64 const writer) {
+        // Keep the part of the interval starting before the range, and the
+        // part of any interval ending after it.
+        auto it(m_intervals.upper_bound(first));
+        if (it != m_intervals.begin()) {
+            auto const prev(std::prev(it));
+            if (prev->first < first && first <= prev->second.first) {
+                auto const [prevLast, prevWriter](prev->second);
+                prev->second.first = first - 1;
+                if (last < prevLast) {
+                    m_intervals.emplace(last + 1,
+                                        std::make_pair(prevLast, prevWriter));
+                }
+            }
+        }
+        for (it = m_intervals.lower_bound(first);
+             it != m_intervals.end() && it->first <= last;) {
+            if (last < it->second.first) {
+                std::pair<u64, u64> const tail(it->second);
+                m_intervals.erase(it);
+                m_intervals.emplace(last + 1, tail);
+                break;
+            }
+            it = m_intervals.erase(it);
+        }
+        m_intervals.emplace(first, std::make_pair(last, writer));
+    }
+
+private:
+    // Maps the first address of each interval to its last address and its
+    // writer.
+    std::map<u64, std::pair<u64, u64>> m_intervals;
+};
+
+DependencyGraph::DependencyGraph(
+    std::vector<Step> const& steps,
+    std::shared_ptr<std::atomic<bool> const> const cancelled) {
+    // The last step that wrote each register and each byte of memory.
+    std::unordered_map<std::string, u64> regWriters;
+    MemoryWriters memWriters;
+    // The dependency of each node on the deepest chain ending with it.
+    std::vector<std::optional<u64>> predecessors;
+    m_nodes.reserve(steps.size());
+    predecessors.reserve(steps.size());
+    for (u64 i(0); i < steps.size(); ++i) {
+        checkCancelled(cancelled);
+        Step const& step(steps[i]);
+        Node node({
+            .step = i,
+            .rip = step.rip,
+            .dependencies = {},
+            .depth = 1,
+        });
+        auto const dependOn([&](u64 const writer) {
+            if (std::find(node.dependencies.begin(), node.dependencies.end(),
+                          writer) == node.dependencies.end()) {
+                node.dependencies.push_back(writer);
+            }
+        });
+        for (std::string const& reg : step.regsRead) {
+            if (auto const it(regWriters.find(reg)); it != regWriters.end()) {
+                dependOn(it->second);
+            }
+        }
+        for (auto const& [addr, size] : step.memRead) {
+            forEachPart(addr, size, [&](u64 const first, u64 const last) {
+                memWriters.forEachWriter(first, last, dependOn);
+            });
+        }
+        std::sort(node.dependencies.begin(), node.dependencies.end());
+
+        // Steps are in topological order, the depth of the dependencies is
+        // final.
+        std::optional<u64> predecessor;
+        for (u64 const dep : node.dependencies) {
+            if (node.depth < m_nodes[dep].depth + 1) {
+                node.depth = m_nodes[dep].depth + 1;
+                predecessor = dep;
+            }
+        }
+
+        // Writes come after the reads, e.g. add rax, rbx depends on the
+        // previous writer of rax.
+        for (std::string const& reg : step.regsWritten) {
+            regWriters[reg] = i;
+        }
+        for (auto const& [addr, size] : step.memWritten) {
+            forEachPart(addr, size, [&](u64 const first, u64 const last) {
+                memWriters.write(first, last, i);
+            });
+        }
+        m_nodes.push_back(std::move(node));
+        predecessors.push_back(predecessor);
+    }
+
+    if (m_nodes.empty()) {
+        return;
+    }
+    // The critical path ends with the first deepest node.
+    std::optional<u64> curr(std::max_element(m_nodes.begin(), m_nodes.end(),
+        [](Node const& lhs, Node const& rhs) {
+            return lhs.depth < rhs.depth;
+        })->step);
+    for (; !!curr; curr = predecessors[*curr]) {
+        m_criticalPath.push_back(*curr);
+        m_criticalInstructions[m_nodes[*curr].rip] ++;
+    }
+    std::reverse(m_criticalPath.begin(), m_criticalPath.end());
+}
+
+// Get the value of a register used in an address.
+// @param regs: The values of the registers.
+// @param name: The name of the register, as reported by Capstone, e.g. "eax".
+// @param nextRip: The address of the next instruction, which is the value of
+// rip in rip-relative addressing.
+// @return: The value of the register and the mask of its bits. Empty if the
+// register cannot be used in an address.
+static std::optional<std::pair<u64, u64>> addressRegister(
+    Snapshot::Registers const& regs,
+    std::string const& name,
+    u64 const nextRip) {
+    // The names of the 64, 32 and 16-bit variants of each register.
+    struct Gpr {
+        char const * names[3];
+        u64 Snapshot::Registers::* reg;
+    };
+    static Gpr const gprs[] = {
+        {{"rax", "eax", "ax"}, &Snapshot::Registers::rax},
+        {{"rbx", "ebx", "bx"}, &Snapshot::Registers::rbx},
+        {{"rcx", "ecx", "cx"}, &Snapshot::Registers::rcx},
+        {{"rdx", "edx", "dx"}, &Snapshot::Registers::rdx},
+        {{"rsi", "esi", "si"}, &Snapshot::Registers::rsi},
+        {{"rdi", "edi", "di"}, &Snapshot::Registers::rdi},
+        {{"rsp", "esp", "sp"}, &Snapshot::Registers::rsp},
+        {{"rbp", "ebp", "bp"}, &Snapshot::Registers::rbp},
+        {{"r8", "r8d", "r8w"}, &Snapshot::Registers::r8},
+        {{"r9", "r9d", "r9w"}, &Snapshot::Registers::r9},
+        {{"r10", "r10d", "r10w"}, &Snapshot::Registers::r10},
+        {{"r11", "r11d", "r11w"}, &Snapshot::Registers::r11},
+        {{"r12", "r12d", "r12w"}, &Snapshot::Registers::r12},
+        {{"r13", "r13d", "r13w"}, &Snapshot::Registers::r13},
+        {{"r14", "r14d", "r14w"}, &Snapshot::Registers::r14},
+        {{"r15", "r15d", "r15w"}, &Snapshot::Registers::r15},
+        {{"rip", "eip", "ip"}, nullptr},
+    };
+    static u64 const masks[] = {~0ULL, 0xffffffffULL, 0xffffULL};
+    for (Gpr const& gpr : gprs) {
+        for (u8 i(0); i < 3; ++i) {
+            if (name == gpr.names[i]) {
+                u64 const value(!!gpr.reg ? regs.*gpr.reg : nextRip);
+                return std::make_pair(value & masks[i], masks[i]);
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+// Compute the linear address accessed by a memory operand.
+// @param snap: The snapshot of the step executing the instruction.
+// @param insn: The instruction.
+// @param op: The memory operand.
+// @return: The linear address, empty if it cannot be computed.
+static std::optional<u64> linearAddress(
+    Snapshot const& snap,
+    Disassembler::Instruction const& insn,
+    Disassembler::MemoryOperand const& op) {
+    Vm::CpuMode const mode(snap.cpuMode());
+    u64 const nextRip(insn.address + insn.size);
+    // Without base nor index, the offset has the size of the addresses.
+    u64 offset(op.disp);
+    u64 mask(mode == Vm::CpuMode::LongMode ? ~0ULL :
+             (mode == Vm::CpuMode::ProtectedMode ? 0xffffffffULL : 0xffffULL));
+    std::pair<std::string const&, u64> const regs[] = {
+        {op.base, 1}, {op.index, op.scale},
+    };
+    for (auto const& [reg, scale] : regs) {
+        if (reg.empty()) {
+            continue;
+        }
+        std::optional<std::pair<u64, u64>> const value(
+            addressRegister(snap.registers(), reg, nextRip));
+        if (!value) {
+            return std::nullopt;
+        }
+        offset += value->first * scale;
+        mask = value->second;
+    }
+    offset &= mask;
+
+    // Segments only have a base outside of long mode, except fs and gs.
+    Vm::State::ExtendedState const& ext(snap.extendedState());
+    bool const stack(op.base == "rsp" || op.base == "esp" || op.base == "sp" ||
+                     op.base == "rbp" || op.base == "ebp" || op.base == "bp");
+    std::string const segment(!op.segment.empty() ? op.segment :
+                              (stack ? "ss" : "ds"));
+    std::map<std::string, Vm::State::ExtendedState::Segment const*> const
+        segments({
+            {"cs", &ext.cs}, {"ds", &ext.ds}, {"es", &ext.es},
+            {"fs", &ext.fs}, {"gs", &ext.gs}, {"ss", &ext.ss},
+        });
+    auto const it(segments.find(segment));
+    bool const hasBase(mode != Vm::CpuMode::LongMode || segment == "fs" ||
+                       segment == "gs");
+    if (it == segments.end() || !hasBase) {
+        return offset;
+    }
+    u64 const linear(it->second->base + offset);
+    return mode == Vm::CpuMode::LongMode ? linear : linear & 0xffffffffULL;
+}
+
+// Check if an instruction is a zeroing idiom, e.g. xor eax, eax, whose result
+// is zero whatever the value of its operands. The cpu recognizes those and
+// does not wait for the previous writer of the register.
+// @param insn: The instruction.
+// @return: True if the instruction is a zeroing idiom.
+static bool isZeroingIdiom(Disassembler::Instruction const& insn) {
+    static std::set<std::string> const mnemonics({
+        "xor", "sub", "pxor", "xorps", "xorpd", "psubb", "psubw", "psubd",
+        "psubq", "pcmpgtb", "pcmpgtw", "pcmpgtd", "pcmpgtq", "vpxor", "vpxord",
+        "vpxorq", "vxorps", "vxorpd", "vpsubb", "vpsubw", "vpsubd", "vpsubq",
+        "vpcmpgtb", "vpcmpgtw", "vpcmpgtd", "vpcmpgtq",
+    });
+    // Masked forms, e.g. {k1}, merge into the destination hence read it.
+    if (!mnemonics.contains(insn.mnemonic) ||
+        insn.operands.find('{') != std::string::npos) {
+        return false;
+    }
+    std::vector<std::string> operands;
+    for (u64 start(0); start <= insn.operands.size();) {
+        u64 const end(std::min(insn.operands.find(", ", start),
+                               insn.operands.size()));
+        operands.push_back(insn.operands.substr(start, end - start));
+        start = end + 2;
+    }
+    // The sources are the last two operands, the first one is also the
+    // destination in the two-operand forms. Identical memory operands can be
+    // different values, e.g. with a concurrent write, and are not idioms.
+    u64 const numOps(operands.size());
+    return (numOps == 2 || numOps == 3) &&
+        operands[numOps - 2] == operands[numOps - 1] &&
+        operands[numOps - 1].find('[') == std::string::npos;
+}
+
+// Find the data accessed by the instruction executed at a step.
+// @param before: The snapshot of the step, before executing the instruction.
+// @param after: The snapshot of the next step.
+// @param insn: The instruction executed, decoded from `before`.
+// @return: The accesses of the instruction.
+static DependencyGraph::Step stepAccesses(
+    Snapshot const& before,
+    Snapshot const& after,
+    Disassembler::Instruction const& insn) {
+    DependencyGraph::Step step({
+        .rip = insn.address,
+        .regsRead = insn.regsRead,
+        .regsWritten = insn.regsWritten,
+        .memRead = {},
+        .memWritten = {},
+    });
+    if (isZeroingIdiom(insn)) {
+        step.regsRead.clear();
+    }
+
+    // A rep-prefixed string instruction executes as many iterations as rcx
+    // decreased during the step, each of them moving its pointers by the size
+    // of an element, backwards if the direction flag is set. Capstone includes
+    // the prefix in the mnemonic.
+    bool const repeated(insn.mnemonic.starts_with("rep"));
+    Snapshot::Registers const& regs(before.registers());
+    bool const backwards(regs.rflags & (1ULL << 10));
+    for (Disassembler::MemoryOperand const& op : insn.memoryOperands) {
+        std::optional<u64> const addr(linearAddress(before, insn, op));
+        if (!addr) {
+            continue;
+        }
+        u64 start(*addr);
+        u64 size(op.size);
+        if (repeated) {
+            // The counter has the size of the addresses, as the pointers.
+            std::optional<std::pair<u64, u64>> const pointer(
+                addressRegister(regs, op.base, insn.address + insn.size));
+            u64 const mask(!!pointer ? pointer->second : ~0ULL);
+            u64 const countBefore(regs.rcx & mask);
+            u64 const countAfter(after.registers().rcx & mask);
+            // Anything unusual, e.g. an exception, is assumed to be a single
+            // iteration.
+            u64 const count(countAfter <= countBefore ?
+                            countBefore - countAfter : 1);
+            if (!count) {
+                continue;
+            }
+            size = count * op.size;
+            start = backwards ? *addr - (count - 1) * op.size : *addr;
+        }
+        if (op.read) {
+            step.memRead.emplace_back(start, size);
+        }
+        if (op.write) {
+            step.memWritten.emplace_back(start, size);
+        }
+    }
+
+    // The stack accesses of push, pop, call, ret and leave are implicit,
+    // deduce them from the change of rsp. Anything unusual, e.g. an exception
+    // delivered while executing the instruction, is ignored.
+    u64 const width(before.cpuMode() == Vm::CpuMode::LongMode ? 8 :
+                    (before.cpuMode() == Vm::CpuMode::ProtectedMode ? 4 : 2));
+    u64 const maxPush(width * 8);
+    u64 const rspBefore(before.registers().rsp);
+    u64 const rspAfter(after.registers().rsp);
+    std::string const& mnemonic(insn.mnemonic);
+    if ((mnemonic.starts_with("push") || mnemonic.starts_with("call")) &&
+        rspAfter < rspBefore && rspBefore - rspAfter <= maxPush) {
+        step.memWritten.emplace_back(rspAfter, rspBefore - rspAfter);
+    } else if ((mnemonic.starts_with("pop") || mnemonic.starts_with("ret")) &&
+               rspBefore < rspAfter) {
+        step.memRead.emplace_back(rspBefore,
+                                  std::min(rspAfter - rspBefore, width));
+    } else if (mnemonic == "leave" && width <= rspAfter) {
+        step.memRead.emplace_back(rspAfter - width, width);
+    }
+    return step;
+}
+
+DependencyGraph DependencyGraph::fromHistory(
+    std::shared_ptr<Snapshot const> const last,
+    std::shared_ptr<std::atomic<bool> const> const cancelled,
+    Util::ThreadPool& pool) {
+    // Partial result of the decoding, with the disassemblers of the task since
+    // Capstone handles cannot be shared across threads.
+    struct Partial {
+        std::vector<Step> steps;
+        std::map<Vm::CpuMode, std::shared_ptr<Disassembler>> disassemblers;
+    };
+
+    HistoryQuery const query(last, pool);
+    std::vector<Step> steps(query.mapReduce<Partial>(
+        {},
+        [&](Partial& partial, u64 const i, Snapshot const& after) {
+            checkCancelled(cancelled);
+            // Each step is analyzed with the instruction executed at the
+            // previous step.
+            if (!i) {
+                return;
+            }
+            Snapshot const& before(*after.base());
+            Snapshot::Registers const& regs(before.registers());
+            Step step({
+                .rip = regs.rip,
+                .regsRead = {},
+                .regsWritten = {},
+                .memRead = {},
+                .memWritten = {},
+            });
+            u64 const linearRip(before.extendedState().cs.base + regs.rip);
+            std::vector<u8> const bytes(
+                before.readLinearMemory(linearRip, Vm::MaxInstructionLength));
+            std::shared_ptr<Disassembler>& disasm(
+                partial.disassemblers[before.cpuMode()]);
+            if (!disasm) {
+                disasm = std::make_shared<Disassembler>(before.cpuMode());
+            }
+            std::optional<Disassembler::Instruction> const insn(
+                disasm->decode(bytes, regs.rip));
+            if (!insn) {
+                partial.steps.push_back(step);
+                return;
+            }
+            partial.steps.push_back(stepAccesses(before, after, *insn));
+        },
+        [](Partial& result, Partial&& partial) {
+            result.steps.insert(result.steps.end(),
+                                std::make_move_iterator(partial.steps.begin()),
+                                std::make_move_iterator(partial.steps.end()));
+        }).steps);
+    return DependencyGraph(steps, cancelled);
+}
+
+std::vector<DependencyGraph::Node> const& DependencyGraph::nodes() const {
+    return m_nodes;
+}
+
+std::vector<u64> const& DependencyGraph::criticalPath() const {
+    return m_criticalPath;
+}
+
+std::map<u64, u64> const& DependencyGraph::criticalInstructions() const {
+    return m_criticalInstructions;
+}
+}
@@ -0,0 +1,244 @@
+#include <x86lab/disassembler.hpp>
+#include <algorithm>
+#include <cctype>
+#include <map>
+#include <set>
+
+namespace X86Lab {
+
+// Get the name of the full register a register is part of.
+// @param name: The name of the register, e.g. "al".
+// @return: The name of the full register, e.g. "rax". Registers that are not
+// part of another one are returned as is.
+static std::string fullRegister(std::string const& name) {
+    static std::map<std::string, std::string> const gprs({
+        {"al", "rax"}, {"ah", "rax"}, {"ax", "rax"}, {"eax", "rax"},
+        {"bl", "rbx"}, {"bh", "rbx"}, {"bx", "rbx"}, {"ebx", "rbx"},
+        {"cl", "rcx"}, {"ch", "rcx"}, {"cx", "rcx"}, {"ecx", "rcx"},
+        {"dl", "rdx"}, {"dh", "rdx"}, {"dx", "rdx"}, {"edx", "rdx"},
+        {"sil", "rsi"}, {"si", "rsi"}, {"esi", "rsi"},
+        {"dil", "rdi"}, {"di", "rdi"}, {"edi", "rdi"},
+        {"spl", "rsp"}, {"sp", "rsp"}, {"esp", "rsp"},
+        {"bpl", "rbp"}, {"bp", "rbp"}, {"ebp", "rbp"},
+        {"ip", "rip"}, {"eip", "rip"},
+        {"flags", "rflags"}, {"eflags", "rflags"},
+    });
+    if (auto const it(gprs.find(name)); it != gprs.end()) {
+        return it->second;
+    }
+    // r8-r15: r8b, r8w and r8d are part of r8.
+    bool const extended(3 <= name.size() && name[0] == 'r' &&
+                        std::isdigit(name[1]) &&
+                        std::string("bwd").find(name.back()) !=
+                            std::string::npos);
+    if (extended) {
+        return name.substr(0, name.size() - 1);
+    }
+    // Vector registers are part of the zmm register with the same index.
+    bool const vector(name.starts_with("xmm") || name.starts_with("ymm"));
+    return vector ? "zmm" + name.substr(3) : name;
+}
+
+Disassembler::Disassembler(Vm::CpuMode const mode) {
+    cs_mode csMode;
+    if (mode == Vm::CpuMode::RealMode) {
+        csMode = CS_MODE_16;
+    } else if (mode == Vm::CpuMode::ProtectedMode) {
+        csMode = CS_MODE_32;
+    } else {
+        csMode = CS_MODE_64;
+    }
+    if (cs_open(CS_ARCH_X86, csMode, &m_handle) != CS_ERR_OK) {
+        throw Error("Cannot initialize Capstone", 0);
+    }
+    // Details are needed to get the groups of each instruction.
+    if (cs_option(m_handle, CS_OPT_DETAIL, CS_OPT_ON) != CS_ERR_OK) {
+        cs_close(&m_handle);
+        throw Error("Cannot enable Capstone details", 0);
+    }
+}
+
+Disassembler::~Disassembler() {
+    cs_close(&m_handle);
+}
+
+std::vector<Disassembler::Instruction> Disassembler::decodeBlock(
+    std::vector<u8> const& code,
+    u64 const address) const {
+    std::vector<Instruction> res;
+    cs_insn * const insn(cs_malloc(m_handle));
+    if (!insn) {
+        throw Error("Cannot allocate Capstone instruction", 0);
+    }
+    u8 const * codePtr(code.data());
+    size_t codeSize(code.size());
+    u64 addr(address);
+    while (cs_disasm_iter(m_handle, &codePtr, &codeSize, &addr, insn)) {
+        res.push_back(makeInstruction(*insn));
+        if (res.back().endsBlock) {
+            break;
+        }
+    }
+    cs_free(insn, 1);
+    return res;
+}
+
+std::optional<Disassembler::Instruction> Disassembler::decode(
+    std::vector<u8> const& code,
+    u64 const address) const {
+    cs_insn * const insn(cs_malloc(m_handle));
+    if (!insn) {
+        throw Error("Cannot allocate Capstone instruction", 0);
+    }
+    u8 const * codePtr(code.data());
+    size_t codeSize(code.size());
+    u64 addr(address);
+    std::optional<Instruction> res;
+    if (cs_disasm_iter(m_handle, &codePtr, &codeSize, &addr, insn)) {
+        res = makeInstruction(*insn);
+    }
+    cs_free(insn, 1);
+    return res;
+}
+
+std::optional<u64> Disassembler::registerOnlyNextRip(Vm const& vm) const {
+    u64 const rip(vm.instructionPointer());
+    std::optional<Instruction> const insn(
+        decode(vm.readInstructionBytes(Vm::MaxInstructionLength), rip));
+    if (!insn || insn->endsBlock || insn->mayWriteMemory) {
+        return std::nullopt;
+    }
+    return rip + insn->size;
+}
+
+Disassembler::Instruction Disassembler::makeInstruction(
+    cs_insn const& insn) const {
+    bool const endsBlock(cs_insn_group(m_handle, &insn, CS_GRP_JUMP) ||
+                         cs_insn_group(m_handle, &insn, CS_GRP_CALL) ||
+                         cs_insn_group(m_handle, &insn, CS_GRP_RET) ||
+                         cs_insn_group(m_handle, &insn, CS_GRP_INT) ||
+                         cs_insn_group(m_handle, &insn, CS_GRP_IRET) ||
+                         insn.id == X86_INS_HLT);
+    Instruction res({
+        .address = insn.address,
+        .size = insn.size,
+        .mnemonic = insn.mnemonic,
+        .operands = insn.op_str,
+        .endsBlock = endsBlock,
+        .mayWriteMemory = mayWriteMemory(insn),
+        .regsRead = {},
+        .regsWritten = {},
+        .memoryOperands = {},
+    });
+
+    // The registers accessed, including the implicit accesses. Sub-registers
+    // of the same register are reported once.
+    cs_regs regsRead;
+    cs_regs regsWritten;
+    u8 numRead(0);
+    u8 numWritten(0);
+    if (cs_regs_access(m_handle, &insn, regsRead, &numRead, regsWritten,
+                       &numWritten) == CS_ERR_OK) {
+        auto const add([&](std::vector<std::string>& regs, u16 const reg) {
+            std::string const full(fullRegister(registerName(reg)));
+            if (full != "rip" && !full.empty() &&
+                std::find(regs.begin(), regs.end(), full) == regs.end()) {
+                regs.push_back(full);
+            }
+        });
+        for (u8 i(0); i < numRead; ++i) {
+            add(res.regsRead, regsRead[i]);
+        }
+        for (u8 i(0); i < numWritten; ++i) {
+            add(res.regsWritten, regsWritten[i]);
+        }
+    }
+
+    if (insn.id == X86_INS_LEA || insn.id == X86_INS_NOP) {
+        return res;
+    }
+    cs_x86 const& x86(insn.detail->x86);
+    for (u8 i(0); i < x86.op_count; ++i) {
+        cs_x86_op const& op(x86.operands[i]);
+        if (op.type != X86_OP_MEM) {
+            continue;
+        }
+        bool const write(op.access & CS_AC_WRITE);
+        res.memoryOperands.push_back(MemoryOperand({
+            .segment = registerName(op.mem.segment),
+            .base = registerName(op.mem.base),
+            .index = registerName(op.mem.index),
+            .scale = static_cast<u64>(op.mem.scale),
+            .disp = op.mem.disp,
+            .size = op.size,
+            .read = (op.access & CS_AC_READ) || !write,
+            .write = write,
+        }));
+    }
+    return res;
+}
+
+std::string Disassembler::registerName(unsigned int const reg) const {
+    if (reg == X86_REG_INVALID) {
+        return "";
+    }
+    char const * const name(cs_reg_name(m_handle, reg));
+    return !!name ? name : "";
+}
+
+bool Disassembler::mayWriteMemory(cs_insn const& insn) const {
+    // Calls, interrupts and system instructions write to the stack, to
+    // descriptor tables, MSRs, ... Do not try to be clever about those.
+    if (cs_insn_group(m_handle, &insn, CS_GRP_CALL) ||
+        cs_insn_group(m_handle, &insn, CS_GRP_INT) ||
+        cs_insn_group(m_handle, &insn, CS_GRP_IRET) ||
+        cs_insn_group(m_handle, &insn, CS_GRP_PRIVILEGE)) {
+        return true;
+    }
+
+    // Instructions writing memory through an implicit operand. String
+    // instructions are listed here even though Capstone reports their memory
+    // operands since not all versions report the access of those operands.
+    // Note: X86_INS_MOVSD is also the SSE scalar move, which is conservatively
+    // treated as a string instruction.
+    static std::set<unsigned int> const implicitWrites({
+        X86_INS_MOVSB, X86_INS_MOVSW, X86_INS_MOVSD, X86_INS_MOVSQ,
+        X86_INS_STOSB, X86_INS_STOSW, X86_INS_STOSD, X86_INS_STOSQ,
+        X86_INS_MASKMOVQ, X86_INS_MASKMOVDQU, X86_INS_VMASKMOVDQU,
+    });
+    if (implicitWrites.contains(insn.id)) {
+        return true;
+    }
+
+    cs_detail const& detail(*insn.detail);
+    cs_x86 const& x86(detail.x86);
+    if (x86.prefix[0] == X86_PREFIX_REP || x86.prefix[0] == X86_PREFIX_REPNE) {
+        // Any rep-prefixed instruction is treated as a string instruction.
+        return true;
+    }
+
+    // Stack instructions (push, enter, pushf, ...) implicitly modify the stack
+    // pointer. This also catches pop and leave which only read memory, which
+    // is fine.
+    for (u8 i(0); i < detail.regs_write_count; ++i) {
+        u16 const reg(detail.regs_write[i]);
+        if (reg == X86_REG_RSP || reg == X86_REG_ESP || reg == X86_REG_SP) {
+            return true;
+        }
+    }
+
+    // Finally, explicit memory operands. lea and nop have a memory operand but
+    // never access it. Some instructions do not have their operand access
+    // documented in Capstone, only trust operands known to be read-only.
+    if (insn.id == X86_INS_LEA || insn.id == X86_INS_NOP) {
+        return false;
+    }
+    for (u8 i(0); i < x86.op_count; ++i) {
+        cs_x86_op const& op(x86.operands[i]);
+        if (op.type == X86_OP_MEM && op.access != CS_AC_READ) {
+            return true;
+        }
+    }
+    return false;
+}
+}
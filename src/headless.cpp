@@ -0,0 +1,139 @@
+#include <x86lab/headless.hpp>
+
+namespace X86Lab {
+
+HeadlessRunner::Config::Config() :
+    startMode(Vm::CpuMode::LongMode),
+    memorySize(4 * PAGE_SIZE),
+    maxSteps(~((u64)0)),
+    granularity(Granularity::Instruction),
+    recordHistory(true),
+    repStringStepping(false),
+    backend(Vm::BackendType::Kvm) {}
+
+HeadlessRunner::HeadlessRunner(std::shared_ptr<Code const> const code,
+                               Config const& config) :
+    m_config(config),
+    m_code(code),
+    m_vm(new Vm(config.startMode,
+                config.memorySize,
+                config.placement,
+                config.backend)),
+    m_numSteps(0) {
+    m_vm->loadCode(*m_code);
+    m_history.push_back(
+        std::shared_ptr<Snapshot>(new Snapshot(m_vm->getState())));
+}
+
+Vm::OperatingState HeadlessRunner::run() {
+    for (u64 i(0); i < m_config.maxSteps; ++i) {
+        if (step() != Vm::OperatingState::Runnable) {
+            break;
+        }
+    }
+    return m_vm->operatingState();
+}
+
+Vm::OperatingState HeadlessRunner::step() {
+    if (m_vm->operatingState() != Vm::OperatingState::Runnable) {
+        return m_vm->operatingState();
+    }
+    Vm::OperatingState state;
+    // See Disassembler::registerOnlyNextRip().
+    std::optional<u64> registerOnlyNextRip;
+    if (m_config.granularity == Granularity::BasicBlock) {
+        state = stepBasicBlock();
+    } else {
+        std::optional<u64> const repLen(m_config.repStringStepping ?
+            m_vm->repStringInstructionLength() : std::nullopt);
+        if (!repLen && m_config.recordHistory) {
+            registerOnlyNextRip = disassembler(
+                m_vm->cpuMode()).registerOnlyNextRip(*m_vm);
+        }
+        state = !!repLen ?
+            m_vm->runUntil(m_vm->instructionPointer() + *repLen) :
+            m_vm->step();
+    }
+    m_numSteps ++;
+    if (m_config.recordHistory) {
+        m_history.push_back(Snapshot::afterStep(
+            m_history.back(), *m_vm, registerOnlyNextRip));
+    }
+    return state;
+}
+
+Vm::OperatingState HeadlessRunner::stepBasicBlock() {
+    u64 const start(m_vm->instructionPointer());
+    std::vector<Disassembler::Instruction> const block(
+        disassembler(m_vm->cpuMode()).decodeBlock(
+            m_vm->readInstructionBytes(maxBlockBytes), start));
+    if (block.empty()) {
+        // Cannot decode the next instruction, let the cpu deal with it.
+        m_blocks.push_back(BasicBlock({.start = start, .numInstructions = 1}));
+        return m_vm->step();
+    }
+    m_blocks.push_back(BasicBlock({
+        .start = start,
+        .numInstructions = block.size(),
+    }));
+
+    Disassembler::Instruction const& last(block.back());
+    if (!last.endsBlock) {
+        // The block is longer than maxBlockBytes, run until the end of the
+        // decoded part. The next step continues the block.
+        return m_vm->runUntil(last.address + last.size);
+    }
+    if (last.address != start) {
+        Vm::OperatingState const state(m_vm->runUntil(last.address));
+        if (state != Vm::OperatingState::Runnable ||
+            m_vm->instructionPointer() != last.address) {
+            // Something interrupted the block before reaching the branch.
+            return state;
+        }
+    }
+    // Single-step the branch to find out where it goes.
+    return m_vm->step();
+}
+
+Disassembler const& HeadlessRunner::disassembler(
+    Vm::CpuMode const mode) const {
+    std::unique_ptr<Disassembler>& disasm(m_disassemblers[mode]);
+    if (!disasm) {
+        disasm = std::make_unique<Disassembler>(mode);
+    }
+    return *disasm;
+}
+
+u64 HeadlessRunner::numSteps() const {
+    return m_numSteps;
+}
+
+Vm const& HeadlessRunner::vm() const {
+    return *m_vm;
+}
+
+std::vector<std::shared_ptr<Snapshot>> const& HeadlessRunner::history() const {
+    return m_history;
+}
+
+std::vector<HeadlessRunner::BasicBlock> const& HeadlessRunner::blocks() const {
+    return m_blocks;
+}
+
+std::vector<u64> HeadlessRunner::blockInstructions(
+    u64 const blockIndex) const {
+    if (!m_config.recordHistory) {
+        throw Error("Reconstructing a block requires the history", 0);
+    }
+    BasicBlock const& block(m_blocks.at(blockIndex));
+    std::shared_ptr<Snapshot const> const snap(m_history.at(blockIndex));
+    std::vector<Disassembler::Instruction> const insns(
+        disassembler(snap->cpuMode()).decodeBlock(
+            snap->readLinearMemory(block.start, maxBlockBytes), block.start));
+    std::vector<u64> res;
+    for (u64 i(0); i < insns.size() && i < block.numInstructions; ++i) {
+        res.push_back(insns[i].address);
+    }
+    return res;
+}
+}
@@ -0,0 +1,59 @@
+#include <x86lab/historycompressor.hpp>
+
+namespace X86Lab {
+HistoryCompressor::HistoryCompressor() :
+    m_busy(false),
+    m_stop(false),
+    m_stats({}),
+    m_thread([this]() { run(); }) {}
+
+HistoryCompressor::~HistoryCompressor() {
+    {
+        std::unique_lock<std::mutex> const lock(m_mutex);
+        m_stop = true;
+    }
+    m_workCond.notify_all();
+    m_thread.join();
+}
+
+void HistoryCompressor::enqueue(std::shared_ptr<Snapshot const> const snapshot,
+                                std::shared_ptr<Snapshot const> const live) {
+    {
+        std::unique_lock<std::mutex> const lock(m_mutex);
+        m_queue.emplace_back(snapshot, live);
+    }
+    m_workCond.notify_one();
+}
+
+void HistoryCompressor::waitIdle() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idleCond.wait(lock, [&]() { return m_queue.empty() && !m_busy; });
+}
+
+Snapshot::CompressionStats HistoryCompressor::stats() const {
+    std::unique_lock<std::mutex> const lock(m_mutex);
+    return m_stats;
+}
+
+void HistoryCompressor::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_workCond.wait(lock, [&]() { return m_stop || !m_queue.empty(); });
+        if (m_stop) {
+            return;
+        }
+        Work const work(m_queue.front());
+        m_queue.pop_front();
+        m_busy = true;
+        lock.unlock();
+        Snapshot::CompressionStats const stats(
+            work.first->compressMemory(*work.second));
+        lock.lock();
+        m_stats += stats;
+        m_busy = false;
+        if (m_queue.empty()) {
+            m_idleCond.notify_all();
+        }
+    }
+}
+}
@@ -0,0 +1,147 @@
+#include <x86lab/historyquery.hpp>
+#include <algorithm>
+
+namespace X86Lab {
+
+HistoryQuery::HistoryQuery(std::shared_ptr<Snapshot const> const last,
+                           Util::ThreadPool& pool) :
+    m_last(last),
+    m_pool(&pool) {
+    for (Snapshot const * snap(m_last.get()); !!snap;
+         snap = snap->base().get()) {
+        m_snapshots.push_back(snap);
+    }
+    std::reverse(m_snapshots.begin(), m_snapshots.end());
+}
+
+u64 HistoryQuery::size() const {
+    return m_snapshots.size();
+}
+
+Snapshot const& HistoryQuery::snapshot(u64 const step) const {
+    return *m_snapshots[step];
+}
+
+std::vector<std::pair<u64, u64>> HistoryQuery::splitSteps() const {
+    u64 const numSteps(size());
+    u64 const numTasks(std::clamp<u64>(
+        (numSteps + MinStepsPerTask - 1) / MinStepsPerTask,
+        1,
+        m_pool->numThreads() * TasksPerThread));
+    std::vector<std::pair<u64, u64>> ranges;
+    for (u64 i(0); i < numTasks; ++i) {
+        ranges.emplace_back(numSteps * i / numTasks,
+                            numSteps * (i + 1) / numTasks);
+    }
+    return ranges;
+}
+
+std::vector<u64> HistoryQuery::findSteps(
+    std::function<bool(u64, Snapshot const&)> const& predicate) const {
+    return mapReduce<std::vector<u64>>(
+        {},
+        [&](std::vector<u64>& steps, u64 const step, Snapshot const& snap) {
+            if (predicate(step, snap)) {
+                steps.push_back(step);
+            }
+        },
+        [](std::vector<u64>& steps, std::vector<u64>&& partial) {
+            steps.insert(steps.end(), partial.begin(), partial.end());
+        });
+}
+
+// Translate a range of linear memory into the physical memory it is mapped to.
+// @param regions: The mapped regions, see Snapshot::mappedRegions().
+// @param offset: The linear address of the range.
+// @param size: The size of the range in bytes.
+// @return: The physical ranges, as pairs of offset and size, in ascending
+// order of linear address. Stops at the first byte that is not mapped.
+static std::vector<std::pair<u64, u64>> translate(
+    std::vector<Snapshot::MappedRegion> const& regions,
+    u64 const offset,
+    u64 const size) {
+    std::vector<std::pair<u64, u64>> ranges;
+    // Find the last region starting at or before the offset.
+    auto it(std::upper_bound(regions.begin(), regions.end(), offset,
+                             [](u64 const addr, auto const& region) {
+        return addr < region.linearAddress;
+    }));
+    if (it == regions.begin()) {
+        return ranges;
+    }
+    --it;
+    u64 addr(offset);
+    u64 const end(offset + size);
+    for (; addr < end && it != regions.end(); ++it) {
+        if (addr < it->linearAddress ||
+            it->linearAddress + it->size <= addr) {
+            break;
+        }
+        u64 const len(std::min(end, it->linearAddress + it->size) - addr);
+        ranges.emplace_back(it->physicalOffset + addr - it->linearAddress,
+                            len);
+        addr += len;
+    }
+    return ranges;
+}
+
+// Partial result of distinctValues(), along with the value of the range at the
+// last step mapped so that it is not read again if unchanged.
+struct DistinctValues {
+    std::map<std::vector<u8>, u64> values;
+    // The mapped regions at the last step, nullptr before the first step.
+    std::vector<Snapshot::MappedRegion> const * regions = nullptr;
+    // The physical memory the range is mapped to at the last step.
+    std::vector<std::pair<u64, u64>> ranges;
+    // The value of the range at the last step.
+    std::vector<u8> value;
+};
+
+std::map<std::vector<u8>, u64> HistoryQuery::distinctValues(
+    u64 const offset,
+    u64 const size) const {
+    return mapReduce<DistinctValues>(
+        {},
+        [&](DistinctValues& partial, u64 const step, Snapshot const& snap) {
+            // Mapped regions are shared with the base when the page tables did
+            // not change, in which case the translation still holds.
+            std::vector<Snapshot::MappedRegion> const& regions(
+                snap.mappedRegions());
+            bool const firstStep(!partial.regions);
+            bool const remapped(&regions != partial.regions);
+            if (remapped) {
+                partial.regions = &regions;
+                partial.ranges = translate(regions, offset, size);
+            }
+            // Steps within a partial are consecutive, hence the last step is
+            // the base of this one.
+            bool const unchanged(!firstStep && !remapped &&
+                std::all_of(partial.ranges.begin(), partial.ranges.end(),
+                            [&](auto const& range) {
+                return snap.sharesPhysicalRangeWithBase(range.first,
+                                                        range.second);
+            }));
+            if (unchanged) {
+                return;
+            }
+            partial.value.clear();
+            for (auto const& [phyOff, len] : partial.ranges) {
+                std::vector<u8> const data(
+                    snap.readPhysicalMemory(phyOff, len));
+                partial.value.insert(partial.value.end(), data.begin(),
+                                     data.end());
+            }
+            partial.values.emplace(partial.value, step);
+        },
+        [](DistinctValues& result, DistinctValues&& partial) {
+            // Partials are reduced in order, the first step is kept.
+            result.values.merge(partial.values);
+        }).values;
+}
+
+std::vector<u64> HistoryQuery::pagingChanges() const {
+    return findSteps([](u64, Snapshot const& snap) {
+        return snap.pagingChangedSinceBase();
+    });
+}
+}
@@ -0,0 +1,346 @@
+#include <x86lab/instructiontable.hpp>
+#include <x86lab/nativebenchmark.hpp>
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace X86Lab {
+
+// The registers used by the benchmarks of a register class.
+struct BenchmarkRegisters {
+    // The register carrying the dependency chain of the latency benchmark.
+    char const * chain;
+    // The destinations of the throughput benchmark, used in a round-robin
+    // fashion. Instances using the same destination are dependent, there must
+    // be enough of them to cover the latency of the instruction times the
+    // number of ports executing it, hence all the free registers are used.
+    std::vector<char const *> destinations;
+    // The source of the throughput benchmark, never written.
+    char const * source;
+};
+
+// Get the registers used by the benchmarks of a register class. rax, rcx, rdx,
+// r15 and rsp are reserved for the benchmark itself.
+// @param regClass: The register class.
+// @return: The registers of this class.
+static BenchmarkRegisters const& benchmarkRegisters(
+    InstructionTable::RegisterClass const regClass) {
+    static std::map<InstructionTable::RegisterClass, BenchmarkRegisters> const
+        registers({
+        {InstructionTable::RegisterClass::Gpr64, {
+            .chain = "rbx",
+            .destinations = {"rbx", "rsi", "rdi", "rbp", "r8",
+                             "r9", "r10", "r11", "r12", "r13"},
+            .source = "r14",
+        }},
+        {InstructionTable::RegisterClass::Xmm, {
+            .chain = "xmm0",
+            .destinations = {"xmm0", "xmm1", "xmm2", "xmm3", "xmm4",
+                             "xmm5", "xmm6", "xmm7", "xmm8", "xmm9",
+                             "xmm10", "xmm11", "xmm12", "xmm13", "xmm14"},
+            .source = "xmm15",
+        }},
+        {InstructionTable::RegisterClass::Ymm, {
+            .chain = "ymm0",
+            .destinations = {"ymm0", "ymm1", "ymm2", "ymm3", "ymm4",
+                             "ymm5", "ymm6", "ymm7", "ymm8", "ymm9",
+                             "ymm10", "ymm11", "ymm12", "ymm13", "ymm14"},
+            .source = "ymm15",
+        }},
+    });
+    return registers.at(regClass);
+}
+
+// Replace the operands in the pattern of a form.
+// @param pattern: The pattern, see InstructionTable::Form.
+// @param dst: The replacement of {dst}.
+// @param src: The replacement of {src}.
+// @return: The pattern with all the operands replaced.
+static std::string instantiate(std::string const& pattern,
+                               std::string const& dst,
+                               std::string const& src) {
+    std::string res(pattern);
+    for (auto const& [operand, reg] :
+         {std::make_pair(std::string("{dst}"), dst),
+          std::make_pair(std::string("{src}"), src)}) {
+        for (size_t pos(res.find(operand)); pos != std::string::npos;
+             pos = res.find(operand, pos + reg.size())) {
+            res.replace(pos, operand.size(), reg);
+        }
+    }
+    return res;
+}
+
+std::vector<InstructionTable::Form> InstructionTable::parseForms(
+    std::istream& stream) {
+    static std::map<std::string, RegisterClass> const classes({
+        {"r64", RegisterClass::Gpr64},
+        {"xmm", RegisterClass::Xmm},
+        {"ymm", RegisterClass::Ymm},
+    });
+    static std::map<std::string, bool (*)()> const extensions({
+        {"-", nullptr},
+        {"sse", Util::Extension::hasSse},
+        {"sse2", Util::Extension::hasSse2},
+        {"sse3", Util::Extension::hasSse3},
+        {"ssse3", Util::Extension::hasSsse3},
+        {"sse4.1", Util::Extension::hasSse4_1},
+        {"sse4.2", Util::Extension::hasSse4_2},
+        {"avx", Util::Extension::hasAvx},
+        {"avx2", Util::Extension::hasAvx2},
+        {"avx512", Util::Extension::hasAvx512},
+    });
+
+    std::vector<Form> forms;
+    std::string line;
+    for (u64 lineNumber(1); std::getline(stream, line); ++lineNumber) {
+        std::istringstream iss(line);
+        std::string regClass;
+        if (!(iss >> regClass) || regClass[0] == '#') {
+            continue;
+        }
+        std::string extension;
+        std::string pattern;
+        iss >> extension >> std::ws;
+        std::getline(iss, pattern);
+        if (!classes.contains(regClass) || !extensions.contains(extension) ||
+            pattern.empty()) {
+            throw Error("Invalid instruction form on line " +
+                        std::to_string(lineNumber), 0);
+        }
+        RegisterClass const cls(classes.at(regClass));
+        forms.push_back({
+            .name = instantiate(pattern, regClass, regClass),
+            .pattern = pattern,
+            .regClass = cls,
+            .isSupported = extensions.at(extension),
+        });
+    }
+    return forms;
+}
+
+InstructionTable::Config::Config() :
+    clock(Clock::Tsc),
+    unroll(64),
+    iterations(1000),
+    repetitions(5),
+    attempts(3) {}
+
+InstructionTable::InstructionTable(Config const& config) :
+    m_config(config),
+    m_cyclesFd(-1) {
+    if (m_config.clock == Clock::CoreCycles) {
+        // Only count the cycles spent in the guest, e.g. while the calling
+        // thread is in KVM_RUN, excluding the exits to the host.
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        attr.disabled = 1;
+        attr.exclude_host = 1;
+        m_cyclesFd = ::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (m_cyclesFd == -1) {
+            throw Error("Cannot open the cycle counter", errno);
+        }
+    }
+}
+
+InstructionTable::~InstructionTable() {
+    if (m_cyclesFd != -1) {
+        ::close(m_cyclesFd);
+    }
+}
+
+InstructionTable::Entry InstructionTable::measure(Form const& form) const {
+    Entry entry({
+        .name = form.name,
+        .supported = false,
+        .noisy = false,
+        .latency = 0,
+        .throughput = 0,
+    });
+    if (!!form.isSupported && !form.isSupported()) {
+        return entry;
+    }
+    Result const latency(run(form, Benchmark::Latency));
+    Result const throughput(run(form, Benchmark::Throughput));
+    if (!latency.halted || !throughput.halted) {
+        return entry;
+    }
+    entry.supported = true;
+    if (!latency.ticks || !throughput.ticks) {
+        entry.noisy = true;
+        return entry;
+    }
+    entry.latency = *latency.ticks;
+    entry.throughput = *throughput.ticks;
+    return entry;
+}
+
+std::vector<InstructionTable::Entry> InstructionTable::measure(
+    std::vector<Form> const& forms) const {
+    std::vector<Entry> entries;
+    for (Form const& form : forms) {
+        entries.push_back(measure(form));
+    }
+    return entries;
+}
+
+std::string InstructionTable::benchmarkSource(Form const& form,
+                                              Benchmark const benchmark,
+                                              u64 const unroll) {
+    BenchmarkRegisters const& regs(benchmarkRegisters(form.regClass));
+    std::ostringstream oss;
+    oss << "BITS 64" << std::endl;
+    oss << "; " << form.name << ", "
+        << (benchmark == Benchmark::Latency ? "latency" : "throughput")
+        << " benchmark" << std::endl;
+    // Non-zero general purpose registers.
+    for (char const * const reg : {"rbx", "rsi", "rdi", "rbp", "r8", "r9",
+                                   "r10", "r11", "r12", "r13", "r14"}) {
+        oss << "mov " << reg << ", 1" << std::endl;
+    }
+    // Vector registers hold 1.0 in the precision of the instruction, which
+    // stays normal through chains of mul, div and sqrt instead of taking the
+    // special paths of zeros, NaNs or denormals. Integer instructions do not
+    // care about the value.
+    if (form.regClass != RegisterClass::Gpr64) {
+        std::string const mnemonic(
+            form.pattern.substr(0, form.pattern.find(' ')));
+        bool const isDouble(mnemonic.ends_with("pd") ||
+                            mnemonic.ends_with("sd"));
+        // VEX-encoded instructions for ymm forms, which mix neither with
+        // legacy SSE instructions.
+        std::string const v(form.regClass == RegisterClass::Ymm ? "v" : "");
+        oss << "mov rax, "
+            << (isDouble ? "0x3ff0000000000000" : "0x3f8000003f800000")
+            << std::endl;
+        oss << v << "movq xmm15, rax" << std::endl;
+        oss << v << "punpcklqdq xmm15, xmm15" << (v.empty() ? "" : ", xmm15")
+            << std::endl;
+        if (form.regClass == RegisterClass::Ymm) {
+            oss << "vinsertf128 ymm15, ymm15, xmm15, 1" << std::endl;
+        }
+        for (char const * const reg : regs.destinations) {
+            oss << v << "movaps " << reg << ", " << regs.source << std::endl;
+        }
+    }
+    oss << NativeBenchmark::readTsc(true);
+    oss << "benchLoop:" << std::endl;
+    for (u64 i(0); i < unroll; ++i) {
+        if (benchmark == Benchmark::Latency) {
+            oss << instantiate(form.pattern, regs.chain, regs.chain);
+        } else {
+            char const * const dst(
+                regs.destinations[i % regs.destinations.size()]);
+            oss << instantiate(form.pattern, dst, regs.source);
+        }
+        oss << std::endl;
+    }
+    oss << "dec rcx" << std::endl;
+    oss << "jnz benchLoop" << std::endl;
+    oss << NativeBenchmark::readTsc(false);
+    oss << "hlt" << std::endl;
+    return oss.str();
+}
+
+std::string InstructionTable::format(std::vector<Entry> const& entries,
+                                     Clock const clock) {
+    u64 nameWidth(std::string("Instruction").size());
+    for (Entry const& entry : entries) {
+        nameWidth = std::max<u64>(nameWidth, entry.name.size());
+    }
+    std::ostringstream oss;
+    oss << "# Unit: " << (clock == Clock::Tsc ? "TSC ticks" : "core cycles")
+        << ", throughput is in " << (clock == Clock::Tsc ? "ticks" : "cycles")
+        << " per instruction" << std::endl;
+    oss << std::left << std::setw(nameWidth) << "Instruction" << std::right
+        << std::setw(12) << "Latency" << std::setw(12) << "Throughput"
+        << std::endl;
+    for (Entry const& entry : entries) {
+        oss << std::left << std::setw(nameWidth) << entry.name << std::right;
+        if (entry.noisy) {
+            oss << std::setw(24) << "noisy";
+        } else if (entry.supported) {
+            oss << std::fixed << std::setprecision(2)
+                << std::setw(12) << entry.latency
+                << std::setw(12) << entry.throughput;
+        } else {
+            oss << std::setw(24) << "unsupported";
+        }
+        oss << std::endl;
+    }
+    return oss.str();
+}
+
+InstructionTable::Result InstructionTable::run(
+    Form const& form,
+    Benchmark const benchmark) const {
+    std::unique_ptr<Code const> const code(NativeBenchmark::assemble(
+        benchmarkSource(form, benchmark, m_config.unroll)));
+
+    // A fresh Vm for each benchmark, a previous benchmark might have left the
+    // vCpu in a bad state.
+    Vm vm(Vm::CpuMode::LongMode, 4 * PAGE_SIZE, m_config.placement);
+    for (u64 attempt(0); attempt < m_config.attempts; ++attempt) {
+        std::optional<u64> shortest;
+        std::optional<u64> longest;
+        for (u64 i(0); i < m_config.repetitions; ++i) {
+            std::optional<u64> const shortRun(
+                runOnce(vm, *code, m_config.iterations));
+            std::optional<u64> const longRun(
+                runOnce(vm, *code, 2 * m_config.iterations));
+            if (!shortRun || !longRun) {
+                return Result({.halted = false, .ticks = std::nullopt});
+            }
+            shortest = std::min(shortest.value_or(*shortRun), *shortRun);
+            longest = std::min(longest.value_or(*longRun), *longRun);
+        }
+        // A long run that is not slower than the short run, e.g. 0 ticks per
+        // instance, is noise.
+        if (!!shortest && *shortest < *longest) {
+            return Result({
+                .halted = true,
+                .ticks = static_cast<double>(*longest - *shortest) /
+                    (m_config.iterations * m_config.unroll),
+            });
+        }
+        // No repetition, or too much noise to tell anything.
+    }
+    return Result({.halted = true, .ticks = std::nullopt});
+}
+
+std::optional<u64> InstructionTable::runOnce(Vm& vm,
+                                             Code const& code,
+                                             u64 const iterations) const {
+    // The counter excludes the host, loading the code is not counted.
+    if (m_cyclesFd != -1) {
+        ::ioctl(m_cyclesFd, PERF_EVENT_IOC_RESET, 0);
+        ::ioctl(m_cyclesFd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    std::optional<u64> const ticks(NativeBenchmark::run(vm, code,
+        [&](Vm::State::Registers& regs) {
+            regs.rcx = iterations;
+        }));
+    if (m_cyclesFd != -1) {
+        ::ioctl(m_cyclesFd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    if (!ticks) {
+        return std::nullopt;
+    }
+    if (m_cyclesFd != -1) {
+        u64 cycles;
+        if (::read(m_cyclesFd, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+            throw Error("Cannot read the cycle counter", errno);
+        }
+        return cycles;
+    } else {
+        return *ticks;
+    }
+}
+}
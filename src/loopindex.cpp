@@ -0,0 +1,155 @@
+#include <x86lab/loopindex.hpp>
+#include <algorithm>
+
+namespace X86Lab {
+
+LoopIndex::LoopIndex() :
+    m_size(0),
+    m_numIterations(0),
+    m_numActivations(0) {}
+
+void LoopIndex::append(Snapshot::Registers const& regs) {
+    u64 const step(m_size);
+    u64 const rip(regs.rip);
+    if (!!step) {
+        // Exit the loops left by this step, innermost first. Deeper frames,
+        // e.g. a call from the body, are still part of the loop.
+        while (!m_active.empty()) {
+            ActiveLoop const& active(m_active.back());
+            Loop const& loop(m_loops[active.loop]);
+            bool const returned(active.rsp < regs.rsp);
+            bool const left(active.rsp == regs.rsp &&
+                            (rip < loop.header || loop.latch < rip));
+            if (!returned && !left) {
+                break;
+            }
+            exitInnermost(step);
+        }
+
+        bool const backEdge(rip <= m_prevRegs.rip &&
+                            regs.rsp == m_prevRegs.rsp &&
+                            regs.cs == m_prevRegs.cs);
+        if (backEdge) {
+            if (!m_active.empty() &&
+                m_loops[m_active.back().loop].header == rip) {
+                // Next iteration of the innermost loop.
+                Loop& loop(m_loops[m_active.back().loop]);
+                loop.latch = std::max(loop.latch, m_prevRegs.rip);
+                loop.iterationStarts.push_back(step);
+                loop.activations.back().numIterations ++;
+                m_numIterations ++;
+                m_active.back().rsp = regs.rsp;
+            } else {
+                // New activation, the first iteration started at the last
+                // visit of the header.
+                auto const [it, inserted](m_loopByHeader.emplace(
+                    rip, m_loops.size()));
+                if (inserted) {
+                    m_loops.push_back(Loop({
+                        .header = rip,
+                        .latch = m_prevRegs.rip,
+                        .iterationStarts = {},
+                        .activations = {},
+                    }));
+                }
+                Loop& loop(m_loops[it->second]);
+                loop.latch = std::max(loop.latch, m_prevRegs.rip);
+                Activation activation({
+                    .firstIteration = loop.iterationStarts.size(),
+                    .numIterations = 1,
+                    .end = std::nullopt,
+                });
+                // Loops entered by jumping into their body, e.g. to a
+                // condition at the bottom, do not visit the header before. A
+                // visit prior to the previous activation or to the current
+                // iteration of the enclosing loop is not part of this one.
+                auto const lastVisit(m_lastVisit.find(rip));
+                bool const entered(lastVisit != m_lastVisit.end() &&
+                    (loop.activations.empty() ||
+                     (!!loop.activations.back().end &&
+                      *loop.activations.back().end <= lastVisit->second)) &&
+                    (m_active.empty() ||
+                     m_loops[m_active.back().loop].iterationStarts.back() <=
+                        lastVisit->second));
+                if (entered) {
+                    loop.iterationStarts.push_back(lastVisit->second);
+                    activation.numIterations ++;
+                }
+                loop.iterationStarts.push_back(step);
+                loop.activations.push_back(activation);
+                m_numIterations += activation.numIterations;
+                m_numActivations ++;
+                m_active.push_back(ActiveLoop({
+                    .loop = it->second,
+                    .rsp = regs.rsp,
+                }));
+            }
+        }
+    }
+    m_lastVisit[rip] = step;
+    m_prevRegs = regs;
+    m_size ++;
+}
+
+void LoopIndex::exitInnermost(u64 const step) {
+    m_loops[m_active.back().loop].activations.back().end = step;
+    m_active.pop_back();
+}
+
+u64 LoopIndex::size() const {
+    return m_size;
+}
+
+std::vector<LoopIndex::Loop> const& LoopIndex::loops() const {
+    return m_loops;
+}
+
+u64 LoopIndex::storageBytes() const {
+    return m_loops.size() * sizeof(Loop) +
+        m_numIterations * sizeof(u64) +
+        m_numActivations * sizeof(Activation) +
+        m_loopByHeader.size() * sizeof(decltype(m_loopByHeader)::value_type) +
+        m_lastVisit.size() * sizeof(decltype(m_lastVisit)::value_type) +
+        m_active.size() * sizeof(ActiveLoop);
+}
+
+LoopIndex::Iteration LoopIndex::iteration(u64 const loopIndex,
+                                          u64 const index) const {
+    Loop const& loop(m_loops[loopIndex]);
+    // Find the activation of the iteration.
+    auto const activation(std::prev(std::upper_bound(
+        loop.activations.begin(), loop.activations.end(), index,
+        [](u64 const i, Activation const& act) {
+            return i < act.firstIteration;
+        })));
+    bool const last(index + 1 ==
+        activation->firstIteration + activation->numIterations);
+    return Iteration({
+        .loop = loopIndex,
+        .index = index,
+        .activation = static_cast<u64>(activation - loop.activations.begin()),
+        .activationIndex = index - activation->firstIteration,
+        .start = loop.iterationStarts[index],
+        .end = last ? activation->end
+                    : std::optional<u64>(loop.iterationStarts[index + 1]),
+    });
+}
+
+std::optional<LoopIndex::Iteration> LoopIndex::iterationAt(
+    u64 const step) const {
+    std::optional<Iteration> innermost;
+    for (u64 i(0); i < m_loops.size(); ++i) {
+        std::vector<u64> const& starts(m_loops[i].iterationStarts);
+        auto const it(std::upper_bound(starts.begin(), starts.end(), step));
+        if (it == starts.begin()) {
+            continue;
+        }
+        Iteration const iter(iteration(i, it - starts.begin() - 1));
+        bool const contains(!iter.end || step < *iter.end);
+        if (contains && (!innermost || innermost->start < iter.start)) {
+            innermost = iter;
+        }
+    }
+    return innermost;
+}
+}
@@ -0,0 +1,363 @@
+#include <x86lab/memoryprofile.hpp>
+#include <x86lab/nativebenchmark.hpp>
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <x86intrin.h>
+
+namespace X86Lab {
+
+// The number of entries in a page table, at any level.
+static constexpr u64 EntriesPerTable = 512;
+
+// Get the level of the page tables holding the leaf entries for a page size.
+// @param pageSize: The page size, 4KiB, 2MiB or 1GiB.
+// @return: 1 for the PT, 2 for the PD, 3 for the PDPT.
+static u64 leafLevel(u64 const pageSize) {
+    return pageSize == (1ULL << 30) ? 3 : (pageSize == (1ULL << 21) ? 2 : 1);
+}
+
+// Get the size of the memory covered by a single table at a level, e.g. 2MiB
+// for a PT.
+// @param level: The level of the table, 1 for the PT up to 4 for the PML4.
+// @return: The size in bytes.
+static u64 tableCoverage(u64 const level) {
+    return PAGE_SIZE << (9 * level);
+}
+
+// Compute the number of tables needed to map a range of memory starting at 0.
+// @param mappedSize: The size of the range in bytes.
+// @param pageSize: The page size of the mapping.
+// @return: The number of tables, including the PML4.
+static u64 numPageTables(u64 const mappedSize, u64 const pageSize) {
+    u64 num(0);
+    for (u64 level(leafLevel(pageSize)); level <= 4; ++level) {
+        u64 const coverage(tableCoverage(level));
+        num += (mappedSize + coverage - 1) / coverage;
+    }
+    return num;
+}
+
+// Measure the frequency of the TSC against the steady clock.
+// @return: The frequency in GHz, e.g. ticks per nanosecond.
+static double measureTscFrequency() {
+    auto const start(std::chrono::steady_clock::now());
+    u64 const startTsc(__rdtsc());
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    u64 const endTsc(__rdtsc());
+    auto const end(std::chrono::steady_clock::now());
+    double const ns(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        end - start).count());
+    return (endTsc - startTsc) / ns;
+}
+
+MemoryProfile::Config::Config() :
+    pageSize(PAGE_SIZE),
+    minSize(1 << 10),
+    maxSize(256 << 20),
+    maxTlbPages(16384),
+    minLoads(1 << 20),
+    minBytes(256 << 20),
+    memoryType(Vm::MemoryType::WriteBack) {}
+
+MemoryProfile::MemoryProfile(Config const& config) :
+    m_config(config),
+    m_bufferAddr(config.pageSize),
+    m_bufferSize((config.maxSize + config.pageSize - 1) / config.pageSize *
+                 config.pageSize),
+    m_tscFrequency(0) {
+    auto const isPowerOfTwo([](u64 const v) { return !!v && !(v & (v - 1)); });
+    if (m_config.pageSize != PAGE_SIZE && m_config.pageSize != (1ULL << 21) &&
+        m_config.pageSize != (1ULL << 30)) {
+        throw Error("Page size must be 4KiB, 2MiB or 1GiB", 0);
+    } else if (m_config.pageSize == (1ULL << 30) &&
+               !Util::Extension::hasPage1Gb()) {
+        throw Error("1GiB pages are not supported by the host", 0);
+    } else if (!isPowerOfTwo(m_config.minSize) || m_config.minSize < 1024 ||
+               !isPowerOfTwo(m_config.maxSize) ||
+               m_config.maxSize < m_config.minSize ||
+               !isPowerOfTwo(m_config.maxTlbPages)) {
+        throw Error("Invalid memory profile sizes", 0);
+    }
+
+    // Layout of the guest's memory: the code at 0 in the first page, the
+    // working sets starting at the second page, then the page tables.
+    u64 const mappedSize(m_bufferAddr + m_bufferSize);
+    u64 const tablesSize(numPageTables(mappedSize, m_config.pageSize) *
+                         PAGE_SIZE);
+    Vm::Placement placement(m_config.placement);
+    placement.hugePages = placement.hugePages || m_config.pageSize != PAGE_SIZE;
+    m_vm = std::make_unique<Vm>(Vm::CpuMode::LongMode,
+                                mappedSize + tablesSize,
+                                placement);
+    Vm::State::Registers regs(m_vm->getRegisters());
+    regs.cr3 = buildPageTables();
+    m_vm->setRegisters(regs);
+    m_vm->setMemoryType(m_bufferAddr, m_bufferSize, m_config.memoryType);
+    m_tscFrequency = measureTscFrequency();
+}
+
+MemoryProfile::Results MemoryProfile::run(
+    std::function<void(std::string const&)> const& progress) {
+    auto const report([&](std::string const& what, u64 const size) {
+        if (!!progress) {
+            progress("Measuring " + what + " " + std::to_string(size));
+        }
+    });
+    Results results({
+        .pageSize = m_config.pageSize,
+        .hostPageSize = PAGE_SIZE,
+        .memoryType = m_config.memoryType,
+        .memoryTypeHonored =
+            m_config.memoryType == Vm::MemoryType::WriteBack ||
+            m_vm->honorsMemoryTypes(),
+        .tscFrequency = m_tscFrequency,
+        .latency = {},
+        .readBandwidth = {},
+        .writeBandwidth = {},
+        .streamingWriteBandwidth = {},
+        .copyBandwidth = {},
+        .tlbLatency = {},
+    });
+
+    // One node per cache line of the working set.
+    u64 const lineSize(64);
+    for (u64 size(m_config.minSize); size <= m_config.maxSize; size *= 2) {
+        report("latency, bytes:", size);
+        std::vector<u64> nodes(size / lineSize);
+        for (u64 i(0); i < nodes.size(); ++i) {
+            nodes[i] = m_bufferAddr + i * lineSize;
+        }
+        results.latency.push_back({size, measureLatency(nodes)});
+    }
+
+    for (auto const& [benchmark, name, curve] : {
+        std::make_tuple(Benchmark::Read, "read", &results.readBandwidth),
+        std::make_tuple(Benchmark::Write, "write", &results.writeBandwidth),
+        std::make_tuple(Benchmark::StreamingWrite, "streaming write",
+                        &results.streamingWriteBandwidth),
+        std::make_tuple(Benchmark::Copy, "copy", &results.copyBandwidth)}) {
+        for (u64 size(m_config.minSize); size <= m_config.maxSize; size *= 2) {
+            report(std::string(name) + " bandwidth, bytes:", size);
+            curve->push_back({size, measureBandwidth(benchmark, size)});
+        }
+    }
+
+    // One node per page, at a random cache line in the page. Using the same
+    // offset in all pages would map all the nodes to the same cache sets.
+    std::mt19937_64 rng(0);
+    u64 const linesPerPage(m_config.pageSize / lineSize);
+    u64 const maxPages(std::min(m_config.maxTlbPages,
+                                m_bufferSize / m_config.pageSize));
+    for (u64 numPages(1); numPages <= maxPages; numPages *= 2) {
+        report("TLB latency, pages:", numPages);
+        std::vector<u64> nodes(numPages);
+        for (u64 i(0); i < numPages; ++i) {
+            nodes[i] = m_bufferAddr + i * m_config.pageSize +
+                (rng() % linesPerPage) * lineSize;
+        }
+        results.tlbLatency.push_back({numPages, measureLatency(nodes)});
+    }
+
+    // The working sets were all touched, the huge pages, if any, were
+    // allocated. Their page size is that of the host's transparent huge pages.
+    if (m_vm->hugePageBytes() >= m_bufferSize) {
+        results.hostPageSize = 1 << 21;
+    }
+    return results;
+}
+
+std::string MemoryProfile::toCsv(Results const& results) {
+    std::ostringstream oss;
+    oss << "benchmark,page_size,size,value,unit" << std::endl;
+    for (auto const& [name, curve, unit] : {
+        std::make_tuple("latency", &results.latency, "ns"),
+        std::make_tuple("read", &results.readBandwidth, "GB/s"),
+        std::make_tuple("write", &results.writeBandwidth, "GB/s"),
+        std::make_tuple("stream_write", &results.streamingWriteBandwidth,
+                        "GB/s"),
+        std::make_tuple("copy", &results.copyBandwidth, "GB/s"),
+        std::make_tuple("tlb", &results.tlbLatency, "ns")}) {
+        for (Point const& point : *curve) {
+            oss << name << "," << results.pageSize << "," << point.size << ","
+                << point.value << "," << unit << std::endl;
+        }
+    }
+    return oss.str();
+}
+
+std::string MemoryProfile::benchmarkSource(Benchmark const benchmark) {
+    std::ostringstream oss;
+    oss << "BITS 64" << std::endl;
+
+    if (benchmark == Benchmark::PointerChase) {
+        // rbx: the first node, r8: the number of nodes, r9: the number of
+        // timed loads, a multiple of 8.
+        oss << "warmup:" << std::endl;
+        oss << "mov rbx, [rbx]" << std::endl;
+        oss << "dec r8" << std::endl;
+        oss << "jnz warmup" << std::endl;
+        oss << NativeBenchmark::readTsc(true);
+        oss << "chase:" << std::endl;
+        for (u64 i(0); i < 8; ++i) {
+            oss << "mov rbx, [rbx]" << std::endl;
+        }
+        oss << "sub r9, 8" << std::endl;
+        oss << "jnz chase" << std::endl;
+        oss << NativeBenchmark::readTsc(false);
+        oss << "hlt" << std::endl;
+        return oss.str();
+    }
+
+    // rbx: the working set, r9: the number of bytes per pass, a multiple of
+    // 64, r8: the number of timed passes. Copies move r9 bytes from rbx to
+    // rbp.
+    // Emit a loop doing r14 passes over the working set.
+    auto const passes([&](std::string const& label) {
+        oss << label << "Pass:" << std::endl;
+        if (benchmark == Benchmark::Copy) {
+            oss << "mov rsi, rbx" << std::endl;
+            oss << "mov rdi, rbp" << std::endl;
+            oss << "mov rcx, r9" << std::endl;
+            oss << "rep movsb" << std::endl;
+        } else {
+            oss << "mov rdi, rbx" << std::endl;
+            oss << "mov rcx, r9" << std::endl;
+            oss << label << "Loop:" << std::endl;
+            // Independent accesses to each quadword of a cache line.
+            char const * const regs[] = {"r10", "r11", "r12", "r13"};
+            for (u64 i(0); i < 8; ++i) {
+                if (benchmark == Benchmark::Read) {
+                    oss << "mov " << regs[i % 4] << ", [rdi + " << i * 8
+                        << "]" << std::endl;
+                } else if (benchmark == Benchmark::StreamingWrite) {
+                    oss << "movnti [rdi + " << i * 8 << "], " << regs[i % 4]
+                        << std::endl;
+                } else {
+                    oss << "mov [rdi + " << i * 8 << "], " << regs[i % 4]
+                        << std::endl;
+                }
+            }
+            oss << "add rdi, 64" << std::endl;
+            oss << "sub rcx, 64" << std::endl;
+            oss << "jnz " << label << "Loop" << std::endl;
+        }
+        oss << "dec r14" << std::endl;
+        oss << "jnz " << label << "Pass" << std::endl;
+    });
+    oss << "mov r14, 1" << std::endl;
+    passes("warmup");
+    oss << NativeBenchmark::readTsc(true);
+    oss << "mov r14, r8" << std::endl;
+    passes("timed");
+    if (benchmark == Benchmark::StreamingWrite) {
+        // Non-temporal stores are weakly ordered, wait for all of them to be
+        // globally visible.
+        oss << "sfence" << std::endl;
+    }
+    oss << NativeBenchmark::readTsc(false);
+    oss << "hlt" << std::endl;
+    return oss.str();
+}
+
+u64 MemoryProfile::buildPageTables() {
+    // The tables are placed right after the working sets, table i of level l
+    // is at tablesAddr + (levelFirstTable[l] + i) * PAGE_SIZE.
+    u64 const mappedSize(m_bufferAddr + m_bufferSize);
+    u64 const tablesAddr(mappedSize);
+    u64 const leaf(leafLevel(m_config.pageSize));
+    std::vector<u64> levelFirstTable(5, 0);
+    u64 numTables(0);
+    for (u64 level(4); leaf <= level; --level) {
+        levelFirstTable[level] = numTables;
+        u64 const coverage(tableCoverage(level));
+        numTables += (mappedSize + coverage - 1) / coverage;
+    }
+    std::vector<u64> tables(numTables * EntriesPerTable, 0);
+
+    // Present and writable.
+    u64 const flags(0x3);
+    // Page Size bit, for the leaves of the PD and PDPT.
+    u64 const pageSizeBit(leaf > 1 ? (1 << 7) : 0);
+    for (u64 addr(0); addr < mappedSize; addr += m_config.pageSize) {
+        for (u64 level(4); leaf <= level; --level) {
+            u64 const table(levelFirstTable[level] +
+                            addr / tableCoverage(level));
+            u64 const index((addr / tableCoverage(level - 1)) %
+                            EntriesPerTable);
+            u64 entry;
+            if (level == leaf) {
+                entry = addr | pageSizeBit | flags;
+            } else {
+                u64 const next(levelFirstTable[level - 1] +
+                               addr / tableCoverage(level - 1));
+                entry = (tablesAddr + next * PAGE_SIZE) | flags;
+            }
+            tables[table * EntriesPerTable + index] = entry;
+        }
+    }
+    m_vm->writePhysicalMemory(tablesAddr,
+                              tables.data(),
+                              tables.size() * sizeof(u64));
+    return tablesAddr + levelFirstTable[4] * PAGE_SIZE;
+}
+
+u64 MemoryProfile::writeChain(std::vector<u64> const& nodes) {
+    std::vector<u64> order(nodes.size());
+    std::iota(order.begin(), order.end(), 0);
+    // Same seed for every run so that the profiles of different hosts are
+    // measured with the same chains.
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(nodes.size()));
+    for (u64 i(0); i < order.size(); ++i) {
+        u64 const next(nodes[order[(i + 1) % order.size()]]);
+        m_vm->writePhysicalMemory(nodes[order[i]], &next, sizeof(next));
+    }
+    return nodes[order[0]];
+}
+
+u64 MemoryProfile::runBenchmark(
+    Benchmark const benchmark,
+    std::function<void(Vm::State::Registers&)> const& setParams) {
+    if (!m_code.contains(benchmark)) {
+        m_code[benchmark] =
+            NativeBenchmark::assemble(benchmarkSource(benchmark));
+    }
+    std::optional<u64> const ticks(
+        NativeBenchmark::run(*m_vm, *m_code.at(benchmark), setParams));
+    if (!ticks) {
+        throw Error("Memory benchmark did not run to completion", 0);
+    }
+    return *ticks;
+}
+
+double MemoryProfile::measureLatency(std::vector<u64> const& nodes) {
+    u64 const first(writeChain(nodes));
+    u64 const numLoads((std::max<u64>(m_config.minLoads, nodes.size()) + 7) /
+                       8 * 8);
+    u64 const ticks(runBenchmark(Benchmark::PointerChase,
+                                 [&](Vm::State::Registers& regs) {
+        regs.rbx = first;
+        regs.r8 = nodes.size();
+        regs.r9 = numLoads;
+    }));
+    return ticks / m_tscFrequency / numLoads;
+}
+
+double MemoryProfile::measureBandwidth(Benchmark const benchmark,
+                                       u64 const size) {
+    // Copies move the first half of the working set to the second half.
+    u64 const bytesPerPass(benchmark == Benchmark::Copy ? size / 2 : size);
+    u64 const numPasses(std::max<u64>(1, m_config.minBytes / bytesPerPass));
+    u64 const ticks(runBenchmark(benchmark, [&](Vm::State::Registers& regs) {
+        regs.rbx = m_bufferAddr;
+        regs.rbp = m_bufferAddr + bytesPerPass;
+        regs.r8 = numPasses;
+        regs.r9 = bytesPerPass;
+    }));
+    // Bytes per nanosecond, e.g. GB/s.
+    return bytesPerPass * numPasses / (ticks / m_tscFrequency);
+}
+}
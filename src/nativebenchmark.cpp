@@ -0,0 +1,42 @@
+#include <x86lab/nativebenchmark.hpp>
+#include <fstream>
+#include <sstream>
+
+namespace X86Lab::NativeBenchmark {
+std::unique_ptr<Code const> assemble(std::string const& source) {
+    Util::TempFile file("/tmp/x86lab_benchmark");
+    std::ofstream stream(file.ostream());
+    if (!stream) {
+        throw Error("Cannot open temporary file", errno);
+    }
+    stream << source;
+    stream.close();
+    return std::make_unique<Code const>(file.path());
+}
+
+std::string readTsc(bool const start) {
+    std::ostringstream oss;
+    oss << "lfence" << std::endl;
+    oss << "rdtsc" << std::endl;
+    oss << "shl rdx, 32" << std::endl;
+    oss << "or rax, rdx" << std::endl;
+    oss << (start ? "mov r15, rax" : "sub rax, r15") << std::endl;
+    return oss.str();
+}
+
+std::optional<u64> run(
+    Vm& vm,
+    Code const& code,
+    std::function<void(Vm::State::Registers&)> const& setParams) {
+    vm.loadCode(code);
+    Vm::State::Registers regs(vm.getRegisters());
+    setParams(regs);
+    vm.setRegisters(regs);
+    // The breakpoint at the end of the code is never reached, the benchmark
+    // runs natively until the hlt.
+    if (vm.runUntil(code.size()) != Vm::OperatingState::Halted) {
+        return std::nullopt;
+    }
+    return vm.getRegisters().rax;
+}
+}
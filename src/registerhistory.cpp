@@ -0,0 +1,200 @@
+#include <x86lab/registerhistory.hpp>
+#include <algorithm>
+#include <cassert>
+#include <functional>
+
+namespace X86Lab {
+
+std::map<RegisterHistory::Register, std::string> const
+RegisterHistory::registerNames = {
+    {Register::Rax, "rax"}, {Register::Rbx, "rbx"},
+    {Register::Rcx, "rcx"}, {Register::Rdx, "rdx"},
+    {Register::Rdi, "rdi"}, {Register::Rsi, "rsi"},
+    {Register::Rsp, "rsp"}, {Register::Rbp, "rbp"},
+    {Register::R8, "r8"}, {Register::R9, "r9"},
+    {Register::R10, "r10"}, {Register::R11, "r11"},
+    {Register::R12, "r12"}, {Register::R13, "r13"},
+    {Register::R14, "r14"}, {Register::R15, "r15"},
+    {Register::Rip, "rip"}, {Register::Rflags, "rflags"},
+    {Register::Cs, "cs"}, {Register::Ds, "ds"},
+    {Register::Es, "es"}, {Register::Fs, "fs"},
+    {Register::Gs, "gs"}, {Register::Ss, "ss"},
+    {Register::Cr0, "cr0"}, {Register::Cr2, "cr2"},
+    {Register::Cr3, "cr3"}, {Register::Cr4, "cr4"},
+    {Register::Cr8, "cr8"}, {Register::Efer, "efer"},
+};
+
+std::map<RegisterHistory::Comparison, std::string> const
+RegisterHistory::comparisonNames = {
+    {Comparison::Equal, "=="},
+    {Comparison::NotEqual, "!="},
+    {Comparison::Less, "<"},
+    {Comparison::LessEqual, "<="},
+    {Comparison::Greater, ">"},
+    {Comparison::GreaterEqual, ">="},
+};
+
+// Extract the values of all the tracked registers, in the order of the
+// Register enum.
+// @param regs: The registers to extract the values from.
+// @return: The value of each register.
+static std::array<u64, RegisterHistory::NumRegisters> extract(
+    Snapshot::Registers const& regs) {
+    return {
+        regs.rax, regs.rbx, regs.rcx, regs.rdx,
+        regs.rdi, regs.rsi, regs.rsp, regs.rbp,
+        regs.r8, regs.r9, regs.r10, regs.r11,
+        regs.r12, regs.r13, regs.r14, regs.r15,
+        regs.rip, regs.rflags,
+        regs.cs, regs.ds, regs.es, regs.fs, regs.gs, regs.ss,
+        regs.cr0, regs.cr2, regs.cr3, regs.cr4, regs.cr8, regs.efer,
+    };
+}
+
+// Find the first value in an array satisfying a comparison.
+// The array is processed in fixed-size chunks. Within a chunk there is no early
+// exit, only an OR-reduction of the comparisons, which the compiler turns into
+// SIMD compares. Only once a chunk is known to contain a match is it re-scanned
+// element by element to find its index.
+// @param values: The values to scan.
+// @param size: The number of values.
+// @param value: The value to compare against, on the right-hand side.
+// @param cmp: The comparison.
+// @return: The index of the first match, or size if there is no match.
+template<typename Cmp>
+static u64 scan(u64 const * const values,
+                u64 const size,
+                u64 const value,
+                Cmp const cmp) {
+    // 8 cache lines worth of values.
+    static constexpr u64 chunkSize = 64;
+    u64 i(0);
+    for (; i + chunkSize <= size; i += chunkSize) {
+        bool found(false);
+        for (u64 j(0); j < chunkSize; ++j) {
+            found |= cmp(values[i + j], value);
+        }
+        if (found) {
+            break;
+        }
+    }
+    for (; i < size; ++i) {
+        if (cmp(values[i], value)) {
+            return i;
+        }
+    }
+    return size;
+}
+
+RegisterHistory::RegisterHistory() : m_size(0) {}
+
+void RegisterHistory::append(Snapshot::Registers const& regs) {
+    std::array<u64, NumRegisters> const values(extract(regs));
+    for (u64 i(0); i < NumRegisters; ++i) {
+        Column& column(m_columns[i]);
+        if (column.values.empty() || column.values.back() != values[i]) {
+            column.starts.push_back(m_size);
+            column.values.push_back(values[i]);
+        }
+    }
+    m_size ++;
+}
+
+u64 RegisterHistory::size() const {
+    return m_size;
+}
+
+u64 RegisterHistory::value(Register const reg, u64 const step) const {
+    Column const& column(m_columns[static_cast<u64>(reg)]);
+    return column.values[runIndex(column, step)];
+}
+
+std::optional<u64> RegisterHistory::findFirst(Register const reg,
+                                              Comparison const cmp,
+                                              u64 const value,
+                                              u64 const fromStep) const {
+    if (fromStep >= m_size) {
+        return std::nullopt;
+    }
+    Column const& column(m_columns[static_cast<u64>(reg)]);
+    // The run containing fromStep is only partially in the searched range,
+    // hence the result is at least fromStep.
+    u64 const firstRun(runIndex(column, fromStep));
+    u64 const * const values(column.values.data() + firstRun);
+    u64 const numValues(column.values.size() - firstRun);
+    u64 idx;
+    switch (cmp) {
+        case Comparison::Equal:
+            idx = scan(values, numValues, value, std::equal_to<u64>());
+            break;
+        case Comparison::NotEqual:
+            idx = scan(values, numValues, value, std::not_equal_to<u64>());
+            break;
+        case Comparison::Less:
+            idx = scan(values, numValues, value, std::less<u64>());
+            break;
+        case Comparison::LessEqual:
+            idx = scan(values, numValues, value, std::less_equal<u64>());
+            break;
+        case Comparison::Greater:
+            idx = scan(values, numValues, value, std::greater<u64>());
+            break;
+        case Comparison::GreaterEqual:
+            idx = scan(values, numValues, value, std::greater_equal<u64>());
+            break;
+        default:
+            throw Error("Invalid comparison", 0);
+    }
+    if (idx == numValues) {
+        return std::nullopt;
+    }
+    return std::max(column.starts[firstRun + idx], fromStep);
+}
+
+std::vector<u64> RegisterHistory::sample(Register const reg,
+                                         u64 const first,
+                                         u64 const last,
+                                         u64 const maxSamples) const {
+    assert(first <= last && last < m_size);
+    Column const& column(m_columns[static_cast<u64>(reg)]);
+    u64 const numSteps(last - first + 1);
+    u64 const numSamples(std::min(numSteps, maxSamples));
+    std::vector<u64> res;
+    res.reserve(numSamples);
+    // Steps are increasing, hence the run index can only move forward. Avoids
+    // a binary search per sample.
+    u64 run(runIndex(column, first));
+    for (u64 i(0); i < numSamples; ++i) {
+        u64 const step(first + (numSamples == 1 ? 0 :
+                                i * (numSteps - 1) / (numSamples - 1)));
+        while (run + 1 < column.starts.size() &&
+               column.starts[run + 1] <= step) {
+            run ++;
+        }
+        res.push_back(column.values[run]);
+    }
+    return res;
+}
+
+u64 RegisterHistory::numRuns(Register const reg) const {
+    return m_columns[static_cast<u64>(reg)].values.size();
+}
+
+u64 RegisterHistory::storageBytes() const {
+    u64 bytes(0);
+    for (Column const& column : m_columns) {
+        bytes += (column.starts.size() + column.values.size()) * sizeof(u64);
+    }
+    return bytes;
+}
+
+u64 RegisterHistory::runIndex(Column const& column, u64 const step) {
+    assert(!column.starts.empty());
+    // Find the last run starting at or before step. The first run always
+    // starts at step 0 so this is always valid.
+    auto const it(std::upper_bound(column.starts.begin(),
+                                   column.starts.end(),
+                                   step));
+    return std::distance(column.starts.begin(), it) - 1;
+}
+}
@@ -3,18 +3,48 @@
 namespace X86Lab {
 Runner::Runner(std::shared_ptr<Vm> const vm,
                std::shared_ptr<Code const> const code,
-               std::shared_ptr<Ui::Backend> const ui) :
+               std::shared_ptr<Ui::Backend> const ui,
+               bool const repStringStepping,
+               bool const workingSetTracking,
+               u64 const historyQuota) :
     m_vm(vm),
     m_code(code),
     m_ui(ui),
-    m_historyIndex(0) {
+    m_historyIndex(0),
+    m_historyQuota(historyQuota),
+    m_historyBytes(0),
+    m_registerHistory(new RegisterHistory()),
+    m_loopIndex(new LoopIndex()),
+    m_repStringStepping(repStringStepping),
+    m_workingSetTracking(workingSetTracking),
+    m_fullSnapshotPending(false),
+    m_analysisCancelled(new std::atomic<bool>(false)),
+    m_compressor(new HistoryCompressor()),
+    m_nextToCompress(0) {
     if (m_vm->operatingState() == Vm::OperatingState::NoCodeLoaded) {
         m_vm->loadCode(*m_code);
     }
 
+    if (m_workingSetTracking) {
+        // Only report the pages touched from now on. This clears the accessed
+        // and dirty bits, hence must be done before taking the snapshot.
+        m_vm->scanWorkingSet();
+    }
+
     // Setup the base snapshot.
     m_history.push_back(
         std::shared_ptr<Snapshot>(new Snapshot(m_vm->getState())));
+    m_historyBytes = sizeof(Snapshot) + sizeof(Vm::State::ExtendedState) +
+        m_history.back()->storageStats().leafBytes;
+    m_registerHistory->append(m_history.back()->registers());
+    m_loopIndex->append(m_history.back()->registers());
+
+    m_workingSetHistory = std::make_shared<WorkingSetHistory>(
+        m_history.back()->physicalMemorySize() / PAGE_SIZE);
+}
+
+Runner::~Runner() {
+    *m_analysisCancelled = true;
 }
 
 Runner::ReturnReason Runner::run() {
@@ -54,21 +84,76 @@ Runner::ReturnReason Runner::run() {
     }
 }
 
+bool Runner::repStringStepping() const {
+    return m_repStringStepping;
+}
+
+bool Runner::workingSetTracking() const {
+    return m_workingSetTracking;
+}
+
 void Runner::updateUi() {
     assert(m_historyIndex < m_history.size());
     m_ui->update(Ui::State(m_vm->operatingState(),
                            m_code,
-                           m_history[m_historyIndex]));
+                           m_history[m_historyIndex],
+                           m_registerHistory,
+                           m_historyIndex,
+                           m_workingSetHistory,
+                           m_memoryProfile,
+                           m_loopIndex,
+                           m_dependencyGraph));
+}
+
+u64 Runner::historyBytes() const {
+    return m_historyBytes + m_registerHistory->storageBytes() +
+        m_loopIndex->storageBytes() + m_workingSetHistory->storageBytes();
+}
+
+std::optional<u64> Runner::registerOnlyNextRip() {
+    Vm::CpuMode const mode(m_vm->cpuMode());
+    std::unique_ptr<Disassembler>& disasm(m_disassemblers[mode]);
+    if (!disasm) {
+        disasm = std::make_unique<Disassembler>(mode);
+    }
+    return disasm->registerOnlyNextRip(*m_vm);
 }
 
-void Runner::updateLastSnapshot() {
+void Runner::updateLastSnapshot(std::optional<u64> const registerOnlyNextRip) {
     // Adding a new snapshot can only be done if we are running the vm, eg. not
     // looking at an old state.
     assert(m_historyIndex == m_history.size() - 1);
-    std::shared_ptr<Snapshot> const nextSnapshot(
-        ::new Snapshot(m_history[m_historyIndex], m_vm->getState()));
+    std::shared_ptr<Snapshot> const base(m_history[m_historyIndex]);
+    std::shared_ptr<Snapshot> const nextSnapshot(m_fullSnapshotPending ?
+        std::make_shared<Snapshot>(base, m_vm->getState()) :
+        Snapshot::afterStep(base, *m_vm, registerOnlyNextRip));
+    m_fullSnapshotPending = false;
     m_history.push_back(nextSnapshot);
+    m_historyBytes += sizeof(Snapshot) + nextSnapshot->storageStats().leafBytes;
+    // The extended state is only copied when the step changed it.
+    if (&nextSnapshot->extendedState() != &base->extendedState()) {
+        m_historyBytes += sizeof(Vm::State::ExtendedState);
+    }
+    m_registerHistory->append(nextSnapshot->registers());
+    m_loopIndex->append(nextSnapshot->registers());
     m_historyIndex ++;
+
+    // Snapshots far behind are unlikely to be looked at, compress them.
+    while (m_nextToCompress + ColdDistance <= m_historyIndex) {
+        m_compressor->enqueue(m_history[m_nextToCompress], nextSnapshot);
+        m_nextToCompress ++;
+    }
+}
+
+void Runner::trackWorkingSet() {
+    if (!m_workingSetTracking) {
+        return;
+    }
+    std::optional<Vm::WorkingSet> const workingSet(m_vm->scanWorkingSet());
+    if (!!workingSet) {
+        // The snapshot of this step is about to be appended to m_history.
+        m_workingSetHistory->append(m_history.size(), *workingSet);
+    }
 }
 
 void Runner::processAction(Ui::Action const action) {
@@ -80,12 +165,159 @@ void Runner::processAction(Ui::Action const action) {
         case Ui::Action::ReverseStep:
             doReverseStep();
             break;
+        case Ui::Action::ToggleRepStringStepping:
+            m_repStringStepping = !m_repStringStepping;
+            m_ui->log(std::string("Rep-string stepping ") +
+                      (m_repStringStepping ? "enabled" : "disabled"));
+            break;
+        case Ui::Action::ToggleWorkingSetTracking:
+            m_workingSetTracking = !m_workingSetTracking;
+            if (m_workingSetTracking) {
+                // Pages touched while tracking was disabled must not be
+                // reported by the next sample.
+                m_vm->scanWorkingSet();
+                // The accessed and dirty bits cleared by the scan are not in
+                // the last snapshot, the next one cannot re-use its memory.
+                m_fullSnapshotPending = true;
+            }
+            m_ui->log(std::string("Working set tracking ") +
+                      (m_workingSetTracking ? "enabled" : "disabled"));
+            break;
+        case Ui::Action::ProfileMemory:
+            doProfileMemory(m_ui->actionArgument());
+            break;
+        case Ui::Action::NextIteration:
+        case Ui::Action::PreviousIteration:
+        case Ui::Action::JumpToIteration:
+            doIterationAction(action, m_ui->actionArgument());
+            break;
+        case Ui::Action::AnalyzeDependencies:
+            doAnalyzeDependencies();
+            break;
         default:
             // This includes Action::None.
             break;
     }
 }
 
+void Runner::doProfileMemory(u64 const pageSize) {
+    bool const running(m_memoryProfile.valid() &&
+        m_memoryProfile.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready);
+    if (running) {
+        m_ui->log("Memory profile already running");
+        return;
+    }
+    MemoryProfile::Config config;
+    if (!!pageSize) {
+        config.pageSize = pageSize;
+    }
+    config.placement = m_vm->placement();
+    m_ui->log("Profiling memory, page size: " +
+              std::to_string(config.pageSize));
+    // The profile runs in its own Vm, the state of m_vm is untouched. A failed
+    // profile has no results, see Ui::State::memoryProfile().
+    m_memoryProfile = std::async(std::launch::async, [config] {
+        MemoryProfile profile(config);
+        return std::make_shared<MemoryProfile::Results const>(profile.run());
+    }).share();
+}
+
+void Runner::doAnalyzeDependencies() {
+    bool const running(m_dependencyGraph.valid() &&
+        m_dependencyGraph.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready);
+    if (running) {
+        m_ui->log("Dependency analysis already running");
+        return;
+    }
+    m_ui->log("Analyzing dependencies over " +
+              std::to_string(m_history.size() - 1) + " steps");
+    // Snapshots are immutable, the analysis reads them concurrently with the
+    // next steps.
+    std::shared_ptr<Snapshot const> const last(m_history.back());
+    std::shared_ptr<std::atomic<bool> const> const cancelled(
+        m_analysisCancelled);
+    m_dependencyGraph = std::async(std::launch::async, [last, cancelled] {
+        return std::make_shared<DependencyGraph const>(
+            DependencyGraph::fromHistory(last, cancelled));
+    }).share();
+}
+
+void Runner::doIterationAction(Ui::Action const action, u64 const argument) {
+    std::optional<LoopIndex::Iteration> const iteration(
+        m_loopIndex->iterationAt(m_historyIndex));
+    if (!iteration) {
+        m_ui->log("Current step is not part of a loop");
+    } else if (action == Ui::Action::NextIteration) {
+        goToIteration(iteration->loop, 0, iteration->index + 1);
+    } else if (action == Ui::Action::JumpToIteration) {
+        // Iterations are counted from the entry of the loop.
+        LoopIndex::Activation const& activation(
+            m_loopIndex->loops()[iteration->loop].activations[
+                iteration->activation]);
+        if (!!activation.end && activation.numIterations <= argument) {
+            m_ui->log("The loop only ran " +
+                      std::to_string(activation.numIterations) +
+                      " iterations");
+        } else {
+            goToIteration(iteration->loop, activation.firstIteration,
+                          argument);
+        }
+    } else if (!iteration->index) {
+        m_ui->log("Current step is in the first iteration of the loop");
+    } else {
+        goToIteration(iteration->loop, 0, iteration->index - 1);
+    }
+}
+
+void Runner::goToIteration(u64 const loop, u64 const first, u64 const index) {
+    // The loops are only referenced through their index, stepping may detect
+    // new loops and re-allocate them.
+    auto const numIterations([&]() {
+        return m_loopIndex->loops()[loop].iterationStarts.size() - first;
+    });
+    auto const running([&]() {
+        return !m_loopIndex->loops()[loop].activations.back().end;
+    });
+    u64 const prevHistoryIndex(m_historyIndex);
+    // Set if the Vm could not step anymore, e.g. it halted.
+    bool stopped(false);
+    if (numIterations() <= index && running()) {
+        // The iteration was not executed yet, run until it starts.
+        m_historyIndex = m_history.size() - 1;
+        for (u64 i(0); i < MaxIterationSteps; ++i) {
+            if (index < numIterations() || !running()) {
+                break;
+            }
+            u64 const historySize(m_history.size());
+            doStep();
+            if (m_history.size() == historySize) {
+                // doStep() logged why.
+                stopped = true;
+                break;
+            }
+        }
+    }
+    if (index < numIterations()) {
+        m_historyIndex =
+            m_loopIndex->loops()[loop].iterationStarts[first + index];
+        return;
+    }
+    // Stay where we were, the steps executed are kept in the history.
+    m_historyIndex = prevHistoryIndex;
+    if (!running()) {
+        m_ui->log("The loop only ran " + std::to_string(numIterations()) +
+                  " iterations");
+    } else if (stopped) {
+        m_ui->log("Iteration " + std::to_string(index) + " did not start " +
+                  "before the Vm stopped");
+    } else {
+        m_ui->log("Iteration " + std::to_string(index) + " did not start " +
+                  "after " + std::to_string(MaxIterationSteps) + " steps");
+    }
+}
+
 void Runner::doStep() {
     if (m_vm->operatingState() != Vm::OperatingState::Runnable) {
         // The VM is no longer runnable, cannot satisfy the action.
@@ -116,8 +348,28 @@ void Runner::doStep() {
     } else {
         // We are looking at the latest state of the VM, going to the next state
         // requires actually executing the next instruction.
-        m_vm->step();
-        updateLastSnapshot();
+        if (!!m_historyQuota && m_historyQuota <= historyBytes()) {
+            m_ui->log("History quota of " + std::to_string(m_historyQuota) +
+                      " bytes exceeded, reset the VM to continue");
+            return;
+        }
+        // KVM single-stepping traps after each iteration of a rep-prefixed
+        // string instruction. When requested, run such instructions natively
+        // until reaching the next instruction instead.
+        std::optional<u64> const repLen(m_repStringStepping ?
+            m_vm->repStringInstructionLength() : std::nullopt);
+        if (!!repLen) {
+            m_vm->runUntil(m_history.back()->registers().rip + *repLen);
+            trackWorkingSet();
+            updateLastSnapshot();
+        } else {
+            // Most instructions only modify registers, in which case there is
+            // no need to copy the memory of the Vm.
+            std::optional<u64> const nextRip(registerOnlyNextRip());
+            m_vm->step();
+            trackWorkingSet();
+            updateLastSnapshot(nextRip);
+        }
     }
 }
 
@@ -0,0 +1,590 @@
+#include <x86lab/server.hpp>
+#include <x86lab/runner.hpp>
+#include <x86lab/ui/cli.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace X86Lab {
+
+// Wake the event loop up.
+// @param wakeFd: The eventfd of the event loop.
+static void wake(int const wakeFd) {
+    u64 const one(1);
+    // Can only fail if the counter overflows, in which case the event loop is
+    // awake anyway.
+    [[maybe_unused]] ssize_t const res(::write(wakeFd, &one, sizeof(one)));
+}
+
+// Resolve the path of a file loaded by a client.
+// @param directory: The directory the file must be in.
+// @param path: The path of the file, relative to directory.
+// @return: The canonical path of the file.
+// @throws: An Error if the file does not exist or is not within directory.
+static std::string resolveSourcePath(std::string const& directory,
+                                     std::string const& path) {
+    std::error_code error;
+    std::filesystem::path const root(std::filesystem::canonical(directory,
+                                                                error));
+    if (!!error) {
+        throw Error("Cannot access source directory", error.value());
+    }
+    std::filesystem::path const file(std::filesystem::canonical(root / path,
+                                                                error));
+    if (!!error) {
+        throw Error("Cannot access " + path, error.value());
+    }
+    // Both paths are canonical, the file is within the directory if all the
+    // components of the directory are a prefix of the file's.
+    if (std::mismatch(root.begin(), root.end(),
+                      file.begin(), file.end()).first != root.end()) {
+        throw Error(path + " is outside of the source directory", 0);
+    }
+    return file.string();
+}
+
+class Server::Session {
+public:
+    // Create a session and start its thread.
+    // @param fd: The connection to the client, non-blocking. Owned by the
+    // session.
+    // @param config: The configuration of the server.
+    // @param wakeFd: The eventfd of the event loop, written when the session
+    // has new output or terminates.
+    Session(int const fd, Config const& config, int const wakeFd);
+
+    // Hang up and wait for the thread to terminate, then close the
+    // connection.
+    ~Session();
+
+    // Read all the data available on the connection and queue the complete
+    // lines for the thread. Upon end of file, the thread reads the queued
+    // lines then terminates. If the client sends a line longer than
+    // MaxLineLength, or more than MaxPendingInput bytes of lines that the
+    // thread did not read yet, the queued lines are discarded, an error is
+    // sent and the input is closed.
+    void receive();
+
+    // The client is gone: cancel the current batch of steps, discard the
+    // pending output and terminate the thread.
+    void hangUp();
+
+    // Send as much of the pending output as the connection accepts without
+    // blocking. Hangs up if the connection failed.
+    void flush();
+
+    // Check if the session can be destroyed without blocking.
+    // @return: true if the thread terminated and either all its output was
+    // sent or the client is gone.
+    bool done() const;
+
+private:
+    // Stream buffer reading the lines received from the client, blocking
+    // until one is available.
+    class InputBuffer : public std::streambuf {
+    public:
+        InputBuffer(Session& session) : m_session(session) {}
+    private:
+        virtual int_type underflow();
+        Session& m_session;
+        // The line being read, including its new line.
+        std::string m_line;
+    };
+
+    // Stream buffer appending to the pending output of the session.
+    class OutputBuffer : public std::streambuf {
+    public:
+        OutputBuffer(Session& session) : m_session(session) {}
+    private:
+        virtual int_type overflow(int_type c);
+        virtual std::streamsize xsputn(char const * s, std::streamsize n);
+        Session& m_session;
+    };
+
+    // The pending output above which the thread blocks until the client
+    // catches up.
+    static constexpr u64 MaxPendingOutput = 1 << 20;
+    // The longest line accepted from the client, without its new line.
+    static constexpr u64 MaxLineLength = 1 << 13;
+    // The size of the lines received and not yet read by the thread above
+    // which the input is closed.
+    static constexpr u64 MaxPendingInput = 1 << 20;
+
+    // The body of the thread: assemble the code named by the first line then
+    // run it, re-creating the Vm upon reset, until the client quits.
+    void main();
+
+    // Helper for main(), which reports the exceptions to the client.
+    // @param input: The stream of the lines received from the client.
+    // @param output: The stream sent to the client.
+    void run(std::istream& input, std::ostream& output);
+
+    // Wait for the next line received from the client.
+    // @param line: Set to the line, without its new line.
+    // @return: false if there is no more line, e.g. the client closed the
+    // connection.
+    bool nextLine(std::string& line);
+
+    // Append to the pending output, blocking while the client is behind.
+    // @param data: The data to send.
+    // @param size: The size of the data in bytes.
+    void send(char const * const data, u64 const size);
+
+    int m_fd;
+    Config m_config;
+    int m_wakeFd;
+
+    // Protects all the members below, except m_terminated.
+    mutable std::mutex m_mutex;
+    // Signaled when a line is received or the input is closed.
+    std::condition_variable m_inputCond;
+    // Signaled when pending output is sent or the client is gone.
+    std::condition_variable m_outputCond;
+    // The complete lines received and not yet read by the thread.
+    std::deque<std::string> m_lines;
+    // The total size of m_lines in bytes.
+    u64 m_pendingInput;
+    // The received data after the last new line.
+    std::string m_partialLine;
+    // Set upon end of file or hang up, no more line will be received.
+    bool m_inputClosed;
+    // Set upon hang up, the output is discarded.
+    bool m_hungUp;
+    // The output not yet sent to the client.
+    std::string m_output;
+    // The Cli of the session, once the code is loaded.
+    std::shared_ptr<Ui::Cli> m_cli;
+
+    // Set when the thread is about to terminate.
+    std::atomic<bool> m_terminated;
+    // Started last, once all the other members are initialized.
+    std::thread m_thread;
+};
+
+Server::Session::Session(int const fd,
+                         Config const& config,
+                         int const wakeFd) :
+    m_fd(fd),
+    m_config(config),
+    m_wakeFd(wakeFd),
+    m_pendingInput(0),
+    m_inputClosed(false),
+    m_hungUp(false),
+    m_terminated(false),
+    m_thread(&Session::main, this) {}
+
+Server::Session::~Session() {
+    hangUp();
+    m_thread.join();
+    ::close(m_fd);
+}
+
+void Server::Session::receive() {
+    char buf[4096];
+    while (true) {
+        ssize_t const len(::recv(m_fd, buf, sizeof(buf), 0));
+        if (len == -1 && errno == EINTR) {
+            continue;
+        } else if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        std::lock_guard<std::mutex> const lock(m_mutex);
+        if (len <= 0) {
+            // End of file or error. The client might still be reading, let the
+            // thread consume the queued lines.
+            m_inputClosed = true;
+            m_inputCond.notify_all();
+            return;
+        } else if (m_inputClosed) {
+            // The input overflowed, drain the connection until the client
+            // notices that it is shut down.
+            continue;
+        }
+        m_partialLine.append(buf, len);
+        std::string error;
+        size_t pos;
+        while (error.empty() &&
+               (pos = m_partialLine.find('\n')) != std::string::npos) {
+            if (MaxLineLength < pos) {
+                error = "Input line too long";
+                break;
+            }
+            m_lines.push_back(m_partialLine.substr(0, pos));
+            m_pendingInput += pos;
+            m_partialLine.erase(0, pos + 1);
+        }
+        if (error.empty() && MaxLineLength < m_partialLine.size()) {
+            error = "Input line too long";
+        } else if (error.empty() && MaxPendingInput < m_pendingInput) {
+            error = "Too much pending input";
+        }
+        if (!error.empty()) {
+            // The memory of the server is shared by all the sessions, stop
+            // reading from this client. The error bypasses MaxPendingOutput
+            // since the thread might be blocked sending.
+            m_lines.clear();
+            m_pendingInput = 0;
+            m_partialLine.clear();
+            m_inputClosed = true;
+            m_output += "Error: " + error + "\n";
+            if (!!m_cli) {
+                m_cli->cancel();
+            }
+            ::shutdown(m_fd, SHUT_RD);
+            m_outputCond.notify_all();
+        }
+        m_inputCond.notify_all();
+    }
+}
+
+void Server::Session::hangUp() {
+    std::lock_guard<std::mutex> const lock(m_mutex);
+    m_inputClosed = true;
+    m_hungUp = true;
+    m_lines.clear();
+    m_pendingInput = 0;
+    m_output.clear();
+    if (!!m_cli) {
+        m_cli->cancel();
+    }
+    m_inputCond.notify_all();
+    m_outputCond.notify_all();
+}
+
+void Server::Session::flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_output.empty() && !m_hungUp) {
+        ssize_t const len(::send(m_fd, m_output.data(), m_output.size(),
+                                 MSG_NOSIGNAL | MSG_DONTWAIT));
+        if (len == -1 && errno == EINTR) {
+            continue;
+        } else if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (len == -1) {
+            lock.unlock();
+            hangUp();
+            return;
+        }
+        m_output.erase(0, len);
+        m_outputCond.notify_all();
+    }
+}
+
+bool Server::Session::done() const {
+    std::lock_guard<std::mutex> const lock(m_mutex);
+    return m_terminated && (m_hungUp || m_output.empty());
+}
+
+Server::Session::InputBuffer::int_type
+Server::Session::InputBuffer::underflow() {
+    if (!m_session.nextLine(m_line)) {
+        return traits_type::eof();
+    }
+    m_line += '\n';
+    setg(m_line.data(), m_line.data(), m_line.data() + m_line.size());
+    return traits_type::to_int_type(m_line[0]);
+}
+
+Server::Session::OutputBuffer::int_type
+Server::Session::OutputBuffer::overflow(int_type c) {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        char const ch(traits_type::to_char_type(c));
+        m_session.send(&ch, 1);
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize Server::Session::OutputBuffer::xsputn(char const * s,
+                                                      std::streamsize n) {
+    m_session.send(s, n);
+    return n;
+}
+
+bool Server::Session::nextLine(std::string& line) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_inputCond.wait(lock, [&]() { return !m_lines.empty() || m_inputClosed; });
+    if (m_lines.empty()) {
+        return false;
+    }
+    line = std::move(m_lines.front());
+    m_lines.pop_front();
+    m_pendingInput -= line.size();
+    return true;
+}
+
+void Server::Session::send(char const * const data, u64 const size) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_outputCond.wait(lock, [&]() {
+        return m_output.size() < MaxPendingOutput || m_hungUp;
+    });
+    if (m_hungUp) {
+        return;
+    }
+    bool const wasEmpty(m_output.empty());
+    m_output.append(data, size);
+    lock.unlock();
+    if (wasEmpty) {
+        wake(m_wakeFd);
+    }
+}
+
+void Server::Session::main() {
+    InputBuffer inputBuffer(*this);
+    OutputBuffer outputBuffer(*this);
+    std::istream input(&inputBuffer);
+    std::ostream output(&outputBuffer);
+    try {
+        run(input, output);
+    } catch (std::exception const& e) {
+        output << "Error: " << e.what() << std::endl;
+    }
+    m_terminated = true;
+    wake(m_wakeFd);
+}
+
+void Server::Session::run(std::istream& input, std::ostream& output) {
+    // The first command names the code to run.
+    std::shared_ptr<Code const> code;
+    std::string line;
+    while (!code) {
+        if (!std::getline(input, line)) {
+            return;
+        }
+        std::istringstream iss(line);
+        std::string cmd;
+        std::string path;
+        if (!(iss >> cmd) || cmd[0] == '#') {
+            continue;
+        } else if (cmd != "load" || !(iss >> path)) {
+            output << "Error: Expected load <file>: " << line << std::endl;
+            continue;
+        }
+        try {
+            code = std::make_shared<Code const>(
+                resolveSourcePath(m_config.sourceDirectory, path));
+        } catch (Error const& error) {
+            output << "Error: " << error.what() << ": " << line << std::endl;
+        }
+    }
+    output << "Assembled code is " << code->size() << " bytes" << std::endl;
+
+    // Commands and logs are both sent to the client, which cannot act on the
+    // host.
+    std::shared_ptr<Ui::Cli> const cli(
+        std::make_shared<Ui::Cli>(input, output, output, true));
+    {
+        std::lock_guard<std::mutex> const lock(m_mutex);
+        if (m_hungUp) {
+            return;
+        }
+        m_cli = cli;
+    }
+    if (!cli->init()) {
+        return;
+    }
+
+    // Same as the main loop of the GUI: re-create the Vm upon reset.
+    bool repStringStepping(false);
+    bool workingSetTracking(false);
+    Vm::CpuMode startCpuMode(Vm::CpuMode::LongMode);
+    while (true) {
+        std::shared_ptr<Vm> const vm(new Vm(startCpuMode,
+                                            m_config.memorySize,
+                                            m_config.placement,
+                                            m_config.backend));
+        vm->loadCode(*code);
+        Runner runner(vm, code, cli, repStringStepping, workingSetTracking,
+                      m_config.historyQuota);
+        Runner::ReturnReason const retReason(runner.run());
+        repStringStepping = runner.repStringStepping();
+        workingSetTracking = runner.workingSetTracking();
+        if (retReason == Runner::ReturnReason::Quit) {
+            return;
+        } else if (retReason == Runner::ReturnReason::Reset16) {
+            startCpuMode = Vm::CpuMode::RealMode;
+        } else if (retReason == Runner::ReturnReason::Reset32) {
+            startCpuMode = Vm::CpuMode::ProtectedMode;
+        } else if (retReason == Runner::ReturnReason::Reset64) {
+            startCpuMode = Vm::CpuMode::LongMode;
+        }
+    }
+}
+
+Server::Config::Config() :
+    maxSessions(64),
+    historyQuota(256 << 20),
+    memorySize(4 * PAGE_SIZE),
+    backend(Vm::BackendType::Kvm),
+    sourceDirectory(".") {}
+
+Server::Server(std::string const& socketPath, Config const& config) :
+    m_socketPath(socketPath),
+    m_config(config),
+    m_listenFd(-1),
+    m_epollFd(-1),
+    m_wakeFd(-1),
+    m_stopRequested(false),
+    m_numSessions(0) {
+    // Close the file descriptors opened so far and throw.
+    auto const fail([&](std::string const& what) {
+        int const errNo(errno);
+        for (int const fd : {m_listenFd, m_epollFd, m_wakeFd}) {
+            if (fd != -1) {
+                ::close(fd);
+            }
+        }
+        throw Error(what, errNo);
+    });
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (sizeof(addr.sun_path) <= socketPath.size()) {
+        errno = ENAMETOOLONG;
+        fail("Socket path too long");
+    }
+    std::strcpy(addr.sun_path, socketPath.c_str());
+    m_listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+    if (m_listenFd == -1) {
+        fail("Cannot create socket");
+    }
+    // Replace the socket of a previous server.
+    if (::unlink(socketPath.c_str()) == -1 && errno != ENOENT) {
+        fail("Cannot remove " + socketPath);
+    }
+    if (::bind(m_listenFd, reinterpret_cast<sockaddr*>(&addr),
+               sizeof(addr)) == -1) {
+        fail("Cannot bind socket to " + socketPath);
+    } else if (::listen(m_listenFd, SOMAXCONN) == -1) {
+        fail("Cannot listen on " + socketPath);
+    }
+
+    m_epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollFd == -1) {
+        fail("Cannot create epoll instance");
+    }
+    m_wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeFd == -1) {
+        fail("Cannot create eventfd");
+    }
+    for (int const fd : {m_listenFd, m_wakeFd}) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (::epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            fail("Cannot add file descriptor to epoll instance");
+        }
+    }
+}
+
+Server::~Server() {
+    // Hang up first so that all the sessions terminate concurrently.
+    for (auto const& [fd, session] : m_sessions) {
+        session->hangUp();
+    }
+    m_sessions.clear();
+    ::close(m_listenFd);
+    ::close(m_epollFd);
+    ::close(m_wakeFd);
+    ::unlink(m_socketPath.c_str());
+}
+
+void Server::run() {
+    static constexpr int MaxEvents = 64;
+    epoll_event events[MaxEvents];
+    while (!m_stopRequested) {
+        int const numEvents(::epoll_wait(m_epollFd, events, MaxEvents, -1));
+        if (numEvents == -1 && errno == EINTR) {
+            continue;
+        } else if (numEvents == -1) {
+            throw Error("Failed to wait for events", errno);
+        }
+        for (int i(0); i < numEvents; ++i) {
+            int const fd(events[i].data.fd);
+            u32 const mask(events[i].events);
+            if (fd == m_listenFd) {
+                acceptClients();
+            } else if (fd == m_wakeFd) {
+                u64 count;
+                [[maybe_unused]] ssize_t const res(
+                    ::read(m_wakeFd, &count, sizeof(count)));
+            } else if (m_sessions.contains(fd)) {
+                Session& session(*m_sessions.at(fd));
+                if (mask & (EPOLLIN | EPOLLRDHUP)) {
+                    session.receive();
+                }
+                if (mask & (EPOLLHUP | EPOLLERR)) {
+                    // The client closed both directions of the connection.
+                    session.hangUp();
+                }
+            }
+        }
+        serviceSessions();
+    }
+}
+
+void Server::stop() {
+    m_stopRequested = true;
+    wake(m_wakeFd);
+}
+
+u64 Server::numSessions() const {
+    return m_numSessions;
+}
+
+void Server::acceptClients() {
+    while (true) {
+        int const fd(::accept4(m_listenFd, nullptr, nullptr,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC));
+        if (fd == -1 && errno == EINTR) {
+            continue;
+        } else if (fd == -1) {
+            // No more pending connection, or a connection was aborted before
+            // being accepted.
+            return;
+        }
+        if (m_config.maxSessions <= m_sessions.size()) {
+            std::string const msg("Error: Too many sessions\n");
+            [[maybe_unused]] ssize_t const res(::send(
+                fd, msg.data(), msg.size(), MSG_NOSIGNAL | MSG_DONTWAIT));
+            ::close(fd);
+            continue;
+        }
+        // Edge-triggered: receive() reads until EAGAIN, and the output is
+        // sent after every batch of events.
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = fd;
+        if (::epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            ::close(fd);
+            continue;
+        }
+        m_sessions.emplace(fd, std::make_unique<Session>(fd, m_config,
+                                                         m_wakeFd));
+        m_numSessions = m_sessions.size();
+    }
+}
+
+void Server::serviceSessions() {
+    for (auto it(m_sessions.begin()); it != m_sessions.end();) {
+        it->second->flush();
+        if (it->second->done()) {
+            // Closing the connection removes it from the epoll instance.
+            it = m_sessions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_numSessions = m_sessions.size();
+}
+}
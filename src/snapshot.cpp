@@ -1,10 +1,324 @@
 #include <x86lab/snapshot.hpp>
 #include <algorithm>
+#include <atomic>
+#include <list>
 #include <map>
 #include <functional>
+#include <unordered_map>
 
 namespace X86Lab {
 
+// Compression of the memory stored in snapshots. Guest memory is mostly made of
+// zeroes and of repeated patterns (e.g. filled by rep stos), hence the data is
+// encoded as a sequence of runs of identical qwords and runs of literal qwords.
+// Each run starts with a header: the length of the run in qwords, shifted left
+// by one, with bit 0 set for a run of identical qwords, encoded as LEB128. The
+// header is followed by the repeated qword or by the literal qwords.
+namespace Compression {
+// Append a LEB128-encoded value to a buffer.
+// @param out: The buffer to append to.
+// @param value: The value to encode.
+static void putVarint(std::vector<u8>& out, u64 value) {
+    while (value >= 0x80) {
+        out.push_back((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(value);
+}
+
+// Read a LEB128-encoded value from a buffer.
+// @param in: The buffer to read from, advanced past the value.
+// @return: The decoded value.
+static u64 getVarint(u8 const *& in) {
+    u64 value(0);
+    for (u64 shift(0); ; shift += 7) {
+        u8 const byte(*(in++));
+        value |= u64(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+// Compress a buffer.
+// @param data: The data to compress.
+// @param size: The size of the data, must be a multiple of 8.
+// @return: The compressed data.
+static std::vector<u8> compress(u8 const * const data, u64 const size) {
+    assert(!(size % sizeof(u64)));
+    u64 const numWords(size / sizeof(u64));
+    auto const word([&](u64 const i) {
+        u64 w;
+        std::memcpy(&w, data + i * sizeof(u64), sizeof(w));
+        return w;
+    });
+    // Runs of identical qwords shorter than this are stored as literals, the
+    // header of the run would cost more than it saves.
+    static constexpr u64 minRepeat = 3;
+    std::vector<u8> out;
+    u64 i(0);
+    while (i < numWords) {
+        u64 repeat(1);
+        while (i + repeat < numWords && word(i + repeat) == word(i)) {
+            repeat ++;
+        }
+        if (repeat >= minRepeat) {
+            putVarint(out, (repeat << 1) | 1);
+            out.insert(out.end(), data + i * sizeof(u64),
+                       data + (i + 1) * sizeof(u64));
+            i += repeat;
+            continue;
+        }
+        // Literal run up to the next run of repeated qwords.
+        u64 end(i + 1);
+        u64 runLen(1);
+        for (; end < numWords; ++end) {
+            runLen = (word(end) == word(end - 1)) ? runLen + 1 : 1;
+            if (runLen == minRepeat) {
+                end -= minRepeat - 1;
+                break;
+            }
+        }
+        putVarint(out, (end - i) << 1);
+        out.insert(out.end(), data + i * sizeof(u64), data + end * sizeof(u64));
+        i = end;
+    }
+    return out;
+}
+
+// Decompress a buffer compressed with compress().
+// @param in: The compressed data.
+// @param out: The buffer to decompress into.
+// @param size: The size of the decompressed data.
+static void decompress(std::vector<u8> const& in,
+                       u8 * const out,
+                       u64 const size) {
+    u8 const * ptr(in.data());
+    u64 offset(0);
+    while (offset < size) {
+        u64 const header(getVarint(ptr));
+        u64 const len((header >> 1) * sizeof(u64));
+        if (header & 1) {
+            for (u64 i(0); i < len; i += sizeof(u64)) {
+                std::memcpy(out + offset + i, ptr, sizeof(u64));
+            }
+            ptr += sizeof(u64);
+        } else {
+            std::memcpy(out + offset, ptr, len);
+            ptr += len;
+        }
+        offset += len;
+    }
+    assert(offset == size && ptr == in.data() + in.size());
+}
+}
+
+// The data of a leaf of a BlockTree. The data can be compressed in place, after
+// which reads transparently decompress it. Leaves can share the same LeafData,
+// e.g. a leaf re-using part of a leaf of the base tree.
+class LeafData {
+public:
+    // Create a LeafData holding uncompressed data.
+    // @param data: The data. If nullptr then this LeafData reads as zeroes,
+    // see zeroes().
+    // @param size: The size of the data in bytes.
+    LeafData(std::unique_ptr<u8[]> data, u64 const size);
+
+    // Get the LeafData of memory that was never populated. It reads as zeroes
+    // for any offset and is shared by all the trees, it is never compressed.
+    // @return: The shared zero LeafData.
+    static std::shared_ptr<LeafData> const& zeroes();
+
+    // Remove this data from the decompressed cache.
+    ~LeafData();
+
+    // Read part of the data, decompressing it if needed.
+    // @param dest: The buffer to read into.
+    // @param offset: The offset to read from.
+    // @param len: The number of bytes to read.
+    void read(u8 * const dest, u64 const offset, u64 const len) const;
+
+    // Compress the data in place. This is a no-op if the data is already
+    // compressed or if it does not compress well, in which case it is kept
+    // uncompressed.
+    // @return: The stats of the compression, all zeroes if this was a no-op.
+    Snapshot::CompressionStats compress();
+
+private:
+    // True for the LeafData returned by zeroes(). Never changes, hence is not
+    // protected by m_mutex.
+    bool m_isZero;
+    // Never changes, hence is not protected by m_mutex.
+    u64 m_size;
+    // Reads of uncompressed data, by far the most common, do not take m_mutex
+    // so that threads reading the same leaves, e.g. when building snapshots
+    // in parallel or running a HistoryQuery, do not serialize. Instead a
+    // reader registers in m_rawReaders, then checks m_hasRaw before copying
+    // from m_raw. compress() clears m_hasRaw, then waits for the registered
+    // readers to be done before freeing m_raw.
+    std::atomic<bool> m_hasRaw;
+    mutable std::atomic<u64> m_rawReaders;
+    // The uncompressed data, nullptr if the data is compressed. Immutable
+    // while m_hasRaw is set.
+    std::unique_ptr<u8[]> m_raw;
+    // Protects all the fields below.
+    mutable std::mutex m_mutex;
+    // The compressed data, empty if the data is not compressed.
+    std::vector<u8> m_compressed;
+    // Set when compress() was called, to avoid trying to compress the same
+    // data repeatedly.
+    bool m_compressionAttempted;
+};
+
+// A small LRU cache of decompressed LeafData, shared by all the snapshots.
+// Reading memory from a compressed leaf, e.g. through the UI, usually reads
+// the same leaves many times in a row.
+class DecompressedCache {
+public:
+    // Get the process-wide cache.
+    // @return: The cache.
+    static DecompressedCache& shared() {
+        static DecompressedCache cache;
+        return cache;
+    }
+
+    // Get the decompressed data of a LeafData.
+    // @param key: The LeafData.
+    // @return: The decompressed data, nullptr if not in the cache.
+    std::shared_ptr<std::vector<u8> const> get(LeafData const * const key) {
+        std::unique_lock<std::mutex> const lock(m_mutex);
+        auto const it(m_index.find(key));
+        if (it == m_index.end()) {
+            return nullptr;
+        }
+        // Move to the front of the LRU list.
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        return it->second->second;
+    }
+
+    // Add decompressed data to the cache, evicting the least recently used
+    // entries if needed.
+    // @param key: The LeafData.
+    // @param data: The decompressed data.
+    void put(LeafData const * const key,
+             std::shared_ptr<std::vector<u8> const> const data) {
+        std::unique_lock<std::mutex> const lock(m_mutex);
+        if (m_index.contains(key)) {
+            return;
+        }
+        m_lru.emplace_front(key, data);
+        m_index[key] = m_lru.begin();
+        m_size += data->size();
+        while (m_size > MaxSize && m_lru.size() > 1) {
+            m_size -= m_lru.back().second->size();
+            m_index.erase(m_lru.back().first);
+            m_lru.pop_back();
+        }
+    }
+
+    // Remove a LeafData from the cache.
+    // @param key: The LeafData.
+    void evict(LeafData const * const key) {
+        std::unique_lock<std::mutex> const lock(m_mutex);
+        auto const it(m_index.find(key));
+        if (it != m_index.end()) {
+            m_size -= it->second->second->size();
+            m_lru.erase(it->second);
+            m_index.erase(it);
+        }
+    }
+
+private:
+    // The maximum total size of the decompressed data in the cache.
+    static constexpr u64 MaxSize = 16 * 1024 * 1024;
+
+    DecompressedCache() : m_size(0) {}
+
+    using Entry = std::pair<LeafData const*,
+                            std::shared_ptr<std::vector<u8> const>>;
+    std::mutex m_mutex;
+    // Most recently used first.
+    std::list<Entry> m_lru;
+    std::unordered_map<LeafData const*, std::list<Entry>::iterator> m_index;
+    u64 m_size;
+};
+
+LeafData::LeafData(std::unique_ptr<u8[]> data, u64 const size) :
+    m_isZero(!data),
+    m_size(size),
+    m_hasRaw(!!data),
+    m_rawReaders(0),
+    m_raw(std::move(data)),
+    m_compressionAttempted(m_isZero) {}
+
+std::shared_ptr<LeafData> const& LeafData::zeroes() {
+    static std::shared_ptr<LeafData> const zero(
+        std::make_shared<LeafData>(nullptr, 0));
+    return zero;
+}
+
+LeafData::~LeafData() {
+    if (m_compressed.size()) {
+        DecompressedCache::shared().evict(this);
+    }
+}
+
+void LeafData::read(u8 * const dest, u64 const offset, u64 const len) const {
+    if (m_isZero) {
+        std::memset(dest, 0, len);
+        return;
+    }
+    // Registering before checking m_hasRaw, and compress() clearing it before
+    // checking m_rawReaders, requires sequentially consistent accesses.
+    m_rawReaders.fetch_add(1);
+    if (m_hasRaw.load()) {
+        std::memcpy(dest, m_raw.get() + offset, len);
+        m_rawReaders.fetch_sub(1);
+        return;
+    }
+    m_rawReaders.fetch_sub(1);
+
+    std::unique_lock<std::mutex> const lock(m_mutex);
+    DecompressedCache& cache(DecompressedCache::shared());
+    std::shared_ptr<std::vector<u8> const> decompressed(cache.get(this));
+    if (!decompressed) {
+        std::shared_ptr<std::vector<u8>> const buf(
+            std::make_shared<std::vector<u8>>(m_size));
+        Compression::decompress(m_compressed, buf->data(), m_size);
+        cache.put(this, buf);
+        decompressed = buf;
+    }
+    std::memcpy(dest, decompressed->data() + offset, len);
+}
+
+Snapshot::CompressionStats LeafData::compress() {
+    std::unique_lock<std::mutex> const lock(m_mutex);
+    if (m_compressionAttempted) {
+        return Snapshot::CompressionStats({});
+    }
+    m_compressionAttempted = true;
+    std::vector<u8> compressed(Compression::compress(m_raw.get(), m_size));
+    // Keep the data uncompressed unless this saves at least a quarter of it,
+    // the decompression cost would not be worth it.
+    if (compressed.size() > m_size / 4 * 3) {
+        return Snapshot::CompressionStats({});
+    }
+    compressed.shrink_to_fit();
+    Snapshot::CompressionStats const stats({
+        .numLeaves = 1,
+        .rawBytes = m_size,
+        .compressedBytes = compressed.size(),
+    });
+    // Readers seeing m_hasRaw cleared take m_mutex, hence see m_compressed.
+    m_compressed = std::move(compressed);
+    m_hasRaw.store(false);
+    while (!!m_rawReaders.load()) {
+        std::this_thread::yield();
+    }
+    m_raw.reset();
+    return stats;
+}
+
 // Tree-like data structure of blocks of memory. Each node of the tree is
 // either a leaf node which contains data for a particular range of the memory;
 // or an intermediate node which does not contain data but two pointers to
@@ -19,11 +333,28 @@ public:
     // @param data: A read-only copy of the memory to be represented by the
     // tree.
     // @param size: The size of the memory.
+    // @param populated: For each page of the memory, true if it is populated.
+    // Pages that are not populated are zeroes and are not read from `data`.
+    // Empty if all the pages are populated.
     BlockTree(std::shared_ptr<BlockTree> const base,
               u8 const * const data,
-              u64 const size) :
+              u64 const size,
+              std::vector<bool> const& populated) :
         m_memSize(size),
-        m_root(build(base, data, size)) {}
+        m_stats({}),
+        m_root(build(base, data, size, populated)) {}
+
+    // Construct a BlockTree from a base tree and the ranges of memory written
+    // since, without comparing the rest of the memory. Only the nodes covering
+    // the written ranges are rebuilt, the other nodes are re-used.
+    // @param base: The base BlockTree to build from.
+    // @param writes: The new content of the written ranges, see
+    // Snapshot::PhysicalData.
+    BlockTree(std::shared_ptr<BlockTree> const base,
+              Snapshot::PhysicalData const& writes) :
+        m_memSize(base->m_memSize),
+        m_stats({}),
+        m_root(update(base->m_root, 0, base->m_root->size(), writes)) {}
 
     // Read a buffer from the memory described by this tree.
     // @param offset: The offset at which to read from.
@@ -44,6 +375,142 @@ public:
         return buf;
     }
 
+    // Get the size of the memory described by this tree.
+    // @return: The size in bytes.
+    u64 size() const {
+        return m_memSize;
+    }
+
+    // Check if a range of memory is stored in the same nodes in this tree and
+    // in another tree. This is the case when one of the trees has been built
+    // from the other (directly or not) and the range did not change in
+    // between, in which case the sub-tree covering the range has been re-used.
+    // This does not read any data, only the nodes on the path to the range
+    // are visited.
+    // @param other: The tree to compare against.
+    // @param offset: The offset of the range.
+    // @param size: The size of the range in bytes.
+    // @return: true if the range is shared, which implies that its content is
+    // identical in both trees. false otherwise, in which case the content may
+    // or may not be identical.
+    bool sharesRange(BlockTree const& other,
+                     u64 const offset,
+                     u64 const size) const {
+        if (m_memSize != other.m_memSize || m_memSize <= offset) {
+            return false;
+        }
+        u64 const len(std::min(size, m_memSize - offset));
+        return m_root->sharesRange(other.m_root.get(), offset, len);
+    }
+
+    // Find the ranges of memory that are not stored in the same nodes in this
+    // tree and in another tree, see sharesRange(). Only the nodes that differ
+    // are visited, no data is read.
+    // @param other: The tree to compare against.
+    // @return: The ranges, as pairs of offset and size, in ascending order of
+    // offset. Adjacent ranges are merged. The content of the memory outside of
+    // the ranges is identical in both trees, the content of the ranges may or
+    // may not be.
+    std::vector<std::pair<u64, u64>> changedRanges(BlockTree const& other)
+        const {
+        std::vector<std::pair<u64, u64>> ranges;
+        if (m_memSize != other.m_memSize) {
+            ranges.emplace_back(0, m_memSize);
+            return ranges;
+        }
+        // Add a range, merging it with the previous one if adjacent.
+        auto const addRange([&](u64 const offset, u64 const size) {
+            if (!ranges.empty() &&
+                ranges.back().first + ranges.back().second == offset) {
+                ranges.back().second += size;
+            } else {
+                ranges.emplace_back(offset, size);
+            }
+        });
+        // Compare two nodes over a range. Each node either covers exactly the
+        // range or is a leaf covering a larger range, e.g. when the other tree
+        // split it.
+        std::function<void (Node const*, Node const*, u64, u64)> diff(
+            [&](Node const * const node,
+                Node const * const otherNode,
+                u64 const offset,
+                u64 const size) {
+            if (node == otherNode) {
+                return;
+            } else if (node->isLeaf() && otherNode->isLeaf()) {
+                // Leaves split from the same leaf point to the same data.
+                bool const shared(node->data() == otherNode->data() &&
+                    node->dataOffset() + (offset - node->offset()) ==
+                    otherNode->dataOffset() + (offset - otherNode->offset()));
+                if (!shared) {
+                    addRange(offset, size);
+                }
+                return;
+            }
+            u64 const middle(size / 2);
+            diff(node->isLeaf() ? node : node->leftNode().get(),
+                 otherNode->isLeaf() ? otherNode : otherNode->leftNode().get(),
+                 offset,
+                 middle);
+            diff(node->isLeaf() ? node : node->rightNode().get(),
+                 otherNode->isLeaf() ? otherNode : otherNode->rightNode().get(),
+                 offset + middle,
+                 middle);
+        });
+        diff(m_root.get(), other.m_root.get(), 0, m_root->size());
+        // The root might cover more than the memory.
+        while (!ranges.empty() && m_memSize <= ranges.back().first) {
+            ranges.pop_back();
+        }
+        if (!ranges.empty()) {
+            ranges.back().second = std::min(ranges.back().second,
+                                            m_memSize - ranges.back().first);
+        }
+        return ranges;
+    }
+
+    // Compress the leaves of this tree that are not shared with the base tree
+    // and that are not used by another tree, typically the tree of the latest
+    // snapshot. In other words the data that is only visible in the snapshots
+    // between the base and the other tree.
+    // @param base: The tree this tree was built from, nullptr if none.
+    // @param live: Leaves used by this tree are not compressed.
+    // @return: The stats of the compressed leaves.
+    Snapshot::CompressionStats compressLeaves(BlockTree const * const base,
+                                              BlockTree const& live) const {
+        Snapshot::CompressionStats stats({});
+        std::function<void (Node const*, Node const*)> walk(
+            [&](Node const * const node, Node const * const baseNode) {
+            if (node == baseNode) {
+                // Shared with the base, not allocated by this tree.
+                return;
+            } else if (node->isLeaf()) {
+                if (!live.m_root->usesData(node->data().get(),
+                                           node->offset(),
+                                           node->size())) {
+                    stats += node->data()->compress();
+                }
+                return;
+            }
+            bool const baseSplit(!!baseNode && !baseNode->isLeaf());
+            walk(node->leftNode().get(),
+                 baseSplit ? baseNode->leftNode().get() : nullptr);
+            walk(node->rightNode().get(),
+                 baseSplit ? baseNode->rightNode().get() : nullptr);
+        });
+        if (m_memSize == live.m_memSize) {
+            walk(m_root.get(), !!base ? base->m_root.get() : nullptr);
+        }
+        return stats;
+    }
+
+    // Get statistics about the nodes allocated when building this tree, e.g.
+    // the nodes that are not re-used from the base tree.
+    // @return: The stats.
+    Snapshot::StorageStats const& stats() const {
+        return m_stats;
+    }
+
 private:
     // A Node in a BlockTree. A node covers a well defined range of memory
     // [offset; offset + size]. The data for this range is either stored in this
@@ -69,10 +536,17 @@ private:
         // node.
         // @param size: The size in bytes of the range of memory defined by that
         // node.
-        // @param data: The data for the range of memory. This pointer must be
-        // `size` bytes long.
-        Node(u64 const offset, u64 const size, std::shared_ptr<u8> const data) :
-            m_offset(offset), m_size(size), m_data(data) {}
+        // @param data: The data for the range of memory. It may be shared with
+        // another leaf covering a larger range.
+        // @param dataOffset: The offset of the data of this leaf in `data`.
+        Node(u64 const offset,
+             u64 const size,
+             std::shared_ptr<LeafData> const data,
+             u64 const dataOffset) :
+            m_offset(offset),
+            m_size(size),
+            m_data(data),
+            m_dataOffset(dataOffset) {}
 
         // Create an intermediate node.
         // @param offset: The offset of the range of memory defined by that
@@ -90,7 +564,11 @@ private:
              u64 const size,
              std::shared_ptr<Node> const left,
              std::shared_ptr<Node> const right) :
-            m_offset(offset), m_size(size), m_left(left), m_right(right) {
+            m_offset(offset),
+            m_size(size),
+            m_left(left),
+            m_right(right),
+            m_dataOffset(0) {
             // Check invariants.
             assert(!!left&&!!right);
             assert((left->m_size + right->m_size) == m_size);
@@ -114,7 +592,7 @@ private:
             if (isLeaf()) {
                 // This is a leaf node, the data is readily available, just copy
                 // it into dest and ret.
-                std::memcpy(dest, m_data.get() + relOff, len);
+                m_data->read(dest, m_dataOffset + relOff, len);
                 return;
             }
 
@@ -155,6 +633,113 @@ private:
             }
         }
 
+        // Check if a range covered by this node is stored in the same nodes,
+        // or in leaves pointing to the same data, under another node. The
+        // other node covers the same range as this node or is a leaf covering
+        // a larger range, e.g. when the tree of this node split a leaf of the
+        // tree of the other node.
+        // @param other: The other node.
+        // @param relOff: The offset of the range, relative to the start of the
+        // memory range described by this node.
+        // @param len: The length of the range in bytes.
+        // @return: true if the range is shared, false otherwise.
+        bool sharesRange(Node const * const other,
+                         u64 const relOff,
+                         u64 const len) const {
+            assert(other->m_offset <= m_offset &&
+                   m_offset + m_size <= other->m_offset + other->m_size);
+            assert(other->isLeaf() ||
+                   (m_offset == other->m_offset && m_size == other->m_size));
+            if (this == other) {
+                return true;
+            } else if (isLeaf() && other->isLeaf()) {
+                // Two different leaves can still point to the same data if one
+                // of them was split from the other. The range is shared if it
+                // is at the same position in the data.
+                return m_data == other->m_data &&
+                    m_dataOffset + other->m_offset ==
+                    other->m_dataOffset + m_offset;
+            } else if (isLeaf()) {
+                // The other node is split while this one is not, swap the
+                // nodes so that the leaf is the larger node.
+                return other->sharesRange(this, relOff, len);
+            }
+            // Split this node. The other node is either split the same way or
+            // is a leaf covering both halves.
+            Node const * const otherLeft(
+                other->isLeaf() ? other : other->m_left.get());
+            Node const * const otherRight(
+                other->isLeaf() ? other : other->m_right.get());
+            u64 const middle(m_size / 2);
+            if (relOff < middle &&
+                !m_left->sharesRange(otherLeft,
+                                     relOff,
+                                     std::min(relOff + len, middle) - relOff)) {
+                return false;
+            }
+            if (middle < relOff + len) {
+                u64 const rightOff(std::max(middle, relOff));
+                return m_right->sharesRange(otherRight,
+                                            rightOff - middle,
+                                            relOff + len - rightOff);
+            }
+            return true;
+        }
+
+        // Check if any leaf under this node uses a given LeafData for a range.
+        // @param data: The LeafData.
+        // @param relOff: The offset of the range, relative to the start of the
+        // memory range described by this node.
+        // @param len: The length of the range in bytes.
+        // @return: true if the data is used by a leaf covering part of the
+        // range, false otherwise.
+        bool usesData(LeafData const * const data,
+                      u64 const relOff,
+                      u64 const len) const {
+            if (isLeaf()) {
+                return m_data.get() == data;
+            }
+            u64 const middle(m_size / 2);
+            if (relOff < middle &&
+                m_left->usesData(data,
+                                 relOff,
+                                 std::min(relOff + len, middle) - relOff)) {
+                return true;
+            }
+            if (middle < relOff + len) {
+                u64 const rightOff(std::max(middle, relOff));
+                return m_right->usesData(data,
+                                         rightOff - middle,
+                                         relOff + len - rightOff);
+            }
+            return false;
+        }
+
+        // Get the offset of the memory range covered by this node.
+        // @return: The offset in bytes.
+        u64 offset() const {
+            return m_offset;
+        }
+
+        // Get the size of the memory range covered by this node.
+        // @return: The size in bytes.
+        u64 size() const {
+            return m_size;
+        }
+
+        // Get the data of this node.
+        // @return: The data of this node, nullptr if this node is an
+        // intermediate node.
+        std::shared_ptr<LeafData> data() const {
+            return m_data;
+        }
+
+        // Get the offset of the data of this node in data().
+        // @return: The offset in bytes.
+        u64 dataOffset() const {
+            return m_dataOffset;
+        }
+
         // Check if this node is a leaf node.
         // @return: true if this is a leaf node, false if it is an intermediate
         // node.
@@ -186,79 +771,613 @@ private:
         // Right child. nullptr if this node is a leaf node.
         std::shared_ptr<Node> m_right;
         // Data of this node. nullptr if this node is an intermediate node.
-        std::shared_ptr<u8> m_data;
+        std::shared_ptr<LeafData> m_data;
+        // Offset of the data of this node in m_data.
+        u64 m_dataOffset;
     };
 
+    // Approximate cost in bytes of allocating a node: the node itself and the
+    // control block of the shared_ptr pointing to it.
+    static constexpr u64 NodeCost = sizeof(Node) + 16;
+    // Additional cost of a leaf holding its own copy of the data: the control
+    // block of the shared_ptr owning the data.
+    static constexpr u64 LeafDataCost = 16;
+    // Ranges up to this size that changed since the base are stored using the
+    // layout, among single leaf or recursive split, which minimizes the memory
+    // used, e.g. a whole page is kept as a single leaf if most of it changed
+    // but is split down to Node::MinSize for sparse writes. Larger ranges
+    // are always split.
+    static constexpr u64 AdaptiveMaxSize = PAGE_SIZE;
+
     // Size of the memory described by this BlockTree.
     u64 m_memSize;
 
+    // Statistics about the nodes allocated by build().
+    Snapshot::StorageStats m_stats;
+
     // Root node of the block tree.
     std::shared_ptr<Node> m_root;
 
+    // Ranges of memory are built in parallel on the shared ThreadPool, each
+    // range being at least this size.
+    static constexpr u64 ParallelMinSize = 4 * 1024 * 1024;
+
+    // Builds the nodes of a range of a new tree, re-using the nodes from the
+    // base tree where the memory did not change. Builders of disjoint ranges
+    // are independent from each other, hence can run in parallel. Each
+    // builder collects the stats of the nodes it allocates.
+    // In the methods below, a base node for a range is either the node of the
+    // base tree covering exactly that range, or a leaf of the base tree
+    // covering a larger range.
+    class Builder {
+    public:
+        // Create a builder.
+        // @param data: The latest memory content, for the entire memory.
+        // @param baseData: The content of the base memory for the range handled
+        // by this builder. nullptr if the builder does not compare against the
+        // base.
+        // @param baseOffset: The offset of the first byte of baseData in the
+        // memory.
+        // @param populated: For each page of the memory, true if it is
+        // populated. Empty if all the pages are populated.
+        Builder(u8 const * const data,
+                u8 const * const baseData,
+                u64 const baseOffset,
+                std::vector<bool> const& populated) :
+            m_data(data),
+            m_baseData(baseData),
+            m_baseOffset(baseOffset),
+            m_populated(populated),
+            m_stats({}) {}
+
+        // Get the stats of the nodes allocated by this builder.
+        // @return: The stats.
+        Snapshot::StorageStats const& stats() const {
+            return m_stats;
+        }
+
+        // Check if a range of memory is identical in the base.
+        // @param offset: The offset of the range.
+        // @param size: The size of the range.
+        // @return: true if the range did not change, false otherwise or if
+        // this builder has no base data.
+        bool isUnchanged(u64 const offset, u64 const size) const {
+            if (!isPopulated(offset, size)) {
+                // Pages are never depopulated, hence the range was zeroes in
+                // the base as well.
+                return true;
+            } else if (!m_baseData) {
+                return false;
+            }
+            bool unchanged(true);
+            forEachPopulated(offset, size, [&](u64 const off, u64 const len) {
+                unchanged = unchanged &&
+                    !std::memcmp(m_baseData + off - m_baseOffset,
+                                 m_data + off,
+                                 len);
+            });
+            return unchanged;
+        }
+
+        // Check if any page of a range is populated.
+        // @param offset: The offset of the range.
+        // @param size: The size of the range.
+        // @return: true if at least one page intersecting the range is
+        // populated.
+        bool isPopulated(u64 const offset, u64 const size) const {
+            if (m_populated.empty()) {
+                return true;
+            }
+            for (u64 p(offset / PAGE_SIZE); p * PAGE_SIZE < offset + size; ++p) {
+                if (m_populated[p]) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Call a function on each part of a range that lies in populated
+        // pages.
+        // @param offset: The offset of the range.
+        // @param size: The size of the range.
+        // @param func: Called with the offset and length of each part.
+        template<typename Func>
+        void forEachPopulated(u64 const offset,
+                              u64 const size,
+                              Func const& func) const {
+            for (u64 off(offset); off < offset + size;) {
+                u64 const end(std::min(offset + size,
+                                       (off / PAGE_SIZE + 1) * PAGE_SIZE));
+                if (m_populated.empty() || m_populated[off / PAGE_SIZE]) {
+                    func(off, end - off);
+                }
+                off = end;
+            }
+        }
+
+        // Check if a range can be split in two halves. This is not the case
+        // for the smallest nodes but also for ranges which halves would not be
+        // a multiple of Node::MinSize, which happens when the size of the
+        // memory is not a power of two.
+        // @param size: The size of the range.
+        // @return: true if the range can be split.
+        static bool canSplit(u64 const size) {
+            return !(size % (2 * Node::MinSize));
+        }
+
+        // Get the base node of one half of a range.
+        // @param baseNode: The base node of the range.
+        // @param left: If true get the base of the left half, otherwise the
+        // base of the right half.
+        // @return: The base node of the half.
+        static std::shared_ptr<Node> childBase(
+            std::shared_ptr<Node> const baseNode,
+            bool const left) {
+            if (!baseNode || baseNode->isLeaf()) {
+                return baseNode;
+            }
+            return left ? baseNode->leftNode() : baseNode->rightNode();
+        }
+
+        // Create a leaf node holding a copy of data[offset;offset + size].
+        // Pages that are not populated are filled with zeroes.
+        // @param offset: The offset of the range.
+        // @param size: The size of the range.
+        // @return: The new leaf.
+        std::shared_ptr<Node> newLeaf(u64 const offset, u64 const size) {
+            std::unique_ptr<u8[]> leafData(new u8[size]);
+            if (m_populated.empty()) {
+                std::memcpy(leafData.get(), m_data + offset, size);
+            } else {
+                std::memset(leafData.get(), 0, size);
+                forEachPopulated(offset, size, [&](u64 const off,
+                                                   u64 const len) {
+                    std::memcpy(leafData.get() + off - offset,
+                                m_data + off,
+                                len);
+                });
+            }
+            m_stats.numNodes ++;
+            m_stats.numLeaves ++;
+            m_stats.leafBytes += size;
+            for (u64 i(0); i < size; i += Node::MinSize) {
+                if (!isUnchanged(offset + i, Node::MinSize)) {
+                    m_stats.changedBytes += Node::MinSize;
+                }
+            }
+            return std::shared_ptr<Node>(new Node(
+                offset, size,
+                std::make_shared<LeafData>(std::move(leafData), size), 0));
+        }
+
+        // Get the node to use for an unchanged range, re-using the base
+        // tree. If the base node is a larger leaf then this creates a new leaf
+        // pointing inside its data, copying nothing.
+        // @param baseNode: The base node of the range.
+        // @param offset: The offset of the range.
+        // @param size: The size of the range.
+        // @return: The node for the range.
+        std::shared_ptr<Node> reuse(std::shared_ptr<Node> const baseNode,
+                                    u64 const offset,
+                                    u64 const size) {
+            if (baseNode->offset() == offset && baseNode->size() == size) {
+                return baseNode;
+            }
+            assert(baseNode->isLeaf());
+            m_stats.numNodes ++;
+            return std::shared_ptr<Node>(new Node(
+                offset, size, baseNode->data(),
+                baseNode->dataOffset() + offset - baseNode->offset()));
+        }
+
+        // Compute the minimum cost of storing a range given its base node,
+        // e.g. the best choice among a single leaf or splitting the range.
+        // This mirrors the decisions made by build().
+        // @param baseNode: The base node of the range.
+        // @param offset: The offset of the range.
+        // @param size: The size of the range.
+        // @return: The approximate cost in bytes.
+        u64 cost(std::shared_ptr<Node> const baseNode,
+                 u64 const offset,
+                 u64 const size) const {
+            if (isUnchanged(offset, size)) {
+                bool const exact(baseNode->offset() == offset &&
+                                 baseNode->size() == size);
+                return exact ? 0 : NodeCost;
+            }
+            u64 const leafCost(size + NodeCost + LeafDataCost);
+            if (!canSplit(size)) {
+                return leafCost;
+            }
+            u64 const splitCost(
+                NodeCost +
+                cost(childBase(baseNode, true), offset, size / 2) +
+                cost(childBase(baseNode, false), offset + size / 2, size / 2));
+            return std::min(leafCost, splitCost);
+        }
+
+        // Build a new node for range data[offset;offset + size] using
+        // baseNode as the base. If the data in this range is identical to the
+        // data described by baseNode then baseNode is re-used. Otherwise this
+        // returns a new Node describing the latest data[offset;offset + size].
+        // @param baseNode: The base node of the range. If nullptr then this
+        // always allocate a leaf node.
+        // @param offset: The offset of the range.
+        // @param size: The size of the range.
+        // @return: The node for the range.
+        std::shared_ptr<Node> build(std::shared_ptr<Node> const baseNode,
+                                    u64 const offset,
+                                    u64 const size) {
+            assert(size >= Node::MinSize);
+            if (!baseNode) {
+                // Nothing to base on. Ranges that were never populated point
+                // to the shared zero data, others are split until they are
+                // either entirely populated or cannot be split further.
+                if (!isPopulated(offset, size)) {
+                    m_stats.numNodes ++;
+                    return std::shared_ptr<Node>(
+                        new Node(offset, size, LeafData::zeroes(), 0));
+                } else if (!canSplit(size) || isFullyPopulated(offset, size)) {
+                    return newLeaf(offset, size);
+                }
+                std::shared_ptr<Node> recLeft(build(nullptr, offset, size / 2));
+                std::shared_ptr<Node> recRight(
+                    build(nullptr, offset + size / 2, size / 2));
+                m_stats.numNodes ++;
+                return std::shared_ptr<Node>(
+                    new Node(offset, size, recLeft, recRight));
+            } else if (isUnchanged(offset, size)) {
+                // Data is identical to the base, re-use it.
+                return reuse(baseNode, offset, size);
+            } else if (!canSplit(size)) {
+                // The data is not identical to the base, we need to allocated a
+                // new node. However, we have reached the minimum allowed node
+                // size. Hence create a leaf node.
+                return newLeaf(offset, size);
+            }
+
+            u64 const middleOff(offset + size / 2);
+            std::shared_ptr<Node> const leftBase(childBase(baseNode, true));
+            std::shared_ptr<Node> const rightBase(childBase(baseNode, false));
+            if (size <= AdaptiveMaxSize) {
+                // Splitting re-uses the unchanged parts of the range at the
+                // cost of more nodes. Only do so if this is cheaper than
+                // copying the whole range into a single leaf.
+                u64 const leafCost(size + NodeCost + LeafDataCost);
+                u64 const splitCost(NodeCost +
+                                    cost(leftBase, offset, size / 2) +
+                                    cost(rightBase, middleOff, size / 2));
+                if (leafCost <= splitCost) {
+                    return newLeaf(offset, size);
+                }
+            }
+            // Create an intermediate node that breaks this range in half as
+            // this range will most likely change in the future, at which point
+            // we might have more chance for re-use.
+            std::shared_ptr<Node> recLeft(build(leftBase, offset, size / 2));
+            std::shared_ptr<Node> recRight(build(rightBase, middleOff, size / 2));
+            m_stats.numNodes ++;
+            return std::shared_ptr<Node>(
+                new Node(offset, size, recLeft, recRight));
+        }
+
+    private:
+        // Check if all the pages of a range are populated.
+        // @param offset: The offset of the range.
+        // @param size: The size of the range.
+        // @return: true if all the pages intersecting the range are
+        // populated.
+        bool isFullyPopulated(u64 const offset, u64 const size) const {
+            if (m_populated.empty()) {
+                return true;
+            }
+            for (u64 p(offset / PAGE_SIZE); p * PAGE_SIZE < offset + size; ++p) {
+                if (!m_populated[p]) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        u8 const * m_data;
+        u8 const * m_baseData;
+        u64 m_baseOffset;
+        std::vector<bool> const& m_populated;
+        Snapshot::StorageStats m_stats;
+    };
+
     // Build a BlockTree from a base tree. This creates an optimized BlockTree
     // that re-uses nodes from the base tree if the memory ranges described by
-    // those node are identical in `memory`.
+    // those node are identical in `memory`. Large memories are split into
+    // ranges following the layout of the tree, which are compared and built
+    // in parallel. Updates m_stats.
     // @param base: The base BlockTree to build from.
     // @param data: The latest memory content. This is the memory that will be
     // described by the new tree.
     // @param size: The size of the memory.
+    // @param populated: For each page of the memory, true if it is populated.
+    // Empty if all the pages are populated.
     // @return: The root node of the new tree covering the entire memory.
-    static std::shared_ptr<Node> build(std::shared_ptr<BlockTree> const base,
-                                       u8 const * const data,
-                                       u64 const size) {
+    std::shared_ptr<Node> build(std::shared_ptr<BlockTree> const base,
+                                u8 const * const data,
+                                u64 const size,
+                                std::vector<bool> const& populated) {
         assert(!(size % Node::MinSize));
-        // Helper lambda recursively building the new tree one node at a time.
-        // This lambda builds a new node for range data[offset;offset + size]
-        // using baseNode as the base. If the data in this range is identical to
-        // the data described by baseNode then baseNode is returned. Otherwise
-        // this returns a new Node describing the latest data[offset;offset +
-        // size].
-        // If baseNode is nullptr then this always allocate a leaf node.
-        std::function<std::shared_ptr<Node> (std::shared_ptr<Node>,u64,u64)>
-            inner([&](std::shared_ptr<Node> const baseNode,
-                      u64 const offset,
-                      u64 const size) {
-            assert(size >= Node::MinSize);
-            if (!baseNode) {
-                // Base-case, nothing to base on, just build a leaf node for
-                // that range of memory.
-                std::shared_ptr<u8> leafData(new u8[size]);
-                std::memcpy(leafData.get(), data + offset, size);
-                return std::shared_ptr<Node>(new Node(offset, size, leafData));
-            }
-
-            // We have a baseNode for this range. Read its data and compare to
-            // the latest data.
-            std::unique_ptr<u8> baseNodeData(new u8[size]);
-            baseNode->read(baseNodeData.get(), 0, size);
-            if (!std::memcmp(baseNodeData.get(), data + offset, size)) {
-                // Data is identical to baseNode, we can re-use this node.
-                return baseNode;
-            } else if (size == Node::MinSize) {
-                // The data is not identical to baseNode, we need to allocated a
-                // new node. However, we have reached the minimum allowed node
-                // size. Hence create a leaf node.
-                std::shared_ptr<u8> leafData(new u8[size]);
-                std::memcpy(leafData.get(), data + offset, size);
-                return std::shared_ptr<Node>(new Node(offset, size, leafData));
+        assert(populated.empty() ||
+               populated.size() == (size + PAGE_SIZE - 1) / PAGE_SIZE);
+        bool const allPopulated(std::find(populated.begin(),
+                                          populated.end(),
+                                          false) == populated.end());
+        if (!base && !allPopulated) {
+            // Only copy the populated parts of the memory.
+            Builder builder(data, nullptr, 0, populated);
+            std::shared_ptr<Node> const root(builder.build(nullptr, 0, size));
+            m_stats = builder.stats();
+            return root;
+        } else if (!base) {
+            // Nothing to base on, build a single leaf for the entire memory.
+            std::unique_ptr<u8[]> leafData(new u8[size]);
+            Util::parallelMemcpy(leafData.get(), data, size);
+            m_stats = Snapshot::StorageStats({
+                .numNodes = 1,
+                .numLeaves = 1,
+                .leafBytes = size,
+                .changedBytes = size,
+            });
+            return std::shared_ptr<Node>(new Node(
+                0, size, std::make_shared<LeafData>(std::move(leafData), size),
+                0));
+        }
+
+        // Check if a range is split into ranges that are built in parallel.
+        auto const isSplit([](u64 const size) {
+            return size >= 2 * ParallelMinSize && Builder::canSplit(size);
+        });
+
+        // A range built by a single task. node is nullptr if the range did not
+        // change.
+        struct Range {
+            std::shared_ptr<Node> baseNode;
+            u64 offset;
+            u64 size;
+            std::shared_ptr<Node> node;
+            Snapshot::StorageStats stats;
+        };
+        std::vector<Range> ranges;
+        std::function<void (std::shared_ptr<Node>, u64, u64)> split(
+            [&](std::shared_ptr<Node> const baseNode,
+                u64 const offset,
+                u64 const size) {
+            if (isSplit(size)) {
+                split(Builder::childBase(baseNode, true), offset, size / 2);
+                split(Builder::childBase(baseNode, false),
+                      offset + size / 2,
+                      size / 2);
             } else {
-                // The data is different than the base. Create an intermediate
-                // node that breaks this range in half as this range will most
-                // likely change in the future, at which point we might have
-                // more chance for re-use.
-                u64 const middleOff(offset + size / 2);
-                std::shared_ptr<Node> recLeft(
-                    inner(baseNode->leftNode(), offset, size / 2));
-                std::shared_ptr<Node> recRight(
-                    inner(baseNode->rightNode(), middleOff, size / 2));
-                return std::shared_ptr<Node>(
-                    new Node(offset, size, recLeft, recRight));
+                ranges.push_back(Range({
+                    .baseNode = baseNode,
+                    .offset = offset,
+                    .size = size,
+                    .node = nullptr,
+                    .stats = {},
+                }));
+            }
+        });
+        split(base->m_root, 0, size);
+
+        Util::ThreadPool::shared().parallelFor(ranges.size(), [&](u64 const i) {
+            Range& range(ranges[i]);
+            if (!Builder(data, nullptr, 0, populated).isPopulated(range.offset,
+                                                                  range.size)) {
+                // Never populated, hence unchanged. Avoids reading the base.
+                return;
+            }
+            // Read the base memory of the range only once instead of reading
+            // each base node as they are compared.
+            std::unique_ptr<u8[]> const baseData(new u8[range.size]);
+            range.baseNode->read(baseData.get(),
+                                 range.offset - range.baseNode->offset(),
+                                 range.size);
+            Builder builder(data, baseData.get(), range.offset, populated);
+            if (!builder.isUnchanged(range.offset, range.size)) {
+                range.node = builder.build(range.baseNode,
+                                           range.offset,
+                                           range.size);
+            }
+            range.stats = builder.stats();
+        });
+
+        // Assemble the nodes above the ranges, in the same order as split().
+        // Returns nullptr if the whole range did not change.
+        Builder builder(data, nullptr, 0, populated);
+        u64 nextRange(0);
+        std::function<std::shared_ptr<Node> (std::shared_ptr<Node>, u64, u64)>
+            assemble([&](std::shared_ptr<Node> const baseNode,
+                         u64 const offset,
+                         u64 const size) -> std::shared_ptr<Node> {
+            if (!isSplit(size)) {
+                Range const& range(ranges[nextRange ++]);
+                m_stats += range.stats;
+                return range.node;
+            }
+            std::shared_ptr<Node> const leftBase(
+                Builder::childBase(baseNode, true));
+            std::shared_ptr<Node> const rightBase(
+                Builder::childBase(baseNode, false));
+            u64 const middleOff(offset + size / 2);
+            std::shared_ptr<Node> left(assemble(leftBase, offset, size / 2));
+            std::shared_ptr<Node> right(assemble(rightBase, middleOff, size / 2));
+            if (!left && !right) {
+                return nullptr;
+            } else if (!left) {
+                left = builder.reuse(leftBase, offset, size / 2);
+            } else if (!right) {
+                right = builder.reuse(rightBase, middleOff, size / 2);
             }
+            m_stats.numNodes ++;
+            return std::shared_ptr<Node>(new Node(offset, size, left, right));
         });
-        return inner(!!base ? base->m_root : nullptr, 0, size);
+        std::shared_ptr<Node> root(assemble(base->m_root, 0, size));
+        if (!root) {
+            root = builder.reuse(base->m_root, 0, size);
+        }
+        m_stats += builder.stats();
+        return root;
     }
+
+    // Build the node of a range from its base node and the writes to the
+    // memory. Ranges that are not written re-use the base, ranges entirely
+    // covered by a single write or that cannot be split become a new leaf,
+    // others are split. Updates m_stats.
+    // @param baseNode: The base node of the range.
+    // @param offset: The offset of the range.
+    // @param size: The size of the range.
+    // @param writes: The writes, only those intersecting the range are used.
+    // @return: The node for the range.
+    std::shared_ptr<Node> update(std::shared_ptr<Node> const baseNode,
+                                 u64 const offset,
+                                 u64 const size,
+                                 Snapshot::PhysicalData const& writes) {
+        Snapshot::PhysicalData inRange;
+        bool covered(false);
+        for (auto const& [writeOff, data] : writes) {
+            if (writeOff < offset + size && offset < writeOff + data.size()) {
+                inRange.emplace_back(writeOff, data);
+                covered = covered || (writeOff <= offset &&
+                                      offset + size <= writeOff + data.size());
+            }
+        }
+        if (inRange.empty()) {
+            std::vector<bool> const allPopulated;
+            Builder builder(nullptr, nullptr, 0, allPopulated);
+            std::shared_ptr<Node> const node(
+                builder.reuse(baseNode, offset, size));
+            m_stats += builder.stats();
+            return node;
+        } else if (covered || !Builder::canSplit(size)) {
+            std::unique_ptr<u8[]> leafData(new u8[size]);
+            baseNode->read(leafData.get(), offset - baseNode->offset(), size);
+            std::unique_ptr<u8[]> const baseData(new u8[size]);
+            std::memcpy(baseData.get(), leafData.get(), size);
+            // Later writes take precedence over the earlier ones.
+            for (auto const& [writeOff, data] : inRange) {
+                u64 const start(std::max(offset, writeOff));
+                u64 const end(std::min(offset + size, writeOff + data.size()));
+                std::memcpy(leafData.get() + start - offset,
+                            data.data() + start - writeOff,
+                            end - start);
+            }
+            m_stats.numNodes ++;
+            m_stats.numLeaves ++;
+            m_stats.leafBytes += size;
+            for (u64 i(0); i < size; i += Node::MinSize) {
+                if (!!std::memcmp(leafData.get() + i,
+                                  baseData.get() + i,
+                                  Node::MinSize)) {
+                    m_stats.changedBytes += Node::MinSize;
+                }
+            }
+            return std::shared_ptr<Node>(new Node(
+                offset, size,
+                std::make_shared<LeafData>(std::move(leafData), size), 0));
+        }
+        u64 const middleOff(offset + size / 2);
+        std::shared_ptr<Node> left(update(Builder::childBase(baseNode, true),
+                                          offset,
+                                          size / 2,
+                                          inRange));
+        std::shared_ptr<Node> right(update(Builder::childBase(baseNode, false),
+                                           middleOff,
+                                           size / 2,
+                                           inRange));
+        m_stats.numNodes ++;
+        return std::shared_ptr<Node>(new Node(offset, size, left, right));
+    }
+};
+
+// Physical memory ranges, as pairs of offset and size.
+using PhysicalRanges = std::vector<std::pair<u64, u64>>;
+
+// The values derived from the state of a Snapshot, see Snapshot::cpuMode() and
+// below. Each value is stored along with the physical memory ranges read to
+// compute it, so that the next snapshot can check if it is still valid.
+struct DerivedState {
+    // A computed value.
+    template<typename T>
+    struct Entry {
+        T value;
+        // The physical memory read to compute the value.
+        PhysicalRanges reads;
+    };
+
+    // A cached value, nullptr until computed. Entries are immutable once
+    // computed, hence they are shared with the next snapshots when still
+    // valid.
+    template<typename T>
+    using Slot = std::shared_ptr<Entry<T> const>;
+
+    // Protects all the slots below.
+    std::mutex mutex;
+    Slot<Vm::CpuMode> cpuMode;
+    Slot<std::vector<u8>> gdt;
+    Slot<std::vector<u8>> idt;
+    Slot<std::vector<u64>> stackFrames;
+    Slot<std::vector<Snapshot::MappedRegion>> mappedRegions;
 };
 
+// Get a value from a DerivedState, computing it if needed. The value of the base
+// is only re-used if the base already computed it, this never computes values
+// of the base.
+// @param derived: The DerivedState of the snapshot.
+// @param base: The DerivedState of the base snapshot, nullptr if none.
+// @param slot: The slot of the value.
+// @param canReuse: Called with the entry of the base, if computed. Returns true
+// if its value is still valid for the snapshot.
+// @param compute: Computes the value, appending the physical memory ranges it
+// reads to its argument.
+// @return: The value.
+template<typename T>
+static T const& derive(
+    DerivedState& derived,
+    DerivedState * const base,
+    DerivedState::Slot<T> DerivedState::* const slot,
+    std::function<bool (DerivedState::Entry<T> const&)> const& canReuse,
+    std::function<T (PhysicalRanges&)> const& compute) {
+    std::unique_lock<std::mutex> const lock(derived.mutex);
+    if (!!(derived.*slot)) {
+        return (derived.*slot)->value;
+    }
+    DerivedState::Slot<T> baseEntry;
+    if (!!base) {
+        std::unique_lock<std::mutex> const baseLock(base->mutex);
+        baseEntry = base->*slot;
+    }
+    if (!!baseEntry && canReuse(*baseEntry)) {
+        derived.*slot = baseEntry;
+    } else {
+        PhysicalRanges reads;
+        T value(compute(reads));
+        derived.*slot = std::make_shared<DerivedState::Entry<T> const>(
+            DerivedState::Entry<T>({
+                .value = std::move(value),
+                .reads = std::move(reads),
+            }));
+    }
+    return (derived.*slot)->value;
+}
+
+// Check if the registers controlling the translation of linear addresses are
+// identical.
+// @param a: The first set of registers.
+// @param b: The second set of registers.
+// @return: true if the registers are identical, in which case the same page
+// tables are used.
+static bool samePaging(Snapshot::Registers const& a,
+                       Snapshot::Registers const& b) {
+    return a.cr0 == b.cr0 && a.cr3 == b.cr3 && a.cr4 == b.cr4 &&
+        a.efer == b.efer;
+}
+
 Snapshot::Snapshot(std::unique_ptr<Vm::State> state) :
     Snapshot(nullptr, std::move(state)) {}
 
@@ -266,9 +1385,109 @@ Snapshot::Snapshot(std::shared_ptr<Snapshot> const base,
                    std::unique_ptr<Vm::State> state) :
     m_baseSnapshot(base),
     m_regs(state->registers()),
+    m_extendedState(shareExtendedState(base, state->extendedState())),
     m_blockTree(new BlockTree(!!base ? base->m_blockTree : nullptr,
                             state->memory().data.get(),
-                            state->memory().size)) {}
+                            state->memory().size,
+                            state->memory().populated)),
+    m_derived(new DerivedState()) {}
+
+Snapshot::Snapshot(std::shared_ptr<Snapshot> const base,
+                   Vm::State::Registers const& regs) :
+    m_baseSnapshot(base),
+    m_regs(regs),
+    m_extendedState(base->m_extendedState),
+    m_blockTree(base->m_blockTree),
+    m_derived(new DerivedState()) {}
+
+Snapshot::Snapshot(std::shared_ptr<Snapshot> const base,
+                   Vm::State::Registers const& regs,
+                   Vm::State::ExtendedState const& extendedState) :
+    m_baseSnapshot(base),
+    m_regs(regs),
+    m_extendedState(shareExtendedState(base, extendedState)),
+    m_blockTree(base->m_blockTree),
+    m_derived(new DerivedState()) {}
+
+Snapshot::Snapshot(std::shared_ptr<Snapshot> const base,
+                   Vm::State::Registers const& regs,
+                   Vm::State::ExtendedState const& extendedState,
+                   PhysicalData const& writes) :
+    m_baseSnapshot(base),
+    m_regs(regs),
+    m_extendedState(shareExtendedState(base, extendedState)),
+    m_blockTree(new BlockTree(base->m_blockTree, writes)),
+    m_derived(new DerivedState()) {}
+
+std::shared_ptr<Snapshot> Snapshot::afterStep(
+    std::shared_ptr<Snapshot> const base,
+    Vm const& vm,
+    std::optional<u64> const registerOnlyNextRip) {
+    // Backends recording the effects of the step tell exactly which memory
+    // was written, otherwise rely on decoding the instruction.
+    std::optional<Vm::StepEffects> const effects(vm.lastStepEffects());
+    if (!effects && !registerOnlyNextRip) {
+        return std::make_shared<Snapshot>(base, vm.getState());
+    }
+    auto const [regs, extendedState](vm.getCpuState());
+    if (!effects && regs.rip != *registerOnlyNextRip) {
+        // The instruction raised an exception which might have pushed an
+        // exception frame onto the stack.
+        return std::make_shared<Snapshot>(base, vm.getState());
+    } else if (!effects || effects->memoryWrites.empty()) {
+        // Without effects, the accessed and dirty bits set in the page tables
+        // by the cpu while executing the instruction are not recorded here but
+        // by the next full snapshot, see the declaration.
+        return std::make_shared<Snapshot>(base, regs, extendedState);
+    }
+    // Merge the overlapping and adjacent writes, e.g. the elements written
+    // by a rep stos, so that each range is read and stored once.
+    std::vector<std::pair<u64, u64>> ranges(effects->memoryWrites);
+    std::sort(ranges.begin(), ranges.end());
+    PhysicalData writes;
+    for (u64 i(0); i < ranges.size();) {
+        u64 const offset(ranges[i].first);
+        u64 end(offset + ranges[i].second);
+        for (++i; i < ranges.size() && ranges[i].first <= end; ++i) {
+            end = std::max(end, ranges[i].first + ranges[i].second);
+        }
+        writes.emplace_back(offset,
+                            vm.readPhysicalMemory(offset, end - offset));
+    }
+    return std::make_shared<Snapshot>(base, regs, extendedState, writes);
+}
+
+Snapshot::StorageStats& Snapshot::StorageStats::operator+=(
+    StorageStats const& other) {
+    numNodes += other.numNodes;
+    numLeaves += other.numLeaves;
+    leafBytes += other.leafBytes;
+    changedBytes += other.changedBytes;
+    return *this;
+}
+
+Snapshot::CompressionStats& Snapshot::CompressionStats::operator+=(
+    CompressionStats const& other) {
+    numLeaves += other.numLeaves;
+    rawBytes += other.rawBytes;
+    compressedBytes += other.compressedBytes;
+    return *this;
+}
+
+Snapshot::CompressionStats Snapshot::compressMemory(
+    Snapshot const& live) const {
+    return m_blockTree->compressLeaves(
+        !!m_baseSnapshot ? m_baseSnapshot->m_blockTree.get() : nullptr,
+        *live.m_blockTree);
+}
+
+Snapshot::StorageStats Snapshot::storageStats() const {
+    if (!!m_baseSnapshot && m_baseSnapshot->m_blockTree == m_blockTree) {
+        // The tree is re-used from the base, nothing was allocated.
+        return StorageStats({});
+    }
+    return m_blockTree->stats();
+}
 
 std::shared_ptr<Snapshot> Snapshot::base() const {
     return m_baseSnapshot;
@@ -282,11 +1501,76 @@ Snapshot::Registers const& Snapshot::registers() const {
     return m_regs;
 }
 
+Vm::State::ExtendedState const& Snapshot::extendedState() const {
+    return *m_extendedState;
+}
+
+std::shared_ptr<Vm::State::ExtendedState const> Snapshot::shareExtendedState(
+    std::shared_ptr<Snapshot> const& base,
+    Vm::State::ExtendedState const& extendedState) {
+    if (!!base && *base->m_extendedState == extendedState) {
+        return base->m_extendedState;
+    }
+    return std::make_shared<Vm::State::ExtendedState const>(extendedState);
+}
+
 std::vector<u8> Snapshot::readPhysicalMemory(u64 const offset,
                                              u64 const size) const {
     return m_blockTree->read(offset, size);
 }
 
+u64 Snapshot::physicalMemorySize() const {
+    return m_blockTree->size();
+}
+
+std::vector<std::pair<u64, u64>> Snapshot::changedPhysicalRanges(
+    Snapshot const& other) const {
+    if (m_blockTree == other.m_blockTree) {
+        return {};
+    }
+    return m_blockTree->changedRanges(*other.m_blockTree);
+}
+
+bool Snapshot::sharesPhysicalRangeWithBase(u64 const offset,
+                                           u64 const size) const {
+    return unchangedSinceBase(PhysicalRanges({{offset, size}}));
+}
+
+std::vector<Snapshot::MemoryWrite> Snapshot::physicalMemoryHistory(
+    u64 const offset,
+    u64 const size) const {
+    // Walk the chain of bases backward, from this snapshot to the root. The
+    // steps are only known once the root is reached, hence record the
+    // distance to this snapshot for now.
+    std::vector<MemoryWrite> writes;
+    u64 distance(0);
+    Snapshot const * curr(this);
+    std::vector<u8> currValue(readPhysicalMemory(offset, size));
+    for (; curr->hasBase(); curr = curr->m_baseSnapshot.get(), ++distance) {
+        Snapshot const& base(*curr->m_baseSnapshot);
+        if (curr->m_blockTree->sharesRange(*base.m_blockTree, offset, size)) {
+            // The range is shared with the base, skip without reading memory.
+            continue;
+        }
+        // The nodes differ, which might only be due to another part of the
+        // same leaf changing.
+        std::vector<u8> baseValue(base.readPhysicalMemory(offset, size));
+        if (baseValue != currValue) {
+            writes.push_back(MemoryWrite(distance, base.m_regs.rip, currValue));
+            currValue = std::move(baseValue);
+        }
+    }
+    // Initial value, in the root snapshot.
+    writes.push_back(MemoryWrite(distance, 0, currValue));
+
+    // Convert the distances into steps and order by ascending step.
+    std::reverse(writes.begin(), writes.end());
+    for (MemoryWrite& write : writes) {
+        write.step = distance - write.step;
+    }
+    return writes;
+}
+
 // A entry in a page table. The beauty of X86_64 is that all level are sharing
 // the same entry layout.
 struct Entry {
@@ -351,17 +1635,21 @@ private:
 // @param lAddr: The linear address to map.
 // @return: The physical address to which `lAddr` is mapped to.
 template<u64 L>
-MapResult map(BlockTree const& mem, u64 const tableOffset, u64 const lAddr) {
+MapResult map(BlockTree const& mem,
+              u64 const tableOffset,
+              u64 const lAddr,
+              PhysicalRanges& reads) {
     // Compute the bits that are used to index the current table of level L.
     u64 const mask(0b111111111);
     u64 const entryIdx((lAddr >> (12 + (L - 1) * 9)) & mask);
     u64 const entryOffset(tableOffset + entryIdx * sizeof(Entry));
     // Read the entry from the table.
     std::vector<u8> const raw(mem.read(entryOffset, sizeof(Entry)));
+    reads.emplace_back(entryOffset, sizeof(Entry));
     Entry const * const entry(reinterpret_cast<Entry const*>(raw.data()));
     if (entry->present) {
         // Recurse on the next table.
-        return map<L-1>(mem, entry->nextTableOffset(), lAddr);
+        return map<L-1>(mem, entry->nextTableOffset(), lAddr, reads);
     } else {
         // The linear address is not mapped. Return an invalid address.
         return MapResult();
@@ -373,7 +1661,8 @@ MapResult map(BlockTree const& mem, u64 const tableOffset, u64 const lAddr) {
 template<>
 MapResult map<0>(BlockTree const& mem __attribute__((unused)),
                u64 const frameOffset,
-               u64 const lAddr) {
+               u64 const lAddr,
+               PhysicalRanges& reads __attribute__((unused))) {
     // Sanity check that the address is page aligned.
     u64 const pageOffsetMask((1ULL << 12) - 1);
     assert(!(frameOffset & pageOffsetMask));
@@ -383,10 +1672,18 @@ MapResult map<0>(BlockTree const& mem __attribute__((unused)),
 
 std::vector<u8> Snapshot::readLinearMemory(u64 const offset,
                                            u64 const size) const {
+    PhysicalRanges reads;
+    return readLinearMemory(offset, size, reads);
+}
+
+std::vector<u8> Snapshot::readLinearMemory(u64 const offset,
+                                           u64 const size,
+                                           PhysicalRanges& reads) const {
     bool const pagingEnabled(m_regs.cr0 & (1 << 31));
     if (!pagingEnabled) {
         // Paging is not enabled, linear memory addresses == physical memory
         // addresses hence we can read from physical memory directly.
+        reads.emplace_back(offset, size);
         return readPhysicalMemory(offset, size);
     }
     // FIXME: If paging is enabled while running in 32-bit protected mode, this
@@ -408,13 +1705,15 @@ std::vector<u8> Snapshot::readLinearMemory(u64 const offset,
         // Map the linear address to read from.
         MapResult const mapRes(map<4>(*m_blockTree.get(),
                                       pml4Offset,
-                                      readStartLinOffset));
+                                      readStartLinOffset,
+                                      reads));
         if (mapRes) {
             // The linear address is mapped to physical memory. Read the
             // associated physical memory and append to the result buffer.
             u64 const readOff(mapRes.physicalOffset());
             // Read data for this page from physical memory.
             std::vector<u8> const data(m_blockTree->read(readOff, readLen));
+            reads.emplace_back(readOff, readLen);
             // Copy over the data in destination buffer.
             result.insert(result.end(), data.begin(), data.end());
         } else {
@@ -428,83 +1727,284 @@ std::vector<u8> Snapshot::readLinearMemory(u64 const offset,
     return result;
 }
 
+bool Snapshot::unchangedSinceBase(PhysicalRanges const& ranges) const {
+    if (!m_baseSnapshot) {
+        return false;
+    } else if (m_baseSnapshot->m_blockTree == m_blockTree) {
+        // Register-only snapshot, the memory is identical.
+        return true;
+    }
+    BlockTree const& baseTree(*m_baseSnapshot->m_blockTree);
+    return std::all_of(ranges.begin(), ranges.end(), [&](auto const& range) {
+        return m_blockTree->sharesRange(baseTree, range.first, range.second);
+    });
+}
+
 Vm::CpuMode Snapshot::cpuMode() const {
+    return derive<Vm::CpuMode>(
+        *m_derived,
+        !!m_baseSnapshot ? m_baseSnapshot->m_derived.get() : nullptr,
+        &DerivedState::cpuMode,
+        [&](DerivedState::Entry<Vm::CpuMode> const& entry) {
+            Registers const& base(m_baseSnapshot->m_regs);
+            return samePaging(m_regs, base) && m_regs.cs == base.cs &&
+                m_regs.gdt == base.gdt && unchangedSinceBase(entry.reads);
+        },
+        [&](PhysicalRanges& reads) {
+            return computeCpuMode(reads);
+        });
+}
+
+Vm::CpuMode Snapshot::computeCpuMode(PhysicalRanges& reads) const {
     bool const protectedModeEnabled(m_regs.cr0 & 0x1);
     if (!protectedModeEnabled) {
         // Protected mode is not enabled, we are in real mode hence running
         // 16-bit code.
         return Vm::CpuMode::RealMode;
+    }
+    // Protected mode is enabled, we can either run 16, 32, or 64 bit code at
+    // this point. This depends on the descriptor of the current code segment.
+    // FIXME: We are not yet supporting LDTs here.
+    u16 const codeSegmentIndex(m_regs.cs >> 3);
+
+    // Check if the entry is a valid GDT entry, that is the entry is within the
+    // GDT's limits and its present bit is set. Make sure not to get bamboozled
+    // by an overflow: a limit of 0xffff is valid and indicate that the GDT has
+    // the max amount of entries.
+    u64 const numEntries((u64(m_regs.gdt.limit) + 1) / 8);
+    bool isValidEntry(false);
+    u64 entry(0);
+    if (codeSegmentIndex < numEntries) {
+        u64 const entryLinAddr(m_regs.gdt.base + codeSegmentIndex * 8);
+        std::vector<u8> const entryBytes(
+            readLinearMemory(entryLinAddr, sizeof(entry), reads));
+        if (entryBytes.size() == sizeof(entry)) {
+            std::memcpy(&entry, entryBytes.data(), sizeof(entry));
+            isValidEntry = !!(entry & (1ULL << 47));
+        }
+    }
+    // The D/B bit and the L bit of the descriptor.
+    bool const defaultOpSize((entry >> 54) & 1);
+    bool const lBit((entry >> 53) & 1);
+
+    bool const longModeActive(m_regs.efer & (1 << 10));
+    if (!longModeActive) {
+        // The Long Mode Active (LMA) bit of EFER is un-set hence we are still
+        // in protected mode, right before enabling 64-bit mode. Look at the
+        // current code segment being used to know if we are running in 16 or
+        // 32 bit mode.
+        if (!isValidEntry) {
+            // The code segment index is not valid, we must be still in 16-bit
+            // mode between the mov enabling the protected mode and the far
+            // jump into protected mode.
+            return Vm::CpuMode::RealMode;
+        } else if (!defaultOpSize) {
+            // We are running in a 16-bit segment.
+            return Vm::CpuMode::RealMode;
+        } else {
+            // We are running in a 32-bit segment.
+            return Vm::CpuMode::ProtectedMode;
+        }
     } else {
-        // Protected mode is enabled, we can either run 16, 32, or 64 bit code
-        // at this point.
-        // Check if the entry at index `index` is a valid GDT entry, that is the
-        // entry is within the GDT's limits and its present bit is set.
-        // @return: true if the entry is valid, false otherwise.
-        auto const isValidGdtEntry([this](u16 const index) {
-            // Make sure not to get bamboozled by an overflow: a limit of 0xffff
-            // is valid and indicate that the GDT has the max amount of entries.
-            u64 const numEntries((u64(m_regs.gdt.limit) + 1) / 8);
-            if (numEntries <= index) {
-                // Index points outside the GDT.
-                return false;
-            }
-            // Now read the GDT entry.
-            u64 const gdtOffset(m_regs.gdt.base);
-            u64 const entryLinAddr(gdtOffset + index * 8);
-            std::vector<u8> const entryBytes(readLinearMemory(entryLinAddr, 8));
-            // Check the present bit.
-            u64 const mask(1ULL << 47);
-            return !!(*reinterpret_cast<u64 const*>(entryBytes.data()) & mask);
+        // Long mode is active, we are either in a 32-bit compat mode or in a
+        // 64-bit mode. We can differentiate by looking at the L bit of the
+        // current code segment.
+        if (lBit) {
+            return Vm::CpuMode::LongMode;
+        } else {
+            return Vm::CpuMode::ProtectedMode;
+        }
+    }
+}
+
+std::vector<u8> const& Snapshot::descriptorTable(
+    DescriptorTable const table) const {
+    bool const isGdt(table == DescriptorTable::Gdt);
+    Registers::Table const& reg(isGdt ? m_regs.gdt : m_regs.idt);
+    return derive<std::vector<u8>>(
+        *m_derived,
+        !!m_baseSnapshot ? m_baseSnapshot->m_derived.get() : nullptr,
+        isGdt ? &DerivedState::gdt : &DerivedState::idt,
+        [&](DerivedState::Entry<std::vector<u8>> const& entry) {
+            Registers const& base(m_baseSnapshot->m_regs);
+            Registers::Table const& baseReg(isGdt ? base.gdt : base.idt);
+            return samePaging(m_regs, base) && reg == baseReg &&
+                unchangedSinceBase(entry.reads);
+        },
+        [&](PhysicalRanges& reads) {
+            // Promote the limit to 64 bits, a limit of 0xffff is valid.
+            return readLinearMemory(reg.base, u64(reg.limit) + 1, reads);
         });
+}
 
-        // Read the segment descriptor at index `index` in the GDT and return
-        // its D/B.
-        auto const defaultOpSizeForGdtEntry([this](u16 const index) {
-            u64 const gdtOffset(m_regs.gdt.base);
-            u64 const entryLinAddr(gdtOffset + index * 8);
-            std::vector<u8> const entryBytes(readLinearMemory(entryLinAddr, 8));
-            return (*reinterpret_cast<u64 const*>(entryBytes.data()) >> 54) & 1;
+std::vector<u64> const& Snapshot::stackFrames() const {
+    return derive<std::vector<u64>>(
+        *m_derived,
+        !!m_baseSnapshot ? m_baseSnapshot->m_derived.get() : nullptr,
+        &DerivedState::stackFrames,
+        [&](DerivedState::Entry<std::vector<u64>> const& entry) {
+            Registers const& base(m_baseSnapshot->m_regs);
+            return samePaging(m_regs, base) && m_regs.rsp == base.rsp &&
+                m_regs.rbp == base.rbp && unchangedSinceBase(entry.reads);
+        },
+        [&](PhysicalRanges& reads) {
+            return computeStackFrames(reads);
         });
+}
 
-        // Read the L bit of the segment descriptor at index `index` in the GDT.
-        auto const LbitForGdtEntry([this](u16 const index) {
-            u64 const gdtOffset(m_regs.gdt.base);
-            u64 const entryLinAddr(gdtOffset + index * 8);
-            std::vector<u8> const entryBytes(readLinearMemory(entryLinAddr, 8));
-            return (*reinterpret_cast<u64 const*>(entryBytes.data()) >> 53) & 1;
+std::vector<u64> Snapshot::computeStackFrames(PhysicalRanges& reads) const {
+    std::vector<u64> frames;
+    u64 curr(m_regs.rbp);
+    while (m_regs.rsp <= curr && frames.size() < MaxStackFrames) {
+        frames.push_back(curr);
+        // Move to next stack frame, follow the saved RBP "linked list".
+        std::vector<u8> const rawRbp(
+            readLinearMemory(curr, sizeof(curr), reads));
+        if (rawRbp.size() != sizeof(curr)) {
+            // The saved RBP is not mapped, we cannot go up the stack frames
+            // anymore.
+            break;
+        }
+        u64 next;
+        std::memcpy(&next, rawRbp.data(), sizeof(next));
+        if (next <= curr) {
+            // Frames of callers are above the frames of their callees. This
+            // also avoids looping on a saved RBP pointing to itself.
+            break;
+        }
+        curr = next;
+    }
+    return frames;
+}
+
+std::vector<Snapshot::MappedRegion> const& Snapshot::mappedRegions() const {
+    return derive<std::vector<MappedRegion>>(
+        *m_derived,
+        !!m_baseSnapshot ? m_baseSnapshot->m_derived.get() : nullptr,
+        &DerivedState::mappedRegions,
+        [&](DerivedState::Entry<std::vector<MappedRegion>> const& entry) {
+            return samePaging(m_regs, m_baseSnapshot->m_regs) &&
+                unchangedSinceBase(entry.reads);
+        },
+        [&](PhysicalRanges& reads) {
+            return computeMappedRegions(reads);
         });
+}
 
-        // FIXME: We are not yet supporting LDTs here.
-        u16 const codeSegmentIndex(m_regs.cs >> 3);
-
-        bool const longModeActive(m_regs.efer & (1 << 10));
-        if (!longModeActive) {
-            // The Long Mode Active (LMA) bit of EFER is un-set hence we are
-            // still in protected mode, right before enabling 64-bit mode. Look
-            // at the current code segment being used to know if we are running
-            // in 16 or 32 bit mode.
-            if (!isValidGdtEntry(codeSegmentIndex)) {
-                // The code segment index is not valid, we must be still in
-                // 16-bit mode between the mov enabling the protected mode and
-                // the far jump into protected mode.
-                return Vm::CpuMode::RealMode;
-            } else if (defaultOpSizeForGdtEntry(codeSegmentIndex) == 0) {
-                // We are running in a 16-bit segment.
-                return Vm::CpuMode::RealMode;
-            } else {
-                // We are running in a 32-bit segment.
-                return Vm::CpuMode::ProtectedMode;
+bool Snapshot::pagingChangedSinceBase() const {
+    if (!m_baseSnapshot) {
+        return false;
+    } else if (!samePaging(m_regs, m_baseSnapshot->m_regs)) {
+        return true;
+    } else if (m_baseSnapshot->m_blockTree == m_blockTree) {
+        // Register-only snapshot, the page tables are identical.
+        return false;
+    }
+    // The page tables are the memory read by the base to compute its mapped
+    // regions.
+    Snapshot const& base(*m_baseSnapshot);
+    base.mappedRegions();
+    PhysicalRanges tables;
+    {
+        std::unique_lock<std::mutex> const lock(base.m_derived->mutex);
+        tables = base.m_derived->mappedRegions->reads;
+    }
+    BlockTree const& baseTree(*base.m_blockTree);
+    return std::any_of(tables.begin(), tables.end(), [&](auto const& table) {
+        auto const& [offset, size] = table;
+        if (m_blockTree->sharesRange(baseTree, offset, size)) {
+            return false;
+        }
+        // The accessed and dirty bits are set by the cpu when walking the
+        // tables and cleared when tracking the working set, they do not
+        // change the translation.
+        u64 const accessedDirtyMask((1 << 5) | (1 << 6));
+        std::vector<u8> const curr(m_blockTree->read(offset, size));
+        std::vector<u8> const prev(baseTree.read(offset, size));
+        for (u64 i(0); i + sizeof(u64) <= size; i += sizeof(u64)) {
+            u64 currEntry, prevEntry;
+            std::memcpy(&currEntry, curr.data() + i, sizeof(currEntry));
+            std::memcpy(&prevEntry, prev.data() + i, sizeof(prevEntry));
+            if ((currEntry ^ prevEntry) & ~accessedDirtyMask) {
+                return true;
             }
-        } else {
-            // Long mode is active, we are either in a 32-bit compat mode or in
-            // a 64-bit mode. We can differentiate by looking at the L bit of
-            // the current code segment.
-            if (LbitForGdtEntry(codeSegmentIndex)) {
-                return Vm::CpuMode::LongMode;
+        }
+        return false;
+    });
+}
+
+std::vector<Snapshot::MappedRegion> Snapshot::computeMappedRegions(
+    PhysicalRanges& reads) const {
+    bool const pagingEnabled(m_regs.cr0 & (1 << 31));
+    if (!pagingEnabled) {
+        return std::vector<MappedRegion>({
+            MappedRegion({
+                .linearAddress = 0,
+                .physicalOffset = 0,
+                .size = physicalMemorySize(),
+            }),
+        });
+    }
+
+    std::vector<MappedRegion> regions;
+    // Add a page to the regions, extending the last region if the page is
+    // contiguous to it in both linear and physical memory.
+    auto const addPage([&](u64 const linAddr, u64 const phyOff) {
+        if (!regions.empty()) {
+            MappedRegion& last(regions.back());
+            if (last.linearAddress + last.size == linAddr &&
+                last.physicalOffset + last.size == phyOff) {
+                last.size += PAGE_SIZE;
+                return;
+            }
+        }
+        regions.push_back(MappedRegion({
+            .linearAddress = linAddr,
+            .physicalOffset = phyOff,
+            .size = PAGE_SIZE,
+        }));
+    });
+
+    // Walk a table of level L, mapping the linear addresses starting at
+    // linBase. Tables are read entirely at once instead of one entry at a
+    // time as done in map<>(), and only once even if they are reached through
+    // several paths, e.g. with a recursive mapping.
+    // FIXME: Like map<>(), this assumes 4-level paging with 4KiB pages.
+    u64 const numEntries(PAGE_SIZE / sizeof(Entry));
+    std::unordered_map<u64, std::vector<u8>> tables;
+    u64 numWalked(0);
+    std::function<void (u64, u64, u64)> walk(
+        [&](u64 const tableOffset, u64 const level, u64 const linBase) {
+        auto it(tables.find(tableOffset));
+        if (it == tables.end()) {
+            it = tables.emplace(tableOffset,
+                                m_blockTree->read(tableOffset,
+                                                  PAGE_SIZE)).first;
+            reads.emplace_back(tableOffset, PAGE_SIZE);
+        }
+        Entry const * const entries(
+            reinterpret_cast<Entry const*>(it->second.data()));
+        u64 const entrySpan(1ULL << (12 + (level - 1) * 9));
+        for (u64 i(0); i < numEntries; ++i) {
+            if (!entries[i].present) {
+                continue;
+            } else if (++numWalked > MaxPageTableEntries) {
+                throw Error("Too many page table entries, the page tables "
+                            "may reference themselves", 0);
+            }
+            u64 linAddr(linBase + i * entrySpan);
+            if (level == 4 && (linAddr & (1ULL << 47))) {
+                // Canonical form: bits 48 to 63 are copies of bit 47.
+                linAddr |= ~((1ULL << 48) - 1);
+            }
+            if (level == 1) {
+                addPage(linAddr, entries[i].nextTableOffset());
             } else {
-                return Vm::CpuMode::ProtectedMode;
+                walk(entries[i].nextTableOffset(), level - 1, linAddr);
             }
         }
-    }
+    });
+    walk(m_regs.cr3 & ~((1ULL << 12) - 1), 4, 0);
+    return regions;
 }
 }
@@ -1,51 +1,528 @@
 #include <x86lab/ui/cli.hpp>
+#include <x86lab/historyquery.hpp>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <set>
 
 namespace X86Lab::Ui {
-Action Cli::doWaitForNextAction() {
-    if (m_isVmRunnable) {
-        return Action::Step;
+
+// Accessors for the registers that can be named in the reg and until
+// commands.
+using RegisterAccessor = std::function<u64(Snapshot::Registers const&)>;
+static std::map<std::string, RegisterAccessor> const registerAccessors = {
+    {"rax", [](auto const& r) { return r.rax; }},
+    {"rbx", [](auto const& r) { return r.rbx; }},
+    {"rcx", [](auto const& r) { return r.rcx; }},
+    {"rdx", [](auto const& r) { return r.rdx; }},
+    {"rdi", [](auto const& r) { return r.rdi; }},
+    {"rsi", [](auto const& r) { return r.rsi; }},
+    {"rsp", [](auto const& r) { return r.rsp; }},
+    {"rbp", [](auto const& r) { return r.rbp; }},
+    {"r8",  [](auto const& r) { return r.r8; }},
+    {"r9",  [](auto const& r) { return r.r9; }},
+    {"r10", [](auto const& r) { return r.r10; }},
+    {"r11", [](auto const& r) { return r.r11; }},
+    {"r12", [](auto const& r) { return r.r12; }},
+    {"r13", [](auto const& r) { return r.r13; }},
+    {"r14", [](auto const& r) { return r.r14; }},
+    {"r15", [](auto const& r) { return r.r15; }},
+    {"rip", [](auto const& r) { return r.rip; }},
+    {"rflags", [](auto const& r) { return r.rflags; }},
+    {"cs",  [](auto const& r) { return u64(r.cs); }},
+    {"ds",  [](auto const& r) { return u64(r.ds); }},
+    {"es",  [](auto const& r) { return u64(r.es); }},
+    {"fs",  [](auto const& r) { return u64(r.fs); }},
+    {"gs",  [](auto const& r) { return u64(r.gs); }},
+    {"ss",  [](auto const& r) { return u64(r.ss); }},
+    {"cr0", [](auto const& r) { return r.cr0; }},
+    {"cr2", [](auto const& r) { return r.cr2; }},
+    {"cr3", [](auto const& r) { return r.cr3; }},
+    {"cr4", [](auto const& r) { return r.cr4; }},
+    {"cr8", [](auto const& r) { return r.cr8; }},
+    {"efer", [](auto const& r) { return r.efer; }},
+};
+
+// Get the accessor for a register.
+// @param name: The name of the register.
+// @return: The accessor for this register.
+// @throws: std::invalid_argument if the register is unknown.
+static RegisterAccessor const& getRegisterAccessor(std::string const& name) {
+    auto const it(registerAccessors.find(name));
+    if (it == registerAccessors.end()) {
+        throw std::invalid_argument("Unknown register " + name);
+    }
+    return it->second;
+}
+
+// Parse an integer value, accepting decimal, hexadecimal (0x prefix) and octal
+// (0 prefix) notations.
+// @param str: The string to parse.
+// @return: The parsed value.
+// @throws: std::invalid_argument if the string is not a valid integer.
+static u64 parseValue(std::string const& str) {
+    size_t end(0);
+    u64 const value(std::stoull(str, &end, 0));
+    if (end != str.size()) {
+        throw std::invalid_argument("Invalid value " + str);
+    }
+    return value;
+}
+
+// Parse a condition of the form <reg><op><value>.
+// @param cond: The condition to parse, without any whitespace.
+// @return: A function evaluating the condition on a set of registers.
+// @throws: std::invalid_argument if the condition is malformed.
+static std::function<bool(Snapshot::Registers const&)> parseCondition(
+    std::string const& cond) {
+    // Two-chars operators must be tried first so that "<=" is not parsed as
+    // "<" followed by "=<value>".
+    static std::vector<std::pair<std::string, std::function<bool(u64, u64)>>>
+        const operators = {
+        {"==", std::equal_to<u64>()},
+        {"!=", std::not_equal_to<u64>()},
+        {"<=", std::less_equal<u64>()},
+        {">=", std::greater_equal<u64>()},
+        {"<", std::less<u64>()},
+        {">", std::greater<u64>()},
+    };
+    for (auto const& op : operators) {
+        size_t const pos(cond.find(op.first));
+        if (pos == std::string::npos) {
+            continue;
+        }
+        RegisterAccessor const reg(getRegisterAccessor(cond.substr(0, pos)));
+        u64 const value(parseValue(cond.substr(pos + op.first.size())));
+        std::function<bool(u64, u64)> const cmp(op.second);
+        return [=](Snapshot::Registers const& regs) {
+            return cmp(reg(regs), value);
+        };
+    }
+    throw std::invalid_argument("Invalid condition " + cond);
+}
+
+Cli::Cli(std::string const& scriptPath) :
+    m_scriptPath(scriptPath),
+    m_input(nullptr),
+    m_output(&std::cout),
+    m_log(&std::cerr),
+    m_restricted(false),
+    m_batchAction(Action::None),
+    m_batchRemaining(0),
+    m_cancelRequested(false),
+    m_printEachStep(false),
+    m_repStringStepping(false),
+    m_workingSetTracking(false) {}
+
+Cli::Cli(std::istream& input,
+         std::ostream& output,
+         std::ostream& log,
+         bool const restricted) :
+    m_input(&input),
+    m_output(&output),
+    m_log(&log),
+    m_restricted(restricted),
+    m_batchAction(Action::None),
+    m_batchRemaining(0),
+    m_cancelRequested(false),
+    m_printEachStep(false),
+    m_repStringStepping(false),
+    m_workingSetTracking(false) {}
+
+void Cli::cancel() {
+    m_cancelRequested = true;
+}
+
+bool Cli::doInit() {
+    if (!!m_input) {
+        // Reading from a stream given to the constructor.
+        return !!*m_input;
+    } else if (m_scriptPath == "-") {
+        m_input = &std::cin;
     } else {
+        m_scriptFile = std::make_unique<std::ifstream>(m_scriptPath);
+        m_input = m_scriptFile.get();
+    }
+    return !!*m_input;
+}
+
+Action Cli::doWaitForNextAction() {
+    while (true) {
+        if (m_cancelRequested.exchange(false)) {
+            cancelBatch();
+        }
+        if (!!m_batchRemaining) {
+            m_batchRemaining --;
+            return m_batchAction;
+        }
+        cancelBatch();
+
+        std::string line;
+        if (!std::getline(*m_input, line)) {
+            // End of the script.
+            return Action::Quit;
+        }
+        try {
+            Action const action(execute(line));
+            if (action != Action::None) {
+                return action;
+            }
+        } catch (std::exception const& e) {
+            *m_log << "Error: " << e.what() << ": " << line << std::endl;
+        }
+    }
+}
+
+Action Cli::execute(std::string const& line) {
+    std::istringstream iss(line);
+    std::string cmd;
+    if (!(iss >> cmd) || cmd[0] == '#') {
+        // Blank line or comment.
+        return Action::None;
+    }
+
+    std::vector<std::string> args;
+    for (std::string arg; iss >> arg;) {
+        args.push_back(arg);
+    }
+    auto const checkNumArgs([&](u64 const min, u64 const max) {
+        if (args.size() < min || max < args.size()) {
+            throw std::invalid_argument("Invalid number of arguments");
+        }
+    });
+    // Commands writing files or running benchmarks on the host.
+    static std::set<std::string> const hostCommands({"snapshot", "memprofile"});
+    if (m_restricted && hostCommands.contains(cmd)) {
+        throw std::invalid_argument("Command not available in this session");
+    }
+    // Parse the length of a range of memory read by a command.
+    auto const parseLength([&](std::string const& arg) {
+        u64 const len(parseValue(arg));
+        if (m_restricted && MaxRestrictedLength < len) {
+            throw std::invalid_argument("Length exceeds " +
+                                        std::to_string(MaxRestrictedLength) +
+                                        " bytes in this session");
+        }
+        return len;
+    });
+
+    if (cmd == "step" || cmd == "rstep") {
+        checkNumArgs(0, 1);
+        m_batchAction = (cmd == "step") ? Action::Step : Action::ReverseStep;
+        m_batchRemaining = args.empty() ? 1 : parseValue(args[0]);
+    } else if (cmd == "until") {
+        checkNumArgs(1, 2);
+        m_batchUntil = parseCondition(args[0]);
+        if ((*m_batchUntil)(m_state.registers())) {
+            // The condition already holds, nothing to do.
+            cancelBatch();
+        } else {
+            m_batchAction = Action::Step;
+            m_batchRemaining = (args.size() == 2) ? parseValue(args[1])
+                                                  : ~((u64)0);
+        }
+    } else if (cmd == "reg") {
+        checkNumArgs(1, 1);
+        u64 const value(getRegisterAccessor(args[0])(m_state.registers()));
+        print("%s = 0x%016lx\n", args[0].c_str(), value);
+    } else if (cmd == "regs") {
+        checkNumArgs(0, 0);
+        printRegisters();
+    } else if (cmd == "mem") {
+        checkNumArgs(2, 2);
+        if (!m_state.snapshot()) {
+            throw std::invalid_argument("No snapshot available");
+        }
+        u64 const addr(parseValue(args[0]));
+        u64 const len(parseLength(args[1]));
+        if (m_state.snapshot()->physicalMemorySize() < len) {
+            throw std::invalid_argument("Length exceeds the size of the "
+                                        "physical memory");
+        }
+        std::vector<u8> const data(
+            m_state.snapshot()->readLinearMemory(addr, len));
+        for (u64 i(0); i < data.size(); ++i) {
+            if (!(i % 16)) {
+                print("%s0x%016lx:", !!i ? "\n" : "", addr + i);
+            }
+            print(" %02x", data[i]);
+        }
+        print("\n");
+        if (data.size() != len) {
+            *m_log << "Warning: address 0x" << std::hex
+                   << addr + data.size() << std::dec << " is not mapped"
+                   << std::endl;
+        }
+    } else if (cmd == "snapshot") {
+        checkNumArgs(2, 2);
+        if (args[0] != "save") {
+            throw std::invalid_argument("Unknown snapshot command " + args[0]);
+        } else if (!m_state.snapshot()) {
+            throw std::invalid_argument("No snapshot available");
+        }
+        std::shared_ptr<Snapshot const> const snap(m_state.snapshot());
+        std::vector<u8> const data(
+            snap->readPhysicalMemory(0, snap->physicalMemorySize()));
+        std::ofstream file(args[1], std::ios::out | std::ios::binary);
+        file.write(reinterpret_cast<char const*>(data.data()), data.size());
+        if (!file) {
+            throw std::invalid_argument("Cannot write " + args[1]);
+        }
+    } else if (cmd == "memstats") {
+        checkNumArgs(0, 0);
+        if (!m_state.snapshot()) {
+            throw std::invalid_argument("No snapshot available");
+        }
+        Snapshot::StorageStats total({});
+        u64 numSnapshots(0);
+        for (std::shared_ptr<Snapshot const> snap(m_state.snapshot()); !!snap;
+             snap = snap->base()) {
+            total += snap->storageStats();
+            numSnapshots ++;
+        }
+        print("snapshots = %lu\n", numSnapshots);
+        print("nodes = %lu\n", total.numNodes);
+        print("leaves = %lu\n", total.numLeaves);
+        print("leaf bytes = %lu\n", total.leafBytes);
+        print("changed bytes = %lu\n", total.changedBytes);
+    } else if (cmd == "query") {
+        checkNumArgs(1, 3);
+        if (!m_state.snapshot()) {
+            throw std::invalid_argument("No snapshot available");
+        }
+        HistoryQuery const query(m_state.snapshot());
+        if (args[0] == "values") {
+            checkNumArgs(3, 3);
+            std::map<std::vector<u8>, u64> const values(
+                query.distinctValues(parseValue(args[1]),
+                                     parseLength(args[2])));
+            // Print the values in the order they first appeared.
+            std::map<u64, std::vector<u8> const*> byStep;
+            for (auto const& [value, step] : values) {
+                byStep.emplace(step, &value);
+            }
+            print("values = %lu\n", values.size());
+            for (auto const& [step, value] : byStep) {
+                print("step %lu:", step);
+                for (u8 const byte : *value) {
+                    print(" %02x", byte);
+                }
+                print("\n");
+            }
+            return Action::None;
+        }
+        checkNumArgs(1, 1);
+        std::vector<u64> steps;
+        if (args[0] == "paging") {
+            steps = query.pagingChanges();
+        } else {
+            std::function<bool(Snapshot::Registers const&)> const cond(
+                parseCondition(args[0]));
+            steps = query.findSteps([&](u64, Snapshot const& snap) {
+                return cond(snap.registers());
+            });
+        }
+        print("steps = %lu\n", steps.size());
+        for (u64 i(0); i < steps.size(); ++i) {
+            print("%s%lu", !!(i % 16) ? " " : (!!i ? "\n" : ""), steps[i]);
+        }
+        if (!steps.empty()) {
+            print("\n");
+        }
+    } else if (cmd == "loops") {
+        checkNumArgs(0, 0);
+        std::shared_ptr<LoopIndex const> const index(m_state.loopIndex());
+        if (!index) {
+            throw std::invalid_argument("No loop index available");
+        }
+        std::vector<LoopIndex::Loop> const& loops(index->loops());
+        print("loops = %lu\n", loops.size());
+        for (u64 i(0); i < loops.size(); ++i) {
+            LoopIndex::Loop const& loop(loops[i]);
+            std::optional<u64> const end(loop.activations.back().end);
+            print("loop %lu: 0x%lx-0x%lx, %lu iterations, %lu activations, "
+                  "steps %lu-%s\n", i, loop.header, loop.latch,
+                  loop.iterationStarts.size(), loop.activations.size(),
+                  loop.iterationStarts.front(),
+                  !!end ? std::to_string(*end - 1).c_str() : "running");
+        }
+        std::optional<LoopIndex::Iteration> const curr(
+            index->iterationAt(m_state.historyIndex()));
+        if (!!curr) {
+            print("current = loop %lu, activation %lu, iteration %lu\n",
+                  curr->loop, curr->activation, curr->activationIndex);
+        }
+    } else if (cmd == "iter") {
+        checkNumArgs(1, 2);
+        if (args[0] == "next" || args[0] == "prev") {
+            m_batchAction = (args[0] == "next") ? Action::NextIteration
+                                                : Action::PreviousIteration;
+            m_batchRemaining = (args.size() == 1) ? 1 : parseValue(args[1]);
+        } else {
+            checkNumArgs(1, 1);
+            setActionArgument(parseValue(args[0]));
+            return Action::JumpToIteration;
+        }
+    } else if (cmd == "print") {
+        checkNumArgs(1, 1);
+        if (args[0] != "on" && args[0] != "off") {
+            throw std::invalid_argument("Expected on or off");
+        }
+        m_printEachStep = (args[0] == "on");
+    } else if (cmd == "repstring") {
+        checkNumArgs(1, 1);
+        if (args[0] != "on" && args[0] != "off") {
+            throw std::invalid_argument("Expected on or off");
+        }
+        bool const enable(args[0] == "on");
+        if (enable != m_repStringStepping) {
+            m_repStringStepping = enable;
+            return Action::ToggleRepStringStepping;
+        }
+    } else if (cmd == "workingset") {
+        checkNumArgs(1, 1);
+        if (args[0] == "report") {
+            std::shared_ptr<WorkingSetHistory const> const history(
+                m_state.workingSetHistory());
+            if (!history) {
+                throw std::invalid_argument("No working set available");
+            }
+            WorkingSetHistory::Footprint const footprint(
+                history->footprint(0, m_state.historyIndex()));
+            print("samples = %lu\n", footprint.numSamples);
+            print("accessed pages = %lu\n", footprint.numAccessed);
+            print("dirty pages = %lu\n", footprint.numDirty);
+        } else if (args[0] == "on" || args[0] == "off") {
+            bool const enable(args[0] == "on");
+            if (enable != m_workingSetTracking) {
+                m_workingSetTracking = enable;
+                return Action::ToggleWorkingSetTracking;
+            }
+        } else {
+            throw std::invalid_argument("Expected on, off or report");
+        }
+    } else if (cmd == "memprofile") {
+        checkNumArgs(1, 2);
+        if (args[0] == "run") {
+            setActionArgument((args.size() == 1) ? 0 : parseValue(args[1]));
+            return Action::ProfileMemory;
+        } else if (args[0] != "save" || args.size() != 2) {
+            throw std::invalid_argument(
+                "Expected run [<page size>] or save <file>");
+        }
+        // Scripts do not poll, wait for the profile to complete.
+        std::shared_ptr<MemoryProfile::Results const> const profile(
+            m_state.memoryProfile(true));
+        if (!profile) {
+            throw std::invalid_argument("No memory profile available");
+        }
+        std::ofstream file(args[1]);
+        file << MemoryProfile::toCsv(*profile);
+        if (!file) {
+            throw std::invalid_argument("Cannot write " + args[1]);
+        }
+    } else if (cmd == "critpath") {
+        checkNumArgs(1, 1);
+        if (args[0] == "run") {
+            return Action::AnalyzeDependencies;
+        } else if (args[0] != "report") {
+            throw std::invalid_argument("Expected run or report");
+        }
+        // Scripts do not poll, wait for the analysis to complete.
+        std::shared_ptr<DependencyGraph const> const graph(
+            m_state.dependencyGraph(true));
+        if (!graph) {
+            throw std::invalid_argument("No dependency graph available");
+        }
+        print("critical path = %lu / %lu instructions\n",
+              graph->criticalPath().size(), graph->nodes().size());
+        for (auto const& [rip, count] : graph->criticalInstructions()) {
+            print("0x%016lx: %lu\n", rip, count);
+        }
+    } else if (cmd == "reset") {
+        checkNumArgs(0, 0);
+        return Action::Reset;
+    } else if (cmd == "quit") {
+        checkNumArgs(0, 0);
         return Action::Quit;
+    } else {
+        throw std::invalid_argument("Unknown command " + cmd);
+    }
+    return Action::None;
+}
+
+void Cli::print(char const * const format, ...) const {
+    va_list args;
+    va_start(args, format);
+    char * str(nullptr);
+    int const len(::vasprintf(&str, format, args));
+    va_end(args);
+    if (len != -1) {
+        m_output->write(str, len);
+        std::free(str);
     }
 }
 
+void Cli::cancelBatch() {
+    m_batchRemaining = 0;
+    m_batchUntil.reset();
+}
+
 void Cli::doUpdate(State const& newState) {
-    // Simply dump the state in stdout.
-    Snapshot::Registers const& r(newState.registers());
-
-    // Using printf for hexadecimal output is just way simpler than std::cout.
-    printf("-- @ rip = 0x%016lx --------------------------\n", r.rip);
-    printf("rax = 0x%016lx\trbx = 0x%016lx\n", r.rax, r.rbx);
-    printf("rcx = 0x%016lx\trdx = 0x%016lx\n", r.rcx, r.rdx);
-    printf("rdi = 0x%016lx\trsi = 0x%016lx\n", r.rdi, r.rsi);
-    printf("rbp = 0x%016lx\trsp = 0x%016lx\n", r.rbp, r.rsp);
-    printf("r8  = 0x%016lx\tr9  = 0x%016lx\n", r.r8, r.r9);
-    printf("r10 = 0x%016lx\tr11 = 0x%016lx\n", r.r10, r.r11);
-    printf("r12 = 0x%016lx\tr13 = 0x%016lx\n", r.r12, r.r13);
-    printf("r14 = 0x%016lx\tr15 = 0x%016lx\n", r.r14, r.r15);
-    printf("rip = 0x%016lx\trfl = 0x%016lx\n", r.rip, r.rflags);
-    printf("cs = 0x%04x\tds = 0x%04x\n", r.cs, r.ds);
-    printf("es = 0x%04x\tfs = 0x%04x\n", r.es, r.fs);
-    printf("gs = 0x%04x\tss = 0x%04x\n", r.gs, r.ss);
-    printf("cr0 = 0x%016lx\tcr2 = 0x%016lx\n", r.cr0, r.cr2);
-    printf("cr3 = 0x%016lx\tcr4 = 0x%016lx\n", r.cr3, r.cr4);
-    printf("cr8 = 0x%016lx\n", r.cr8);
-    printf("idt :  base = 0x%016lx\tlimit = 0x%08x\n", r.idt.base, r.idt.limit);
-    printf("gdt :  base = 0x%016lx\tlimit = 0x%08x\n", r.gdt.base, r.gdt.limit);
-    printf("efer = 0x%016lx\n", r.efer);
+    // If the snapshot did not change then the last step could not be carried
+    // out, e.g. the Vm is not runnable anymore or we reached the beginning of
+    // the history. Stop the batch in that case instead of spinning.
+    bool const progressed(newState.snapshot() != m_state.snapshot());
+    m_state = newState;
+    if (!progressed ||
+        (!!m_batchUntil && (*m_batchUntil)(m_state.registers()))) {
+        cancelBatch();
+    }
+    if (m_printEachStep && progressed) {
+        printRegisters();
+    }
+}
+
+void Cli::printRegisters() const {
+    Snapshot::Registers const& r(m_state.registers());
+
+    // printf-style formatting is just way simpler than streams for hexadecimal
+    // output.
+    print("-- @ rip = 0x%016lx --------------------------\n", r.rip);
+    print("rax = 0x%016lx\trbx = 0x%016lx\n", r.rax, r.rbx);
+    print("rcx = 0x%016lx\trdx = 0x%016lx\n", r.rcx, r.rdx);
+    print("rdi = 0x%016lx\trsi = 0x%016lx\n", r.rdi, r.rsi);
+    print("rbp = 0x%016lx\trsp = 0x%016lx\n", r.rbp, r.rsp);
+    print("r8  = 0x%016lx\tr9  = 0x%016lx\n", r.r8, r.r9);
+    print("r10 = 0x%016lx\tr11 = 0x%016lx\n", r.r10, r.r11);
+    print("r12 = 0x%016lx\tr13 = 0x%016lx\n", r.r12, r.r13);
+    print("r14 = 0x%016lx\tr15 = 0x%016lx\n", r.r14, r.r15);
+    print("rip = 0x%016lx\trfl = 0x%016lx\n", r.rip, r.rflags);
+    print("cs = 0x%04x\tds = 0x%04x\n", r.cs, r.ds);
+    print("es = 0x%04x\tfs = 0x%04x\n", r.es, r.fs);
+    print("gs = 0x%04x\tss = 0x%04x\n", r.gs, r.ss);
+    print("cr0 = 0x%016lx\tcr2 = 0x%016lx\n", r.cr0, r.cr2);
+    print("cr3 = 0x%016lx\tcr4 = 0x%016lx\n", r.cr3, r.cr4);
+    print("cr8 = 0x%016lx\n", r.cr8);
+    print("idt :  base = 0x%016lx\tlimit = 0x%08x\n", r.idt.base, r.idt.limit);
+    print("gdt :  base = 0x%016lx\tlimit = 0x%08x\n", r.gdt.base, r.gdt.limit);
+    print("efer = 0x%016lx\n", r.efer);
 
     // Print information on the instruction being executed.
-    u64 const currLine(newState.currentLine());
+    u64 const currLine(m_state.currentLine());
     if (!!currLine) {
-        std::cout << "Line        = " << currLine << std::endl;
+        *m_output << "Line        = " << currLine << std::endl;
     } else {
-        std::cout << "Line        = ?" << std::endl;
+        *m_output << "Line        = ?" << std::endl;
     }
-
-    m_isVmRunnable = newState.isVmRunnable();
 }
 
 void Cli::doLog(std::string const& msg) {
-    std::cout << msg << std::endl;
+    // Logs go to a separate stream so that the output of the commands can be
+    // piped.
+    *m_log << msg << std::endl;
 }
 }
@@ -6,6 +6,7 @@
 #include <algorithm>
 #include <span>
 #include <functional>
+#include <chrono>
 
 #include <capstone/capstone.h>
 
@@ -63,6 +64,7 @@ bool Imgui::doInit() {
     m_stackWindow = std::make_unique<StackWindow>();
     m_cpuStateWindow = std::make_unique<CpuStateWindow>();
     m_memoryWindow = std::make_unique<MemoryWindow>();
+    m_memoryMapWindow = std::make_unique<MemoryMapWindow>(m_sdlRenderer);
     return true;
 }
 
@@ -87,6 +89,7 @@ Action Imgui::doWaitForNextAction() {
 
         Action const configAction(m_configBar->clickedAction());
         if (configAction != Action::None) {
+            setActionArgument(m_configBar->clickedActionArgument());
             return configAction;
         } else if (ImGui::IsKeyPressed(ImGuiKey_S, true)) {
             return Action::Step;
@@ -118,8 +121,8 @@ void Imgui::draw() {
     // |         |         |         |
     // |         |         |         |
     // +---------+---------+---------+
-    // |           MEMORY            |
-    // +-----------------------------+
+    // |       MEMORY        |  MAP  |
+    // +---------------------+-------+
     // FIXME: As of now there is no log window/pane. This is because it has been
     // replaced by the memory window. There is not much use for a log window but
     // in the future a dialog or pane will be added to log errors.
@@ -130,6 +133,9 @@ void Imgui::draw() {
     ImGuiViewport const& viewport(*ImGui::GetMainViewport());
     ImVec2 const vpSize(viewport.WorkSize);
     ImVec2 const codeWinSize(ImVec2(0.25f, 0.70f));
+    // Fraction of the width of the bottom pane used by the memory window, the
+    // memory map window uses the rest.
+    float const memoryWinWidth(0.70f);
 
     // Config bar is at (0,0) and spans the entire width of the window. The
     // height is computed to fit the content which is all in one line.
@@ -166,9 +172,18 @@ void Imgui::draw() {
     // Memory window.
     ImVec2 const memoryWindowPos(0.0f,
         cpuStateWindowPos.y + cpuStateWindowSize.y);
-    ImVec2 const memoryWindowSetupSize(vpSize.x,
+    ImVec2 const memoryWindowSetupSize(memoryWinWidth * vpSize.x,
         vpSize.y - codeWindowSize.y - configBarSize.y);
-    m_memoryWindow->draw(memoryWindowPos, memoryWindowSetupSize, m_state);
+    ImVec2 const memoryWindowSize(m_memoryWindow->draw(memoryWindowPos,
+        memoryWindowSetupSize, m_state));
+
+    // Memory map window, on the right of the memory window.
+    ImVec2 const memoryMapWindowPos(memoryWindowPos.x + memoryWindowSize.x,
+                                    memoryWindowPos.y);
+    ImVec2 const memoryMapWindowSetupSize(vpSize.x - memoryWindowSize.x,
+                                          memoryWindowSize.y);
+    m_memoryMapWindow->draw(memoryMapWindowPos, memoryMapWindowSetupSize,
+        m_state);
 
     // FIXME: For now the log window is disabled and the memory window is taking
     // its place.
@@ -300,13 +315,20 @@ float Imgui::Dropdown<T>::childFrameWidth() {
 Imgui::ConfigBar::ConfigBar() :
     Window("Dummy", defaultFlags),
     m_lastAction(Action::None),
-    m_startCpuMode(Vm::CpuMode::LongMode) {}
+    m_startCpuMode(Vm::CpuMode::LongMode),
+    m_repStringStepping(false),
+    m_workingSetTracking(false),
+    m_iterationTarget(0) {}
 
 Action Imgui::ConfigBar::clickedAction() const {
     return m_lastAction;
 }
 
-void Imgui::ConfigBar::doDraw(State const& __attribute__((unused)) state) {
+u64 Imgui::ConfigBar::clickedActionArgument() const {
+    return (m_lastAction == Action::JumpToIteration) ? m_iterationTarget : 0;
+}
+
+void Imgui::ConfigBar::doDraw(State const& state) {
     // Stepping buttons + Reset.
     m_lastAction = Action::None;
     if (ImGui::Button("[s] Step")) {
@@ -321,6 +343,24 @@ void Imgui::ConfigBar::doDraw(State const& __attribute__((unused)) state) {
         m_lastAction = Action::Reset;
     }
 
+    // Loop navigation, see LoopIndex.
+    ImGui::SameLine();
+    if (ImGui::Button("Prev. iteration")) {
+        m_lastAction = Action::PreviousIteration;
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Next iteration")) {
+        m_lastAction = Action::NextIteration;
+    }
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(8 * ImGui::CalcTextSize("0").x +
+                            2 * ImGui::GetStyle().FramePadding.x);
+    ImGui::InputScalar("##iteration", ImGuiDataType_U64, &m_iterationTarget);
+    ImGui::SameLine();
+    if (ImGui::Button("Go to iteration")) {
+        m_lastAction = Action::JumpToIteration;
+    }
+
     // Starting CPU mode radio button. Only one mode can be selected at a time.
     // Changing this mode resets the VM.
     ImGui::SameLine();
@@ -351,6 +391,33 @@ void Imgui::ConfigBar::doDraw(State const& __attribute__((unused)) state) {
             m_lastAction = Action::Reset64;
         }
     }
+
+    // Rep-string stepping does not reset the VM and is kept across resets.
+    ImGui::SameLine();
+    if (ImGui::Checkbox("Run rep strings in one step", &m_repStringStepping)) {
+        m_lastAction = Action::ToggleRepStringStepping;
+    }
+    ImGui::SameLine();
+    if (ImGui::Checkbox("Track working set", &m_workingSetTracking)) {
+        m_lastAction = Action::ToggleWorkingSetTracking;
+    }
+    ImGui::SameLine();
+    if (state.memoryProfileRunning()) {
+        ImGui::AlignTextToFramePadding();
+        ImGui::Text("Profiling memory...");
+    } else if (ImGui::Button("Profile memory")) {
+        m_lastAction = Action::ProfileMemory;
+    }
+
+    // Dependency analysis, the critical path is highlighted in the CodeWindow
+    // once ready.
+    ImGui::SameLine();
+    if (state.dependencyAnalysisRunning()) {
+        ImGui::AlignTextToFramePadding();
+        ImGui::Text("Analyzing dependencies...");
+    } else if (ImGui::Button("Critical path")) {
+        m_lastAction = Action::AnalyzeDependencies;
+    }
 }
 
 Imgui::CodeWindow::CodeWindow() :
@@ -481,9 +548,8 @@ void Imgui::CodeWindow::doDrawDisassembly(State const& state) {
     bool const isDrawingNewState(m_previousRip != state.registers().rip);
     m_previousRip = state.registers().rip;
 
-    ImVec2 const padding(ImGui::GetStyle().CellPadding);
-    float const rowHeight(ImGui::GetFontSize() + padding.y * 2.0f);
-    ImDrawList* const drawList(ImGui::GetWindowDrawList());
+    std::shared_ptr<DependencyGraph const> const graph(
+        state.dependencyGraph());
 
     for (auto& elem : m_disassembledCode) {
         u64 const insAddr(elem.first);
@@ -492,18 +558,13 @@ void Imgui::CodeWindow::doDrawDisassembly(State const& state) {
 
         ImGui::TableNextColumn();
         if (insAddr == state.registers().rip) {
-            ImVec2 const cursorPos(ImGui::GetCursorScreenPos());
-            ImVec2 const rectMin(cursorPos.x - padding.x,
-                                 cursorPos.y - padding.y);
-            float const rectWidth(ImGui::GetWindowContentRegionMax().x);
-            float const rectHeight(rowHeight);
-            ImVec2 const rectMax(rectMin.x + rectWidth,
-                                 rectMin.y + rectHeight);
-            u32 const color(ImGui::GetColorU32(currLineBgColor));
-            drawList->AddRectFilled(rectMin, rectMax, color);
+            drawRowBackground(currLineBgColor);
             if (isDrawingNewState) {
                 ImGui::SetScrollHereY(0.5);
             }
+        } else if (!!graph &&
+                   graph->criticalInstructions().contains(insAddr)) {
+            drawRowBackground(critPathBgColor);
         }
         ImGui::Text("0x%016lx", insAddr);
         ImGui::TableNextColumn();
@@ -515,6 +576,20 @@ void Imgui::CodeWindow::doDrawDisassembly(State const& state) {
     ImGui::EndTable();
 }
 
+void Imgui::CodeWindow::drawRowBackground(ImVec4 const& color) const {
+    // Unfortunately there is no easy way to set a background color on a single
+    // row of a table, hence we are constrained to draw a rectangle over the
+    // entire row ourselves.
+    ImVec2 const padding(ImGui::GetStyle().CellPadding);
+    float const rowHeight(ImGui::GetFontSize() + padding.y * 2.0f);
+    ImVec2 const cursorPos(ImGui::GetCursorScreenPos());
+    ImVec2 const rectMin(cursorPos.x - padding.x, cursorPos.y - padding.y);
+    float const rectWidth(ImGui::GetWindowContentRegionMax().x);
+    ImVec2 const rectMax(rectMin.x + rectWidth, rectMin.y + rowHeight);
+    ImGui::GetWindowDrawList()->AddRectFilled(rectMin, rectMax,
+                                              ImGui::GetColorU32(color));
+}
+
 void Imgui::CodeWindow::doDrawSourceFile(State const& state) {
     std::string const fileName(state.sourceFileName());
     if (!fileName.size()) {
@@ -536,9 +611,14 @@ void Imgui::CodeWindow::doDrawSourceFile(State const& state) {
 
     std::ifstream file(fileName, std::ios::in);
     u64 const currLine(state.currentLine());
-    ImVec2 const padding(ImGui::GetStyle().CellPadding);
-    float const rowHeight(ImGui::GetFontSize() + padding.y * 2.0f);
-    ImDrawList* const drawList(ImGui::GetWindowDrawList());
+    // The lines of the instructions on the critical path.
+    std::set<u64> critPathLines;
+    if (std::shared_ptr<DependencyGraph const> const graph(
+            state.dependencyGraph()); !!graph) {
+        for (auto const& [rip, count] : graph->criticalInstructions()) {
+            critPathLines.insert(state.mapToLine(rip));
+        }
+    }
     u64 lineNum(0);
     for (std::string line; std::getline(file, line);) {
         // Line column.
@@ -551,20 +631,9 @@ void Imgui::CodeWindow::doDrawSourceFile(State const& state) {
                 // through.
                 ImGui::SetScrollHereY(0.5);
             }
-
-            // Change the background color for this line only. Unfortunately
-            // there is no easy way to set a background color on a single row of
-            // a table, hence we are constrained to draw a rectangle over the
-            // entire row ourselves.
-            ImVec2 const cursorPos(ImGui::GetCursorScreenPos());
-            ImVec2 const rectMin(cursorPos.x - padding.x,
-                                 cursorPos.y - padding.y);
-            float const rectWidth(ImGui::GetWindowContentRegionMax().x);
-            float const rectHeight(rowHeight);
-            ImVec2 const rectMax(rectMin.x + rectWidth,
-                                 rectMin.y + rectHeight);
-            u32 const color(ImGui::GetColorU32(currLineBgColor));
-            drawList->AddRectFilled(rectMin, rectMax, color);
+            drawRowBackground(currLineBgColor);
+        } else if (critPathLines.contains(lineNum)) {
+            drawRowBackground(critPathBgColor);
         }
 
         ImGui::Text("%ld ", lineNum);
@@ -577,57 +646,12 @@ void Imgui::CodeWindow::doDrawSourceFile(State const& state) {
 }
 
 Imgui::StackWindow::StackWindow() : Window(defaultTitle, windowFlags),
-                                    m_previousRbp(~((u64)0)),
                                     m_previousRsp(~((u64)0)) {}
 
-void Imgui::StackWindow::updateStackFrameStartOffsets(State const& state) {
-    m_stackFrameStartOffsets.clear();
-    // Find all offsets corresponding to the start of stack frames by reading
-    // the stack and all saved RBPs. In the worst case scenario we would need to
-    // find the last maxHistory stack frames, any older frame would not show up
-    // in the stack window anyway, hence skipping. This puts a bound on the
-    // number of lookups however we still have the problem that we cannot
-    // reliably determine what is a stack frame and what isn't: maybe the
-    // application/function is not creating stack frames in a "standard" fashion
-    // (e.g. good old `push  rbp ; mov rbp, rsp`)? So we might read some garbage
-    // data. A rule of thumb to avoid reading too much garbage is to stop when
-    // we see that a saved rbp is < rsp, such a stack frame would be invalid,
-    // except in some very peculiar situation (for instance if there is a wrap
-    // around when pushing on the stack); this should be sufficient for 99.99%
-    // of the cases.
-    u64 const rbp(state.registers().rbp);
-    u64 const rsp(state.registers().rsp);
-    u64 currFrameStartOffset(rbp);
-    while (rsp <= currFrameStartOffset &&
-           m_stackFrameStartOffsets.size() <= maxHistory) {
-        m_stackFrameStartOffsets.insert(currFrameStartOffset);
-
-        // Move to next stack frame, follow the saved RBP "linked
-        // list".
-        std::vector<u8> const rawRbp(state.snapshot()->readLinearMemory(
-            currFrameStartOffset, sizeof(currFrameStartOffset)));
-        if (rawRbp.size() != sizeof(currFrameStartOffset)) {
-            // The read returned a partial buffer (or even empty). This means
-            // that the linear address currFrameStartOffset is not mapped to
-            // physical memory, we cannot go up the stack frames anymore.
-            return;
-        }
-        currFrameStartOffset = *reinterpret_cast<u64 const*>(rawRbp.data());
-    }
-}
-
-
 void Imgui::StackWindow::doDraw(State const& state) {
-    if (m_previousRsp != state.registers().rsp ||
-        m_previousRbp != state.registers().rbp) {
-        // Re-compute the cached stack frame start offsets now that the state
-        // of the stack. The condition is a bit sloppy here, we might end up
-        // recomputing more than necessary, but as long as we are not missing a
-        // recomputation when one is needed we are fine.
-        // We _could_ keep track of the frame creation / deletion but this would
-        // be error prone especially when dealing with reverse execution.
-        updateStackFrameStartOffsets(state);
-    }
+    // The stack frames are computed once per snapshot, and re-used from the
+    // previous snapshot when the stack did not change.
+    std::vector<u64> const& stackFrames(state.snapshot()->stackFrames());
 
     // There seems to be a bug in Dear ImGui where not setting ScrollX when
     // setting ScrollY on a table leads to the scroll bar overlapping with the
@@ -688,7 +712,8 @@ void Imgui::StackWindow::doDraw(State const& state) {
     // @return: true if the row is the start of a frame, false otherwise.
     auto const isRowStartOfStackFrame([&](u32 const rowId) {
         u64 const rowOffset(rowIdToOffset(rowId));
-        return m_stackFrameStartOffsets.contains(rowOffset);
+        return std::find(stackFrames.begin(), stackFrames.end(), rowOffset) !=
+            stackFrames.end();
     });
 
     // Print a row of the table showing the stack's content.
@@ -742,7 +767,6 @@ void Imgui::StackWindow::doDraw(State const& state) {
     ImGui::EndTable();
 
     m_previousRsp = state.registers().rsp;
-    m_previousRbp = state.registers().rbp;
 }
 
 std::map<Imgui::Granularity, u32> const Imgui::granularityToBytes = {
@@ -786,7 +810,11 @@ Imgui::displayFormatAndBitsToFormatString = {
 };
 
 Imgui::CpuStateWindow::CpuStateWindow() :
-    Window(defaultTitle, Imgui::defaultWindowFlags) {
+    Window(defaultTitle, Imgui::defaultWindowFlags),
+    m_historyQueryValue(0),
+    m_memHistoryAddr(0),
+    m_workingSetFirstStep(0),
+    m_workingSetLastStep(0) {
     m_gpFormatDropdown = std::make_unique<Dropdown<DisplayFormat>>(
         "Value format:", formatToString);
 
@@ -828,6 +856,22 @@ Imgui::CpuStateWindow::CpuStateWindow() :
         mmxDisplayFormatOpt);
     m_sseAvxFormatDropdown = std::make_unique<Dropdown<DisplayFormat>>(
         "Value format:", sseDisplayFormatOpt);
+
+    m_historyRegDropdown =
+        std::make_unique<Dropdown<RegisterHistory::Register>>(
+            "Register:", RegisterHistory::registerNames);
+    m_historyCmpDropdown =
+        std::make_unique<Dropdown<RegisterHistory::Comparison>>(
+            "Condition:", RegisterHistory::comparisonNames);
+
+    static std::map<Granularity, std::string> const memHistorySizeOpt({
+        {Granularity::Byte,  "Byte"},
+        {Granularity::Word,  "Word"},
+        {Granularity::Dword, "Double-word"},
+        {Granularity::Qword, "Quad-word"},
+    });
+    m_memHistorySizeDropdown = std::make_unique<Dropdown<Granularity>>(
+        "Size:", memHistorySizeOpt);
 }
 
 template<size_t W>
@@ -897,6 +941,31 @@ void Imgui::CpuStateWindow::doDraw(State const& state) {
         ImGui::EndTabItem();
     }
 
+    if (ImGui::BeginTabItem("Reg. history", NULL, 0)) {
+        doDrawHistory(state);
+        ImGui::EndTabItem();
+    }
+
+    if (ImGui::BeginTabItem("Mem. history", NULL, 0)) {
+        doDrawMemoryHistory(state);
+        ImGui::EndTabItem();
+    }
+
+    if (ImGui::BeginTabItem("Working set", NULL, 0)) {
+        doDrawWorkingSet(state);
+        ImGui::EndTabItem();
+    }
+
+    if (ImGui::BeginTabItem("Mem. profile", NULL, 0)) {
+        doDrawMemoryProfile(state);
+        ImGui::EndTabItem();
+    }
+
+    if (ImGui::BeginTabItem("Loops", NULL, 0)) {
+        doDrawLoops(state);
+        ImGui::EndTabItem();
+    }
+
     ImGui::EndTabBar();
 }
 
@@ -1683,7 +1752,7 @@ void Imgui::CpuStateWindow::doDrawGdt(State const& state) {
     ImGui::Text("GDT base linear address: 0x%016lx", gdt.base);
     ImGui::Text("GDT limit: 0x%04hx", gdt.limit);
 
-    doDrawTable<SegmentDescriptor>(gdt, state);
+    doDrawTable<SegmentDescriptor>(Snapshot::DescriptorTable::Gdt, state);
 }
 
 // Type to use in doDrawIdtHelper in order to print a real-mode IDT.
@@ -1874,13 +1943,13 @@ void Imgui::CpuStateWindow::doDrawIdt(State const& state) {
     Vm::CpuMode const cpuMode(snap->cpuMode());
     switch (cpuMode) {
         case Vm::CpuMode::RealMode:
-            doDrawTable<IdtEntry16Bits>(state.registers().idt, state);
+            doDrawTable<IdtEntry16Bits>(Snapshot::DescriptorTable::Idt, state);
             break;
         case Vm::CpuMode::ProtectedMode:
-            doDrawTable<IdtEntry32Bits>(state.registers().idt, state);
+            doDrawTable<IdtEntry32Bits>(Snapshot::DescriptorTable::Idt, state);
             break;
         case Vm::CpuMode::LongMode:
-            doDrawTable<IdtEntry64Bits>(state.registers().idt, state);
+            doDrawTable<IdtEntry64Bits>(Snapshot::DescriptorTable::Idt, state);
             break;
         default:
             ImGui::Text("Not supported in current CPU mode");
@@ -1890,16 +1959,19 @@ void Imgui::CpuStateWindow::doDrawIdt(State const& state) {
 
 template<typename EntryType>
 void Imgui::CpuStateWindow::doDrawTable(
-    Vm::State::Registers::Table const& table,
+    Snapshot::DescriptorTable const table,
     State const& state) {
     std::shared_ptr<X86Lab::Snapshot const> const snap(state.snapshot());
+    // The content of the table is read once per snapshot, instead of reading
+    // each entry every frame.
+    std::vector<u8> const& raw(snap->descriptorTable(table));
     u64 const entrySize(sizeof(EntryType));
     // The limit is always of the form 8*N - 1 because base + limit must point
-    // to the last byte of the table. Assuming each entry being `entrySize`
-    // bytes, the number of entries is (limit + 1) / entrySize.
-    // Note: Promote the limit to 64 bit so that we gracefully handle the case
-    // where limit == 0xffff.
-    u64 const numEntries((u64(table.limit) + 1) / entrySize);
+    // to the last byte of the table, hence the table holds (limit + 1) bytes.
+    // Assuming each entry being `entrySize` bytes, the number of entries is
+    // (limit + 1) / entrySize. Entries that are not mapped in linear memory
+    // are not part of raw, hence not shown.
+    u64 const numEntries(raw.size() / entrySize);
 
     ImGuiTableFlags const tableFlags(ImGuiTableFlags_BordersOuter |
                                      ImGuiTableFlags_RowBg |
@@ -1931,9 +2003,8 @@ void Imgui::CpuStateWindow::doDrawTable(
 
     // Print each entry of the table.
     for (u32 i(0); i < numEntries; ++i) {
-        u64 const entryOff(table.base + i * entrySize);
-        std::vector<u8> const raw(snap->readLinearMemory(entryOff, entrySize));
-        EntryType const entry(*reinterpret_cast<EntryType const*>(raw.data()));
+        EntryType const entry(*reinterpret_cast<EntryType const*>(
+            raw.data() + i * entrySize));
 
         ImGui::TableNextColumn();
         ImGui::Text("%d", i);
@@ -1944,6 +2015,426 @@ void Imgui::CpuStateWindow::doDrawTable(
     ImGui::EndTable();
 }
 
+void Imgui::CpuStateWindow::doDrawHistory(State const& state) {
+    std::shared_ptr<RegisterHistory const> const history(
+        state.registerHistory());
+    if (!history || !history->size()) {
+        ImGui::Text("No history available");
+        return;
+    }
+
+    m_historyRegDropdown->draw();
+    ImGui::SameLine();
+    m_historyCmpDropdown->draw();
+    ImGui::SameLine();
+    RegisterHistory::Register const reg(m_historyRegDropdown->selection());
+    RegisterHistory::Comparison const cmp(m_historyCmpDropdown->selection());
+
+    // Value to compare against, in hexadecimal.
+    ImGuiStyle const& style(ImGui::GetStyle());
+    ImGui::SetNextItemWidth(17 * ImGui::CalcTextSize("0").x +
+                            style.FramePadding.x * 2.0f);
+    ImGui::InputScalar("##value",
+                       ImGuiDataType_U64,
+                       &m_historyQueryValue,
+                       NULL,
+                       NULL,
+                       "%016lx",
+                       ImGuiInputTextFlags_CharsHexadecimal);
+    ImGui::SameLine();
+    // Searching from the step after the current one allows to repeatedly
+    // click "Find next" to iterate over all the matches.
+    bool const findFirst(ImGui::Button("Find first"));
+    ImGui::SameLine();
+    bool const findNext(ImGui::Button("Find next"));
+    if (findFirst || findNext) {
+        u64 const fromStep(findNext ? state.historyIndex() + 1 : 0);
+        std::optional<u64> const step(
+            history->findFirst(reg, cmp, m_historyQueryValue, fromStep));
+        std::ostringstream oss;
+        oss << RegisterHistory::registerNames.at(reg) << " "
+            << RegisterHistory::comparisonNames.at(cmp) << " 0x" << std::hex
+            << m_historyQueryValue << std::dec << ": ";
+        if (!!step) {
+            oss << "first at step " << *step;
+        } else {
+            oss << "no match in " << history->size() << " steps";
+        }
+        m_historyQueryResult = oss.str();
+    }
+    if (!m_historyQueryResult.empty()) {
+        ImGui::Text("%s", m_historyQueryResult.c_str());
+    }
+
+    // Timeline of the register over the full history.
+    u64 const last(history->size() - 1);
+    std::vector<u64> const samples(
+        history->sample(reg, 0, last, maxHistoryPlotPoints));
+    std::vector<float> const points(samples.begin(), samples.end());
+    std::string const overlay(
+        "step " + std::to_string(state.historyIndex()) + "/" +
+        std::to_string(last) + ", " +
+        std::to_string(history->numRuns(reg)) + " distinct runs");
+    ImGui::PlotLines("##timeline",
+                     points.data(),
+                     points.size(),
+                     0,
+                     overlay.c_str(),
+                     FLT_MAX,
+                     FLT_MAX,
+                     ImVec2(ImGui::GetContentRegionAvail().x,
+                            ImGui::GetContentRegionAvail().y));
+}
+
+void Imgui::CpuStateWindow::doDrawMemoryHistory(State const& state) {
+    std::shared_ptr<Snapshot const> const snap(state.snapshot());
+    if (!snap) {
+        ImGui::Text("No history available");
+        return;
+    }
+
+    ImGui::AlignTextToFramePadding();
+    ImGui::Text("Physical address 0x");
+    ImGui::SameLine();
+    ImGuiStyle const& style(ImGui::GetStyle());
+    ImGui::SetNextItemWidth(17 * ImGui::CalcTextSize("0").x +
+                            style.FramePadding.x * 2.0f);
+    ImGui::InputScalar("##addr",
+                       ImGuiDataType_U64,
+                       &m_memHistoryAddr,
+                       NULL,
+                       NULL,
+                       "%016lx",
+                       ImGuiInputTextFlags_CharsHexadecimal);
+    ImGui::SameLine();
+    m_memHistorySizeDropdown->draw();
+    ImGui::SameLine();
+    Granularity const gran(m_memHistorySizeDropdown->selection());
+    u64 const size(granularityToBytes.at(gran));
+    if (ImGui::Button("Query")) {
+        auto const start(std::chrono::steady_clock::now());
+        m_memHistoryWrites = snap->physicalMemoryHistory(m_memHistoryAddr,
+                                                         size);
+        auto const end(std::chrono::steady_clock::now());
+        u64 const us(std::chrono::duration_cast<std::chrono::microseconds>(
+            end - start).count());
+        std::ostringstream oss;
+        oss << (m_memHistoryWrites.size() - 1) << " write(s) to 0x" << std::hex
+            << m_memHistoryAddr << std::dec << " in " << state.historyIndex()
+            << " steps (" << us << " us)";
+        m_memHistorySummary = oss.str();
+    }
+    if (m_memHistoryWrites.empty()) {
+        return;
+    }
+    ImGui::Text("%s", m_memHistorySummary.c_str());
+
+    ImGuiTableFlags const tableFlags(ImGuiTableFlags_BordersOuter |
+                                     ImGuiTableFlags_RowBg |
+                                     ImGuiTableFlags_ScrollY |
+                                     ImGuiTableFlags_SizingFixedFit |
+                                     ImGuiTableFlags_BordersInnerV);
+    if (!ImGui::BeginTable("MemHistory", 4, tableFlags)) {
+        return;
+    }
+    ImGui::TableSetupScrollFreeze(0, 1);
+    ImGui::TableSetupColumn("Step");
+    ImGui::TableSetupColumn("Written by");
+    ImGui::TableSetupColumn("Line");
+    ImGui::TableSetupColumn("Value");
+    ImGui::TableHeadersRow();
+
+    ImGuiListClipper clipper;
+    clipper.Begin(m_memHistoryWrites.size());
+    while (clipper.Step()) {
+        for (int i(clipper.DisplayStart); i < clipper.DisplayEnd; ++i) {
+            Snapshot::MemoryWrite const& write(m_memHistoryWrites[i]);
+            ImGui::TableNextColumn();
+            ImGui::Text("%lu", write.step);
+            ImGui::TableNextColumn();
+            if (!!write.step) {
+                ImGui::Text("0x%016lx", write.rip);
+            } else {
+                ImGui::Text("(initial)");
+            }
+            ImGui::TableNextColumn();
+            u64 const line(!!write.step ? state.mapToLine(write.rip) : 0);
+            if (!!line) {
+                ImGui::Text("%lu", line);
+            } else {
+                ImGui::Text("-");
+            }
+            ImGui::TableNextColumn();
+            // Values are at most 8 bytes, zero-extend to a qword.
+            u64 value(0);
+            std::memcpy(&value, write.value.data(), write.value.size());
+            ImGui::Text("0x%0*lx", int(size * 2), value);
+        }
+    }
+    ImGui::EndTable();
+}
+
+void Imgui::CpuStateWindow::doDrawWorkingSet(State const& state) {
+    std::shared_ptr<WorkingSetHistory const> const history(
+        state.workingSetHistory());
+    if (!history || !history->size()) {
+        ImGui::Text("No working set available, enable \"Track working set\" "
+                    "in long mode");
+        return;
+    }
+
+    // Footprint of a range of steps.
+    ImGuiStyle const& style(ImGui::GetStyle());
+    float const inputWidth(12 * ImGui::CalcTextSize("0").x +
+                           style.FramePadding.x * 2.0f);
+    ImGui::AlignTextToFramePadding();
+    ImGui::Text("Steps");
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(inputWidth);
+    ImGui::InputScalar("##first", ImGuiDataType_U64, &m_workingSetFirstStep);
+    ImGui::SameLine();
+    ImGui::Text("to");
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(inputWidth);
+    ImGui::InputScalar("##last", ImGuiDataType_U64, &m_workingSetLastStep);
+    ImGui::SameLine();
+    bool const compute(ImGui::Button("Footprint"));
+    ImGui::SameLine();
+    bool const wholeRun(ImGui::Button("Whole run"));
+    if (wholeRun) {
+        m_workingSetFirstStep = 0;
+        m_workingSetLastStep = state.historyIndex();
+    }
+    if (compute || wholeRun) {
+        WorkingSetHistory::Footprint const footprint(
+            history->footprint(m_workingSetFirstStep, m_workingSetLastStep));
+        std::ostringstream oss;
+        oss << footprint.numSamples << " sample(s): " << footprint.numAccessed
+            << " page(s) accessed, " << footprint.numDirty << " written, out "
+            << "of " << history->numPages();
+        m_workingSetSummary = oss.str();
+    }
+    if (!m_workingSetSummary.empty()) {
+        ImGui::Text("%s", m_workingSetSummary.c_str());
+    }
+
+    // Heatmap of the pages touched by the most recent samples up to the
+    // current step, one row per sample from top to bottom, physical pages
+    // from left to right. Each cell covers a range of pages, its opacity is
+    // the fraction of those pages touched.
+    u64 end(history->size());
+    while (!!end && state.historyIndex() < history->sample(end - 1).step) {
+        end --;
+    }
+    ImVec2 const avail(ImGui::GetContentRegionAvail());
+    u64 const numPages(history->numPages());
+    u64 const numCols(std::max<u64>(1, std::min<u64>(numPages,
+        avail.x / heatmapCellSize)));
+    u64 const numRows(std::min<u64>(end, avail.y / heatmapCellSize));
+    if (!numRows) {
+        return;
+    }
+    u64 const pagesPerCol((numPages + numCols - 1) / numCols);
+    float const cellWidth(avail.x / numCols);
+    float const cellHeight(std::min(avail.y / numRows, 4 * heatmapCellSize));
+    ImVec2 const origin(ImGui::GetCursorScreenPos());
+    ImGui::InvisibleButton("##heatmap",
+                           ImVec2(avail.x, cellHeight * numRows));
+    ImDrawList * const drawList(ImGui::GetWindowDrawList());
+    std::vector<u64> reads(numCols);
+    std::vector<u64> writes(numCols);
+    for (u64 row(0); row < numRows; ++row) {
+        WorkingSetHistory::Sample const& sample(
+            history->sample(end - numRows + row));
+        std::fill(reads.begin(), reads.end(), 0);
+        std::fill(writes.begin(), writes.end(), 0);
+        for (u64 const page : sample.accessed) {
+            reads[page / pagesPerCol] ++;
+        }
+        for (u64 const page : sample.dirty) {
+            writes[page / pagesPerCol] ++;
+        }
+        for (u64 col(0); col < numCols; ++col) {
+            if (!reads[col]) {
+                continue;
+            }
+            ImVec4 color(!!writes[col] ? writeColor : readColor);
+            color.w = 0.3f + 0.7f * reads[col] / pagesPerCol;
+            ImVec2 const min(origin.x + col * cellWidth,
+                             origin.y + row * cellHeight);
+            ImVec2 const max(min.x + cellWidth, min.y + cellHeight);
+            drawList->AddRectFilled(min, max, ImGui::GetColorU32(color));
+        }
+    }
+
+    if (ImGui::IsItemHovered()) {
+        ImVec2 const mouse(ImGui::GetIO().MousePos);
+        u64 const row(std::min<u64>(numRows - 1,
+                                    (mouse.y - origin.y) / cellHeight));
+        u64 const col(std::min<u64>(numCols - 1,
+                                    (mouse.x - origin.x) / cellWidth));
+        WorkingSetHistory::Sample const& sample(
+            history->sample(end - numRows + row));
+        u64 const firstPage(col * pagesPerCol);
+        u64 const lastPage(std::min(numPages, firstPage + pagesPerCol) - 1);
+        auto const inRange([&](u64 const page) {
+            return firstPage <= page && page <= lastPage;
+        });
+        ImGui::SetTooltip("Step %lu, 0x%lx - 0x%lx: %ld accessed, %ld written",
+            sample.step,
+            firstPage * PAGE_SIZE,
+            (lastPage + 1) * PAGE_SIZE - 1,
+            std::count_if(sample.accessed.begin(), sample.accessed.end(),
+                          inRange),
+            std::count_if(sample.dirty.begin(), sample.dirty.end(), inRange));
+    }
+}
+
+void Imgui::CpuStateWindow::doDrawMemoryProfile(State const& state) {
+    std::shared_ptr<MemoryProfile::Results const> const profile(
+        state.memoryProfile());
+    if (state.memoryProfileRunning()) {
+        ImGui::Text("Profiling memory...");
+        return;
+    } else if (!profile) {
+        ImGui::Text("No memory profile available, click \"Profile memory\"");
+        return;
+    }
+    ImGui::Text("Page size: %lu bytes, TSC: %.3f GHz", profile->pageSize,
+                profile->tscFrequency);
+    if (!profile->memoryTypeHonored) {
+        ImGui::Text("The host ignored the memory type, the working sets were "
+                    "write-back");
+    }
+    if (profile->hostPageSize < profile->pageSize) {
+        ImGui::Text("The host backed the working sets with %lu bytes pages, "
+                    "the TLB reach is limited by these pages",
+                    profile->hostPageSize);
+    }
+
+    // One plot per curve. The sizes are powers of two, hence the points are
+    // evenly spaced on a logarithmic scale.
+    struct Curve {
+        char const * name;
+        char const * unit;
+        std::vector<MemoryProfile::Point> const * points;
+    };
+    std::vector<Curve> const curves({
+        {"Latency", "ns", &profile->latency},
+        {"Read", "GB/s", &profile->readBandwidth},
+        {"Write", "GB/s", &profile->writeBandwidth},
+        {"Streaming write", "GB/s", &profile->streamingWriteBandwidth},
+        {"Copy", "GB/s", &profile->copyBandwidth},
+        {"TLB latency", "ns", &profile->tlbLatency},
+    });
+    float const plotHeight(4 * ImGui::GetFrameHeightWithSpacing());
+    for (Curve const& curve : curves) {
+        std::vector<float> values;
+        for (MemoryProfile::Point const& point : *curve.points) {
+            values.push_back(point.value);
+        }
+        std::string const label(std::string(curve.name) + " (" + curve.unit +
+                                ")");
+        ImGui::PlotLines(label.c_str(), values.data(), values.size(), 0,
+                         NULL, 0.0f, FLT_MAX, ImVec2(0, plotHeight));
+    }
+
+    // All the points, the size of the TLB benchmark is a number of pages.
+    ImGuiTableFlags const tableFlags(ImGuiTableFlags_BordersOuter |
+                                     ImGuiTableFlags_RowBg |
+                                     ImGuiTableFlags_ScrollY |
+                                     ImGuiTableFlags_SizingFixedFit |
+                                     ImGuiTableFlags_BordersInnerV);
+    if (!ImGui::BeginTable("MemProfile", 3, tableFlags)) {
+        return;
+    }
+    ImGui::TableSetupScrollFreeze(0, 1);
+    ImGui::TableSetupColumn("Benchmark");
+    ImGui::TableSetupColumn("Size");
+    ImGui::TableSetupColumn("Value");
+    ImGui::TableHeadersRow();
+    for (Curve const& curve : curves) {
+        for (MemoryProfile::Point const& point : *curve.points) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%s", curve.name);
+            ImGui::TableNextColumn();
+            ImGui::Text("%lu", point.size);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.2f %s", point.value, curve.unit);
+        }
+    }
+    ImGui::EndTable();
+}
+
+void Imgui::CpuStateWindow::doDrawLoops(State const& state) {
+    std::shared_ptr<LoopIndex const> const index(state.loopIndex());
+    if (!index || index->loops().empty()) {
+        ImGui::Text("No loop executed so far");
+        return;
+    }
+    std::vector<LoopIndex::Loop> const& loops(index->loops());
+    std::optional<LoopIndex::Iteration> const curr(
+        index->iterationAt(state.historyIndex()));
+    if (!!curr) {
+        ImGui::Text("Current step is in iteration %lu of activation %lu of "
+                    "loop %lu", curr->activationIndex, curr->activation,
+                    curr->loop);
+    } else {
+        ImGui::Text("Current step is not part of a loop");
+    }
+
+    // Each loop is collapsed into a single row, whatever its number of
+    // iterations.
+    ImGuiTableFlags const tableFlags(ImGuiTableFlags_BordersOuter |
+                                     ImGuiTableFlags_RowBg |
+                                     ImGuiTableFlags_ScrollY |
+                                     ImGuiTableFlags_SizingFixedFit |
+                                     ImGuiTableFlags_BordersInnerV);
+    if (!ImGui::BeginTable("Loops", 7, tableFlags)) {
+        return;
+    }
+    ImGui::TableSetupScrollFreeze(0, 1);
+    ImGui::TableSetupColumn("Loop");
+    ImGui::TableSetupColumn("Header");
+    ImGui::TableSetupColumn("Latch");
+    ImGui::TableSetupColumn("Lines");
+    ImGui::TableSetupColumn("Iterations");
+    ImGui::TableSetupColumn("Activations");
+    ImGui::TableSetupColumn("Steps");
+    ImGui::TableHeadersRow();
+    for (u64 i(0); i < loops.size(); ++i) {
+        LoopIndex::Loop const& loop(loops[i]);
+        ImGui::TableNextRow();
+        if (!!curr && curr->loop == i) {
+            ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg0,
+                ImGui::GetColorU32(ImGui::GetStyle().Colors[
+                    ImGuiCol_TextSelectedBg]));
+        }
+        ImGui::TableNextColumn();
+        ImGui::Text("%lu", i);
+        ImGui::TableNextColumn();
+        ImGui::Text("0x%016lx", loop.header);
+        ImGui::TableNextColumn();
+        ImGui::Text("0x%016lx", loop.latch);
+        ImGui::TableNextColumn();
+        ImGui::Text("%lu-%lu", state.mapToLine(loop.header),
+                    state.mapToLine(loop.latch));
+        ImGui::TableNextColumn();
+        ImGui::Text("%lu", loop.iterationStarts.size());
+        ImGui::TableNextColumn();
+        ImGui::Text("%lu", loop.activations.size());
+        ImGui::TableNextColumn();
+        std::optional<u64> const end(loop.activations.back().end);
+        if (!!end) {
+            ImGui::Text("%lu-%lu", loop.iterationStarts.front(), *end - 1);
+        } else {
+            ImGui::Text("%lu-", loop.iterationStarts.front());
+        }
+    }
+    ImGui::EndTable();
+}
+
 Imgui::MemoryWindow::MemoryWindow() :
     Window(defaultTitle, windowFlags),
     m_focusedAddr(0) {
@@ -2238,4 +2729,356 @@ void Imgui::MemoryWindow::doDraw(State const& state) {
         drawList->AddLine(sepStart, sepEnd, ImGui::GetColorU32(separatorColor));
     }
 }
+
+Imgui::MemoryMapWindow::MemoryMapWindow(SDL_Renderer * const renderer) :
+    Window(defaultTitle, windowFlags),
+    m_renderer(renderer),
+    m_texture(nullptr),
+    m_textureWidth(0),
+    m_textureHeight(0),
+    m_cellSize(CellSize::CacheLine),
+    m_coloring(Coloring::Value),
+    m_step(0),
+    m_memSize(0),
+    m_dirtyRowsBegin(0),
+    m_dirtyRowsEnd(0) {
+    static std::map<CellSize, std::string> const cellSizeOpt({
+        {CellSize::Byte, "Byte"},
+        {CellSize::CacheLine, "Cache line"},
+    });
+    m_cellSizeDropdown = std::make_unique<Dropdown<CellSize>>("Pixel:",
+                                                              cellSizeOpt);
+    m_cellSizeDropdown->setSelection(m_cellSize);
+    static std::map<Coloring, std::string> const coloringOpt({
+        {Coloring::Value, "Value"},
+        {Coloring::Recency, "Last write"},
+    });
+    m_coloringDropdown = std::make_unique<Dropdown<Coloring>>("Color:",
+                                                              coloringOpt);
+}
+
+Imgui::MemoryMapWindow::~MemoryMapWindow() {
+    if (!!m_texture) {
+        SDL_DestroyTexture(m_texture);
+    }
+}
+
+void Imgui::MemoryMapWindow::update(
+    std::shared_ptr<Snapshot const> const snapshot,
+    u64 const step) {
+    u64 const cellBytes(m_cellSize == CellSize::Byte ? 1 : cacheLineSize);
+    bool const reset(!m_snapshot ||
+                     m_memSize != snapshot->physicalMemorySize());
+
+    // The snapshots after m_snapshot up to the new snapshot, newest first,
+    // when stepping forward.
+    std::vector<Snapshot const*> forward;
+    bool isForward(false);
+    if (!reset) {
+        for (Snapshot const * s(snapshot.get()); !!s; s = s->base().get()) {
+            if (s == m_snapshot.get()) {
+                isForward = true;
+                break;
+            }
+            forward.push_back(s);
+        }
+    }
+
+    if (isForward) {
+        // Only the cells written by the new snapshots have a new last write,
+        // process them from the oldest so that the latest write wins.
+        for (u64 i(forward.size()); !!i; --i) {
+            Snapshot const& s(*forward[i - 1]);
+            u64 const sStep(step - (i - 1));
+            for (auto const& [offset, size] :
+                 s.changedPhysicalRanges(*s.base())) {
+                forEachChangedCell(s, offset, size, [&](u64 const cell) {
+                    m_lastWrite[cell] = sStep;
+                });
+            }
+        }
+        std::shared_ptr<Snapshot const> const prev(m_snapshot);
+        m_snapshot = snapshot;
+        m_step = step;
+        for (auto const& [offset, size] :
+             snapshot->changedPhysicalRanges(*prev)) {
+            readCells(offset, size);
+        }
+        return;
+    }
+
+    // Stepping backward or showing a new history. The cells which last write
+    // is unknown are found by walking back the history from the new
+    // snapshot.
+    u64 const numCells((snapshot->physicalMemorySize() + cellBytes - 1) /
+                       cellBytes);
+    std::vector<bool> pending(numCells, reset);
+    u64 numPending(reset ? numCells : 0);
+    std::shared_ptr<Snapshot const> const prev(m_snapshot);
+    if (reset) {
+        m_memSize = snapshot->physicalMemorySize();
+        m_values.assign(numCells, 0);
+        m_lastWrite.assign(numCells, 0);
+    } else {
+        for (u64 cell(0); cell < numCells; ++cell) {
+            if (step < m_lastWrite[cell]) {
+                m_lastWrite[cell] = 0;
+                pending[cell] = true;
+                numPending ++;
+            }
+        }
+    }
+    m_snapshot = snapshot;
+    m_step = step;
+    if (reset) {
+        readCells(0, m_memSize);
+    } else {
+        for (auto const& [offset, size] :
+             snapshot->changedPhysicalRanges(*prev)) {
+            readCells(offset, size);
+        }
+    }
+
+    // Cells outside of the ranges that differ between a snapshot and the root
+    // of the history were never written up to that snapshot. This resolves
+    // the cells that are never written, e.g. most of the memory, without
+    // walking the history back to the root.
+    Snapshot const * root(snapshot.get());
+    while (root->hasBase()) {
+        root = root->base().get();
+    }
+    auto const resolveUnwritten([&](Snapshot const& s) {
+        std::vector<std::pair<u64, u64>> const ranges(
+            s.changedPhysicalRanges(*root));
+        auto range(ranges.begin());
+        for (u64 cell(0); !!numPending && cell < numCells; ++cell) {
+            u64 const start(cell * cellBytes);
+            while (range != ranges.end() &&
+                   range->first + range->second <= start) {
+                range ++;
+            }
+            bool const changed(range != ranges.end() &&
+                               range->first < start + cellBytes);
+            if (pending[cell] && !changed) {
+                m_lastWrite[cell] = 0;
+                pending[cell] = false;
+                numPending --;
+            }
+        }
+    });
+
+    // Cells that were rewritten with identical content stay pending until
+    // the walk reaches the step their leaf was first written, check again
+    // at exponentially growing intervals to bound the walk.
+    u64 nextCheck(0);
+    u64 sStep(step);
+    for (Snapshot const * s(snapshot.get()); !!numPending && s->hasBase();
+         s = s->base().get(), --sStep) {
+        if (step - sStep == nextCheck) {
+            resolveUnwritten(*s);
+            nextCheck = std::max<u64>(1, 2 * nextCheck);
+            if (!numPending) {
+                break;
+            }
+        }
+        for (auto const& [offset, size] :
+             s->changedPhysicalRanges(*s->base())) {
+            u64 const firstCell(offset / cellBytes);
+            u64 const endCell((offset + size + cellBytes - 1) / cellBytes);
+            if (std::find(pending.begin() + firstCell,
+                          pending.begin() + endCell,
+                          true) == pending.begin() + endCell) {
+                // Avoid reading the memory if none of the cells is pending.
+                continue;
+            }
+            forEachChangedCell(*s, offset, size, [&](u64 const cell) {
+                if (pending[cell]) {
+                    m_lastWrite[cell] = sStep;
+                    pending[cell] = false;
+                    numPending --;
+                }
+            });
+        }
+    }
+}
+
+void Imgui::MemoryMapWindow::readCells(u64 const offset, u64 const size) {
+    u64 const cellBytes(m_cellSize == CellSize::Byte ? 1 : cacheLineSize);
+    u64 const firstCell(offset / cellBytes);
+    u64 const endCell(std::min<u64>(m_values.size(),
+        (offset + size + cellBytes - 1) / cellBytes));
+    std::vector<u8> const data(m_snapshot->readPhysicalMemory(
+        firstCell * cellBytes, (endCell - firstCell) * cellBytes));
+    for (u64 cell(firstCell); cell < endCell; ++cell) {
+        u8 const * const bytes(data.data() + (cell - firstCell) * cellBytes);
+        u64 sum(0);
+        for (u64 i(0); i < cellBytes; ++i) {
+            sum += bytes[i];
+        }
+        // Round up so that only cells containing zeroes are zero.
+        m_values[cell] = (sum + cellBytes - 1) / cellBytes;
+    }
+    if (!m_textureWidth) {
+        return;
+    }
+    u64 const firstRow(firstCell / m_textureWidth);
+    u64 const endRow((endCell + m_textureWidth - 1) / m_textureWidth);
+    if (m_dirtyRowsBegin == m_dirtyRowsEnd) {
+        m_dirtyRowsBegin = firstRow;
+        m_dirtyRowsEnd = endRow;
+    } else {
+        m_dirtyRowsBegin = std::min(m_dirtyRowsBegin, firstRow);
+        m_dirtyRowsEnd = std::max(m_dirtyRowsEnd, endRow);
+    }
+}
+
+void Imgui::MemoryMapWindow::forEachChangedCell(
+    Snapshot const& snapshot,
+    u64 const offset,
+    u64 const size,
+    std::function<void(u64)> const& callback) const {
+    u64 const cellBytes(m_cellSize == CellSize::Byte ? 1 : cacheLineSize);
+    u64 const start(offset / cellBytes * cellBytes);
+    u64 const len((offset + size + cellBytes - 1) / cellBytes * cellBytes -
+                  start);
+    std::vector<u8> const curr(snapshot.readPhysicalMemory(start, len));
+    std::vector<u8> const base(snapshot.base()->readPhysicalMemory(start, len));
+    for (u64 i(0); i < len; i += cellBytes) {
+        if (!!std::memcmp(curr.data() + i, base.data() + i, cellBytes)) {
+            callback((start + i) / cellBytes);
+        }
+    }
+}
+
+u32 Imgui::MemoryMapWindow::cellColor(u64 const cell) const {
+    if (m_values.size() <= cell) {
+        return IM_COL32(0, 0, 0, 0);
+    }
+    if (m_coloring == Coloring::Recency) {
+        u64 const lastWrite(m_lastWrite[cell]);
+        if (!lastWrite) {
+            return neverWrittenColor;
+        }
+        // 1.0 for the current step, towards 0.0 for the first step.
+        float const t(1.0f - std::log2(1.0f + (m_step - lastWrite)) /
+                      std::log2(2.0f + m_step));
+        return IM_COL32(64 + 191 * t, 200 * t * t, 0, 255);
+    }
+    u8 const value(m_values[cell]);
+    if (!value) {
+        return IM_COL32(0, 0, 0, 255);
+    } else if (value == 0xff) {
+        return IM_COL32(255, 255, 255, 255);
+    } else if (0x20 <= value && value < 0x7f) {
+        return IM_COL32(0, 96 + value, 0, 255);
+    } else if (value < 0x80) {
+        return IM_COL32(0, 0, 128 + value, 255);
+    } else {
+        return IM_COL32(value, 0, 0, 255);
+    }
+}
+
+void Imgui::MemoryMapWindow::doDraw(State const& state) {
+    m_cellSizeDropdown->draw();
+    ImGui::SameLine();
+    m_coloringDropdown->draw();
+
+    std::shared_ptr<Snapshot const> const snapshot(state.snapshot());
+    if (!snapshot) {
+        return;
+    }
+    if (m_cellSizeDropdown->selection() != m_cellSize) {
+        // Everything must be computed again with the new cell size.
+        m_cellSize = m_cellSizeDropdown->selection();
+        m_snapshot = nullptr;
+    }
+    bool const recolor(m_coloringDropdown->selection() != m_coloring);
+    m_coloring = m_coloringDropdown->selection();
+
+    if (!m_snapshot || m_memSize != snapshot->physicalMemorySize()) {
+        // (Re-)create the texture. Widen the rows until the texture has a
+        // reasonable height.
+        if (!!m_texture) {
+            SDL_DestroyTexture(m_texture);
+            m_texture = nullptr;
+        }
+        u64 const cellBytes(m_cellSize == CellSize::Byte ? 1 : cacheLineSize);
+        u64 const numCells((snapshot->physicalMemorySize() + cellBytes - 1) /
+                           cellBytes);
+        m_textureWidth = minTextureWidth;
+        while (maxTextureHeight * m_textureWidth < numCells) {
+            m_textureWidth *= 2;
+        }
+        m_textureHeight = (numCells + m_textureWidth - 1) / m_textureWidth;
+        m_texture = SDL_CreateTexture(m_renderer,
+                                      SDL_PIXELFORMAT_ABGR8888,
+                                      SDL_TEXTUREACCESS_STREAMING,
+                                      m_textureWidth,
+                                      m_textureHeight);
+        m_pixels.assign(m_textureWidth * m_textureHeight, 0);
+        m_snapshot = nullptr;
+    }
+    if (!m_texture) {
+        ImGui::Text("Cannot create a %lux%lu texture, try larger pixels",
+                    m_textureWidth, m_textureHeight);
+        return;
+    }
+
+    u64 const prevStep(m_step);
+    if (snapshot != m_snapshot) {
+        update(snapshot, state.historyIndex());
+    }
+    // The colors of all the cells depend on the current step when showing the
+    // recency of the writes.
+    if (recolor ||
+        (m_coloring == Coloring::Recency && prevStep != m_step)) {
+        m_dirtyRowsBegin = 0;
+        m_dirtyRowsEnd = m_textureHeight;
+    }
+    if (m_dirtyRowsBegin < m_dirtyRowsEnd) {
+        for (u64 i(m_dirtyRowsBegin * m_textureWidth);
+             i < m_dirtyRowsEnd * m_textureWidth; ++i) {
+            m_pixels[i] = cellColor(i);
+        }
+        SDL_Rect const rect({
+            .x = 0,
+            .y = static_cast<int>(m_dirtyRowsBegin),
+            .w = static_cast<int>(m_textureWidth),
+            .h = static_cast<int>(m_dirtyRowsEnd - m_dirtyRowsBegin),
+        });
+        SDL_UpdateTexture(m_texture,
+                          &rect,
+                          m_pixels.data() + m_dirtyRowsBegin * m_textureWidth,
+                          m_textureWidth * sizeof(u32));
+        m_dirtyRowsBegin = m_dirtyRowsEnd = 0;
+    }
+
+    // The bitmap spans the width of the window, scroll vertically.
+    ImGui::BeginChild("##map");
+    float const width(ImGui::GetContentRegionAvail().x);
+    float const scale(width / m_textureWidth);
+    ImVec2 const origin(ImGui::GetCursorScreenPos());
+    ImGui::Image(reinterpret_cast<ImTextureID>(m_texture),
+                 ImVec2(width, m_textureHeight * scale));
+    if (ImGui::IsItemHovered()) {
+        ImVec2 const mouse(ImGui::GetIO().MousePos);
+        u64 const x(std::min<u64>(m_textureWidth - 1,
+                                  (mouse.x - origin.x) / scale));
+        u64 const y(std::min<u64>(m_textureHeight - 1,
+                                  (mouse.y - origin.y) / scale));
+        u64 const cell(y * m_textureWidth + x);
+        if (cell < m_values.size()) {
+            u64 const cellBytes(m_cellSize == CellSize::Byte ? 1 :
+                                cacheLineSize);
+            std::string const lastWrite(!!m_lastWrite[cell] ?
+                "step " + std::to_string(m_lastWrite[cell]) : "never");
+            ImGui::SetTooltip("0x%016lx: %s 0x%02x, last written: %s",
+                cell * cellBytes,
+                m_cellSize == CellSize::Byte ? "value" : "average",
+                m_values[cell],
+                lastWrite.c_str());
+        }
+    }
+    ImGui::EndChild();
+}
 }
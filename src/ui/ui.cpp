@@ -7,10 +7,26 @@ namespace X86Lab::Ui {
 
 State::State(Vm::OperatingState const runState,
              std::shared_ptr<Code const> const code,
-             std::shared_ptr<Snapshot const> const snapshot) :
+             std::shared_ptr<Snapshot const> const snapshot,
+             std::shared_ptr<RegisterHistory const> const registerHistory,
+             u64 const historyIndex,
+             std::shared_ptr<WorkingSetHistory const> const
+                workingSetHistory,
+             std::shared_future<
+                std::shared_ptr<MemoryProfile::Results const>> const
+                memoryProfile,
+             std::shared_ptr<LoopIndex const> const loopIndex,
+             std::shared_future<std::shared_ptr<DependencyGraph const>> const
+                dependencyGraph) :
     m_runState(runState), 
     m_loadedCode(code),
-    m_latestSnapshot(snapshot) {}
+    m_latestSnapshot(snapshot),
+    m_registerHistory(registerHistory),
+    m_historyIndex(historyIndex),
+    m_workingSetHistory(workingSetHistory),
+    m_memoryProfile(memoryProfile),
+    m_loopIndex(loopIndex),
+    m_dependencyGraph(dependencyGraph) {}
 
 bool State::isVmRunnable() const {
     return m_runState == Vm::OperatingState::Runnable;
@@ -53,6 +69,58 @@ std::shared_ptr<Snapshot const> State::snapshot() const {
     return m_latestSnapshot;
 }
 
+std::shared_ptr<RegisterHistory const> State::registerHistory() const {
+    return m_registerHistory;
+}
+
+u64 State::historyIndex() const {
+    return m_historyIndex;
+}
+
+std::shared_ptr<WorkingSetHistory const> State::workingSetHistory() const {
+    return m_workingSetHistory;
+}
+
+std::shared_ptr<MemoryProfile::Results const> State::memoryProfile(
+    bool const wait) const {
+    if (!m_memoryProfile.valid() || (!wait && memoryProfileRunning())) {
+        return nullptr;
+    }
+    try {
+        return m_memoryProfile.get();
+    } catch (Error const&) {
+        return nullptr;
+    }
+}
+
+bool State::memoryProfileRunning() const {
+    return m_memoryProfile.valid() &&
+        m_memoryProfile.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready;
+}
+
+std::shared_ptr<LoopIndex const> State::loopIndex() const {
+    return m_loopIndex;
+}
+
+std::shared_ptr<DependencyGraph const> State::dependencyGraph(
+    bool const wait) const {
+    if (!m_dependencyGraph.valid() || (!wait && dependencyAnalysisRunning())) {
+        return nullptr;
+    }
+    try {
+        return m_dependencyGraph.get();
+    } catch (Error const&) {
+        return nullptr;
+    }
+}
+
+bool State::dependencyAnalysisRunning() const {
+    return m_dependencyGraph.valid() &&
+        m_dependencyGraph.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready;
+}
+
 u64 State::codeLinearAddr() const {
     // The code is always loaded at linear address 0x0.
     return 0x0;
@@ -69,6 +137,7 @@ bool Backend::init() {
 }
 
 Action Backend::waitForNextAction() {
+    m_actionArgument = 0;
     return doWaitForNextAction();
 }
 
@@ -76,6 +145,14 @@ void Backend::update(State const& newState) {
     doUpdate(newState);
 }
 
+u64 Backend::actionArgument() const {
+    return m_actionArgument;
+}
+
+void Backend::setActionArgument(u64 const argument) {
+    m_actionArgument = argument;
+}
+
 void Backend::log(std::string const& msg) {
     // Gotta love std::chrono boilerplate.
     std::chrono::time_point<std::chrono::system_clock> const date(
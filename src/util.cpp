@@ -1,7 +1,15 @@
 #include <x86lab/util.hpp>
+#include <algorithm>
+#include <cassert>
+#include <fstream>
+#include <memory>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include <x86lab/vm.hpp>
 
 namespace X86Lab::Util {
@@ -39,6 +47,136 @@ std::ofstream TempFile::ostream(std::ios_base::openmode const mode) {
     return std::ofstream(m_absPath.c_str(), mode);
 }
 
+// Set while a thread runs a task of a ThreadPool, to detect nested
+// parallelFor() calls.
+static thread_local bool isRunningTask(false);
+
+ThreadPool::ThreadPool(u64 const numThreads) :
+    m_jobId(0),
+    m_stop(false),
+    m_func(nullptr),
+    m_count(0),
+    m_next(0),
+    m_numDone(0) {
+    for (u64 i(1); i < numThreads; ++i) {
+        m_workers.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_jobCond.notify_all();
+    for (std::thread& worker : m_workers) {
+        worker.join();
+    }
+}
+
+ThreadPool& ThreadPool::shared() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+u64 ThreadPool::numThreads() const {
+    return m_workers.size() + 1;
+}
+
+void ThreadPool::parallelFor(u64 const count,
+                             std::function<void(u64)> const& func) {
+    if (isRunningTask || m_workers.empty() || count <= 1) {
+        // Nested call from a task, or nothing to parallelize. Waiting for
+        // other tasks from a worker could deadlock, run sequentially instead.
+        for (u64 i(0); i < count; ++i) {
+            func(i);
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> const jobLock(m_jobMutex);
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_func = &func;
+        m_count = count;
+        m_next = 0;
+        m_numDone = 0;
+        m_exception = nullptr;
+        m_jobId ++;
+    }
+    m_jobCond.notify_all();
+    // The calling thread participates as well.
+    processTasks();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_doneCond.wait(lock, [&]() { return m_numDone == m_count; });
+    m_func = nullptr;
+    if (!!m_exception) {
+        std::rethrow_exception(m_exception);
+    }
+}
+
+void ThreadPool::workerLoop() {
+    u64 lastJobId(0);
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_jobCond.wait(lock, [&]() {
+                return m_stop || (m_jobId != lastJobId && !!m_func);
+            });
+            if (m_stop) {
+                return;
+            }
+            lastJobId = m_jobId;
+        }
+        processTasks();
+    }
+}
+
+void ThreadPool::processTasks() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!!m_func && m_next < m_count) {
+        u64 const index(m_next ++);
+        std::function<void(u64)> const& func(*m_func);
+        lock.unlock();
+        std::exception_ptr exception;
+        isRunningTask = true;
+        try {
+            func(index);
+        } catch (...) {
+            exception = std::current_exception();
+        }
+        isRunningTask = false;
+        lock.lock();
+        if (!!exception && !m_exception) {
+            m_exception = exception;
+        }
+        m_numDone ++;
+        if (m_numDone == m_count) {
+            m_doneCond.notify_all();
+        }
+    }
+}
+
+void parallelMemcpy(void * const dest, void const * const src, u64 const size) {
+    // Below this size the cost of waking up the workers is not worth it.
+    static constexpr u64 minChunkSize = 16 * 1024 * 1024;
+    ThreadPool& pool(ThreadPool::shared());
+    u64 const numChunks(std::min(pool.numThreads(),
+                                 std::max<u64>(1, size / minChunkSize)));
+    // Page-aligned chunks, the last one might be smaller.
+    u64 const perChunk((size + numChunks - 1) / numChunks);
+    u64 const chunkSize((perChunk + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE);
+    pool.parallelFor(numChunks, [&](u64 const i) {
+        u64 const offset(i * chunkSize);
+        if (offset < size) {
+            std::memcpy(static_cast<u8*>(dest) + offset,
+                        static_cast<u8 const*>(src) + offset,
+                        std::min(chunkSize, size - offset));
+        }
+    });
+}
+
 namespace Extension {
 // Holds the result of a CPUID instruction.
 struct CpuidResult {
@@ -75,6 +213,140 @@ bool hasAvx2()      { return !!(cpuid(0x7, 0x0).ecx & (1 << 5));  }
 // Note: We do a crude check regarding AVX512 by only looking for AVX512
 // foundation instruction support.
 bool hasAvx512()    { return !!(cpuid(0x7, 0x0).ebx & (1 << 16)); }
+bool hasPage1Gb()   { return !!(cpuid(0x80000001, 0x0).edx & (1 << 26)); }
+}
+
+namespace Host {
+
+void pinCurrentThread(u32 const cpu) {
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    // pthread_setaffinity_np returns the error number instead of setting errno.
+    int const res(::pthread_setaffinity_np(::pthread_self(),
+                                           sizeof(cpuSet),
+                                           &cpuSet));
+    if (!!res) {
+        throw Error("Cannot pin thread to cpu " + std::to_string(cpu), res);
+    }
+}
+
+void bindMemory(void * const addr, u64 const size, u32 const node) {
+    // Call mbind directly instead of going through libnuma, this avoids adding
+    // a dependency for a single syscall.
+    u64 const maxNode(sizeof(u64) * 8);
+    if (node >= maxNode) {
+        throw Error("Invalid NUMA node " + std::to_string(node), EINVAL);
+    }
+    u64 const nodeMask(1ULL << node);
+    // MPOL_MF_STRICT | MPOL_MF_MOVE: Migrate any page that would already be
+    // populated and fail if this is not possible.
+    unsigned const flags(MPOL_MF_STRICT | MPOL_MF_MOVE);
+    // The kernel only reads maxnode - 1 bits of the mask, hence the + 1 for
+    // node 63 to be accepted.
+    if (::syscall(SYS_mbind, addr, size, MPOL_BIND, &nodeMask, maxNode + 1,
+                  flags) == -1) {
+        throw Error("Cannot bind memory to NUMA node " + std::to_string(node),
+                    errno);
+    }
+}
+
+void prefault(void * const addr, u64 const size) {
+    // MADV_POPULATE_WRITE is only available starting with Linux 5.14, in case
+    // it is not supported fallback to touching each page manually.
+    if (::madvise(addr, size, MADV_POPULATE_WRITE) == -1) {
+        u8 volatile * const bytes(static_cast<u8 volatile*>(addr));
+        for (u64 offset(0); offset < size; offset += PAGE_SIZE) {
+            bytes[offset] = bytes[offset];
+        }
+    }
+}
+
+std::vector<bool> populatedPages(void const * const addr, u64 const size) {
+    u64 const numPages((size + PAGE_SIZE - 1) / PAGE_SIZE);
+    int const fd(::open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        return std::vector<bool>(numPages, true);
+    }
+    // Each page is described by a 64-bit entry in pagemap.
+    static constexpr u64 presentBit = 1ULL << 63;
+    static constexpr u64 swappedBit = 1ULL << 62;
+    std::vector<bool> res(numPages, true);
+    std::vector<u64> entries(std::min<u64>(numPages, 4096));
+    u64 const firstPage(reinterpret_cast<u64>(addr) / PAGE_SIZE);
+    for (u64 i(0); i < numPages; i += entries.size()) {
+        u64 const count(std::min<u64>(entries.size(), numPages - i));
+        ssize_t const len(::pread(fd,
+                                  entries.data(),
+                                  count * sizeof(u64),
+                                  (firstPage + i) * sizeof(u64)));
+        if (len != static_cast<ssize_t>(count * sizeof(u64))) {
+            // Conservatively assume the remaining pages are populated.
+            break;
+        }
+        for (u64 j(0); j < count; ++j) {
+            res[i + j] = !!(entries[j] & (presentBit | swappedBit));
+        }
+    }
+    ::close(fd);
+    return res;
+}
+
+std::vector<bool> populatedFilePages(int const fd, u64 const size) {
+    u64 const numPages((size + PAGE_SIZE - 1) / PAGE_SIZE);
+    std::vector<bool> res(numPages, false);
+    // Walk the data segments of the file. The file offset is modified, only
+    // the returned values are used hence concurrent calls on duplicated file
+    // descriptors are fine.
+    off_t offset(0);
+    while (static_cast<u64>(offset) < size) {
+        off_t const data(::lseek(fd, offset, SEEK_DATA));
+        if (data == -1 && errno == ENXIO) {
+            // No data past the offset.
+            break;
+        }
+        off_t const hole(data == -1 ? -1 : ::lseek(fd, data, SEEK_HOLE));
+        if (hole == -1) {
+            // SEEK_DATA and SEEK_HOLE not supported.
+            return std::vector<bool>(numPages, true);
+        }
+        u64 const end(std::min<u64>(hole, size));
+        for (u64 page(data / PAGE_SIZE); page * PAGE_SIZE < end; ++page) {
+            res[page] = true;
+        }
+        offset = hole;
+    }
+    return res;
+}
+
+u64 hugePageBytes(void const * const addr, u64 const size) {
+    std::ifstream smaps("/proc/self/smaps");
+    u64 const start(reinterpret_cast<u64>(addr));
+    u64 const end(start + size);
+    // Each mapping starts with a line "<start>-<end> <perms> ...", followed by
+    // lines "<Field>: <value> kB". The field names end with a colon.
+    static std::vector<std::string> const fields({
+        "AnonHugePages:", "ShmemPmdMapped:", "FilePmdMapped:"});
+    u64 res(0);
+    bool overlaps(false);
+    std::string line;
+    while (std::getline(smaps, line)) {
+        std::string const name(line.substr(0, line.find(' ')));
+        if (!name.ends_with(':')) {
+            u64 const dash(name.find('-'));
+            if (dash == std::string::npos) {
+                continue;
+            }
+            u64 const mapStart(std::stoull(name.substr(0, dash), nullptr, 16));
+            u64 const mapEnd(std::stoull(name.substr(dash + 1), nullptr, 16));
+            overlaps = mapStart < end && start < mapEnd;
+        } else if (overlaps &&
+                   !!std::count(fields.begin(), fields.end(), name)) {
+            res += std::stoull(line.substr(name.size())) * 1024;
+        }
+    }
+    return res;
+}
 }
 
 namespace Kvm {
@@ -156,6 +428,22 @@ void disableMsrFiltering(int const vmFd) {
     }
 }
 
+bool honorGuestPat(int const vmFd) {
+    // Not defined by older kernel headers.
+    u64 const ignoreGuestPatQuirk(1 << 9);
+    int const quirks(checkExtension(vmFd, KVM_CAP_DISABLE_QUIRKS2));
+    if (!(quirks & ignoreGuestPatQuirk)) {
+        return false;
+    }
+    kvm_enable_cap cap{};
+    cap.cap = KVM_CAP_DISABLE_QUIRKS2;
+    cap.args[0] = ignoreGuestPatQuirk;
+    if (::ioctl(vmFd, KVM_ENABLE_CAP, &cap) == -1) {
+        throw KvmError("Failed to disable the ignore guest PAT quirk", errno);
+    }
+    return true;
+}
+
 void setupCpuid(int const vcpuFd) {
     size_t nent(32);
     kvm_cpuid2 * kvmCpuid(nullptr);
@@ -210,6 +498,15 @@ kvm_sregs getSRegs(int const vcpuFd) {
     return sregs;
 }
 
+kvm_translation translate(int const vcpuFd, u64 const linearAddr) {
+    kvm_translation tr{};
+    tr.linear_address = linearAddr;
+    if (::ioctl(vcpuFd, KVM_TRANSLATE, &tr) == -1) {
+        throw KvmError("Cannot translate guest linear address", errno);
+    }
+    return tr;
+}
+
 void setSRegs(int const vcpuFd, kvm_sregs const& regs) {
     if (::ioctl(vcpuFd, KVM_SET_SREGS, std::addressof(regs)) == -1) {
         throw KvmError("Cannot set guest special registers", errno);
@@ -220,6 +517,87 @@ u16 getMaxMemSlots(int const vmFd) {
     return checkExtension(vmFd, KVM_CAP_NR_MEMSLOTS);
 }
 
+kvm_fpu getFpu(int const vcpuFd) {
+    kvm_fpu fpu{};
+    if (::ioctl(vcpuFd, KVM_GET_FPU, &fpu) == -1) {
+        throw KvmError("Cannot get guest FPU state", errno);
+    }
+    return fpu;
+}
+
+void setFpu(int const vcpuFd, kvm_fpu const& fpu) {
+    if (::ioctl(vcpuFd, KVM_SET_FPU, std::addressof(fpu)) == -1) {
+        throw KvmError("Cannot set guest FPU state", errno);
+    }
+}
+
+kvm_debugregs getDebugRegs(int const vcpuFd) {
+    kvm_debugregs debugRegs{};
+    if (::ioctl(vcpuFd, KVM_GET_DEBUGREGS, &debugRegs) == -1) {
+        throw KvmError("Cannot get guest debug registers", errno);
+    }
+    return debugRegs;
+}
+
+void setDebugRegs(int const vcpuFd, kvm_debugregs const& debugRegs) {
+    if (::ioctl(vcpuFd, KVM_SET_DEBUGREGS, std::addressof(debugRegs)) == -1) {
+        throw KvmError("Cannot set guest debug registers", errno);
+    }
+}
+
+// Allocate a kvm_msrs struct, which ends with a flexible array of entries.
+// @param indices: The indices of the MSRs, one entry is created for each.
+// @return: The allocated kvm_msrs.
+static std::unique_ptr<kvm_msrs, void(*)(void*)> allocMsrs(
+    std::vector<u32> const& indices) {
+    size_t const structSize(sizeof(kvm_msrs) +
+                            indices.size() * sizeof(kvm_msr_entry));
+    kvm_msrs * const msrs(static_cast<kvm_msrs*>(std::calloc(1, structSize)));
+    if (!msrs) {
+        throw Error("Cannot allocate kvm_msrs", errno);
+    }
+    msrs->nmsrs = indices.size();
+    for (size_t i(0); i < indices.size(); ++i) {
+        msrs->entries[i].index = indices[i];
+    }
+    return std::unique_ptr<kvm_msrs, void(*)(void*)>(msrs, std::free);
+}
+
+std::vector<u64> getMsrs(int const vcpuFd, std::vector<u32> const& indices) {
+    std::unique_ptr<kvm_msrs, void(*)(void*)> const msrs(allocMsrs(indices));
+    // KVM_GET_MSRS returns the number of MSRs read, stopping at the first MSR
+    // that cannot be read.
+    int const numRead(::ioctl(vcpuFd, KVM_GET_MSRS, msrs.get()));
+    if (numRead == -1) {
+        throw KvmError("Cannot get guest MSRs", errno);
+    } else if (static_cast<size_t>(numRead) != indices.size()) {
+        throw KvmError("Cannot get guest MSR " +
+                       std::to_string(indices[numRead]), 0);
+    }
+    std::vector<u64> values(indices.size());
+    for (size_t i(0); i < indices.size(); ++i) {
+        values[i] = msrs->entries[i].data;
+    }
+    return values;
+}
+
+void setMsrs(int const vcpuFd,
+             std::vector<u32> const& indices,
+             std::vector<u64> const& values) {
+    assert(indices.size() == values.size());
+    std::unique_ptr<kvm_msrs, void(*)(void*)> const msrs(allocMsrs(indices));
+    for (size_t i(0); i < indices.size(); ++i) {
+        msrs->entries[i].data = values[i];
+    }
+    int const numWritten(::ioctl(vcpuFd, KVM_SET_MSRS, msrs.get()));
+    if (numWritten == -1) {
+        throw KvmError("Cannot set guest MSRs", errno);
+    } else if (static_cast<size_t>(numWritten) != indices.size()) {
+        throw KvmError("Cannot set guest MSR " +
+                       std::to_string(indices[numWritten]), 0);
+    }
+}
+
 XSaveArea::XSaveArea() {
     for (u8 i(0); i < Vm::State::Registers::NumMmxRegs; ++i) {
         mmx[i] = vec64(u32(0), u32(0));
@@ -425,7 +803,7 @@ void setXcr0(int const vcpuFd, u64 const xcr0) {
     if (::ioctl(vcpuFd, KVM_GET_XCRS, &src) == -1) {
         throw KvmError("Failed KVM_GET_XCRS", errno);
     }
-    src.xcrs[0].value |= xcr0;
+    src.xcrs[0].value = xcr0;
     if (::ioctl(vcpuFd, KVM_SET_XCRS, &src) == -1) {
         throw KvmError("Failed KVM_SET_XCRS", errno);
     }
@@ -1,6 +1,16 @@
 #include <x86lab/vm.hpp>
+#include <x86lab/backends/kvm.hpp>
+#include <x86lab/backends/emulator.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <functional>
 #include <map>
+#include <sstream>
+#include <set>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace X86Lab {
 
@@ -50,16 +60,83 @@ Vm::State::Registers::Registers(kvm_regs const& regs,
     }
 }
 
+Vm::State::ExtendedState::Segment::Segment() :
+    base(0), limit(0), selector(0), type(0), dpl(0), present(false), db(false),
+    s(false), l(false), g(false), avl(false), unusable(false) {}
+
+Vm::State::ExtendedState::Segment::Segment(kvm_segment const& seg) :
+    base(seg.base), limit(seg.limit), selector(seg.selector), type(seg.type),
+    dpl(seg.dpl), present(!!seg.present), db(!!seg.db), s(!!seg.s),
+    l(!!seg.l), g(!!seg.g), avl(!!seg.avl), unusable(!!seg.unusable) {}
+
+Vm::State::ExtendedState::ExtendedState() :
+    fpu({}), dr{}, dr6(0), dr7(0), msrs{}, xcr0(0) {}
+
+Vm::State::ExtendedState::ExtendedState(kvm_fpu const& kvmFpu,
+                                        kvm_sregs const& sregs,
+                                        kvm_debugregs const& debugRegs,
+                                        std::vector<u64> const& msrValues,
+                                        u64 const xcr0) :
+    fpu({}),
+    cs(sregs.cs), ds(sregs.ds), es(sregs.es),
+    fs(sregs.fs), gs(sregs.gs), ss(sregs.ss),
+    tr(sregs.tr), ldt(sregs.ldt),
+    dr{}, dr6(debugRegs.dr6), dr7(debugRegs.dr7), msrs{}, xcr0(xcr0) {
+    assert(msrValues.size() == NumMsrs);
+    for (u8 i(0); i < Fpu::NumRegs; ++i) {
+        // Each register is stored in 16 bytes, the mantissa in the first 8
+        // bytes followed by the sign and exponent.
+        std::memcpy(&fpu.st[i].mantissa, kvmFpu.fpr[i], sizeof(u64));
+        std::memcpy(&fpu.st[i].signExponent, kvmFpu.fpr[i] + 8, sizeof(u16));
+    }
+    fpu.fcw = kvmFpu.fcw;
+    fpu.fsw = kvmFpu.fsw;
+    fpu.ftw = kvmFpu.ftwx;
+    fpu.lastOpcode = kvmFpu.last_opcode;
+    fpu.lastIp = kvmFpu.last_ip;
+    fpu.lastDp = kvmFpu.last_dp;
+    for (u8 i(0); i < NumDrRegs; ++i) {
+        dr[i] = debugRegs.db[i];
+    }
+    for (u8 i(0); i < NumMsrs; ++i) {
+        msrs[i] = msrValues[i];
+    }
+}
+
 Vm::State::Registers const& Vm::State::registers() const {
     return m_regs;
 }
 
+Vm::State::ExtendedState const& Vm::State::extendedState() const {
+    return m_extendedState;
+}
+
+Vm::State::Memory::Deleter::Deleter(std::default_delete<u8[]> const&) :
+    mappedSize(0) {}
+
+Vm::State::Memory::Deleter::Deleter(u64 const mappedSize) :
+    mappedSize(mappedSize) {}
+
+void Vm::State::Memory::Deleter::operator()(u8 * const ptr) const {
+    if (!mappedSize) {
+        delete[] ptr;
+    } else {
+        ::munmap(ptr, mappedSize);
+    }
+}
+
 Vm::State::Memory const& Vm::State::memory() const {
     return m_mem;
 }
 
 Vm::State::State(Registers const& regs, Memory && mem) :
+    State(regs, ExtendedState(), std::move(mem)) {}
+
+Vm::State::State(Registers const& regs,
+                 ExtendedState const& extendedState,
+                 Memory && mem) :
     m_regs(regs),
+    m_extendedState(extendedState),
     m_mem(std::move(mem)) {}
 
 // Compute ceil(a / b);
@@ -71,15 +148,46 @@ static u64 roundUp(u64 const val, u64 const multiple) {
     return multiple * ceil(val, multiple);
 }
 
+// The size of the transparent huge pages of the host.
+static constexpr u64 HugePageSize = 1 << 21;
+
+// Bits of a leaf page table entry selecting the memory type of the page.
+// @param type: The memory type, its value is its index in Vm::PatValue.
+// @param largePage: If true, compute the bits of an entry mapping a 2MiB or
+// 1GiB page, which hold the PAT bit in bit 12 instead of bit 7.
+// @return: The PAT, PCD and PWT bits of the entry.
+static u64 memoryTypeBits(Vm::MemoryType const type, bool const largePage) {
+    u64 const index(static_cast<u64>(type));
+    u64 const pwt((index & 1) << 3);
+    u64 const pcd(((index >> 1) & 1) << 4);
+    u64 const pat(((index >> 2) & 1) << (largePage ? 12 : 7));
+    return pat | pcd | pwt;
+}
+
+
+Vm::Placement::Placement() : prefault(false), hugePages(false) {}
+
+std::string Vm::Placement::toString() const {
+    std::ostringstream oss;
+    oss << "cpu=" << (cpu ? std::to_string(*cpu) : "any");
+    oss << " node=" << (numaNode ? std::to_string(*numaNode) : "any");
+    oss << " prefault=" << prefault;
+    oss << " hugepages=" << hugePages;
+    return oss.str();
+}
 
-Vm::Vm(CpuMode const startMode, u64 const memorySize) :
-    m_vmFd(Util::Kvm::createVm()),
-    m_vcpuFd(Util::Kvm::createVcpu(m_vmFd)),
-    m_kvmRun(Util::Kvm::getVcpuRunStruct(m_vcpuFd)),
+Vm::Vm(CpuMode const startMode,
+       u64 const memorySize,
+       Placement const& placement,
+       BackendType const backend) :
     m_requestedMemorySize(memorySize),
-    m_currState(OperatingState::NoCodeLoaded) {
-    // VM and VCPU are created in the initialization list. However we still need
-    // to add memory. Physical memory size is rounded-up to a multiple of
+    m_memoryFd(-1),
+    m_memoryFrozen(false),
+    m_backendType(backend),
+    m_currState(OperatingState::NoCodeLoaded),
+    m_placement(placement) {
+    // The backend is created once the physical memory is allocated, it needs
+    // to map it. Physical memory size is rounded-up to a multiple of
     // PAGE_SIZE.
     m_physicalMemorySize = roundUp(memorySize, PAGE_SIZE);
 
@@ -147,47 +255,87 @@ Vm::Vm(CpuMode const startMode, u64 const memorySize) :
     // Allocate the guest's physical memory.
     m_memory = createPhysicalMemory(m_physicalMemorySize);
 
-    // We require some Kvm extension to implement some of the features of this
-    // class. Check that all extension are supported on the host's KVM API now
-    // instead of doing it at every corresponding KVM_* ioctl later.
-    Util::Kvm::requiresExension(m_vmFd, KVM_CAP_X86_MSR_FILTER);
-    Util::Kvm::requiresExension(m_vmFd, KVM_CAP_NR_MEMSLOTS);
-    Util::Kvm::requiresExension(m_vmFd, KVM_CAP_XSAVE);
-    Util::Kvm::requiresExension(m_vmFd, KVM_CAP_XCRS);
-
-    // Disable any MSR access filtering. KVM's doc indicate that if this is not
-    // done then the default behaviour is used. However it's not really clear if
-    // the default behaviour allows access to MSRs or not. Hence disable it here
-    // completely.
-    Util::Kvm::disableMsrFiltering(m_vmFd);
-
-    // Setup access to CPUID information. We don't want to "hide" anything from
-    // the guest, having CPUID instruction available can always be useful.
-    Util::Kvm::setupCpuid(m_vcpuFd);
+    try {
+        m_backend = createBackend();
+    } catch (...) {
+        // The destructor is not called if the constructor throws.
+        ::munmap(m_memory, m_physicalMemorySize);
+        throw;
+    }
 
     // Setup the registers depending on the requested mode and honor the initial
     // value of registers documented in .hpp.
     setRegistersInitialValue(startMode);
 }
 
-Vm::~Vm() {
-    // FIXME: The kvm_run structure is an mmap on the m_vcpuFd. Unmap it before
-    // closing the m_vcpuFd. This could be solved using a custom type returned
-    // by getVcpuRunStruct, with RAII doing the munmap in its destructor.
-    if (::close(m_vcpuFd) == -1) {
-        std::perror("Cannot close KVM Vcpu file descriptor:");
-    } else if (::close(m_vmFd) == -1) {
-        std::perror("Cannot close KVM VM file descriptor:");
+Vm::Vm(Vm const& parent, Placement const& placement) :
+    m_physicalMemorySize(parent.m_physicalMemorySize),
+    m_requestedMemorySize(parent.m_requestedMemorySize),
+    m_extraMemoryOffset(parent.m_extraMemoryOffset),
+    m_memory(nullptr),
+    m_memoryFd(::fcntl(parent.m_memoryFd, F_DUPFD_CLOEXEC, 0)),
+    m_memoryFrozen(true),
+    m_backendType(parent.m_backendType),
+    m_currState(parent.m_currState),
+    m_placement(placement) {
+    if (m_memoryFd == -1) {
+        throw Error("Failed to duplicate guest memory file", errno);
+    }
+    try {
+        // The parent's memory file is never written again, mapping it
+        // copy-on-write shares all its pages with the parent and the other
+        // clones.
+        m_memory = mapPhysicalMemory(m_memoryFd, nullptr);
+        if (m_placement.prefault) {
+            Util::Host::prefault(m_memory, m_physicalMemorySize);
+        }
+        m_backend = createBackend();
+    } catch (...) {
+        if (!!m_memory) {
+            ::munmap(m_memory, m_physicalMemorySize);
+        }
+        ::close(m_memoryFd);
+        throw;
     }
 
+    // The control registers must be set before the extended state, see
+    // setRegistersInitialValue().
+    setRegisters(parent.getRegisters());
+    setExtendedState(parent.getExtendedState());
+}
+
+Vm::~Vm() {
+    // The backend might still reference the memory, destroy it first.
+    m_backend.reset();
+
     // Un-map all physical memory.
     if (::munmap(m_memory, m_physicalMemorySize) == -1) {
         // Virtually impossible if we are passing the output of mmap here.
         std::perror("Failed to unmap memory region:");
     }
+    // Clones keep their own file descriptor, the file is released once the
+    // last mapping and descriptor are gone.
+    if (m_memoryFd != -1) {
+        ::close(m_memoryFd);
+    }
+}
+
+std::unique_ptr<Vm> Vm::clone(Placement const& placement) {
+    freezeMemory();
+    return std::unique_ptr<Vm>(new Vm(*this, placement));
+}
+
+std::unique_ptr<Vm::Backend> Vm::createBackend() {
+    if (m_backendType == BackendType::Kvm) {
+        return std::make_unique<Backends::Kvm>(m_memory, m_physicalMemorySize);
+    } else {
+        return std::make_unique<Backends::Emulator>(
+            static_cast<u8*>(m_memory), m_physicalMemorySize);
+    }
 }
 
 void Vm::loadCode(Code const& code) {
+    m_memoryFrozen = false;
     // For now the code is always loaded at address 0x0.
     std::memcpy(m_memory, code.machineCode(), code.size());
 
@@ -204,115 +352,385 @@ void Vm::loadCode(Code const& code) {
     m_currState = OperatingState::Runnable;
 }
 
+void Vm::writePhysicalMemory(u64 const offset,
+                             void const * const data,
+                             u64 const size) {
+    // The memory past the requested size holds the page tables created by the
+    // Vm, it is off-limits.
+    if (m_requestedMemorySize < offset ||
+        m_requestedMemorySize - offset < size) {
+        throw Error("Write outside of the guest's physical memory", 0);
+    }
+    m_memoryFrozen = false;
+    std::memcpy(static_cast<u8*>(m_memory) + offset, data, size);
+}
+
+std::vector<u8> Vm::readPhysicalMemory(u64 const offset,
+                                       u64 const size) const {
+    std::vector<u8> data(size, 0);
+    if (offset < m_physicalMemorySize) {
+        std::memcpy(data.data(),
+                    static_cast<u8 const*>(m_memory) + offset,
+                    std::min(size, m_physicalMemorySize - offset));
+    }
+    return data;
+}
+
+void Vm::setMemoryType(u64 const offset,
+                       u64 const size,
+                       MemoryType const type) {
+    if ((offset % PAGE_SIZE) || (size % PAGE_SIZE)) {
+        throw Error("Memory type range must be page aligned", 0);
+    } else if (m_requestedMemorySize < offset ||
+               m_requestedMemorySize - offset < size) {
+        throw Error("Memory type range outside of the guest's physical memory",
+                    0);
+    }
+
+    u64 const addrMask(0x000FFFFFFFFFF000ULL);
+    // The leaf entries mapping the range, with the size of their page. They
+    // are only written once the whole range is known to be valid.
+    std::vector<std::pair<u64*, u64>> leaves;
+    bool const paging(walkPageTables([&](u64& entry,
+                                         u8 const level,
+                                         bool const isLeaf) {
+        if (!isLeaf) {
+            return true;
+        }
+        u64 const leafSize(PAGE_SIZE << (9 * (level - 1)));
+        u64 const base((entry & addrMask) & ~(leafSize - 1));
+        if (base + leafSize <= offset || offset + size <= base) {
+            return false;
+        } else if (base < offset || offset + size < base + leafSize) {
+            throw Error("Memory type range covers part of a large page", 0);
+        }
+        leaves.emplace_back(&entry, leafSize);
+        return false;
+    }));
+    if (!paging) {
+        throw Error("Memory types require 4-level paging", 0);
+    }
+    for (std::pair<u64*, u64> const& leaf : leaves) {
+        bool const large(leaf.second != PAGE_SIZE);
+        u64 const mask(memoryTypeBits(MemoryType::WriteCombining, large) |
+                       memoryTypeBits(MemoryType::Uncacheable, large));
+        *leaf.first = (*leaf.first & ~mask) | memoryTypeBits(type, large);
+    }
+    if (!leaves.empty()) {
+        m_backend->invalidateTranslations();
+    }
+}
+
+bool Vm::honorsMemoryTypes() const {
+    return m_backend->honorsMemoryTypes();
+}
+
+u64 Vm::hugePageBytes() const {
+    return Util::Host::hugePageBytes(m_memory, m_physicalMemorySize);
+}
+
 std::unique_ptr<Vm::State> Vm::getState() const {
-    State::Registers const regs(getRegisters());
+    auto const [regs, extendedState](getCpuState());
+    // Anonymous memory reads as zeroes without being populated, hence the
+    // buffer is a valid image of the memory without writing the pages that
+    // are not populated in the VM.
+    void * const buf(::mmap(nullptr,
+                            m_physicalMemorySize,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1,
+                            0));
+    if (buf == MAP_FAILED) {
+        throw MmapError("Failed to mmap memory snapshot", errno);
+    }
     Vm::State::Memory mem({
-        .data = std::unique_ptr<u8[]>(new u8[m_physicalMemorySize]),
+        .data = Vm::State::Memory::Buffer(static_cast<u8*>(buf),
+                                          m_physicalMemorySize),
         .size = m_physicalMemorySize,
+        .populated = populatedPages(),
     });
-    std::memcpy(mem.data.get(), m_memory, m_physicalMemorySize);
-    return std::unique_ptr<Vm::State>(new Vm::State(regs, std::move(mem)));
+    // Only copy the populated pages, one run of consecutive pages at a time.
+    // The other pages are never touched, neither in the VM nor in the copy.
+    u64 const numPages(mem.populated.size());
+    for (u64 start(0); start < numPages;) {
+        if (!mem.populated[start]) {
+            start ++;
+            continue;
+        }
+        u64 end(start + 1);
+        while (end < numPages && mem.populated[end]) {
+            end ++;
+        }
+        u64 const offset(start * PAGE_SIZE);
+        u64 const len(std::min(end * PAGE_SIZE, m_physicalMemorySize) - offset);
+        Util::parallelMemcpy(mem.data.get() + offset,
+                             static_cast<u8 const*>(m_memory) + offset,
+                             len);
+        start = end;
+    }
+    return std::unique_ptr<Vm::State>(
+        new Vm::State(regs, extendedState, std::move(mem)));
 }
 
 Vm::State::Registers Vm::getRegisters() const {
-    kvm_regs const regs(Util::Kvm::getRegs(m_vcpuFd));
-    kvm_sregs const sregs(Util::Kvm::getSRegs(m_vcpuFd));
-    std::unique_ptr<Util::Kvm::XSaveArea> const xsave(
-        Util::Kvm::getXSave(m_vcpuFd));
-    return State::Registers(regs, sregs, *xsave);
+    return m_backend->getRegisters();
 }
 
 void Vm::setRegisters(State::Registers const& registerValues) {
-    kvm_regs const regs({
-        .rax    = registerValues.rax, .rbx    = registerValues.rbx,
-        .rcx    = registerValues.rcx, .rdx    = registerValues.rdx,
-        .rsi    = registerValues.rsi, .rdi    = registerValues.rdi,
-        .rsp    = registerValues.rsp, .rbp    = registerValues.rbp,
-        .r8     = registerValues.r8,  .r9     = registerValues.r9,
-        .r10    = registerValues.r10, .r11    = registerValues.r11,
-        .r12    = registerValues.r12, .r13    = registerValues.r13,
-        .r14    = registerValues.r14, .r15    = registerValues.r15,
-        .rip    = registerValues.rip, .rflags = registerValues.rflags,
-    });
-    Util::Kvm::setRegs(m_vcpuFd, regs);
+    m_backend->setRegisters(registerValues);
+}
+
+Vm::State::ExtendedState Vm::getExtendedState() const {
+    return m_backend->getExtendedState();
+}
+
+void Vm::setExtendedState(State::ExtendedState const& state) {
+    m_backend->setExtendedState(state);
+}
 
-    // State::Registers doesn't quite contain all the values that kvm_sregs has.
-    // Hence for those missing values, we read the current kvm_sregs to re-use
-    // them in the call to KVM_SET_SREGS.
-    kvm_sregs sregs(Util::Kvm::getSRegs(m_vcpuFd));
+std::pair<Vm::State::Registers, Vm::State::ExtendedState>
+Vm::getCpuState() const {
+    return m_backend->getCpuState();
+}
 
-    // Set the control registers, efer and the IDT/GDT. Segment registers are
-    // left untouched since setting those using setRegisters is not supported.
-    sregs.cr0 = registerValues.cr0;
-    sregs.cr2 = registerValues.cr2;
-    sregs.cr3 = registerValues.cr3;
-    sregs.cr4 = registerValues.cr4;
-    sregs.cr8 = registerValues.cr8;
-    sregs.efer = registerValues.efer;
-    sregs.idt.base = registerValues.idt.base;
-    sregs.idt.limit = registerValues.idt.limit;
-    sregs.gdt.base = registerValues.gdt.base;
-    sregs.gdt.limit = registerValues.gdt.limit;
+Vm::OperatingState Vm::operatingState() const {
+    return m_currState;
+}
 
-    Util::Kvm::setSRegs(m_vcpuFd, sregs);
+Vm::Placement const& Vm::placement() const {
+    return m_placement;
+}
 
+std::optional<Vm::StepEffects> Vm::lastStepEffects() const {
+    return m_backend->lastStepEffects();
+}
+
+u64 Vm::WorkingSet::numAccessed() const {
+    return std::count(accessed.begin(), accessed.end(), true);
+}
 
-    std::unique_ptr<Util::Kvm::XSaveArea> xsave(Util::Kvm::getXSave(m_vcpuFd));
-    // Set the MMX registers.
-    for (u8 i(0); i < State::Registers::NumMmxRegs; ++i) {
-        xsave->mmx[i] = registerValues.mmx[i];
+u64 Vm::WorkingSet::numDirty() const {
+    return std::count(dirty.begin(), dirty.end(), true);
+}
+
+std::optional<Vm::WorkingSet> Vm::scanWorkingSet() {
+    u64 const numPages(m_physicalMemorySize / PAGE_SIZE);
+    WorkingSet workingSet({
+        .accessed = std::vector<bool>(numPages, false),
+        .dirty = std::vector<bool>(numPages, false),
+    });
+
+    // Bits of the page table entries.
+    u64 const accessed(1 << 5);
+    u64 const dirty(1 << 6);
+    // Bits 51:12 of an entry hold the physical address of the next level or
+    // of the page.
+    u64 const addrMask(0x000FFFFFFFFFF000ULL);
+    // Set if any bit was cleared, in which case the translations cached by the
+    // backend must be invalidated.
+    bool cleared(false);
+
+    // Mark the pages mapped by a leaf entry as touched.
+    // @param entry: The leaf entry.
+    // @param level: The level of the table containing the entry.
+    auto const markPages([&](u64 const entry, u8 const level) {
+        u64 const size(PAGE_SIZE << (9 * (level - 1)));
+        u64 const base((entry & addrMask) & ~(size - 1));
+        u64 const end(std::min(base + size, m_physicalMemorySize));
+        for (u64 addr(base); addr < end; addr += PAGE_SIZE) {
+            workingSet.accessed[addr / PAGE_SIZE] = true;
+            if (entry & dirty) {
+                workingSet.dirty[addr / PAGE_SIZE] = true;
+            }
+        }
+    });
+
+    // Clear the bits along the way. The vCpu sets the accessed bit of every
+    // entry it walks through, hence entries without it do not lead to any
+    // touched page.
+    bool const paging(walkPageTables([&](u64& entry,
+                                         u8 const level,
+                                         bool const isLeaf) {
+        if (!(entry & accessed)) {
+            return false;
+        }
+        cleared = true;
+        if (isLeaf) {
+            markPages(entry, level);
+            entry &= ~(accessed | dirty);
+            return false;
+        }
+        entry &= ~accessed;
+        return true;
+    }));
+    if (!paging) {
+        return std::nullopt;
     }
 
-    // MXCSR_MASK indicates the writable bits in MXCSR.
-    xsave->mxcsr = registerValues.mxcsr & xsave->mxcsrMask;
+    if (cleared) {
+        m_backend->invalidateTranslations();
+    }
+    return workingSet;
+}
 
-    // ZMM registers. This also sets the YMM and XMM registers.
-    for (u8 i(0); i < State::Registers::NumZmmRegs; ++i) {
-        xsave->zmm[i] = registerValues.zmm[i];
+bool Vm::walkPageTables(
+    std::function<bool(u64&, u8 const, bool const)> const& visit) {
+    State::Registers const regs(m_backend->getRegisters());
+    // 4-level paging: CR0.PG, CR4.PAE and EFER.LMA set, CR4.LA57 cleared.
+    bool const pg(regs.cr0 & (1UL << 31));
+    bool const pae(regs.cr4 & (1 << 5));
+    bool const la57(regs.cr4 & (1 << 12));
+    bool const lma(regs.efer & (1 << 10));
+    if (!pg || !pae || !lma || la57) {
+        return false;
     }
-    for (u8 i(0); i < State::Registers::NumKRegs; ++i) {
-        xsave->k[i] = registerValues.k[i];
+    // The visitor might write the page tables.
+    m_memoryFrozen = false;
+
+    u64 const present(1 << 0);
+    u64 const pageSize(1 << 7);
+    u64 const addrMask(0x000FFFFFFFFFF000ULL);
+    // The tables already walked. Tables can be reached through several paths,
+    // e.g. with a recursive mapping, and tables pointing to themselves would
+    // otherwise be walked once per path, up to 512^3 times.
+    std::unordered_set<u64> walked;
+    // Walk a table and the tables below it.
+    // @param tableAddr: The physical address of the table.
+    // @param level: The level of the table, 4 for the PML4.
+    std::function<void(u64, u8)> walk([&](u64 const tableAddr,
+                                          u8 const level) {
+        if (m_physicalMemorySize < tableAddr + PAGE_SIZE ||
+            !walked.insert(tableAddr).second) {
+            return;
+        }
+        u64 * const table(reinterpret_cast<u64*>(
+            static_cast<u8*>(m_memory) + tableAddr));
+        for (u64 i(0); i < PAGE_SIZE / sizeof(u64); ++i) {
+            if (!(table[i] & present)) {
+                continue;
+            }
+            bool const isLeaf(level == 1 ||
+                              ((level == 2 || level == 3) &&
+                               (table[i] & pageSize)));
+            if (visit(table[i], level, isLeaf) && !isLeaf) {
+                walk(table[i] & addrMask, level - 1);
+            }
+        }
+    });
+    walk(regs.cr3 & addrMask, 4);
+    return true;
+}
+
+void Vm::pinVcpuThread() {
+    std::thread::id const currThread(std::this_thread::get_id());
+    if (!m_placement.cpu || m_pinnedThread == currThread) {
+        return;
     }
+    Util::Host::pinCurrentThread(*m_placement.cpu);
+    m_pinnedThread = currThread;
+}
 
-    Util::Kvm::setXSave(m_vcpuFd, *xsave);
+Vm::OperatingState Vm::step() {
+    // The vCpu runs on the thread calling step(), make sure this thread is
+    // running on the requested cpu.
+    pinVcpuThread();
+    // If the backend throws, the Vm is left in the SingleStepError state.
+    m_currState = OperatingState::SingleStepError;
+    m_memoryFrozen = false;
+    m_currState = m_backend->step();
+    return m_currState;
 }
 
-Vm::OperatingState Vm::operatingState() const {
+Vm::OperatingState Vm::runUntil(u64 const rip) {
+    pinVcpuThread();
+    m_currState = OperatingState::SingleStepError;
+    m_memoryFrozen = false;
+    m_currState = m_backend->runUntil(rip);
     return m_currState;
 }
 
-Vm::OperatingState Vm::step() {
-    // Enable debug on guest vcpu in order to be able to do single
-    // stepping.
-    // The documentation is sparse on this, but it seems that single
-    // stepping gets disabled everytime registers are set using
-    // KVM_SET_REGS. Hence do it right before the call to KVM_RUN.
-    kvm_guest_debug dbg;
-    dbg.control = KVM_GUESTDBG_ENABLE | KVM_GUESTDBG_SINGLESTEP;
-    if (::ioctl(m_vcpuFd, KVM_SET_GUEST_DEBUG, &dbg) == -1) {
-        m_currState = OperatingState::SingleStepError;
-        throw KvmError("Cannot set guest debug", errno);
-    }
-
-    if (::ioctl(m_vcpuFd, KVM_RUN, NULL) != 0) {
-        m_currState = OperatingState::SingleStepError;
-        throw KvmError("Cannot run VM", errno);
-    }
-
-    if (m_kvmRun.exit_reason == KVM_EXIT_DEBUG) {
-        // The execution stopped after one step, we are still runnable.
-        m_currState = OperatingState::Runnable;
-    } else if (m_kvmRun.exit_reason == KVM_EXIT_SHUTDOWN) {
-        // Execution stopped the host. This is most likely a triple-fault hehe.
-        m_currState = OperatingState::Shutdown;
-    } else if (m_kvmRun.exit_reason == KVM_EXIT_HLT) {
-        // The single step executed a halt instruction.
-        m_currState = OperatingState::Halted;
+u64 Vm::instructionPointer() const {
+    return m_backend->instructionPointer();
+}
+
+Vm::CpuMode Vm::cpuMode() const {
+    State::ExtendedState::Segment const cs(m_backend->codeSegment());
+    if (cs.l) {
+        return CpuMode::LongMode;
+    } else if (cs.db) {
+        return CpuMode::ProtectedMode;
     } else {
-        // For now consider everything else as an error.
-        m_currState = OperatingState::SingleStepError;
+        return CpuMode::RealMode;
     }
-    return m_currState;
+}
+
+std::vector<u8> Vm::readInstructionBytes(u64 const maxLen) const {
+    u64 const linearRip(m_backend->codeSegment().base + instructionPointer());
+    std::vector<u8> bytes;
+    bytes.reserve(maxLen);
+    while (bytes.size() < maxLen) {
+        // Translate one page at a time since consecutive linear pages are not
+        // necessarily contiguous in physical memory.
+        u64 const linearAddr(linearRip + bytes.size());
+        std::optional<u64> const physAddr(m_backend->translate(linearAddr));
+        if (!physAddr || m_physicalMemorySize <= *physAddr) {
+            break;
+        }
+        u64 const toPageEnd(PAGE_SIZE - (linearAddr % PAGE_SIZE));
+        u64 const len(std::min<u64>({maxLen - bytes.size(),
+                                toPageEnd,
+                                m_physicalMemorySize - *physAddr}));
+        u8 const * const src(reinterpret_cast<u8 const*>(m_memory) + *physAddr);
+        bytes.insert(bytes.end(), src, src + len);
+    }
+    return bytes;
+}
+
+std::optional<u64> Vm::repStringInstructionLength() const {
+    std::vector<u8> const bytes(readInstructionBytes(MaxInstructionLength));
+    bool const is64Bits(cpuMode() == CpuMode::LongMode);
+
+    // Read a byte of the instruction.
+    // @param index: The index of the byte in the instruction.
+    // @return: The byte, or an empty optional if the address is not mapped.
+    auto const readByte([&](u64 const index) -> std::optional<u8> {
+        if (bytes.size() <= index) {
+            return std::nullopt;
+        }
+        return bytes[index];
+    });
+
+    // Legacy prefixes can appear in any order, followed by an optional REX
+    // prefix in 64-bit mode, followed by the opcode.
+    static std::set<u8> const legacyPrefixes({
+        // Lock, repne and rep/repe.
+        0xf0, 0xf2, 0xf3,
+        // Segment overrides.
+        0x2e, 0x36, 0x3e, 0x26, 0x64, 0x65,
+        // Operand-size and address-size overrides.
+        0x66, 0x67,
+    });
+    u64 len(0);
+    bool hasRep(false);
+    std::optional<u8> byte(readByte(len));
+    while (!!byte && legacyPrefixes.contains(*byte) &&
+           len < MaxInstructionLength) {
+        hasRep |= (*byte == 0xf2 || *byte == 0xf3);
+        byte = readByte(++len);
+    }
+    if (!!byte && is64Bits && (*byte & 0xf0) == 0x40) {
+        // REX prefix.
+        byte = readByte(++len);
+    }
+    // String instructions have a single-byte opcode: movs (a4, a5), cmps (a6,
+    // a7), stos (aa, ab), lods (ac, ad) and scas (ae, af). ins and outs are
+    // not considered since they trigger I/O exits.
+    bool const isString(!!byte && ((0xa4 <= *byte && *byte <= 0xa7) ||
+                                   (0xaa <= *byte && *byte <= 0xaf)));
+    if (!hasRep || !isString || MaxInstructionLength <= len) {
+        return std::nullopt;
+    }
+    return len + 1;
 }
 
 // See computeSegmentRegister.
@@ -336,10 +754,11 @@ enum class SegmentType {
 // @param type: Indicate if the segment should be a code segment or data
 // segment.
 // @param rflags: The current value of rflags on the guest.
-// @return: A kvm_segment with the hidden parts set accordingly.
-static kvm_segment computeSegmentRegister(Vm::CpuMode const mode,
-                                          SegmentType const type,
-                                          u64 const rflags) {
+// @return: A Segment with the hidden parts set accordingly.
+static Vm::State::ExtendedState::Segment computeSegmentRegister(
+    Vm::CpuMode const mode,
+    SegmentType const type,
+    u64 const rflags) {
     // VMX is _very_ peculiar about the state of the segment registers (hidden
     // parts) upon a VMentry. AFAIK, the kvm implementation of the Linux kernel
     // does not help us here (except for the accessed flag which is set in
@@ -360,7 +779,7 @@ static kvm_segment computeSegmentRegister(Vm::CpuMode const mode,
         throw Error("Guest startup in virtual8086 mode not supported", 0);
     }
 
-    kvm_segment seg{};
+    Vm::State::ExtendedState::Segment seg;
 
     // Few restrictions on the selector. It's value is irrelevant for execution
     // since it is the hidden parts that are used for logical address
@@ -390,7 +809,7 @@ static kvm_segment computeSegmentRegister(Vm::CpuMode const mode,
     seg.type = (type == SegmentType::Code) ? 0xb : 0x3;
 
     // Must be 1.
-    seg.present = 1;
+    seg.present = true;
 
     // Won't go into details here, the DPL of CS and SS are related and in
     // general related to the selector's RPL. Setting everything to 0 here is
@@ -402,7 +821,7 @@ static kvm_segment computeSegmentRegister(Vm::CpuMode const mode,
     seg.db = (mode == Vm::CpuMode::ProtectedMode);
 
     // Must be 1.
-    seg.s = 1;
+    seg.s = true;
 
     // Only set if the current mode is 64-bit. If L is set then DB must be
     // unset.
@@ -430,34 +849,46 @@ static kvm_segment computeSegmentRegister(Vm::CpuMode const mode,
     // granularity and therefore imposes no restriction on the G bit.
     // In our case, we want a flat segment model spanning the entire address
     // space hence use page granularity.
-    seg.g = 1;
+    seg.g = true;
 
     // Indicate if this segment is usuable or not. I imagine this is used by the
     // micro-arch to know if the segment register has been initialized.
     // In our case, we want all segment registers to be defined/initialized
     // hence unset the bit.
-    seg.unusable = 0;
+    seg.unusable = false;
     return seg;
 }
 
 void Vm::setRegistersInitialValue(CpuMode const mode) {
-    kvm_sregs sregs(Util::Kvm::getSRegs(m_vcpuFd));
+    // Start from the reset values of the backend.
+    State::Registers regs(getRegisters());
+    State::ExtendedState extendedState(getExtendedState());
+
+    // Program the PAT so that each MemoryType can be selected from the page
+    // tables, see setMemoryType().
+    for (u8 i(0); i < State::ExtendedState::NumMsrs; ++i) {
+        if (State::ExtendedState::Msrs[i] == 0x277) {
+            extendedState.msrs[i] = PatValue;
+        }
+    }
 
     // Setup the control registers for the requested cpu mode.
-    enableCpuMode(sregs, mode);
+    enableCpuMode(regs, extendedState, mode);
 
     // Setup the segment registers.
     u64 const initialRflags(0x2);
-    sregs.cs = computeSegmentRegister(mode, SegmentType::Code, initialRflags);
-    sregs.ds = computeSegmentRegister(mode, SegmentType::Data, initialRflags);
-    sregs.es = sregs.ds;
-    sregs.fs = sregs.ds;
-    sregs.gs = sregs.ds;
-    sregs.ss = sregs.ds;
+    extendedState.cs =
+        computeSegmentRegister(mode, SegmentType::Code, initialRflags);
+    extendedState.ds =
+        computeSegmentRegister(mode, SegmentType::Data, initialRflags);
+    extendedState.es = extendedState.ds;
+    extendedState.fs = extendedState.ds;
+    extendedState.gs = extendedState.ds;
+    extendedState.ss = extendedState.ds;
 
     // VMX allows us to set the LDTR to unusable. Do that so we don't have to
     // bother carefully crafting a valid value.
-    sregs.ldt.unusable = 1;
+    extendedState.ldt.unusable = true;
 
     // Not so lucky with TR, which cannot be unusable. Set it up to an empty
     // segment (e.g NULL entry in GDT). This is fine, as long as the code is not
@@ -466,20 +897,16 @@ void Vm::setRegistersInitialValue(CpuMode const mode) {
     // Per Intel's docs, type must be 11 (so it works in all CpuModes), s must
     // be 0, present must be 1, base and limit are free so set them to 0x0 so we
     // get an exception in case we try to exec the task.
-    sregs.tr.selector = 0;
-    sregs.tr.type = 11;
-    sregs.tr.s = 0;
-    sregs.tr.present = 1;
-    sregs.tr.base = 0x0;
-    sregs.tr.limit = 0x0;
-    sregs.tr.g = 0;
-
-    Util::Kvm::setSRegs(m_vcpuFd, sregs);
-
-    // Honor the documented initial values of the registers. Don't touch the
-    // segment registers as those have been set when enabling the requested cpu
-    // mode above.
-    State::Registers regs(getRegisters());
+    extendedState.tr.selector = 0;
+    extendedState.tr.type = 11;
+    extendedState.tr.s = false;
+    extendedState.tr.present = true;
+    extendedState.tr.base = 0x0;
+    extendedState.tr.limit = 0x0;
+    extendedState.tr.g = false;
+
+    // Honor the documented initial values of the registers. The segment
+    // registers are part of the extended state set below.
     regs.rax = 0;  regs.rbx = 0;  regs.rcx = 0;  regs.rdx = 0;
     regs.rdi = 0;  regs.rsi = 0;  regs.rsp = 0;  regs.rbp = 0;
     regs.r8  = 0;  regs.r9  = 0;  regs.r10 = 0;  regs.r11 = 0;
@@ -488,25 +915,30 @@ void Vm::setRegistersInitialValue(CpuMode const mode) {
     // rip will be set when loading code.
     regs.gdt.base = 0; regs.gdt.limit = 0;
     regs.idt.base = 0; regs.idt.limit = 0;
+    // The control registers must be set before XCR0, which requires
+    // CR4.OSXSAVE.
     setRegisters(regs);
+    setExtendedState(extendedState);
 }
 
-void Vm::enableCpuMode(kvm_sregs& sregs, CpuMode const mode) {
+void Vm::enableCpuMode(State::Registers& regs,
+                       State::ExtendedState& extendedState,
+                       CpuMode const mode) {
     if (mode == CpuMode::RealMode) {
-        // RealMode does not need to set anything. Assuming that by default KVM
-        // starts in real mode.
+        // RealMode does not need to set anything. Assuming that by default the
+        // backend starts in real mode.
         return;
     }
 
     // Both protected mode and long mode require having the PE bit (bit 0) set
     // in CR0.
-    sregs.cr0 |= 1;
+    regs.cr0 |= 1;
 
     // Prepare MMX in both Protected and Long modes. Set MP to 1, EM to 0 and TS
     // to 0 as recommended by Intel's docs.
     if (Util::Extension::hasMmx()) {
-        sregs.cr0 |= (1 << 1);
-        sregs.cr0 &= (~((1 << 2) | (1 << 3)));
+        regs.cr0 |= (1 << 1);
+        regs.cr0 &= (~((1 << 2) | (1 << 3)));
     }
 
     // Setup control registers for SSE.
@@ -515,31 +947,29 @@ void Vm::enableCpuMode(kvm_sregs& sregs, CpuMode const mode) {
         // indicated by SSE's doc. However, we can't do much in case this
         // happens, hence let the VM triple fault in that case.
         // OSFXSR bit.
-        sregs.cr4 |= (1 << 9);
+        regs.cr4 |= (1 << 9);
         // OSXMMEXECPT bit
-        sregs.cr4 |= (1 << 10);
+        regs.cr4 |= (1 << 10);
         // CR0.EM is already cleared and CR0.MP is already set.
     }
 
     // Setup AVX.
     if (Util::Extension::hasAvx()) {
         // Set CR4.OSXSAVE[bit18] to enable AVX state saving using XSAVE/XRSTOR.
-        sregs.cr4 |= (1 << 18);
+        regs.cr4 |= (1 << 18);
         // Set bits 1 and 2 in XCR0 (bit 1 must always be set) to enable AVX
         // state in XSAVE.
-        u64 const xcr0(Util::Kvm::getXcr0(m_vcpuFd));
-        Util::Kvm::setXcr0(m_vcpuFd, xcr0 | 0x7);
+        extendedState.xcr0 |= 0x7;
     }
 
     // Setup AVX512.
     if (Util::Extension::hasAvx512()) {
         // Enable AVX-512 execution and save/restore through XSAVE in XCR0.
-        u64 const xcr0(Util::Kvm::getXcr0(m_vcpuFd));
         // Set bits:
         //  - XCR0.opmask (bit 5)
         //  - XCR0.ZMM_Hi256 (bit 6)
         //  - XCR0.Hi16_ZMM (bit 7)
-        Util::Kvm::setXcr0(m_vcpuFd, xcr0 | (1 << 5) | (1 << 6) | (1 << 7));
+        extendedState.xcr0 |= (1 << 5) | (1 << 6) | (1 << 7);
     }
 
     if (mode == CpuMode::LongMode) {
@@ -550,21 +980,21 @@ void Vm::enableCpuMode(kvm_sregs& sregs, CpuMode const mode) {
         // Setup paging.
         // Load PML4 into CR3.
         u64 const pml4Offset(createIdentityMapping());
-        sregs.cr3 = pml4Offset & 0xFFFFFFFFFFFFF000ULL;
+        regs.cr3 = pml4Offset & 0xFFFFFFFFFFFFF000ULL;
 
         // Page table is ready now setup the control registers as they would be
         // in long mode.
         // Enable Physical Address Extension (PAE) in Cr4 (bit 5) , mandatory
         // for 64-bits.
-        sregs.cr4 |= (1 << 5);
+        regs.cr4 |= (1 << 5);
 
         // Set LME (bit 8) and LMA (bit 10) bits in EFER.
-        sregs.efer |= ((1 << 8) | (1 << 10));
+        regs.efer |= ((1 << 8) | (1 << 10));
 
         // CR0: Enable paging bit (PG, bit 31). PE has been enabled already
         // above.
-        assert(sregs.cr0 & 1);
-        sregs.cr0 |= (1UL << 31);
+        assert(regs.cr0 & 1);
+        regs.cr0 |= (1UL << 31);
     }
 }
 
@@ -702,31 +1132,142 @@ u64 Vm::createIdentityMapping() {
 }
 
 void *Vm::createPhysicalMemory(u64 const memorySize) {
-    // Mmap some anonymous memory for the requested size.
+    // Only the pages touched by the guest (or prefaulted) are backed, and they
+    // are zeroed by the kernel upon first touch. Large guests therefore cost
+    // nothing until used. The memory moves to a memory file upon the first
+    // clone, see freezeMemory().
+    assert(memorySize == m_physicalMemorySize);
+    void * const userspaceAddr(mapPhysicalMemory(-1, nullptr));
+
+    if (m_placement.prefault) {
+        Util::Host::prefault(userspaceAddr, memorySize);
+    }
+
+    return userspaceAddr;
+}
+
+void *Vm::mapPhysicalMemory(int const fd, void * const addr) {
     int const prot(PROT_READ | PROT_WRITE);
-    int const flags(MAP_PRIVATE | MAP_ANONYMOUS);
-    void * const userspaceAddr(::mmap(NULL, memorySize, prot, flags, -1, 0));
+    // Don't reserve swap for the whole guest, the pages are only accounted for
+    // once written.
+    int const anonFlags(MAP_PRIVATE | MAP_NORESERVE | MAP_ANONYMOUS);
+    void * start(addr);
+    if (!start && m_placement.hugePages) {
+        // A huge page can only back a range aligned on its size, both in the
+        // guest's physical memory and in the host's virtual memory. Reserve a
+        // larger range and map the memory at its first aligned address.
+        u64 const reservedSize(m_physicalMemorySize + HugePageSize);
+        void * const reserved(
+            ::mmap(nullptr, reservedSize, PROT_NONE, anonFlags, -1, 0));
+        if (reserved == MAP_FAILED) {
+            throw MmapError("Failed to reserve memory for guest", errno);
+        }
+        u64 const reservedStart(reinterpret_cast<u64>(reserved));
+        u64 const alignedStart(roundUp(reservedStart, HugePageSize));
+        u64 const alignedEnd(alignedStart + m_physicalMemorySize);
+        if (reservedStart != alignedStart) {
+            ::munmap(reserved, alignedStart - reservedStart);
+        }
+        ::munmap(reinterpret_cast<void*>(alignedEnd),
+                 reservedStart + reservedSize - alignedEnd);
+        start = reinterpret_cast<void*>(alignedStart);
+    }
+    int const flags((fd == -1 ? anonFlags : (MAP_PRIVATE | MAP_NORESERVE)) |
+                    (!!start ? MAP_FIXED : 0));
+    void * const userspaceAddr(
+        ::mmap(start, m_physicalMemorySize, prot, flags, fd, 0));
     if (userspaceAddr == MAP_FAILED) {
-        throw MmapError("Failed to mmap memory for guest", errno);
+        int const errNo(errno);
+        if (!addr && !!start) {
+            ::munmap(start, m_physicalMemorySize);
+        }
+        throw MmapError("Failed to mmap memory for guest", errNo);
+    }
+    if (m_placement.hugePages) {
+        // Only a hint, the host may not support transparent huge pages. This
+        // must be done before any page is touched for the pages to be
+        // allocated huge upon first touch.
+        ::madvise(userspaceAddr, m_physicalMemorySize, MADV_HUGEPAGE);
     }
 
-    // Zero the allocated memory area.
-    std::memset(userspaceAddr, 0x0, memorySize);
-
-    // Then map the memory to the guest.
-    kvm_userspace_memory_region const kvmMap({
-        // Only using a single slot. It does not matter much which one we
-        // choose.
-        .slot = 0,
-        .flags = 0,
-        .guest_phys_addr = 0,
-        .memory_size = memorySize,
-        .userspace_addr = reinterpret_cast<u64>(userspaceAddr),
-    });
-    if (::ioctl(m_vmFd, KVM_SET_USER_MEMORY_REGION, &kvmMap) == -1) {
-        throw KvmError("Failed to map memory to guest", errno);
+    // The memory policy must be set before any page is touched, otherwise the
+    // pages would have to be migrated.
+    if (m_placement.numaNode) {
+        Util::Host::bindMemory(userspaceAddr,
+                               m_physicalMemorySize,
+                               *m_placement.numaNode);
     }
     return userspaceAddr;
 }
 
+void Vm::freezeMemory() {
+    if (m_memoryFrozen) {
+        // Nothing changed since the last clone.
+        return;
+    }
+    // The memory was written since the last clone, or was never cloned. The
+    // current file, if any, is still mapped by the previous clones, hence
+    // the memory is copied to a new file. Only the populated pages are
+    // copied, the others are holes.
+    int const fd(::memfd_create("x86lab-guest", MFD_CLOEXEC));
+    if (fd == -1) {
+        throw Error("Failed to create guest memory file", errno);
+    }
+    std::vector<bool> const populated(populatedPages());
+    u64 const numPages(populated.size());
+    bool copied(::ftruncate(fd, m_physicalMemorySize) != -1);
+    for (u64 start(0); copied && start < numPages;) {
+        if (!populated[start]) {
+            start ++;
+            continue;
+        }
+        u64 end(start + 1);
+        while (end < numPages && populated[end]) {
+            end ++;
+        }
+        u64 offset(start * PAGE_SIZE);
+        u64 const endOffset(std::min(end * PAGE_SIZE,
+                                     m_physicalMemorySize));
+        while (copied && offset < endOffset) {
+            ssize_t const len(::pwrite(fd,
+                                       static_cast<u8*>(m_memory) + offset,
+                                       endOffset - offset,
+                                       offset));
+            copied = 0 < len;
+            offset += copied ? len : 0;
+        }
+        start = end;
+    }
+    if (!copied) {
+        int const errNo(errno);
+        ::close(fd);
+        throw Error("Failed to copy guest memory", errNo);
+    }
+    if (m_memoryFd != -1) {
+        ::close(m_memoryFd);
+    }
+    m_memoryFd = fd;
+    // Replace the mapping in place so that m_memory stays valid for the
+    // backend. KVM is notified of the change of mapping and faults the new
+    // pages in upon the next access.
+    mapPhysicalMemory(m_memoryFd, m_memory);
+    m_memoryFrozen = true;
+}
+
+std::vector<bool> Vm::populatedPages() const {
+    // The pages of the file that were not accessed through the mapping, or
+    // that were swapped out, are not reported by the page tables.
+    std::vector<bool> populated(
+        Util::Host::populatedPages(m_memory, m_physicalMemorySize));
+    if (m_memoryFd == -1) {
+        return populated;
+    }
+    std::vector<bool> const inFile(
+        Util::Host::populatedFilePages(m_memoryFd, m_physicalMemorySize));
+    for (u64 i(0); i < populated.size(); ++i) {
+        populated[i] = populated[i] || inFile[i];
+    }
+    return populated;
+}
+
 }
@@ -0,0 +1,73 @@
+#include <x86lab/workingsethistory.hpp>
+#include <algorithm>
+#include <cassert>
+
+namespace X86Lab {
+
+WorkingSetHistory::WorkingSetHistory(u64 const numPages) :
+    m_numPages(numPages),
+    m_numIndices(0) {}
+
+void WorkingSetHistory::append(u64 const step,
+                               Vm::WorkingSet const& workingSet) {
+    assert(m_samples.empty() || m_samples.back().step < step);
+    assert(workingSet.accessed.size() == m_numPages);
+    assert(workingSet.dirty.size() == m_numPages);
+    Sample sample({.step = step, .accessed = {}, .dirty = {}});
+    for (u64 i(0); i < m_numPages; ++i) {
+        if (workingSet.accessed[i]) {
+            sample.accessed.push_back(i);
+        }
+        if (workingSet.dirty[i]) {
+            sample.dirty.push_back(i);
+        }
+    }
+    m_numIndices += sample.accessed.size() + sample.dirty.size();
+    m_samples.push_back(std::move(sample));
+}
+
+u64 WorkingSetHistory::size() const {
+    return m_samples.size();
+}
+
+u64 WorkingSetHistory::numPages() const {
+    return m_numPages;
+}
+
+WorkingSetHistory::Sample const& WorkingSetHistory::sample(
+    u64 const index) const {
+    assert(index < m_samples.size());
+    return m_samples[index];
+}
+
+WorkingSetHistory::Footprint WorkingSetHistory::footprint(
+    u64 const firstStep,
+    u64 const lastStep) const {
+    Footprint result({.numSamples = 0, .numAccessed = 0, .numDirty = 0});
+    // Samples are sorted by step, find the first one in the range.
+    auto const first(std::lower_bound(m_samples.begin(),
+                                      m_samples.end(),
+                                      firstStep,
+                                      [](Sample const& sample, u64 const step) {
+        return sample.step < step;
+    }));
+    std::vector<bool> accessed(m_numPages, false);
+    std::vector<bool> dirty(m_numPages, false);
+    for (auto it(first); it != m_samples.end() && it->step <= lastStep; ++it) {
+        result.numSamples ++;
+        for (u64 const page : it->accessed) {
+            result.numAccessed += !accessed[page];
+            accessed[page] = true;
+        }
+        for (u64 const page : it->dirty) {
+            result.numDirty += !dirty[page];
+            dirty[page] = true;
+        }
+    }
+    return result;
+}
+
+u64 WorkingSetHistory::storageBytes() const {
+    return m_samples.size() * sizeof(Sample) + m_numIndices * sizeof(u64);
+}
+}
@@ -0,0 +1,219 @@
+#include <x86lab/dependencygraph.hpp>
+#include <x86lab/headless.hpp>
+#include <x86lab/test.hpp>
+#include <algorithm>
+#include <cerrno>
+
+// Tests for the X86Lab::DependencyGraph.
+
+namespace X86Lab::Test::DependencyGraph {
+using Step = X86Lab::DependencyGraph::Step;
+
+// Build a Step accessing registers only.
+// @param rip: The address of the instruction.
+// @param read: The registers read.
+// @param written: The registers written.
+// @return: The Step.
+static Step regStep(u64 const rip,
+                    std::vector<std::string> const& read,
+                    std::vector<std::string> const& written) {
+    return Step({
+        .rip = rip,
+        .regsRead = read,
+        .regsWritten = written,
+        .memRead = {},
+        .memWritten = {},
+    });
+}
+
+// Check the dependencies through registers and the critical path.
+DECLARE_TEST(testDependencyGraphRegisters) {
+    X86Lab::DependencyGraph const graph({
+        // mov rax, 1
+        regStep(0x0, {}, {"rax"}),
+        // mov rbx, 2
+        regStep(0x7, {}, {"rbx"}),
+        // add rax, rbx
+        regStep(0xe, {"rax", "rbx"}, {"rax", "rflags"}),
+        // imul rcx, rax
+        regStep(0x11, {"rcx", "rax"}, {"rcx", "rflags"}),
+        // mov rdx, 3
+        regStep(0x15, {}, {"rdx"}),
+    });
+    std::vector<X86Lab::DependencyGraph::Node> const& nodes(graph.nodes());
+    TEST_ASSERT(nodes.size() == 5);
+    TEST_ASSERT(nodes[0].dependencies.empty() && nodes[0].depth == 1);
+    TEST_ASSERT(nodes[2].dependencies == std::vector<u64>({0, 1}));
+    TEST_ASSERT(nodes[2].depth == 2);
+    // Writing rflags twice is not a dependency.
+    TEST_ASSERT(nodes[3].dependencies == std::vector<u64>({2}));
+    TEST_ASSERT(nodes[3].depth == 3);
+    TEST_ASSERT(nodes[3].rip == 0x11 && nodes[3].step == 3);
+    TEST_ASSERT(nodes[4].dependencies.empty());
+
+    // Among the two chains of length 3, the first is selected.
+    TEST_ASSERT(graph.criticalPath() == std::vector<u64>({0, 2, 3}));
+    TEST_ASSERT(graph.criticalInstructions() ==
+                (std::map<u64, u64>({{0x0, 1}, {0xe, 1}, {0x11, 1}})));
+
+    X86Lab::DependencyGraph const empty({});
+    TEST_ASSERT(empty.nodes().empty());
+    TEST_ASSERT(empty.criticalPath().empty());
+    TEST_ASSERT(empty.criticalInstructions().empty());
+}
+
+// Check the dependencies through memory, which are tracked per byte, and
+// instructions appearing several times on the critical path.
+DECLARE_TEST(testDependencyGraphMemory) {
+    std::vector<Step> steps({
+        // mov [0x100], rax
+        regStep(0x10, {"rax"}, {}),
+        // mov ebx, [0x104]
+        regStep(0x14, {}, {"rbx"}),
+        // Two iterations of: inc rbx
+        regStep(0x18, {"rbx"}, {"rbx", "rflags"}),
+        regStep(0x18, {"rbx"}, {"rbx", "rflags"}),
+        // mov [0x100], rcx
+        regStep(0x1c, {"rcx"}, {}),
+        // mov rdx, [0x108]
+        regStep(0x20, {}, {"rdx"}),
+    });
+    steps[0].memWritten.emplace_back(0x100, 8);
+    steps[1].memRead.emplace_back(0x104, 4);
+    steps[4].memWritten.emplace_back(0x100, 8);
+    steps[5].memRead.emplace_back(0x108, 8);
+    X86Lab::DependencyGraph const graph(steps);
+    std::vector<X86Lab::DependencyGraph::Node> const& nodes(graph.nodes());
+    TEST_ASSERT(nodes.size() == 6);
+    // Partial overlap of the store.
+    TEST_ASSERT(nodes[1].dependencies == std::vector<u64>({0}));
+    TEST_ASSERT(nodes[3].dependencies == std::vector<u64>({2}));
+    TEST_ASSERT(nodes[3].depth == 4);
+    // Overwriting memory is not a dependency, nor reading the next bytes.
+    TEST_ASSERT(nodes[4].dependencies.empty());
+    TEST_ASSERT(nodes[5].dependencies.empty());
+
+    TEST_ASSERT(graph.criticalPath() == std::vector<u64>({0, 1, 2, 3}));
+    TEST_ASSERT(graph.criticalInstructions() ==
+                (std::map<u64, u64>({{0x10, 1}, {0x14, 1}, {0x18, 2}})));
+}
+
+// Check that large ranges of memory, e.g. written by a rep stos, are tracked
+// without depending on their size, and ranges wrapping around the end of the
+// address space.
+DECLARE_TEST(testDependencyGraphLargeRanges) {
+    std::vector<Step> steps({
+        // rep stosq over 64 MiB.
+        regStep(0x0, {}, {}),
+        // A write in the middle of the buffer.
+        regStep(0x4, {}, {}),
+        // A read across both writes.
+        regStep(0x8, {}, {}),
+        // A read of the end of the buffer.
+        regStep(0xc, {}, {}),
+        // A write wrapping around the end of the address space.
+        regStep(0x10, {}, {}),
+        // A read of its first bytes.
+        regStep(0x14, {}, {}),
+    });
+    steps[0].memWritten.emplace_back(0x1000, 64 << 20);
+    steps[1].memWritten.emplace_back(0x2000, 8);
+    steps[2].memRead.emplace_back(0x1ffc, 8);
+    steps[3].memRead.emplace_back(0x1000 + (64 << 20) - 1, 8);
+    steps[4].memWritten.emplace_back(~0ULL - 3, 8);
+    steps[5].memRead.emplace_back(0x0, 2);
+    X86Lab::DependencyGraph const graph(steps);
+    std::vector<X86Lab::DependencyGraph::Node> const& nodes(graph.nodes());
+    TEST_ASSERT(nodes[2].dependencies == std::vector<u64>({0, 1}));
+    TEST_ASSERT(nodes[3].dependencies == std::vector<u64>({0}));
+    TEST_ASSERT(nodes[5].dependencies == std::vector<u64>({4}));
+}
+
+// Build the graph of a real history, recorded with the emulator, and check the
+// accesses deduced from the decoded instructions.
+DECLARE_TEST(testDependencyGraphFromHistory) {
+    std::shared_ptr<Code const> const code(assemble(R"(
+        BITS 64
+        mov     rax, 1
+        add     rax, 2
+        ; A zeroing idiom does not depend on the previous value of rax.
+        xor     eax, eax
+        add     rax, 3
+        ; Forward rep stos, writing [0x2000, 0x2010).
+        mov     rdi, 0x2000
+        mov     ecx, 16
+        cld
+        rep stosb
+        mov     rbx, [0x200f]
+        ; Backward rep stos, writing [0x2100, 0x2108).
+        mov     rdi, 0x2107
+        mov     ecx, 8
+        std
+        rep stosb
+        cld
+        mov     rdx, [0x2100]
+        mov     r8, [0x2108]
+        ; Implicit stack accesses.
+        push    rdx
+        push    rbx
+        mov     rdi, [rsp + 8]
+        pop     rsi
+        hlt
+    )"));
+    X86Lab::HeadlessRunner::Config config;
+    config.repStringStepping = true;
+    config.backend = X86Lab::Vm::BackendType::Emulator;
+    X86Lab::HeadlessRunner runner(code, config);
+    TEST_ASSERT(runner.run() == X86Lab::Vm::OperatingState::Halted);
+
+    X86Lab::DependencyGraph const graph(
+        X86Lab::DependencyGraph::fromHistory(runner.history().back()));
+    std::vector<X86Lab::DependencyGraph::Node> const& nodes(graph.nodes());
+    TEST_ASSERT(nodes.size() == 21);
+    auto const dependsOn([&](u64 const node, u64 const dep) {
+        return std::find(nodes[node].dependencies.begin(),
+                         nodes[node].dependencies.end(),
+                         dep) != nodes[node].dependencies.end();
+    });
+    TEST_ASSERT(nodes[1].dependencies == std::vector<u64>({0}));
+    TEST_ASSERT(nodes[2].dependencies.empty());
+    TEST_ASSERT(nodes[3].dependencies == std::vector<u64>({2}));
+
+    // The rep stos reads al and rdi, and writes the whole buffer.
+    TEST_ASSERT(dependsOn(7, 3));
+    TEST_ASSERT(dependsOn(7, 4));
+    TEST_ASSERT(nodes[8].dependencies == std::vector<u64>({7}));
+    // Backwards, the buffer ends at the initial rdi.
+    TEST_ASSERT(dependsOn(12, 9));
+    TEST_ASSERT(nodes[14].dependencies == std::vector<u64>({12}));
+    TEST_ASSERT(nodes[15].dependencies.empty());
+
+    // push rbx writes rsp, push rdx wrote the slot above it.
+    TEST_ASSERT(nodes[16].dependencies == std::vector<u64>({14}));
+    TEST_ASSERT(nodes[18].dependencies == std::vector<u64>({16, 17}));
+    TEST_ASSERT(nodes[19].dependencies == std::vector<u64>({17}));
+}
+
+// A cancelled construction throws, as the Runner discarding its history does
+// not wait for the analysis to complete.
+DECLARE_TEST(testDependencyGraphCancelled) {
+    std::vector<Step> const steps({
+        // mov rax, 1
+        regStep(0x0, {}, {"rax"}),
+        // inc rax
+        regStep(0x4, {"rax"}, {"rax", "rflags"}),
+    });
+    std::shared_ptr<std::atomic<bool>> const cancelled(
+        new std::atomic<bool>(false));
+    TEST_ASSERT(X86Lab::DependencyGraph(steps, cancelled).nodes().size() == 2);
+
+    *cancelled = true;
+    bool thrown(false);
+    try {
+        X86Lab::DependencyGraph const graph(steps, cancelled);
+    } catch (Error const& error) {
+        thrown = error.errNo == ECANCELED;
+    }
+    TEST_ASSERT(thrown);
+}
+}
@@ -0,0 +1,124 @@
+#include <x86lab/disassembler.hpp>
+#include <x86lab/test.hpp>
+#include <algorithm>
+
+// Tests for the X86Lab::Disassembler.
+
+namespace X86Lab::Test::Disassembler {
+// Check which instructions are reported as potentially writing memory.
+DECLARE_TEST(testDisassemblerMayWriteMemory) {
+    X86Lab::Disassembler const disasm(Vm::CpuMode::LongMode);
+    std::vector<std::pair<std::vector<u8>, bool>> const cases({
+        // add rax, rbx
+        {{0x48, 0x01, 0xd8}, false},
+        // mov rbx, [rax]
+        {{0x48, 0x8b, 0x18}, false},
+        // lea rax, [rbx + 8]
+        {{0x48, 0x8d, 0x43, 0x08}, false},
+        // vpaddd ymm0, ymm1, ymm2
+        {{0xc5, 0xf5, 0xfe, 0xc2}, false},
+        // mov [rax], rbx
+        {{0x48, 0x89, 0x18}, true},
+        // add [rax], rbx
+        {{0x48, 0x01, 0x18}, true},
+        // push rax
+        {{0x50}, true},
+        // rep stosb
+        {{0xf3, 0xaa}, true},
+        // call 0
+        {{0xe8, 0x00, 0x00, 0x00, 0x00}, true},
+    });
+    for (auto const& [code, mayWrite] : cases) {
+        std::optional<X86Lab::Disassembler::Instruction> const insn(
+            disasm.decode(code, 0x1000));
+        TEST_ASSERT(!!insn);
+        TEST_ASSERT(insn->address == 0x1000);
+        TEST_ASSERT(insn->size == code.size());
+        TEST_ASSERT(insn->mayWriteMemory == mayWrite);
+    }
+    TEST_ASSERT(!disasm.decode({}, 0x1000));
+}
+
+// Check that decodeBlock stops after the first control-flow instruction.
+DECLARE_TEST(testDisassemblerDecodeBlock) {
+    X86Lab::Disassembler const disasm(Vm::CpuMode::LongMode);
+    std::vector<u8> const code({
+        // add rax, rbx
+        0x48, 0x01, 0xd8,
+        // dec ecx
+        0xff, 0xc9,
+        // jnz 0x1000
+        0x75, 0xf9,
+        // hlt
+        0xf4,
+    });
+    std::vector<X86Lab::Disassembler::Instruction> const block(
+        disasm.decodeBlock(code, 0x1000));
+    TEST_ASSERT(block.size() == 3);
+    TEST_ASSERT(block[0].address == 0x1000 && !block[0].endsBlock);
+    TEST_ASSERT(block[1].address == 0x1003 && !block[1].endsBlock);
+    TEST_ASSERT(block[2].address == 0x1005 && block[2].endsBlock);
+    TEST_ASSERT(block[2].mnemonic == "jne");
+
+    // Without a branch, the whole buffer is decoded.
+    std::vector<X86Lab::Disassembler::Instruction> const partial(
+        disasm.decodeBlock(std::vector<u8>(code.begin(), code.begin() + 5),
+                           0x1000));
+    TEST_ASSERT(partial.size() == 2);
+    TEST_ASSERT(!partial.back().endsBlock);
+}
+
+// Check the registers and memory operands accessed by instructions.
+DECLARE_TEST(testDisassemblerAccesses) {
+    X86Lab::Disassembler const disasm(Vm::CpuMode::LongMode);
+    auto const contains([](std::vector<std::string> const& regs,
+                           std::string const& reg) {
+        return std::find(regs.begin(), regs.end(), reg) != regs.end();
+    });
+
+    // add rax, [rbx + rcx * 4 + 8]
+    std::optional<X86Lab::Disassembler::Instruction> const add(
+        disasm.decode({0x48, 0x03, 0x44, 0x8b, 0x08}, 0x1000));
+    TEST_ASSERT(!!add);
+    TEST_ASSERT(contains(add->regsRead, "rax"));
+    TEST_ASSERT(contains(add->regsRead, "rbx"));
+    TEST_ASSERT(contains(add->regsRead, "rcx"));
+    TEST_ASSERT(contains(add->regsWritten, "rax"));
+    TEST_ASSERT(contains(add->regsWritten, "rflags"));
+    TEST_ASSERT(add->memoryOperands.size() == 1);
+    X86Lab::Disassembler::MemoryOperand const& src(add->memoryOperands[0]);
+    TEST_ASSERT(src.segment.empty());
+    TEST_ASSERT(src.base == "rbx" && src.index == "rcx");
+    TEST_ASSERT(src.scale == 4 && src.disp == 8 && src.size == 8);
+    TEST_ASSERT(src.read && !src.write);
+
+    // mov [rax], ebx: sub-registers are reported as the full register.
+    std::optional<X86Lab::Disassembler::Instruction> const mov(
+        disasm.decode({0x89, 0x18}, 0x1000));
+    TEST_ASSERT(!!mov);
+    TEST_ASSERT(contains(mov->regsRead, "rbx"));
+    TEST_ASSERT(!contains(mov->regsRead, "ebx"));
+    TEST_ASSERT(mov->regsWritten.empty());
+    TEST_ASSERT(mov->memoryOperands.size() == 1);
+    TEST_ASSERT(mov->memoryOperands[0].base == "rax");
+    TEST_ASSERT(mov->memoryOperands[0].size == 4);
+    TEST_ASSERT(!mov->memoryOperands[0].read);
+    TEST_ASSERT(mov->memoryOperands[0].write);
+
+    // push rax: the stack access is implicit.
+    std::optional<X86Lab::Disassembler::Instruction> const push(
+        disasm.decode({0x50}, 0x1000));
+    TEST_ASSERT(!!push);
+    TEST_ASSERT(contains(push->regsRead, "rax"));
+    TEST_ASSERT(contains(push->regsRead, "rsp"));
+    TEST_ASSERT(contains(push->regsWritten, "rsp"));
+    TEST_ASSERT(push->memoryOperands.empty());
+
+    // lea rax, [rbx + 8] does not access memory.
+    std::optional<X86Lab::Disassembler::Instruction> const lea(
+        disasm.decode({0x48, 0x8d, 0x43, 0x08}, 0x1000));
+    TEST_ASSERT(!!lea);
+    TEST_ASSERT(contains(lea->regsRead, "rbx"));
+    TEST_ASSERT(lea->memoryOperands.empty());
+}
+}
@@ -0,0 +1,395 @@
+#include <x86lab/vm.hpp>
+#include <x86lab/code.hpp>
+#include <x86lab/snapshot.hpp>
+#include <x86lab/test.hpp>
+#include <cstring>
+
+// Tests for the emulator backend. Most of them run the same code under KVM and
+// the emulator and compare the state of both Vms after each step.
+
+namespace X86Lab::Test::Emulator {
+// Run the code under KVM and the emulator and check that both Vms are in the
+// same state after each instruction. How many iterations of a rep-prefixed
+// instruction a single step executes under KVM depends on the host, hence the
+// states are only compared once an instruction completes. AF is not compared as
+// it is undefined after shifts, nor RF which KVM sets when single-stepping.
+// @param startMode: The cpu mode the VMs start in.
+// @param assembly: The code to run.
+// @return: The final operating state.
+static X86Lab::Vm::OperatingState runLockstep(
+    X86Lab::Vm::CpuMode const startMode,
+    std::string const& assembly) {
+    u64 const memorySize(4 * X86Lab::PAGE_SIZE);
+    std::unique_ptr<X86Lab::Vm> const kvm(createVmAndLoadCode(
+        startMode, assembly, memorySize, X86Lab::Vm::Placement(),
+        X86Lab::Vm::BackendType::Kvm));
+    std::unique_ptr<X86Lab::Vm> const emu(createVmAndLoadCode(
+        startMode, assembly, memorySize, X86Lab::Vm::Placement(),
+        X86Lab::Vm::BackendType::Emulator));
+    TEST_ASSERT(kvm->getRegisters() == emu->getRegisters());
+
+    u64 const flagsMask(~((1ULL << 4) | (1ULL << 16)));
+    X86Lab::Vm::OperatingState state(X86Lab::Vm::OperatingState::Runnable);
+    // Bound the number of steps in case the code does not halt.
+    for (u64 i(0); i < 1000 && state == X86Lab::Vm::OperatingState::Runnable;
+         ++i) {
+        u64 const kvmRip(kvm->instructionPointer());
+        state = kvm->step();
+        if (state == X86Lab::Vm::OperatingState::Runnable &&
+            kvm->instructionPointer() == kvmRip) {
+            continue;
+        }
+        u64 const emuRip(emu->instructionPointer());
+        X86Lab::Vm::OperatingState emuState;
+        do {
+            emuState = emu->step();
+        } while (emuState == X86Lab::Vm::OperatingState::Runnable &&
+                 emu->instructionPointer() == emuRip);
+        if (emuState == X86Lab::Vm::OperatingState::Halted &&
+            state == X86Lab::Vm::OperatingState::Runnable) {
+            // Some hosts report a single-step trap instead of the hlt exit,
+            // with rip after the hlt.
+            state = X86Lab::Vm::OperatingState::Halted;
+        }
+        TEST_ASSERT(emuState == state);
+
+        X86Lab::Vm::State::Registers kvmRegs(kvm->getRegisters());
+        X86Lab::Vm::State::Registers emuRegs(emu->getRegisters());
+        kvmRegs.rflags &= flagsMask;
+        emuRegs.rflags &= flagsMask;
+        TEST_ASSERT(kvmRegs == emuRegs);
+    }
+    TEST_ASSERT(state != X86Lab::Vm::OperatingState::Runnable);
+
+    // The memory that is not used by the page tables must be identical.
+    std::unique_ptr<X86Lab::Vm::State> const kvmState(kvm->getState());
+    std::unique_ptr<X86Lab::Vm::State> const emuState(emu->getState());
+    TEST_ASSERT(!std::memcmp(kvmState->memory().data.get(),
+                             emuState->memory().data.get(),
+                             memorySize));
+    return state;
+}
+
+// Run a mix of the supported instructions in 64-bit mode.
+DECLARE_TEST(testLockstep64) {
+    std::string const assembly(R"(
+        BITS 64
+
+        mov     rax, 0x1122334455667788
+        mov     rbx, 0x1800
+        mov     ecx, 8
+    fill:
+        add     [rbx + rcx * 8 - 8], rax
+        rol     rax, 1
+        dec     rcx
+        jnz     fill
+
+        ; String instructions.
+        lea     rsi, [rbx]
+        lea     rdi, [rbx + 0x100]
+        mov     ecx, 16
+        cld
+        rep movsd
+        mov     ecx, 32
+        mov     al, 0x5a
+        rep stosb
+        lea     rdi, [rbx + 0x100]
+        mov     ecx, 64
+        repne scasb
+        std
+        lodsw
+        cld
+
+        ; Stack and calls.
+        push    rax
+        push    rbx
+        call    func
+        pop     rbx
+        pop     rdx
+        xchg    rax, rdx
+        cmp     rax, rdx
+        cmovl   rax, rdx
+        setg    cl
+        movzx   edx, cl
+        movsx   rsi, byte [rbx + 3]
+        neg     rsi
+        not     rsi
+        sub     esi, 7
+        stc
+        adc     r9, -1
+        sbb     r10w, 3
+        xor     r11d, r11d
+        or      r11b, 0x80
+        and     r11, [rbx]
+        test    r11, r11
+        bswap   rsi
+        sar     rsi, 1
+        shr     rdi, 1
+        shl     rdx, 1
+        rcl     rbx, 1
+        rcr     rbx, 1
+        mov     word [rbx + 0x200], 0x1234
+        inc     word [rbx + 0x200]
+        movsxd  r12, dword [rbx + 0x1fe]
+        imul    r13, r12, 0
+        lea     r14, [rel data]
+        mov     r14, [r14]
+        hlt
+    func:
+        push    rbp
+        mov     rbp, rsp
+        mov     r8, [rbp + 16]
+        inc     r8
+        leave
+        ret
+    data:
+        dq      0xcafebabe
+    )");
+    TEST_ASSERT(runLockstep(X86Lab::Vm::CpuMode::LongMode, assembly) ==
+                X86Lab::Vm::OperatingState::Halted);
+}
+
+// Run 16-bit code in real mode, including segment loads and 16-bit addressing.
+DECLARE_TEST(testLockstep16) {
+    std::string const assembly(R"(
+        BITS 16
+
+        mov     ax, 0x100
+        mov     ds, ax
+        mov     bx, 0x10
+        mov     si, 0x4
+        mov     word [bx + si + 2], 0xbeef
+        mov     cx, [bx + si + 2]
+        add     cx, [0x16]
+        push    cx
+        pop     dx
+        mov     es, ax
+        mov     di, 0x40
+        mov     cx, 4
+        rep stosw
+        loop    done
+    done:
+        hlt
+    )");
+    TEST_ASSERT(runLockstep(X86Lab::Vm::CpuMode::RealMode, assembly) ==
+                X86Lab::Vm::OperatingState::Halted);
+}
+
+// Run 32-bit code in protected mode, including operand size overrides.
+DECLARE_TEST(testLockstep32) {
+    std::string const assembly(R"(
+        BITS 32
+
+        mov     ebx, 0x2000
+        mov     eax, 0x89abcdef
+        mov     [ebx], eax
+        mov     ax, [ebx + 2]
+        add     ax, 0x7fff
+        movzx   ecx, ax
+        push    ecx
+        call    func
+        pop     edx
+        shl     edx, 4
+        setc    cl
+        lea     esi, [ebx + edx * 2 + 4]
+        hlt
+    func:
+        mov     edi, [esp + 4]
+        sub     edi, 0x10
+        ret
+    )");
+    TEST_ASSERT(runLockstep(X86Lab::Vm::CpuMode::ProtectedMode, assembly) ==
+                X86Lab::Vm::OperatingState::Halted);
+}
+
+// An exception without IDT shuts the Vm down with both backends.
+DECLARE_TEST(testLockstepFault) {
+    std::string const assembly(R"(
+        BITS 64
+
+        mov     rax, 1
+        xor     ecx, ecx
+        div     rcx
+        hlt
+    )");
+    TEST_ASSERT(runLockstep(X86Lab::Vm::CpuMode::LongMode, assembly) ==
+                X86Lab::Vm::OperatingState::Shutdown);
+}
+
+// The results of multiplications and divisions, whose flags are partially
+// undefined hence not checked in lockstep.
+DECLARE_TEST(testMulDiv) {
+    std::string const assembly(R"(
+        BITS 64
+
+        mov     rax, 0x123456789abcdef
+        mov     rcx, 0x1000
+        mul     rcx
+        mov     rcx, 0x100
+        div     rcx
+        mov     r8, -7
+        mov     rax, 3
+        imul    r8
+        cqo
+        mov     r9, 2
+        idiv    r9
+        hlt
+    )");
+    std::unique_ptr<X86Lab::Vm> const vm(createVmAndLoadCode(
+        X86Lab::Vm::CpuMode::LongMode, assembly, 4 * X86Lab::PAGE_SIZE,
+        X86Lab::Vm::Placement(), X86Lab::Vm::BackendType::Emulator));
+    // mov, mov, mul.
+    for (u8 i(0); i < 3; ++i) {
+        TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    }
+    X86Lab::Vm::State::Registers regs(vm->getRegisters());
+    TEST_ASSERT(regs.rax == 0x3456789abcdef000);
+    TEST_ASSERT(regs.rdx == 0x12);
+    // CF and OF are set as the upper half is not zero.
+    TEST_ASSERT((regs.rflags & 0x801) == 0x801);
+
+    // mov, div.
+    for (u8 i(0); i < 2; ++i) {
+        TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    }
+    regs = vm->getRegisters();
+    TEST_ASSERT(regs.rax == 0x123456789abcdef0);
+    TEST_ASSERT(regs.rdx == 0x0);
+
+    // mov, mov, imul, cqo, mov, idiv.
+    for (u8 i(0); i < 6; ++i) {
+        TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    }
+    regs = vm->getRegisters();
+    // -21 / 2 = -10, remainder -1.
+    TEST_ASSERT(regs.rax == static_cast<u64>(-10));
+    TEST_ASSERT(regs.rdx == static_cast<u64>(-1));
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Halted);
+}
+
+// The emulator reports the memory written by each step, including the page
+// table entries which accessed and dirty bits were set.
+DECLARE_TEST(testStepEffects) {
+    std::string const assembly(R"(
+        BITS 64
+
+        nop
+        nop
+        mov     rbx, 0x1800
+        mov     [rbx], rax
+        mov     [rbx + 8], rax
+        rep stosb
+        hlt
+    )");
+    std::unique_ptr<X86Lab::Vm> const kvm(createVmAndLoadCode(
+        X86Lab::Vm::CpuMode::LongMode, assembly, 4 * X86Lab::PAGE_SIZE,
+        X86Lab::Vm::Placement(), X86Lab::Vm::BackendType::Kvm));
+    TEST_ASSERT(kvm->step() == X86Lab::Vm::OperatingState::Runnable);
+    TEST_ASSERT(!kvm->lastStepEffects());
+
+    std::unique_ptr<X86Lab::Vm> const vm(createVmAndLoadCode(
+        X86Lab::Vm::CpuMode::LongMode, assembly, 4 * X86Lab::PAGE_SIZE,
+        X86Lab::Vm::Placement(), X86Lab::Vm::BackendType::Emulator));
+    // The first fetch sets the accessed bits of the page tables.
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    TEST_ASSERT(!!vm->lastStepEffects());
+    TEST_ASSERT(!vm->lastStepEffects()->memoryWrites.empty());
+    // Now that the accessed bits are set, instructions that do not write
+    // memory have no effect.
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    TEST_ASSERT(vm->lastStepEffects()->memoryWrites.empty());
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    TEST_ASSERT(vm->lastStepEffects()->memoryWrites.empty());
+
+    // The first write to the page also sets the accessed bits of the data
+    // page's entries and its dirty bit.
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    std::vector<std::pair<u64, u64>> writes(
+        vm->lastStepEffects()->memoryWrites);
+    TEST_ASSERT(1 < writes.size());
+    TEST_ASSERT(writes.back().first == 0x1800 && writes.back().second == 8);
+
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    writes = vm->lastStepEffects()->memoryWrites;
+    TEST_ASSERT(writes.size() == 1);
+    TEST_ASSERT(writes[0].first == 0x1808 && writes[0].second == 8);
+
+    // rcx is zero, hence rep stosb does not write anything.
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    TEST_ASSERT(vm->lastStepEffects()->memoryWrites.empty());
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Halted);
+}
+
+// Snapshots built from the writes recorded by the emulator are identical to a
+// full copy of the memory.
+DECLARE_TEST(testSnapshotAfterStep) {
+    std::string const assembly(R"(
+        BITS 64
+
+        mov     rbx, 0x1800
+        mov     [rbx], rax
+        push    rbx
+        mov     rdi, 0x2000
+        mov     rcx, 0x100
+        mov     al, 0x42
+        rep stosb
+        hlt
+    )");
+    std::unique_ptr<X86Lab::Vm> const vm(createVmAndLoadCode(
+        X86Lab::Vm::CpuMode::LongMode, assembly, 4 * X86Lab::PAGE_SIZE,
+        X86Lab::Vm::Placement(), X86Lab::Vm::BackendType::Emulator));
+    std::shared_ptr<X86Lab::Snapshot> snap(
+        std::make_shared<X86Lab::Snapshot>(vm->getState()));
+    X86Lab::Vm::OperatingState state(X86Lab::Vm::OperatingState::Runnable);
+    while (state == X86Lab::Vm::OperatingState::Runnable) {
+        state = vm->step();
+        snap = X86Lab::Snapshot::afterStep(snap, *vm, std::nullopt);
+        std::unique_ptr<X86Lab::Vm::State> const full(vm->getState());
+        TEST_ASSERT(snap->registers() == full->registers());
+        TEST_ASSERT(snap->extendedState() == full->extendedState());
+        std::vector<u8> const mem(
+            snap->readPhysicalMemory(0, full->memory().size));
+        TEST_ASSERT(!std::memcmp(mem.data(),
+                                 full->memory().data.get(),
+                                 mem.size()));
+        // Only the leaves covering the writes are stored.
+        TEST_ASSERT(snap->storageStats().leafBytes <= X86Lab::PAGE_SIZE);
+    }
+    TEST_ASSERT(state == X86Lab::Vm::OperatingState::Halted);
+}
+
+// The emulator sets the accessed and dirty bits as the cpu does, hence the
+// working sets reported under both backends are the same.
+DECLARE_TEST(testWorkingSet) {
+    std::string const assembly(R"(
+        BITS 64
+
+        mov     rax, [0x2000]
+        push    rax
+        mov     [0x1000], rax
+        pop     rbx
+        mov     rcx, [0x1000]
+        hlt
+    )");
+    std::unique_ptr<X86Lab::Vm> const kvm(createVmAndLoadCode(
+        X86Lab::Vm::CpuMode::LongMode, assembly, 4 * X86Lab::PAGE_SIZE,
+        X86Lab::Vm::Placement(), X86Lab::Vm::BackendType::Kvm));
+    std::unique_ptr<X86Lab::Vm> const emu(createVmAndLoadCode(
+        X86Lab::Vm::CpuMode::LongMode, assembly, 4 * X86Lab::PAGE_SIZE,
+        X86Lab::Vm::Placement(), X86Lab::Vm::BackendType::Emulator));
+    TEST_ASSERT(!!kvm->scanWorkingSet());
+    TEST_ASSERT(!!emu->scanWorkingSet());
+    for (u64 i(0); i < 5; ++i) {
+        TEST_ASSERT(kvm->step() == X86Lab::Vm::OperatingState::Runnable);
+        TEST_ASSERT(emu->step() == X86Lab::Vm::OperatingState::Runnable);
+        std::optional<X86Lab::Vm::WorkingSet> const kvmWs(
+            kvm->scanWorkingSet());
+        std::optional<X86Lab::Vm::WorkingSet> const emuWs(
+            emu->scanWorkingSet());
+        TEST_ASSERT(!!kvmWs && !!emuWs);
+        TEST_ASSERT(kvmWs->accessed == emuWs->accessed);
+        TEST_ASSERT(kvmWs->dirty == emuWs->dirty);
+        TEST_ASSERT(!!emuWs->numAccessed());
+    }
+}
+}
@@ -0,0 +1,187 @@
+#include <x86lab/x86lab.hpp>
+#include <x86lab/test.hpp>
+
+// Tests for the X86Lab::HeadlessRunner.
+
+namespace X86Lab::Test::Headless {
+// Run a snippet to completion and check the recorded history.
+DECLARE_TEST(testHeadlessRun) {
+    std::shared_ptr<Code const> const code(assemble(R"(
+        BITS 64
+        mov     rax, 1
+        mov     rbx, 2
+        add     rax, rbx
+        hlt
+    )"));
+
+    X86Lab::HeadlessRunner runner(code);
+    TEST_ASSERT(runner.run() == X86Lab::Vm::OperatingState::Halted);
+    // Depending on the host, the single-step trap on the hlt might be reported
+    // before the halt itself, in which case the hlt takes two steps.
+    TEST_ASSERT(runner.numSteps() >= 4);
+
+    std::vector<std::shared_ptr<X86Lab::Snapshot>> const& history(
+        runner.history());
+    TEST_ASSERT(history.size() == runner.numSteps() + 1);
+    TEST_ASSERT(history[1]->registers().rax == 1);
+    TEST_ASSERT(history[2]->registers().rbx == 2);
+    TEST_ASSERT(history[3]->registers().rax == 3);
+    TEST_ASSERT(runner.vm().getRegisters().rax == 3);
+}
+
+// Check that maxSteps and recordHistory are honored.
+DECLARE_TEST(testHeadlessMaxStepsNoHistory) {
+    std::shared_ptr<Code const> const code(assemble(R"(
+        BITS 64
+    loop:
+        inc     rax
+        jmp     loop
+    )"));
+
+    X86Lab::HeadlessRunner::Config config;
+    config.maxSteps = 100;
+    config.recordHistory = false;
+    X86Lab::HeadlessRunner runner(code, config);
+    TEST_ASSERT(runner.run() == X86Lab::Vm::OperatingState::Runnable);
+    TEST_ASSERT(runner.numSteps() == 100);
+    TEST_ASSERT(runner.history().size() == 1);
+    TEST_ASSERT(runner.vm().getRegisters().rax == 50);
+
+    // Calling run() again executes another maxSteps instructions.
+    TEST_ASSERT(runner.run() == X86Lab::Vm::OperatingState::Runnable);
+    TEST_ASSERT(runner.numSteps() == 200);
+    TEST_ASSERT(runner.vm().getRegisters().rax == 100);
+}
+
+// Check that repStringStepping executes rep-prefixed string instructions in a
+// single step, with the same end result as stepping each iteration.
+DECLARE_TEST(testHeadlessRepStringStepping) {
+    std::shared_ptr<Code const> const code(assemble(R"(
+        BITS 64
+        mov     rcx, 0x100
+        xor     esi, esi
+        mov     edi, 0x2000
+        rep movsb
+        mov     ecx, 0x10
+        mov     rax, -1
+        rep stosq
+        hlt
+    )"));
+
+    for (bool const repStringStepping : {false, true}) {
+        X86Lab::HeadlessRunner::Config config;
+        config.repStringStepping = repStringStepping;
+        X86Lab::HeadlessRunner runner(code, config);
+        TEST_ASSERT(runner.run() == X86Lab::Vm::OperatingState::Halted);
+        // Find the step reaching the hlt, at offset 0x1f. With rep-string
+        // stepping each of the 7 instructions before it is a single step.
+        // Otherwise rep'ed instructions take at least one step, usually one per
+        // iteration, depending on the host.
+        std::vector<std::shared_ptr<X86Lab::Snapshot>> const& history(
+            runner.history());
+        u64 hltStep(0);
+        while (history[hltStep]->registers().rip != 0x1f) {
+            hltStep ++;
+        }
+        if (repStringStepping) {
+            TEST_ASSERT(hltStep == 7);
+        } else {
+            TEST_ASSERT(hltStep >= 7);
+        }
+
+        X86Lab::Vm::State::Registers const regs(runner.vm().getRegisters());
+        TEST_ASSERT(regs.rcx == 0);
+        TEST_ASSERT(regs.rsi == 0x100);
+        TEST_ASSERT(regs.rdi == 0x2180);
+
+        std::shared_ptr<X86Lab::Snapshot> const last(history.back());
+        TEST_ASSERT(last->readPhysicalMemory(0x2000, 0x100) ==
+                    last->readPhysicalMemory(0x0, 0x100));
+        TEST_ASSERT(last->readPhysicalMemory(0x2100, 0x80) ==
+                    std::vector<u8>(0x80, 0xff));
+    }
+}
+
+// Check tracing with Granularity::BasicBlock.
+DECLARE_TEST(testHeadlessBasicBlockTracing) {
+    std::shared_ptr<Code const> const code(assemble(R"(
+        BITS 64
+        mov     ecx, 10
+        xor     eax, eax
+        xor     ebx, ebx
+    top:
+        inc     rax
+        add     rbx, 2
+        dec     ecx
+        jnz     top
+        hlt
+    )"));
+
+    X86Lab::HeadlessRunner::Config config;
+    config.granularity = X86Lab::HeadlessRunner::Granularity::BasicBlock;
+    X86Lab::HeadlessRunner runner(code, config);
+    TEST_ASSERT(runner.run() == X86Lab::Vm::OperatingState::Halted);
+
+    X86Lab::Vm::State::Registers const regs(runner.vm().getRegisters());
+    TEST_ASSERT(regs.rax == 10);
+    TEST_ASSERT(regs.rbx == 20);
+
+    // The first block runs until the first jnz, then each remaining iteration
+    // is a block of its own, followed by the hlt. Depending on the host the
+    // hlt might take more than one step.
+    std::vector<X86Lab::HeadlessRunner::BasicBlock> const& blocks(
+        runner.blocks());
+    TEST_ASSERT(blocks.size() >= 11);
+    TEST_ASSERT(blocks.size() == runner.numSteps());
+    TEST_ASSERT(runner.history().size() == runner.numSteps() + 1);
+    TEST_ASSERT(blocks[0].start == 0x0);
+    TEST_ASSERT(blocks[0].numInstructions == 7);
+    for (u64 i(1); i < 10; ++i) {
+        TEST_ASSERT(blocks[i].start == 0x9);
+        TEST_ASSERT(blocks[i].numInstructions == 4);
+        TEST_ASSERT(runner.history()[i]->registers().rip == 0x9);
+    }
+    TEST_ASSERT(blocks[10].start == 0x14);
+    TEST_ASSERT(runner.blockInstructions(1) ==
+                std::vector<u64>({0x9, 0xc, 0x10, 0x12}));
+}
+
+// Snapshots taken after instructions that cannot write memory re-use the memory
+// of the previous snapshot. Check that the recorded memory is still correct.
+DECLARE_TEST(testHeadlessRegisterOnlySnapshots) {
+    std::shared_ptr<Code const> const code(assemble(R"(
+        BITS 64
+        mov     rax, 0x1122334455667788
+        add     rax, rax
+        mov     [0x2000], rax
+        inc     rax
+        push    rax
+        mov     rbx, [0x2000]
+        hlt
+    )"));
+    X86Lab::HeadlessRunner runner(code);
+    TEST_ASSERT(runner.run() == X86Lab::Vm::OperatingState::Halted);
+    std::vector<std::shared_ptr<X86Lab::Snapshot>> const& history(
+        runner.history());
+    TEST_ASSERT(history.size() >= 7);
+
+    u64 const value(0x1122334455667788ULL * 2);
+    // Read a u64 from the memory of a snapshot.
+    auto const readU64([&](u64 const step, u64 const offset) {
+        std::vector<u8> const bytes(
+            history[step]->readPhysicalMemory(offset, 8));
+        return *reinterpret_cast<u64 const*>(bytes.data());
+    });
+    TEST_ASSERT(readU64(2, 0x2000) == 0);
+    TEST_ASSERT(readU64(3, 0x2000) == value);
+    u64 const rsp(history[5]->registers().rsp);
+    TEST_ASSERT(rsp == history[4]->registers().rsp - 8);
+    TEST_ASSERT(readU64(4, rsp) == 0);
+    TEST_ASSERT(readU64(5, rsp) == value + 1);
+    TEST_ASSERT(history[6]->registers().rbx == value);
+    for (u64 i(6); i < history.size(); ++i) {
+        TEST_ASSERT(readU64(i, 0x2000) == value);
+        TEST_ASSERT(readU64(i, rsp) == value + 1);
+    }
+}
+}
@@ -0,0 +1,101 @@
+#include <x86lab/historyquery.hpp>
+#include <x86lab/test.hpp>
+#include <cstring>
+
+// Tests for the X86Lab::HistoryQuery.
+
+namespace X86Lab::Test::HistoryQuery {
+// Check that the queries give the same results as a sequential walk through
+// the history, regardless of the number of threads.
+DECLARE_TEST(testHistoryQuery) {
+    // Start from the identity mapping set up by a Vm in long mode so that
+    // the history has page tables.
+    u64 const memSize(4 * X86Lab::PAGE_SIZE);
+    std::unique_ptr<X86Lab::Vm> vm(
+        new X86Lab::Vm(X86Lab::Vm::CpuMode::LongMode, memSize));
+    std::shared_ptr<X86Lab::Snapshot> snap(
+        new X86Lab::Snapshot(vm->getState()));
+    u64 const physicalSize(snap->physicalMemorySize());
+    std::vector<u8> mem(snap->readPhysicalMemory(0, physicalSize));
+    X86Lab::Vm::State::Registers regs(snap->registers());
+    u64 const pml4(regs.cr3 & ~(X86Lab::PAGE_SIZE - 1));
+    std::vector<std::shared_ptr<X86Lab::Snapshot>> history({snap});
+
+    // Steps writing memory are interleaved with register-only steps. The page
+    // tables are written at step 2000 and cr3 is loaded at step 2500.
+    u64 const numSteps(3000);
+    u64 const varAddr(0x100);
+    for (u64 step(1); step < numSteps; ++step) {
+        regs.rip = step;
+        regs.rsp = 0x8000 - (step % 64) * 8;
+        if (step == 2500) {
+            // Same tables, different cache attributes.
+            regs.cr3 |= 1 << 4;
+        }
+        if (!!(step % 10)) {
+            snap = std::make_shared<X86Lab::Snapshot>(snap, regs,
+                                                      snap->extendedState());
+            history.push_back(snap);
+            continue;
+        }
+        u64 const value((step / 10) % 7);
+        std::memcpy(mem.data() + varAddr, &value, sizeof(value));
+        if (step == 2000) {
+            // A non-present entry, the mapping itself does not change.
+            u64 const entry(0x2);
+            std::memcpy(mem.data() + pml4 + 511 * 8, &entry, sizeof(entry));
+        }
+        std::unique_ptr<X86Lab::Vm::State> state(
+            new X86Lab::Vm::State(regs,
+                                  X86Lab::Vm::State::Memory({
+                                      .data = std::unique_ptr<u8[]>(
+                                          new u8[physicalSize]),
+                                      .size = physicalSize})));
+        std::memcpy(state->memory().data.get(), mem.data(), physicalSize);
+        snap = std::make_shared<X86Lab::Snapshot>(snap, std::move(state));
+        history.push_back(snap);
+    }
+
+    // Expected results, from a sequential walk.
+    u64 const rspThreshold(0x8000 - 60 * 8);
+    std::vector<u64> expectedSteps;
+    std::map<std::vector<u8>, u64> expectedValues;
+    for (u64 step(0); step < numSteps; ++step) {
+        if (history[step]->registers().rsp < rspThreshold) {
+            expectedSteps.push_back(step);
+        }
+        expectedValues.emplace(history[step]->readLinearMemory(varAddr, 8),
+                               step);
+    }
+    // The 7 values written plus the initial value, unless it is one of them.
+    TEST_ASSERT(7 <= expectedValues.size());
+
+    for (u64 const numThreads : {1, 4}) {
+        X86Lab::Util::ThreadPool pool(numThreads);
+        X86Lab::HistoryQuery const query(snap, pool);
+        TEST_ASSERT(query.size() == numSteps);
+        TEST_ASSERT(&query.snapshot(numSteps - 1) == snap.get());
+        TEST_ASSERT(query.snapshot(42).registers().rip == 42);
+
+        std::vector<u64> const steps(query.findSteps(
+            [&](u64, X86Lab::Snapshot const& s) {
+                return s.registers().rsp < rspThreshold;
+            }));
+        TEST_ASSERT(steps == expectedSteps);
+        TEST_ASSERT(query.distinctValues(varAddr, 8) == expectedValues);
+        TEST_ASSERT(query.pagingChanges() == std::vector<u64>({2000, 2500}));
+
+        // Custom job: sum of rip over the history.
+        u64 const sum(query.mapReduce<u64>(
+            0,
+            [](u64& acc, u64, X86Lab::Snapshot const& s) {
+                acc += s.registers().rip;
+            },
+            [](u64& acc, u64&& partial) {
+                acc += partial;
+            }));
+        TEST_ASSERT(sum == history[0]->registers().rip +
+                    (numSteps - 1) * numSteps / 2);
+    }
+}
+}
@@ -1,7 +1,10 @@
 // Some utility functions/types helpful to run tests.
 #pragma once
 #include <x86lab/util.hpp>
+#include <x86lab/vm.hpp>
+#include <x86lab/code.hpp>
 #include <functional>
+#include <memory>
 #include <stdexcept>
 
 namespace X86Lab::Test {
@@ -53,4 +56,31 @@ public:
 
 // Run all the tests that have been registered so far.
 void runAllTests();
+
+// Write assembly code to a temporary file, e.g. to be loaded through the Cli.
+// @param assembly: The assembly code.
+// @param pathPrefix: The prefix of the path of the temporary file.
+// @return: The temporary file, deleted when destroyed.
+std::unique_ptr<Util::TempFile> writeSourceFile(
+    std::string const& assembly,
+    std::string const& pathPrefix = "/tmp/x86lab_testcode");
+
+// Assemble the given code.
+// @param assembly: The assembly code to assemble.
+// @return: A shared_ptr on the assembled Code.
+std::shared_ptr<Code const> assemble(std::string const& assembly);
+
+// Create a VM and load the given code to memory.
+// @param startMode: The cpu mode the VM should start in.
+// @param assembly: The assembly code to assemble and load into the Vm.
+// @param memorySize: The size of the physical memory in bytes.
+// @param placement: The placement of the VM on the host.
+// @param backend: The backend running the vCpu.
+// @return: A unique_ptr for the instantiated VM.
+std::unique_ptr<X86Lab::Vm> createVmAndLoadCode(
+    X86Lab::Vm::CpuMode const startMode,
+    std::string const& assembly,
+    u64 const memorySize = X86Lab::PAGE_SIZE,
+    X86Lab::Vm::Placement const& placement = X86Lab::Vm::Placement(),
+    X86Lab::Vm::BackendType const backend = X86Lab::Vm::BackendType::Kvm);
 }
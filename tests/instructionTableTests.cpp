@@ -0,0 +1,129 @@
+#include <x86lab/instructiontable.hpp>
+#include <x86lab/test.hpp>
+#include <sstream>
+
+// Tests for the X86Lab::InstructionTable.
+
+namespace X86Lab::Test::InstructionTable {
+// Check parsing a list of instruction forms.
+DECLARE_TEST(testParseForms) {
+    std::istringstream list(R"(
+        # Comments and empty lines are ignored.
+
+        r64 - imul {dst}, {src}
+        xmm sse2 paddd {dst}, {src}
+        ymm avx2 vpaddd {dst}, {dst}, {src}
+    )");
+    std::vector<X86Lab::InstructionTable::Form> const forms(
+        X86Lab::InstructionTable::parseForms(list));
+    TEST_ASSERT(forms.size() == 3);
+    TEST_ASSERT(forms[0].name == "imul r64, r64");
+    TEST_ASSERT(forms[0].pattern == "imul {dst}, {src}");
+    TEST_ASSERT(forms[0].regClass ==
+                X86Lab::InstructionTable::RegisterClass::Gpr64);
+    TEST_ASSERT(!forms[0].isSupported);
+    TEST_ASSERT(forms[1].name == "paddd xmm, xmm");
+    TEST_ASSERT(forms[1].isSupported == Util::Extension::hasSse2);
+    TEST_ASSERT(forms[2].name == "vpaddd ymm, ymm, ymm");
+    TEST_ASSERT(forms[2].regClass ==
+                X86Lab::InstructionTable::RegisterClass::Ymm);
+
+    std::istringstream invalid("r64 mmx2 add {dst}, {src}");
+    bool thrown(false);
+    try {
+        X86Lab::InstructionTable::parseForms(invalid);
+    } catch (Error const&) {
+        thrown = true;
+    }
+    TEST_ASSERT(thrown);
+}
+
+// Check the registers used by the generated benchmarks.
+DECLARE_TEST(testBenchmarkSource) {
+    X86Lab::InstructionTable::Form const form({
+        .name = "add r64, r64",
+        .pattern = "add {dst}, {src}",
+        .regClass = X86Lab::InstructionTable::RegisterClass::Gpr64,
+        .isSupported = nullptr,
+    });
+    std::string const latency(X86Lab::InstructionTable::benchmarkSource(
+        form, X86Lab::InstructionTable::Benchmark::Latency, 4));
+    TEST_ASSERT(latency.find("add rbx, rbx\nadd rbx, rbx\n"
+                             "add rbx, rbx\nadd rbx, rbx\n") !=
+                std::string::npos);
+    std::string const throughput(X86Lab::InstructionTable::benchmarkSource(
+        form, X86Lab::InstructionTable::Benchmark::Throughput, 4));
+    TEST_ASSERT(throughput.find("add rbx, r14\nadd rsi, r14\n"
+                                "add rdi, r14\nadd rbp, r14\n") !=
+                std::string::npos);
+
+    // All the free vector registers are independent destinations.
+    std::string const vector(X86Lab::InstructionTable::benchmarkSource({
+            .name = "mulps xmm, xmm",
+            .pattern = "mulps {dst}, {src}",
+            .regClass = X86Lab::InstructionTable::RegisterClass::Xmm,
+            .isSupported = nullptr,
+        }, X86Lab::InstructionTable::Benchmark::Throughput, 16));
+    TEST_ASSERT(vector.find("mulps xmm14, xmm15\nmulps xmm0, xmm15\n") !=
+                std::string::npos);
+    // Vector registers hold 1.0 in the precision of the instruction.
+    TEST_ASSERT(vector.find("mov rax, 0x3f8000003f800000\n") !=
+                std::string::npos);
+    TEST_ASSERT(vector.find("movaps xmm14, xmm15\n") != std::string::npos);
+}
+
+// Run the benchmarks of an instruction. The values themselves depend on the
+// host, and on nested virtualization are dominated by the cost of the
+// virtualization, hence only check that they were measured.
+DECLARE_TEST(testMeasure) {
+    X86Lab::InstructionTable::Config config;
+    config.repetitions = 3;
+    X86Lab::InstructionTable const table(config);
+    X86Lab::InstructionTable::Entry const imul(table.measure({
+        .name = "imul r64, r64",
+        .pattern = "imul {dst}, {src}",
+        .regClass = X86Lab::InstructionTable::RegisterClass::Gpr64,
+        .isSupported = nullptr,
+    }));
+    TEST_ASSERT(imul.name == "imul r64, r64");
+    TEST_ASSERT(imul.supported);
+    TEST_ASSERT(!imul.noisy);
+    TEST_ASSERT(imul.latency > 0);
+    TEST_ASSERT(imul.throughput > 0);
+
+    // Unsupported forms are not run.
+    X86Lab::InstructionTable::Entry const unsupported(table.measure({
+        .name = "unsupported",
+        .pattern = "ud2",
+        .regClass = X86Lab::InstructionTable::RegisterClass::Gpr64,
+        .isSupported = []() { return false; },
+    }));
+    TEST_ASSERT(!unsupported.supported);
+
+    // Forms raising an exception are reported as unsupported.
+    X86Lab::InstructionTable::Entry const faulting(table.measure({
+        .name = "ud2",
+        .pattern = "ud2",
+        .regClass = X86Lab::InstructionTable::RegisterClass::Gpr64,
+        .isSupported = nullptr,
+    }));
+    TEST_ASSERT(!faulting.supported);
+    TEST_ASSERT(!faulting.noisy);
+}
+
+// Check that noisy forms are told apart from unsupported ones in the table.
+DECLARE_TEST(testFormatNoisy) {
+    std::string const table(X86Lab::InstructionTable::format({
+        {.name = "add", .supported = true, .noisy = false,
+         .latency = 1, .throughput = 0.25},
+        {.name = "mul", .supported = true, .noisy = true,
+         .latency = 0, .throughput = 0},
+        {.name = "ud2", .supported = false, .noisy = false,
+         .latency = 0, .throughput = 0},
+    }, X86Lab::InstructionTable::Clock::Tsc));
+    TEST_ASSERT(table.find("1.00        0.25") != std::string::npos);
+    TEST_ASSERT(table.find("mul") < table.find("noisy"));
+    TEST_ASSERT(table.find("noisy") < table.find("ud2"));
+    TEST_ASSERT(table.find("unsupported") != std::string::npos);
+}
+}
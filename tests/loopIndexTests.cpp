@@ -0,0 +1,242 @@
+#include <x86lab/loopindex.hpp>
+#include <x86lab/runner.hpp>
+#include <x86lab/ui/cli.hpp>
+#include <x86lab/test.hpp>
+#include <sstream>
+
+// Tests for the X86Lab::LoopIndex.
+
+namespace X86Lab::Test::LoopIndex {
+// Append a sequence of rips to a LoopIndex.
+// @param index: The index to append to.
+// @param rips: The rip of each step.
+// @param rsps: The rsp of each step, 0 if empty.
+static void appendSteps(X86Lab::LoopIndex& index,
+                        std::vector<u64> const& rips,
+                        std::vector<u64> const& rsps = {}) {
+    for (u64 i(0); i < rips.size(); ++i) {
+        Snapshot::Registers regs;
+        regs.rip = rips[i];
+        regs.rsp = rsps.empty() ? 0 : rsps[i];
+        index.append(regs);
+    }
+}
+
+// Check the iterations of a single loop.
+DECLARE_TEST(testLoopIndexSingleLoop) {
+    X86Lab::LoopIndex index;
+    // Three iterations of the loop 0x10-0x30, then exit.
+    appendSteps(index, {0x0, 0x10, 0x20, 0x30, 0x10, 0x20, 0x30, 0x10, 0x20,
+                        0x30, 0x40});
+    TEST_ASSERT(index.size() == 11);
+    TEST_ASSERT(index.loops().size() == 1);
+    X86Lab::LoopIndex::Loop const& loop(index.loops()[0]);
+    TEST_ASSERT(loop.header == 0x10);
+    TEST_ASSERT(loop.latch == 0x30);
+    TEST_ASSERT(loop.iterationStarts == std::vector<u64>({1, 4, 7}));
+    TEST_ASSERT(loop.activations.size() == 1);
+    TEST_ASSERT(loop.activations[0].firstIteration == 0);
+    TEST_ASSERT(loop.activations[0].numIterations == 3);
+    TEST_ASSERT(loop.activations[0].end == 10);
+
+    TEST_ASSERT(!index.iterationAt(0));
+    std::optional<X86Lab::LoopIndex::Iteration> const iter(
+        index.iterationAt(5));
+    TEST_ASSERT(!!iter);
+    TEST_ASSERT(iter->loop == 0);
+    TEST_ASSERT(iter->index == 1);
+    TEST_ASSERT(iter->start == 4);
+    TEST_ASSERT(iter->end == 7);
+    TEST_ASSERT(index.iterationAt(9)->end == 10);
+    TEST_ASSERT(!index.iterationAt(10));
+
+    // The loop, its three iterations and activation, its header and the five
+    // addresses visited.
+    TEST_ASSERT(index.storageBytes() ==
+                sizeof(X86Lab::LoopIndex::Loop) + 3 * sizeof(u64) +
+                sizeof(X86Lab::LoopIndex::Activation) +
+                2 * sizeof(u64) + 5 * 2 * sizeof(u64));
+}
+
+// Check nested loops, calls from a loop body and loops executed several
+// times.
+DECLARE_TEST(testLoopIndexNestedLoops) {
+    X86Lab::LoopIndex index;
+    // Outer loop 0x10-0x50 running inner loop 0x20-0x30 twice per iteration,
+    // then calling a function at 0x0 from 0x40. Returning from the function
+    // is not a back-edge.
+    std::vector<u64> rips;
+    std::vector<u64> rsps;
+    auto const step([&](u64 const rip, u64 const rsp = 0x1000) {
+        rips.push_back(rip);
+        rsps.push_back(rsp);
+    });
+    step(0x8);
+    for (u64 outer(0); outer < 3; ++outer) {
+        step(0x10);
+        for (u64 inner(0); inner < 2; ++inner) {
+            step(0x20);
+            step(0x30);
+        }
+        step(0x40);
+        step(0x0, 0xff8);
+        step(0x4, 0xff8);
+        step(0x48);
+        step(0x50);
+    }
+    step(0x60);
+    appendSteps(index, rips, rsps);
+
+    std::vector<X86Lab::LoopIndex::Loop> const& loops(index.loops());
+    TEST_ASSERT(loops.size() == 2);
+    // The inner loop is detected first.
+    TEST_ASSERT(loops[0].header == 0x20);
+    TEST_ASSERT(loops[0].latch == 0x30);
+    TEST_ASSERT(loops[0].activations.size() == 3);
+    TEST_ASSERT(loops[0].iterationStarts.size() == 6);
+    TEST_ASSERT(loops[1].header == 0x10);
+    TEST_ASSERT(loops[1].latch == 0x50);
+    TEST_ASSERT(loops[1].activations.size() == 1);
+    TEST_ASSERT(loops[1].iterationStarts == std::vector<u64>({1, 11, 21}));
+    TEST_ASSERT(loops[1].activations[0].end == 31);
+
+    // The step in the inner loop is in its iteration, the call in the outer
+    // loop's.
+    TEST_ASSERT(index.iterationAt(12)->loop == 0);
+    TEST_ASSERT(index.iterationAt(12)->index == 2);
+    // First iteration of the second activation of the inner loop.
+    TEST_ASSERT(index.iterationAt(12)->activation == 1);
+    TEST_ASSERT(index.iterationAt(12)->activationIndex == 0);
+    TEST_ASSERT(index.iterationAt(14)->activationIndex == 1);
+    TEST_ASSERT(index.iterationAt(17)->loop == 1);
+    TEST_ASSERT(index.iterationAt(17)->index == 1);
+    TEST_ASSERT(index.iterationAt(17)->activation == 0);
+    TEST_ASSERT(index.iterationAt(17)->activationIndex == 1);
+    TEST_ASSERT(!index.iterationAt(31));
+}
+
+// Check the iteration actions through the Cli, including running the Vm to
+// reach an iteration that was not executed yet.
+DECLARE_TEST(testLoopIndexNavigation) {
+    std::shared_ptr<Code const> const code(assemble(R"(
+        BITS 64
+        xor     rcx, rcx
+        body:
+        inc     rcx
+        cmp     rcx, 50
+        jne     body
+        hlt
+    )"));
+    std::shared_ptr<Vm> const vm(new Vm(Vm::CpuMode::LongMode, PAGE_SIZE));
+    // At the start of iteration k, rcx == k.
+    std::istringstream input(R"(
+        step 10
+        iter 2
+        reg rcx
+        iter next
+        reg rcx
+        iter prev 2
+        reg rcx
+        iter 40
+        reg rcx
+        iter 60
+        reg rcx
+        loops
+    )");
+    std::ostringstream output;
+    std::ostringstream log;
+    std::shared_ptr<Ui::Cli> const cli(new Ui::Cli(input, output, log));
+    TEST_ASSERT(cli->init());
+    Runner runner(vm, code, cli);
+    TEST_ASSERT(runner.run() == Runner::ReturnReason::Quit);
+
+    std::istringstream lines(output.str());
+    std::vector<std::string> expected({
+        "rcx = 0x0000000000000002",
+        "rcx = 0x0000000000000003",
+        "rcx = 0x0000000000000001",
+        "rcx = 0x0000000000000028",
+        "rcx = 0x0000000000000028",
+        "loops = 1",
+    });
+    for (std::string const& exp : expected) {
+        std::string line;
+        TEST_ASSERT(!!std::getline(lines, line));
+        TEST_ASSERT(line == exp);
+    }
+    TEST_ASSERT(log.str().find("The loop only ran 50 iterations") !=
+                std::string::npos);
+}
+
+// Check that iter <k> counts the iterations from the entry of the loop, and
+// that reaching an iteration stops when the Vm shuts down.
+DECLARE_TEST(testLoopIndexActivationNavigation) {
+    std::shared_ptr<Code const> const code(assemble(R"(
+        BITS 64
+        ; Three activations of the inner loop, incrementing rcx from 0 to 3.
+        ; rbx counts the iterations of all the activations.
+        xor     rbx, rbx
+        xor     rdx, rdx
+        outer:
+        xor     rcx, rcx
+        inner:
+        inc     rbx
+        inc     rcx
+        cmp     rcx, 4
+        jne     inner
+        inc     rdx
+        cmp     rdx, 3
+        jne     outer
+        ; A loop shutting the Vm down in its fourth iteration, dividing by
+        ; zero without IDT.
+        xor     rcx, rcx
+        faulting:
+        inc     rcx
+        mov     rax, 1
+        mov     rsi, 4
+        sub     rsi, rcx
+        xor     edx, edx
+        div     rsi
+        jmp     faulting
+    )"));
+    std::shared_ptr<Vm> const vm(new Vm(Vm::CpuMode::LongMode, PAGE_SIZE));
+    std::istringstream input(R"(
+        until rdx==1
+        step 7
+        iter 2
+        reg rcx
+        reg rbx
+        iter 4
+        reg rbx
+        until rdx==3
+        step 10
+        iter 10
+        reg rcx
+    )");
+    std::ostringstream output;
+    std::ostringstream log;
+    std::shared_ptr<Ui::Cli> const cli(new Ui::Cli(input, output, log));
+    TEST_ASSERT(cli->init());
+    Runner runner(vm, code, cli);
+    TEST_ASSERT(runner.run() == Runner::ReturnReason::Quit);
+
+    // At the start of iteration k of the inner loop, rcx == k and rbx counts
+    // the iterations of the previous activations.
+    std::istringstream lines(output.str());
+    std::vector<std::string> expected({
+        "rcx = 0x0000000000000002",
+        "rbx = 0x0000000000000006",
+        "rbx = 0x0000000000000006",
+        "rcx = 0x0000000000000001",
+    });
+    for (std::string const& exp : expected) {
+        std::string line;
+        TEST_ASSERT(!!std::getline(lines, line));
+        TEST_ASSERT(line == exp);
+    }
+    TEST_ASSERT(log.str().find("The loop only ran 4 iterations") !=
+                std::string::npos);
+    TEST_ASSERT(log.str().find("Iteration 10 did not start before the Vm "
+                               "stopped") != std::string::npos);
+}
+}
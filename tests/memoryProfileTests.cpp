@@ -0,0 +1,90 @@
+#include <x86lab/memoryprofile.hpp>
+#include <x86lab/test.hpp>
+#include <sstream>
+
+// Tests for the X86Lab::MemoryProfile.
+
+namespace X86Lab::Test::MemoryProfile {
+// Run a small profile and check that every curve covers the requested sizes.
+// The values themselves depend on the host.
+DECLARE_TEST(testMemoryProfileRun) {
+    X86Lab::MemoryProfile::Config config;
+    config.minSize = 1 << 10;
+    config.maxSize = 64 << 10;
+    config.maxTlbPages = 8;
+    config.minLoads = 1 << 10;
+    config.minBytes = 64 << 10;
+    X86Lab::MemoryProfile profile(config);
+    X86Lab::MemoryProfile::Results const results(profile.run());
+
+    TEST_ASSERT(results.pageSize == PAGE_SIZE);
+    // Depending on the host, anonymous memory may always use huge pages.
+    TEST_ASSERT(results.hostPageSize == PAGE_SIZE ||
+                results.hostPageSize == (1 << 21));
+    TEST_ASSERT(results.memoryType == X86Lab::Vm::MemoryType::WriteBack);
+    TEST_ASSERT(results.memoryTypeHonored);
+    TEST_ASSERT(results.tscFrequency > 0);
+    for (std::vector<X86Lab::MemoryProfile::Point> const * const curve :
+         {&results.latency, &results.readBandwidth, &results.writeBandwidth,
+          &results.streamingWriteBandwidth, &results.copyBandwidth}) {
+        TEST_ASSERT(curve->size() == 7);
+        for (u64 i(0); i < curve->size(); ++i) {
+            TEST_ASSERT((*curve)[i].size == (1ULL << (10 + i)));
+            TEST_ASSERT((*curve)[i].value > 0);
+        }
+    }
+    TEST_ASSERT(results.tlbLatency.size() == 4);
+    TEST_ASSERT(results.tlbLatency.back().size == 8);
+
+    // Header plus one line per point.
+    std::string const csv(X86Lab::MemoryProfile::toCsv(results));
+    std::istringstream iss(csv);
+    std::string line;
+    std::getline(iss, line);
+    TEST_ASSERT(line == "benchmark,page_size,size,value,unit");
+    std::getline(iss, line);
+    TEST_ASSERT(line.starts_with("latency,4096,1024,"));
+    TEST_ASSERT(line.ends_with(",ns"));
+    TEST_ASSERT(std::count(csv.begin(), csv.end(), '\n') == 1 + 5 * 7 + 4);
+}
+
+// Check that the working sets can be mapped with large pages and with another
+// memory type.
+DECLARE_TEST(testMemoryProfileLargePages) {
+    X86Lab::MemoryProfile::Config config;
+    config.pageSize = 1 << 21;
+    config.minSize = 4 << 20;
+    config.maxSize = 4 << 20;
+    config.maxTlbPages = 2;
+    config.minLoads = 1 << 10;
+    config.minBytes = 4 << 20;
+    X86Lab::MemoryProfile profile(config);
+    X86Lab::MemoryProfile::Results const results(profile.run());
+    TEST_ASSERT(results.pageSize == (1 << 21));
+    TEST_ASSERT(results.hostPageSize == PAGE_SIZE ||
+                results.hostPageSize == (1 << 21));
+    TEST_ASSERT(results.latency.size() == 1);
+    TEST_ASSERT(results.latency[0].value > 0);
+    TEST_ASSERT(results.tlbLatency.size() == 2);
+
+    // Write-combining working sets.
+    config.memoryType = X86Lab::Vm::MemoryType::WriteCombining;
+    X86Lab::MemoryProfile writeCombining(config);
+    X86Lab::MemoryProfile::Results const wcResults(writeCombining.run());
+    TEST_ASSERT(wcResults.streamingWriteBandwidth.size() == 1);
+    TEST_ASSERT(wcResults.streamingWriteBandwidth[0].value > 0);
+    // Whether write-combining applies depends on the host's KVM.
+    X86Lab::Vm wcVm(X86Lab::Vm::CpuMode::LongMode, X86Lab::PAGE_SIZE);
+    TEST_ASSERT(wcResults.memoryTypeHonored == wcVm.honorsMemoryTypes());
+
+    // Invalid page size.
+    config.pageSize = 8192;
+    bool thrown(false);
+    try {
+        X86Lab::MemoryProfile invalid(config);
+    } catch (Error const&) {
+        thrown = true;
+    }
+    TEST_ASSERT(thrown);
+}
+}
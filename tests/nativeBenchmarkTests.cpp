@@ -0,0 +1,44 @@
+#include <x86lab/nativebenchmark.hpp>
+#include <x86lab/test.hpp>
+
+// Tests for the X86Lab::NativeBenchmark helpers.
+
+namespace X86Lab::Test::NativeBenchmark {
+// Run a benchmark timing a loop whose number of iterations is set through the
+// registers, and check that rax holds the elapsed ticks when it halts.
+DECLARE_TEST(testNativeBenchmarkRun) {
+    std::unique_ptr<Code const> const code(X86Lab::NativeBenchmark::assemble(
+        "BITS 64\n" + X86Lab::NativeBenchmark::readTsc(true) +
+        "loop:\n"
+        "dec rcx\n"
+        "jnz loop\n" +
+        X86Lab::NativeBenchmark::readTsc(false) +
+        "hlt\n"));
+    Vm vm(Vm::CpuMode::LongMode, 4 * PAGE_SIZE);
+    std::optional<u64> const ticks(X86Lab::NativeBenchmark::run(vm, *code,
+        [](Vm::State::Registers& regs) {
+            regs.rcx = 1000;
+        }));
+    TEST_ASSERT(!!ticks);
+    TEST_ASSERT(*ticks > 0);
+    TEST_ASSERT(vm.getRegisters().rcx == 0);
+
+    // The code is loaded again by every run, which starts from its first
+    // instruction.
+    std::optional<u64> const again(X86Lab::NativeBenchmark::run(vm, *code,
+        [](Vm::State::Registers& regs) {
+            regs.rcx = 1;
+        }));
+    TEST_ASSERT(!!again);
+    TEST_ASSERT(vm.getRegisters().rcx == 0);
+}
+
+// A benchmark that does not halt reports no result.
+DECLARE_TEST(testNativeBenchmarkNoHalt) {
+    std::unique_ptr<Code const> const code(
+        X86Lab::NativeBenchmark::assemble("BITS 64\nud2\n"));
+    Vm vm(Vm::CpuMode::LongMode, 4 * PAGE_SIZE);
+    TEST_ASSERT(!X86Lab::NativeBenchmark::run(vm, *code,
+        [](Vm::State::Registers&) {}));
+}
+}
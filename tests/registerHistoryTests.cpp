@@ -0,0 +1,96 @@
+#include <x86lab/registerhistory.hpp>
+#include <x86lab/test.hpp>
+#include <random>
+
+// Tests for the X86Lab::RegisterHistory.
+
+namespace X86Lab::Test::RegisterHistory {
+using Register = X86Lab::RegisterHistory::Register;
+using Comparison = X86Lab::RegisterHistory::Comparison;
+
+// Check that values are correctly retrieved and that unchanged registers do not
+// create new runs.
+DECLARE_TEST(testRegisterHistoryValue) {
+    X86Lab::RegisterHistory history;
+    X86Lab::Snapshot::Registers regs({}, {}, {});
+    for (u64 i(0); i < 1000; ++i) {
+        regs.rax = i;
+        regs.rbx = i / 100;
+        history.append(regs);
+    }
+    TEST_ASSERT(history.size() == 1000);
+    TEST_ASSERT(history.numRuns(Register::Rax) == 1000);
+    TEST_ASSERT(history.numRuns(Register::Rbx) == 10);
+    TEST_ASSERT(history.numRuns(Register::Rcx) == 1);
+    // A start and a value per run.
+    u64 const numRuns(1000 + 10 + X86Lab::RegisterHistory::NumRegisters - 2);
+    TEST_ASSERT(history.storageBytes() == 2 * sizeof(u64) * numRuns);
+    for (u64 i(0); i < 1000; ++i) {
+        TEST_ASSERT(history.value(Register::Rax, i) == i);
+        TEST_ASSERT(history.value(Register::Rbx, i) == i / 100);
+        TEST_ASSERT(history.value(Register::Rcx, i) == 0);
+    }
+}
+
+// Compare findFirst against a naive search on random histories.
+DECLARE_TEST(testRegisterHistoryFindFirst) {
+    std::mt19937_64 generator;
+    std::vector<u64> values;
+    X86Lab::RegisterHistory history;
+    X86Lab::Snapshot::Registers regs({}, {}, {});
+    for (u64 i(0); i < 5000; ++i) {
+        // Change the value every few steps to get runs of various lengths.
+        if (!(generator() % 4)) {
+            regs.r8 = generator() % 1000;
+        }
+        values.push_back(regs.r8);
+        history.append(regs);
+    }
+
+    std::map<Comparison, std::function<bool(u64, u64)>> const cmps = {
+        {Comparison::Equal, std::equal_to<u64>()},
+        {Comparison::NotEqual, std::not_equal_to<u64>()},
+        {Comparison::Less, std::less<u64>()},
+        {Comparison::LessEqual, std::less_equal<u64>()},
+        {Comparison::Greater, std::greater<u64>()},
+        {Comparison::GreaterEqual, std::greater_equal<u64>()},
+    };
+    for (u64 i(0); i < 200; ++i) {
+        u64 const value(generator() % 1100);
+        u64 const from(generator() % values.size());
+        for (auto const& [cmp, func] : cmps) {
+            std::optional<u64> expected;
+            for (u64 j(from); j < values.size(); ++j) {
+                if (func(values[j], value)) {
+                    expected = j;
+                    break;
+                }
+            }
+            TEST_ASSERT(history.findFirst(Register::R8, cmp, value, from) ==
+                        expected);
+        }
+    }
+    TEST_ASSERT(!history.findFirst(Register::R8, Comparison::Greater, 1000));
+    TEST_ASSERT(!history.findFirst(Register::R8, Comparison::Equal, 0, 5000));
+}
+
+// Check sampling of a register over a range of steps.
+DECLARE_TEST(testRegisterHistorySample) {
+    X86Lab::RegisterHistory history;
+    X86Lab::Snapshot::Registers regs({}, {}, {});
+    for (u64 i(0); i < 101; ++i) {
+        regs.rip = i * 2;
+        history.append(regs);
+    }
+    std::vector<u64> const all(history.sample(Register::Rip, 10, 20, 100));
+    TEST_ASSERT(all.size() == 11);
+    for (u64 i(0); i < all.size(); ++i) {
+        TEST_ASSERT(all[i] == (10 + i) * 2);
+    }
+    std::vector<u64> const some(history.sample(Register::Rip, 0, 100, 11));
+    TEST_ASSERT(some.size() == 11);
+    for (u64 i(0); i < some.size(); ++i) {
+        TEST_ASSERT(some[i] == i * 20);
+    }
+}
+}
@@ -0,0 +1,278 @@
+#include <x86lab/server.hpp>
+#include <x86lab/test.hpp>
+#include <filesystem>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Tests for the X86Lab::Server.
+
+namespace X86Lab::Test::Server {
+// A client connected to a Server.
+class Client {
+public:
+    // Connect to a server.
+    // @param socketPath: The path of the server's socket.
+    Client(std::string const& socketPath) :
+        m_fd(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        socketPath.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+        if (m_fd == -1 || ::connect(m_fd, reinterpret_cast<sockaddr*>(&addr),
+                                    sizeof(addr)) == -1) {
+            throw Error("Cannot connect to " + socketPath, errno);
+        }
+    }
+
+    ~Client() {
+        ::close(m_fd);
+    }
+
+    // Send lines to the server.
+    // @param lines: The lines, including their new lines.
+    void send(std::string const& lines) {
+        if (::write(m_fd, lines.data(), lines.size()) !=
+            static_cast<ssize_t>(lines.size())) {
+            throw Error("Cannot send to server", errno);
+        }
+    }
+
+    // Read from the server until the output contains a string.
+    // @param str: The string to wait for.
+    // @return: true if the string was received, false if the server closed
+    // the connection before.
+    bool waitFor(std::string const& str) {
+        while (m_received.find(str) == std::string::npos) {
+            char buf[4096];
+            ssize_t const len(::read(m_fd, buf, sizeof(buf)));
+            if (len <= 0) {
+                return false;
+            }
+            m_received.append(buf, len);
+        }
+        return true;
+    }
+
+    // Read from the server until it closes the connection.
+    // @return: Everything received.
+    std::string const& readAll() {
+        char buf[4096];
+        ssize_t len;
+        while (0 < (len = ::read(m_fd, buf, sizeof(buf)))) {
+            m_received.append(buf, len);
+        }
+        return m_received;
+    }
+
+private:
+    int m_fd;
+    std::string m_received;
+};
+
+// A temporary directory, removed with its content upon destruction.
+class SourceDirectory {
+public:
+    SourceDirectory() {
+        char path[] = "/tmp/x86lab_testdirXXXXXX";
+        if (!::mkdtemp(path)) {
+            throw Error("Cannot create temporary directory", errno);
+        }
+        m_path = path;
+    }
+
+    ~SourceDirectory() {
+        std::error_code error;
+        std::filesystem::remove_all(m_path, error);
+    }
+
+    std::string const& path() const {
+        return m_path;
+    }
+
+private:
+    std::string m_path;
+};
+
+// A Server running its event loop in a separate thread, stopped upon
+// destruction.
+class RunningServer {
+public:
+    // Create a server and start its event loop.
+    // @param socketPath: The path of the server's socket.
+    // @param config: The configuration of the server.
+    RunningServer(std::string const& socketPath,
+                  X86Lab::Server::Config const& config) :
+        m_server(socketPath, config),
+        m_loop([&]() { m_server.run(); }) {}
+
+    ~RunningServer() {
+        m_server.stop();
+        m_loop.join();
+    }
+
+    X86Lab::Server& server() {
+        return m_server;
+    }
+
+private:
+    X86Lab::Server m_server;
+    std::thread m_loop;
+};
+
+// Check that sessions are served concurrently: a session stuck in an endless
+// batch of steps does not prevent another from stepping.
+DECLARE_TEST(testServerSessions) {
+    SourceDirectory const directory;
+    std::unique_ptr<Util::TempFile> const source(writeSourceFile(R"(
+        BITS 64
+        mov     rax, 0x1234
+        spin:
+        jmp     spin
+    )", directory.path() + "/code"));
+
+    Util::TempFile socket("/tmp/x86lab_testsocket");
+    X86Lab::Server::Config config;
+    config.maxSessions = 2;
+    config.sourceDirectory = directory.path();
+    RunningServer running(socket.path(), config);
+    X86Lab::Server& server(running.server());
+
+    {
+        Client busy(socket.path());
+        busy.send("load " + source->path() + "\nuntil rax==1\n");
+        TEST_ASSERT(busy.waitFor("Ready to run"));
+
+        Client other(socket.path());
+        other.send("load /nonexistent/file.asm\n");
+        TEST_ASSERT(other.waitFor("Error: "));
+        other.send("load " + source->path() + "\nstep\nreg rax\n");
+        TEST_ASSERT(other.waitFor("rax = 0x0000000000001234"));
+
+        // No room for a third session.
+        Client rejected(socket.path());
+        TEST_ASSERT(rejected.readAll() == "Error: Too many sessions\n");
+        TEST_ASSERT(server.numSessions() == 2);
+
+        // The session ends when its client quits.
+        other.send("quit\n");
+        other.readAll();
+    }
+    // The busy session is cancelled when its client disconnects.
+    while (!!server.numSessions()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+// Check that stepping stops once the history of a session reaches its quota.
+DECLARE_TEST(testServerHistoryQuota) {
+    SourceDirectory const directory;
+    std::unique_ptr<Util::TempFile> const source(writeSourceFile(R"(
+        BITS 64
+        spin:
+        inc     rax
+        jmp     spin
+    )", directory.path() + "/code"));
+
+    Util::TempFile socket("/tmp/x86lab_testsocket");
+    X86Lab::Server::Config config;
+    config.sourceDirectory = directory.path();
+    // Enough for the base snapshot and a few thousand steps only.
+    config.historyQuota = 256 << 10;
+    RunningServer running(socket.path(), config);
+    {
+        Client client(socket.path());
+        client.send("load " + source->path() + "\nstep 1000000\nreg rax\n");
+        TEST_ASSERT(client.waitFor("History quota"));
+        TEST_ASSERT(client.waitFor("rax = "));
+    }
+}
+
+// Check that clients can only load files from the source directory, cannot
+// run the commands acting on the host and cannot read large ranges of memory.
+DECLARE_TEST(testServerRestrictions) {
+    SourceDirectory const directory;
+    std::string const code(R"(
+        BITS 64
+        mov     rax, 0x1234
+        hlt
+    )");
+    std::unique_ptr<Util::TempFile> const inside(
+        writeSourceFile(code, directory.path() + "/code"));
+    std::unique_ptr<Util::TempFile> const outside(writeSourceFile(code));
+    std::filesystem::create_symlink(outside->path(),
+                                    directory.path() + "/link.asm");
+
+    Util::TempFile socket("/tmp/x86lab_testsocket");
+    X86Lab::Server::Config config;
+    config.sourceDirectory = directory.path();
+    RunningServer running(socket.path(), config);
+    Client client(socket.path());
+    std::string const outsideName(
+        std::filesystem::path(outside->path()).filename());
+    for (std::string const& path : {outside->path(),
+                                    "../" + outsideName,
+                                    std::string("link.asm")}) {
+        client.send("load " + path + "\n");
+        TEST_ASSERT(client.waitFor("outside of the source directory: load " +
+                                   path + "\n"));
+    }
+
+    // Paths are relative to the source directory.
+    std::string const insideName(
+        std::filesystem::path(inside->path()).filename());
+    Util::TempFile snapshot("/tmp/x86lab_testsnapshot");
+    client.send("load " + insideName + "\n"
+                "snapshot save " + snapshot.path() + "\n"
+                "memprofile run\n"
+                "mem 0x0 0x200000\n"
+                "query values 0x0 0x200000\n"
+                "step\n"
+                "reg rax\n"
+                "quit\n");
+    std::string const& output(client.readAll());
+    TEST_ASSERT(output.find("Error: Command not available in this session: "
+                            "snapshot save") != std::string::npos);
+    TEST_ASSERT(output.find("Error: Command not available in this session: "
+                            "memprofile run") != std::string::npos);
+    for (std::string const cmd : {"mem", "query values"}) {
+        TEST_ASSERT(output.find("Error: Length exceeds 1048576 bytes in this "
+                                "session: " + cmd + " 0x0 0x200000") !=
+                    std::string::npos);
+    }
+    TEST_ASSERT(output.find("rax = 0x0000000000001234") != std::string::npos);
+    TEST_ASSERT(!std::filesystem::file_size(snapshot.path()));
+}
+
+// Check that a client sending a line longer than the server accepts gets an
+// error and is disconnected, without affecting the other sessions.
+DECLARE_TEST(testServerInputLimits) {
+    SourceDirectory const directory;
+    std::unique_ptr<Util::TempFile> const source(writeSourceFile(R"(
+        BITS 64
+        mov     rax, 0x1234
+        hlt
+    )", directory.path() + "/code"));
+    std::string const sourceName(
+        std::filesystem::path(source->path()).filename());
+
+    Util::TempFile socket("/tmp/x86lab_testsocket");
+    X86Lab::Server::Config config;
+    config.sourceDirectory = directory.path();
+    RunningServer running(socket.path(), config);
+    Client other(socket.path());
+    other.send("load " + sourceName + "\n");
+    TEST_ASSERT(other.waitFor("Assembled code"));
+
+    Client client(socket.path());
+    client.send(std::string(16 << 10, 'a'));
+    TEST_ASSERT(client.readAll().find("Error: Input line too long\n") !=
+                std::string::npos);
+
+    other.send("step\n"
+               "reg rax\n"
+               "quit\n");
+    TEST_ASSERT(other.readAll().find("rax = 0x0000000000001234") !=
+                std::string::npos);
+}
+}
@@ -1,6 +1,7 @@
 #include <x86lab/vm.hpp>
 #include <x86lab/test.hpp>
 #include <x86lab/snapshot.hpp>
+#include <x86lab/historycompressor.hpp>
 #include <random>
 
 namespace X86Lab::Test::Snapshot {
@@ -167,4 +168,637 @@ DECLARE_TEST(testReadLinearMemory) {
     std::vector<u8> const linMem(snap.readLinearMemory(0, size));
     TEST_ASSERT(phyMem == linMem);
 }
+
+// Test the physicalMemoryHistory method of Snapshot: only value changes of the
+// queried range are reported, with the step and rip of the writer.
+DECLARE_TEST(testPhysicalMemoryHistory) {
+    u64 const memSize(4 * X86Lab::PAGE_SIZE);
+    std::unique_ptr<X86Lab::Vm::State> const initState(genRandomState(memSize));
+    u8 * const initMem(initState->memory().data.get());
+
+    // Offset of the queried qword, straddling two 64-bytes leaves.
+    u64 const offset(0x1000 + 60);
+    std::mt19937_64 generator;
+    // Expected (step, rip, value) for each change of the qword.
+    std::vector<std::tuple<u64, u64, u64>> expected;
+    expected.emplace_back(0, 0, *reinterpret_cast<u64*>(initMem + offset));
+
+    std::shared_ptr<X86Lab::Snapshot> snap;
+    u64 prevRip(0);
+    u64 const numSnapshots(256);
+    for (u64 i(0); i < numSnapshots; ++i) {
+        X86Lab::Vm::State::Registers regs(initState->registers());
+        regs.rip = i * 4;
+        std::unique_ptr<X86Lab::Vm::State> state(
+            new X86Lab::Vm::State(regs,
+                                  X86Lab::Vm::State::Memory({
+                                      .data = std::unique_ptr<u8[]>(
+                                          new u8[memSize]),
+                                      .size = memSize})));
+        u8 * const mem(state->memory().data.get());
+        std::memcpy(mem, !!snap ?
+                         snap->readPhysicalMemory(0, memSize).data() : initMem,
+                    memSize);
+        if (!!i) {
+            u64 const choice(generator() % 4);
+            if (choice == 0) {
+                // Write a new value to the qword.
+                u64 const value(generator());
+                *reinterpret_cast<u64*>(mem + offset) = value;
+                expected.emplace_back(i, prevRip, value);
+            } else if (choice == 1) {
+                // Write to the same leaf, but outside of the qword.
+                mem[offset - 8] ++;
+            } else if (choice == 2) {
+                // Re-write the same value, not observable.
+                *reinterpret_cast<u64*>(mem + offset) =
+                    *reinterpret_cast<u64*>(mem + offset);
+            }
+        }
+        prevRip = regs.rip;
+        snap = std::shared_ptr<X86Lab::Snapshot>(
+            new X86Lab::Snapshot(snap, std::move(state)));
+    }
+
+    std::vector<X86Lab::Snapshot::MemoryWrite> const writes(
+        snap->physicalMemoryHistory(offset, sizeof(u64)));
+    TEST_ASSERT(writes.size() == expected.size());
+    for (u64 i(0); i < writes.size(); ++i) {
+        auto const& [step, rip, value] = expected[i];
+        TEST_ASSERT(writes[i].step == step);
+        TEST_ASSERT(writes[i].rip == rip);
+        TEST_ASSERT(writes[i].value.size() == sizeof(u64));
+        TEST_ASSERT(*reinterpret_cast<u64 const*>(writes[i].value.data()) ==
+                    value);
+    }
+}
+
+// Create a snapshot on top of `base` with the given memory and the registers of
+// the base.
+// @param base: The base snapshot.
+// @param mem: The memory content of the new snapshot.
+// @return: The new snapshot.
+static std::shared_ptr<X86Lab::Snapshot> nextSnapshot(
+    std::shared_ptr<X86Lab::Snapshot> const base,
+    std::vector<u8> const& mem) {
+    std::unique_ptr<X86Lab::Vm::State> state(
+        new X86Lab::Vm::State(base->registers(),
+                              X86Lab::Vm::State::Memory({
+                                  .data = std::unique_ptr<u8[]>(
+                                      new u8[mem.size()]),
+                                  .size = mem.size()})));
+    std::memcpy(state->memory().data.get(), mem.data(), mem.size());
+    return std::shared_ptr<X86Lab::Snapshot>(
+        new X86Lab::Snapshot(base, std::move(state)));
+}
+
+// Check that the leaf granularity adapts to the writes: sparse writes only copy
+// 64 bytes while a page that is entirely rewritten is stored as a single leaf.
+DECLARE_TEST(testAdaptiveLeafGranularity) {
+    u64 const memSize(16 * X86Lab::PAGE_SIZE);
+    std::shared_ptr<X86Lab::Snapshot> snap(
+        new X86Lab::Snapshot(genRandomState(memSize)));
+    X86Lab::Snapshot::StorageStats const rootStats(snap->storageStats());
+    TEST_ASSERT(rootStats.numLeaves == 1);
+    TEST_ASSERT(rootStats.leafBytes == memSize);
+    std::vector<u8> mem(snap->readPhysicalMemory(0, memSize));
+
+    // Sparse write. The rest of the root leaf is shared, not copied. Splitting
+    // all the way down to 64 bytes would cost more in nodes than the few bytes
+    // it saves, hence the leaf can be slightly larger.
+    *reinterpret_cast<u64*>(mem.data() + 0x3008) += 1;
+    snap = nextSnapshot(snap, mem);
+    X86Lab::Snapshot::StorageStats const sparse(snap->storageStats());
+    TEST_ASSERT(sparse.numLeaves == 1);
+    TEST_ASSERT(sparse.leafBytes <= 256);
+    TEST_ASSERT(sparse.changedBytes == 64);
+
+    // Rewrite a whole page: a single leaf is cheaper than 64 small ones.
+    for (u64 i(0); i < X86Lab::PAGE_SIZE; ++i) {
+        mem[0x5000 + i] ++;
+    }
+    snap = nextSnapshot(snap, mem);
+    X86Lab::Snapshot::StorageStats const page(snap->storageStats());
+    TEST_ASSERT(page.numLeaves == 1);
+    TEST_ASSERT(page.leafBytes == X86Lab::PAGE_SIZE);
+    TEST_ASSERT(page.changedBytes == X86Lab::PAGE_SIZE);
+
+    // Sparse write to that page, which can be split again.
+    mem[0x5010] ++;
+    snap = nextSnapshot(snap, mem);
+    TEST_ASSERT(snap->storageStats().leafBytes <= 256);
+
+
+    // Identical memory allocates nothing.
+    snap = nextSnapshot(snap, mem);
+    TEST_ASSERT(snap->storageStats().numNodes == 0);
+    TEST_ASSERT(snap->readPhysicalMemory(0, memSize) == mem);
+
+    // Unchanged parts of the page are reported as shared between the
+    // snapshots, even though they are stored in different leaves.
+    TEST_ASSERT(snap->physicalMemoryHistory(0x5100, 8).size() == 2);
+    TEST_ASSERT(snap->physicalMemoryHistory(0x5010, 1).size() == 3);
+}
+
+// Check snapshots built from the writes since their base: the content matches
+// a full copy while only the written ranges are stored.
+DECLARE_TEST(testSnapshotFromWrites) {
+    u64 const memSize(16 * X86Lab::PAGE_SIZE);
+    std::shared_ptr<X86Lab::Snapshot> snap(
+        new X86Lab::Snapshot(genRandomState(memSize)));
+    std::vector<u8> mem(snap->readPhysicalMemory(0, memSize));
+    std::mt19937_64 generator;
+    for (u64 i(0); i < 64; ++i) {
+        X86Lab::Snapshot::PhysicalData writes;
+        for (u64 j(0); j < 1 + generator() % 4; ++j) {
+            u64 const offset(generator() % memSize);
+            u64 const size(std::min(1 + generator() % 128, memSize - offset));
+            std::vector<u8> data(size);
+            for (u8& byte : data) {
+                byte = generator();
+            }
+            std::memcpy(mem.data() + offset, data.data(), size);
+            writes.emplace_back(offset, data);
+        }
+        std::shared_ptr<X86Lab::Snapshot> const next(new X86Lab::Snapshot(
+            snap, snap->registers(), snap->extendedState(), writes));
+        TEST_ASSERT(next->readPhysicalMemory(0, memSize) == mem);
+        for (auto const& [offset, size] : next->changedPhysicalRanges(*snap)) {
+            bool written(false);
+            for (auto const& [writeOff, data] : writes) {
+                written = written || (writeOff < offset + size &&
+                                      offset < writeOff + data.size());
+            }
+            TEST_ASSERT(written);
+        }
+        // Each write is stored in at most 3 leaves of 64 bytes.
+        TEST_ASSERT(next->storageStats().leafBytes <= 4 * 3 * 64);
+        snap = next;
+    }
+
+    // Later writes take precedence and writing outside of the memory is
+    // ignored.
+    X86Lab::Snapshot::PhysicalData const writes({
+        {0x100, std::vector<u8>(16, 0xaa)},
+        {0x108, std::vector<u8>(4, 0xbb)},
+        {memSize - 2, std::vector<u8>(4, 0xcc)},
+    });
+    std::shared_ptr<X86Lab::Snapshot> const last(new X86Lab::Snapshot(
+        snap, snap->registers(), snap->extendedState(), writes));
+    std::vector<u8> expected(16, 0xaa);
+    std::fill(expected.begin() + 8, expected.begin() + 12, 0xbb);
+    TEST_ASSERT(last->readPhysicalMemory(0x100, 16) == expected);
+    TEST_ASSERT(last->readPhysicalMemory(memSize - 2, 4) ==
+                std::vector<u8>({0xcc, 0xcc, 0, 0}));
+    TEST_ASSERT(last->physicalMemorySize() == memSize);
+}
+
+// Check that changedPhysicalRanges() covers every byte that differs between two
+// snapshots of the same history, and not much more for sparse writes.
+DECLARE_TEST(testChangedPhysicalRanges) {
+    // Not a power of two, the last node of the tree is partially outside of the
+    // memory.
+    u64 const memSize(13 * X86Lab::PAGE_SIZE);
+    std::vector<std::shared_ptr<X86Lab::Snapshot>> snaps;
+    snaps.emplace_back(new X86Lab::Snapshot(genRandomState(memSize)));
+    std::vector<std::vector<u8>> mems;
+    mems.push_back(snaps[0]->readPhysicalMemory(0, memSize));
+    std::mt19937_64 generator;
+    for (u64 i(0); i < 32; ++i) {
+        std::vector<u8> mem(mems.back());
+        for (u64 j(0); j < generator() % 4; ++j) {
+            mem[generator() % memSize] ++;
+        }
+        snaps.push_back(nextSnapshot(snaps.back(), mem));
+        mems.push_back(mem);
+    }
+
+    for (u64 i(0); i < snaps.size(); i += 3) {
+        for (u64 j(0); j < snaps.size(); j += 5) {
+            std::vector<std::pair<u64, u64>> const ranges(
+                snaps[i]->changedPhysicalRanges(*snaps[j]));
+            std::vector<bool> covered(memSize, false);
+            u64 prevEnd(0);
+            for (auto const& [offset, size] : ranges) {
+                TEST_ASSERT(prevEnd <= offset);
+                TEST_ASSERT(offset + size <= memSize);
+                prevEnd = offset + size;
+                for (u64 k(offset); k < offset + size; ++k) {
+                    covered[k] = true;
+                }
+            }
+            for (u64 k(0); k < memSize; ++k) {
+                if (mems[i][k] != mems[j][k]) {
+                    TEST_ASSERT(covered[k]);
+                }
+            }
+        }
+        TEST_ASSERT(snaps[i]->changedPhysicalRanges(*snaps[i]).empty());
+    }
+
+    // Between a snapshot and its base, only the leaves holding their own copy
+    // of the data differ.
+    for (u64 i(1); i < snaps.size(); ++i) {
+        u64 total(0);
+        for (auto const& range : snaps[i]->changedPhysicalRanges(
+                *snaps[i - 1])) {
+            total += range.second;
+        }
+        TEST_ASSERT(total <= snaps[i]->storageStats().leafBytes);
+    }
+}
+
+// Check the content of snapshots built from random writes of random sizes,
+// exercising all the leaf layouts. The size of the memory is not a power of two,
+// as is the case for most Vms since the page tables are allocated after the
+// requested memory.
+DECLARE_TEST(testAdaptiveLeafGranularityRandomWrites) {
+    u64 const memSize(7 * X86Lab::PAGE_SIZE);
+    std::mt19937_64 generator;
+    std::vector<std::shared_ptr<X86Lab::Snapshot>> snaps;
+    std::vector<std::vector<u8>> mems;
+    snaps.emplace_back(new X86Lab::Snapshot(genRandomState(memSize)));
+    mems.push_back(snaps.back()->readPhysicalMemory(0, memSize));
+    for (u64 i(0); i < 256; ++i) {
+        std::vector<u8> mem(mems.back());
+        u64 const numWrites(generator() % 4);
+        for (u64 j(0); j < numWrites; ++j) {
+            u64 const size(u64(1) << (generator() % 13));
+            u64 const offset(generator() % (memSize - size + 1));
+            for (u64 k(0); k < size; ++k) {
+                mem[offset + k] = generator();
+            }
+        }
+        snaps.push_back(nextSnapshot(snaps.back(), mem));
+        mems.push_back(mem);
+        X86Lab::Snapshot::StorageStats const stats(snaps.back()->storageStats());
+        TEST_ASSERT(stats.changedBytes <= stats.leafBytes);
+    }
+    for (u64 i(0); i < snaps.size(); ++i) {
+        TEST_ASSERT(snaps[i]->readPhysicalMemory(0, memSize) == mems[i]);
+    }
+}
+
+// Check snapshots of a memory large enough to be built in parallel, with writes
+// at the boundaries of the ranges built by different threads.
+DECLARE_TEST(testParallelSnapshotConstruction) {
+    u64 const memSize(24 * 1024 * 1024 + 3 * X86Lab::PAGE_SIZE);
+    std::mt19937_64 generator;
+    std::vector<u8> mem(memSize);
+    for (u64 i(0); i < memSize; i += sizeof(u64)) {
+        *reinterpret_cast<u64*>(mem.data() + i) = generator();
+    }
+    std::unique_ptr<X86Lab::Vm::State> state(genRandomState(memSize));
+    std::memcpy(state->memory().data.get(), mem.data(), memSize);
+    std::vector<std::shared_ptr<X86Lab::Snapshot>> snaps;
+    std::vector<std::vector<u8>> mems;
+    snaps.emplace_back(new X86Lab::Snapshot(std::move(state)));
+    mems.push_back(mem);
+
+    // Unchanged memory does not allocate anything.
+    snaps.push_back(nextSnapshot(snaps.back(), mem));
+    mems.push_back(mem);
+    TEST_ASSERT(snaps.back()->storageStats().numNodes == 0);
+
+    for (u64 i(0); i < 16; ++i) {
+        u64 const numWrites(1 + generator() % 4);
+        for (u64 j(0); j < numWrites; ++j) {
+            // Write around the middle, the quarters or at random.
+            u64 const choice(generator() % 5);
+            u64 const offset(choice < 4 ? (memSize / 4) * choice +
+                             generator() % 16 - 8 : generator() % memSize);
+            mem[std::min(offset, memSize - 1)] ++;
+        }
+        snaps.push_back(nextSnapshot(snaps.back(), mem));
+        mems.push_back(mem);
+        X86Lab::Snapshot::StorageStats const stats(snaps.back()->storageStats());
+        TEST_ASSERT(!!stats.changedBytes);
+        TEST_ASSERT(stats.changedBytes <= numWrites * 64);
+    }
+    for (u64 i(0); i < snaps.size(); ++i) {
+        TEST_ASSERT(snaps[i]->readPhysicalMemory(0, memSize) == mems[i]);
+    }
+}
+
+// Compress the memory of old snapshots and check that reading them, as well as
+// building new snapshots, is unaffected.
+DECLARE_TEST(testHistoryCompression) {
+    u64 const memSize(16 * X86Lab::PAGE_SIZE);
+    std::mt19937_64 generator;
+    std::vector<std::shared_ptr<X86Lab::Snapshot>> snaps;
+    std::vector<std::vector<u8>> mems;
+    std::unique_ptr<X86Lab::Vm::State> state(genRandomState(memSize));
+    std::memset(state->memory().data.get(), 0, memSize);
+    snaps.emplace_back(new X86Lab::Snapshot(std::move(state)));
+    mems.push_back(snaps.back()->readPhysicalMemory(0, memSize));
+    for (u64 i(0); i < 200; ++i) {
+        std::vector<u8> mem(mems.back());
+        // Fill a block with a repeated value, except for a few random bytes, as
+        // a rep stos followed by a few writes would.
+        u64 const size(u64(64) << (generator() % 7));
+        u64 const offset((generator() % (memSize / size)) * size);
+        u64 const value(generator() % 2 ? generator() : 0);
+        for (u64 j(0); j < size; j += sizeof(u64)) {
+            std::memcpy(mem.data() + offset + j, &value, sizeof(value));
+        }
+        mem[generator() % memSize] = generator();
+        snaps.push_back(nextSnapshot(snaps.back(), mem));
+        mems.push_back(mem);
+    }
+
+    X86Lab::HistoryCompressor compressor;
+    for (u64 i(0); i < 150; ++i) {
+        compressor.enqueue(snaps[i], snaps.back());
+    }
+    compressor.waitIdle();
+    X86Lab::Snapshot::CompressionStats const stats(compressor.stats());
+    TEST_ASSERT(!!stats.numLeaves);
+    TEST_ASSERT(stats.compressedBytes < stats.rawBytes);
+
+    // Compressing again is a no-op.
+    for (u64 i(0); i < 150; ++i) {
+        TEST_ASSERT(!snaps[i]->compressMemory(*snaps.back()).numLeaves);
+    }
+
+    // The latest snapshot does not use any compressed memory, hence building
+    // on top of it works as usual.
+    std::vector<u8> mem(mems.back());
+    mem[0] ++;
+    snaps.push_back(nextSnapshot(snaps.back(), mem));
+    mems.push_back(mem);
+
+    for (u64 i(0); i < snaps.size(); ++i) {
+        TEST_ASSERT(snaps[i]->readPhysicalMemory(0, memSize) == mems[i]);
+        // Partial reads, served by the decompressed cache.
+        TEST_ASSERT(snaps[i]->readPhysicalMemory(0x1234, 100) ==
+                    std::vector<u8>(mems[i].begin() + 0x1234,
+                                    mems[i].begin() + 0x1234 + 100));
+    }
+}
+
+// Build snapshots of a sparsely populated memory. Pages that are not populated
+// must read as zeroes, whatever their content in the State, and must not be
+// copied.
+DECLARE_TEST(testSparseMemory) {
+    u64 const memSize(64 * 1024 * 1024);
+    u64 const numPages(memSize / X86Lab::PAGE_SIZE);
+    std::unique_ptr<X86Lab::Vm::State> const regState(genRandomState(64));
+    // Only touch the pages used by the test, as the VM would.
+    auto const makeState([&](std::vector<bool> const& populated,
+                             std::vector<u8> const& expected) {
+        X86Lab::Vm::State::Memory mem({
+            .data = std::unique_ptr<u8[]>(new u8[memSize]),
+            .size = memSize,
+            .populated = populated,
+        });
+        for (u64 i(0); i < numPages; ++i) {
+            u8 * const page(mem.data.get() + i * X86Lab::PAGE_SIZE);
+            if (populated[i]) {
+                std::memcpy(page,
+                            expected.data() + i * X86Lab::PAGE_SIZE,
+                            X86Lab::PAGE_SIZE);
+            } else if (i % 1000 == 1) {
+                // Garbage in some pages that are not populated.
+                std::memset(page, 0xaa, X86Lab::PAGE_SIZE);
+            }
+        }
+        return std::unique_ptr<X86Lab::Vm::State>(new X86Lab::Vm::State(
+            regState->registers(), std::move(mem)));
+    });
+
+    std::vector<bool> populated(numPages, false);
+    std::vector<u8> expected(memSize, 0);
+    for (u64 const page : {u64(0), u64(5), u64(10000)}) {
+        populated[page] = true;
+        std::memset(expected.data() + page * X86Lab::PAGE_SIZE,
+                    page + 1,
+                    X86Lab::PAGE_SIZE);
+    }
+    std::shared_ptr<X86Lab::Snapshot> const first(
+        new X86Lab::Snapshot(makeState(populated, expected)));
+    TEST_ASSERT(first->readPhysicalMemory(0, memSize) == expected);
+    TEST_ASSERT(first->storageStats().leafBytes == 3 * X86Lab::PAGE_SIZE);
+
+    // Populate another page, with a single non-zero byte, as well as writing a
+    // previously populated one.
+    populated[2001] = true;
+    expected[2001 * X86Lab::PAGE_SIZE + 17] = 1;
+    expected[5 * X86Lab::PAGE_SIZE] = 0;
+    std::shared_ptr<X86Lab::Snapshot> const second(
+        new X86Lab::Snapshot(first, makeState(populated, expected)));
+    TEST_ASSERT(second->readPhysicalMemory(0, memSize) == expected);
+    TEST_ASSERT(second->storageStats().leafBytes <= 2 * X86Lab::PAGE_SIZE);
+    TEST_ASSERT(second->storageStats().changedBytes == 2 * 64);
+
+    // Populating a page without writing it changes nothing.
+    populated[3000] = true;
+    std::shared_ptr<X86Lab::Snapshot> const third(
+        new X86Lab::Snapshot(second, makeState(populated, expected)));
+    TEST_ASSERT(third->readPhysicalMemory(0, memSize) == expected);
+    TEST_ASSERT(!third->storageStats().leafBytes);
+}
+
+// Check the values derived from the state of snapshots and that they are
+// re-used from the base only when the state they depend on did not change.
+DECLARE_TEST(testDerivedStateCache) {
+    u64 const memSize(16 * X86Lab::PAGE_SIZE);
+    std::vector<u8> mem(memSize, 0);
+    auto const write64([&](u64 const offset, u64 const value) {
+        std::memcpy(mem.data() + offset, &value, sizeof(value));
+    });
+    // Protected mode without paging. The code segment is the second entry of
+    // the GDT, a 32-bit segment.
+    X86Lab::Vm::State::Registers regs(genRandomState(64)->registers());
+    regs.cr0 = 1;
+    regs.efer = 0;
+    regs.cs = 0x8;
+    regs.gdt = {.base = 0x2000, .limit = 0x17};
+    regs.rsp = 0x1000;
+    regs.rbp = 0x1100;
+    write64(0x2008, (1ULL << 47) | (1ULL << 54));
+    // A chain of three stack frames.
+    write64(0x1100, 0x1200);
+    write64(0x1200, 0x1300);
+    write64(0x1300, 0x0);
+
+    auto const makeSnapshot([&](std::shared_ptr<X86Lab::Snapshot> base) {
+        std::unique_ptr<X86Lab::Vm::State> state(
+            new X86Lab::Vm::State(regs,
+                                  X86Lab::Vm::State::Memory({
+                                      .data = std::unique_ptr<u8[]>(
+                                          new u8[memSize]),
+                                      .size = memSize})));
+        std::memcpy(state->memory().data.get(), mem.data(), memSize);
+        return std::shared_ptr<X86Lab::Snapshot>(
+            new X86Lab::Snapshot(base, std::move(state)));
+    });
+    using DescriptorTable = X86Lab::Snapshot::DescriptorTable;
+
+    std::shared_ptr<X86Lab::Snapshot> const first(makeSnapshot(nullptr));
+    TEST_ASSERT(first->cpuMode() == X86Lab::Vm::CpuMode::ProtectedMode);
+    TEST_ASSERT(first->stackFrames() ==
+                std::vector<u64>({0x1100, 0x1200, 0x1300}));
+    TEST_ASSERT(first->descriptorTable(DescriptorTable::Gdt) ==
+                std::vector<u8>(mem.begin() + 0x2000, mem.begin() + 0x2018));
+    TEST_ASSERT(first->mappedRegions() ==
+                std::vector<X86Lab::Snapshot::MappedRegion>({{
+                    .linearAddress = 0,
+                    .physicalOffset = 0,
+                    .size = memSize}}));
+
+    // Register-only snapshot, all values are shared with the base.
+    std::shared_ptr<X86Lab::Snapshot> const second(
+        new X86Lab::Snapshot(first, regs));
+    TEST_ASSERT(&second->stackFrames() == &first->stackFrames());
+    TEST_ASSERT(&second->descriptorTable(DescriptorTable::Gdt) ==
+                &first->descriptorTable(DescriptorTable::Gdt));
+
+    // Writing unrelated memory does not invalidate anything.
+    write64(0x5000, 0x1234);
+    std::shared_ptr<X86Lab::Snapshot> const third(makeSnapshot(second));
+    TEST_ASSERT(&third->stackFrames() == &first->stackFrames());
+    TEST_ASSERT(third->cpuMode() == X86Lab::Vm::CpuMode::ProtectedMode);
+
+    // Changing a saved RBP and the code segment descriptor does.
+    write64(0x1200, 0x1400);
+    write64(0x2008, 1ULL << 47);
+    std::shared_ptr<X86Lab::Snapshot> const fourth(makeSnapshot(third));
+    TEST_ASSERT(fourth->stackFrames() ==
+                std::vector<u64>({0x1100, 0x1200, 0x1400}));
+    TEST_ASSERT(fourth->cpuMode() == X86Lab::Vm::CpuMode::RealMode);
+    TEST_ASSERT(fourth->descriptorTable(DescriptorTable::Gdt) ==
+                std::vector<u8>(mem.begin() + 0x2000, mem.begin() + 0x2018));
+
+    // Changing RBP does as well. A saved RBP pointing to itself ends the
+    // chain.
+    regs.rbp = 0x1400;
+    write64(0x1400, 0x1400);
+    std::shared_ptr<X86Lab::Snapshot> const fifth(makeSnapshot(fourth));
+    TEST_ASSERT(fifth->stackFrames() == std::vector<u64>({0x1400}));
+}
+
+// Check the mapped regions of the identity-mapping set up by a Vm in long mode.
+DECLARE_TEST(testMappedRegions) {
+    u64 const memSize(4 * X86Lab::PAGE_SIZE);
+    std::unique_ptr<X86Lab::Vm> vm(
+        new X86Lab::Vm(X86Lab::Vm::CpuMode::LongMode, memSize));
+    std::unique_ptr<X86Lab::Vm::State> state(vm->getState());
+    u64 const physicalSize(state->memory().size);
+    X86Lab::Snapshot const snap(std::move(state));
+    TEST_ASSERT(snap.mappedRegions() ==
+                std::vector<X86Lab::Snapshot::MappedRegion>({{
+                    .linearAddress = 0,
+                    .physicalOffset = 0,
+                    .size = physicalSize}}));
+}
+
+// Check that tables reached through several paths, as with a recursive
+// mapping, are walked and that the walk of tables referencing themselves over
+// and over is bounded.
+DECLARE_TEST(testMappedRegionsRecursive) {
+    u64 const memSize(8 * X86Lab::PAGE_SIZE);
+    std::vector<u64> mem(memSize / sizeof(u64), 0);
+    // Present and writable.
+    u64 const flags(0x3);
+    auto const entry([&](u64 const table, u64 const index, u64 const value) {
+        mem[(table + index * sizeof(u64)) / sizeof(u64)] = value | flags;
+    });
+    // Linear page 0 is mapped to 0x5000. The last entry of the PML4 maps the
+    // PML4 itself.
+    entry(0x1000, 0, 0x2000);
+    entry(0x2000, 0, 0x3000);
+    entry(0x3000, 0, 0x4000);
+    entry(0x4000, 0, 0x5000);
+    entry(0x1000, 511, 0x1000);
+
+    X86Lab::Vm::State::Registers regs(genRandomState(64)->registers());
+    regs.cr0 = (1ULL << 31) | 1;
+    regs.cr3 = 0x1000;
+    auto const makeSnapshot([&]() {
+        std::unique_ptr<X86Lab::Vm::State> state(
+            new X86Lab::Vm::State(regs,
+                                  X86Lab::Vm::State::Memory({
+                                      .data = std::unique_ptr<u8[]>(
+                                          new u8[memSize]),
+                                      .size = memSize})));
+        std::memcpy(state->memory().data.get(), mem.data(), memSize);
+        return X86Lab::Snapshot(std::move(state));
+    });
+
+    X86Lab::Snapshot const recursive(makeSnapshot());
+    std::vector<X86Lab::Snapshot::MappedRegion> const& regions(
+        recursive.mappedRegions());
+    using MappedRegion = X86Lab::Snapshot::MappedRegion;
+    TEST_ASSERT(regions.front() == MappedRegion({
+        .linearAddress = 0,
+        .physicalOffset = 0x5000,
+        .size = X86Lab::PAGE_SIZE}));
+    // Going through the last entry of the PML4 four times maps the PML4.
+    TEST_ASSERT(regions.back() == MappedRegion({
+        .linearAddress = ~(X86Lab::PAGE_SIZE - 1),
+        .physicalOffset = 0x1000,
+        .size = X86Lab::PAGE_SIZE}));
+
+    // All the entries of the PML4 point to itself.
+    for (u64 i(0); i < 512; ++i) {
+        entry(0x1000, i, 0x1000);
+    }
+    X86Lab::Snapshot const selfReferencing(makeSnapshot());
+    bool thrown(false);
+    try {
+        selfReferencing.mappedRegions();
+    } catch (X86Lab::Error const&) {
+        thrown = true;
+    }
+    TEST_ASSERT(thrown);
+}
+
+// Check that a snapshot shares the extended state of its base when unchanged.
+DECLARE_TEST(testExtendedStateSharing) {
+    u64 const memSize(X86Lab::PAGE_SIZE);
+    X86Lab::Vm::State::Registers const regs({}, {}, {});
+    // Create a snapshot on top of `base` with the given extended state.
+    auto const makeSnapshot([&](
+        std::shared_ptr<X86Lab::Snapshot> const base,
+        X86Lab::Vm::State::ExtendedState const& extendedState) {
+        std::unique_ptr<X86Lab::Vm::State> state(
+            new X86Lab::Vm::State(regs,
+                                  extendedState,
+                                  X86Lab::Vm::State::Memory({
+                                      .data = std::unique_ptr<u8[]>(
+                                          new u8[memSize]()),
+                                      .size = memSize})));
+        return std::shared_ptr<X86Lab::Snapshot>(
+            new X86Lab::Snapshot(base, std::move(state)));
+    });
+
+    X86Lab::Vm::State::ExtendedState extendedState;
+    extendedState.fpu.fcw = 0x037f;
+    extendedState.xcr0 = 0x7;
+    std::shared_ptr<X86Lab::Snapshot> const first(
+        makeSnapshot(nullptr, extendedState));
+    TEST_ASSERT(first->extendedState() == extendedState);
+
+    std::shared_ptr<X86Lab::Snapshot> const second(
+        makeSnapshot(first, extendedState));
+    TEST_ASSERT(&second->extendedState() == &first->extendedState());
+
+    // Register-only snapshots share it as well.
+    std::shared_ptr<X86Lab::Snapshot> const third(
+        new X86Lab::Snapshot(second, regs, extendedState));
+    TEST_ASSERT(&third->extendedState() == &first->extendedState());
+
+    // Any change creates a new copy.
+    extendedState.fpu.st[3].mantissa = 1;
+    std::shared_ptr<X86Lab::Snapshot> const fourth(
+        new X86Lab::Snapshot(third, regs, extendedState));
+    TEST_ASSERT(&fourth->extendedState() != &third->extendedState());
+    TEST_ASSERT(fourth->extendedState() == extendedState);
+    TEST_ASSERT(third->extendedState().fpu.st[3].mantissa == 0);
+
+    // Without an extended state, the one of the base is re-used.
+    std::shared_ptr<X86Lab::Snapshot> const fifth(
+        new X86Lab::Snapshot(fourth, regs));
+    TEST_ASSERT(&fifth->extendedState() == &fourth->extendedState());
+}
 }
@@ -1,4 +1,5 @@
 #include <x86lab/test.hpp>
+#include <fstream>
 #include <iostream>
 #include <vector>
 
@@ -90,4 +91,34 @@ TestRegistration::TestRegistration(TestFunc const& func,
 void runAllTests() {
     getTestCollectionSingleton().run();
 }
+
+std::unique_ptr<Util::TempFile> writeSourceFile(
+    std::string const& assembly,
+    std::string const& pathPrefix) {
+    std::unique_ptr<Util::TempFile> source(new Util::TempFile(pathPrefix));
+    std::ofstream file(source->ostream());
+    if (!file) {
+        throw X86Lab::Error("Cannot open temporary file", errno);
+    }
+    file << assembly;
+    file.close();
+    return source;
+}
+
+std::shared_ptr<Code const> assemble(std::string const& assembly) {
+    std::unique_ptr<Util::TempFile> const source(writeSourceFile(assembly));
+    return std::shared_ptr<Code const>(new Code(source->path()));
+}
+
+std::unique_ptr<X86Lab::Vm> createVmAndLoadCode(
+    X86Lab::Vm::CpuMode const startMode,
+    std::string const& assembly,
+    u64 const memorySize,
+    X86Lab::Vm::Placement const& placement,
+    X86Lab::Vm::BackendType const backend) {
+    std::unique_ptr<X86Lab::Vm> vm(
+        new X86Lab::Vm(startMode, memorySize, placement, backend));
+    vm->loadCode(*assemble(assembly));
+    return vm;
+}
 }
@@ -0,0 +1,79 @@
+#include <x86lab/util.hpp>
+#include <x86lab/vm.hpp>
+#include <x86lab/test.hpp>
+#include <atomic>
+
+// Tests for the helpers in X86Lab::Util.
+
+namespace X86Lab::Test::Util {
+// Check that parallelFor calls the function exactly once for each index.
+DECLARE_TEST(testThreadPoolParallelFor) {
+    X86Lab::Util::ThreadPool pool(4);
+    TEST_ASSERT(pool.numThreads() == 4);
+    for (u64 const count : {0, 1, 3, 1000}) {
+        std::vector<std::atomic<u64>> calls(count);
+        pool.parallelFor(count, [&](u64 const i) {
+            calls[i] ++;
+        });
+        for (u64 i(0); i < count; ++i) {
+            TEST_ASSERT(calls[i] == 1);
+        }
+    }
+}
+
+// Check that nested calls run sequentially instead of deadlocking and that
+// exceptions are forwarded to the caller.
+DECLARE_TEST(testThreadPoolNestedAndExceptions) {
+    X86Lab::Util::ThreadPool pool(4);
+    std::atomic<u64> sum(0);
+    pool.parallelFor(8, [&](u64 const i) {
+        pool.parallelFor(8, [&](u64 const j) {
+            sum += i * 8 + j;
+        });
+    });
+    TEST_ASSERT(sum == 64 * 63 / 2);
+
+    bool thrown(false);
+    try {
+        pool.parallelFor(100, [&](u64 const i) {
+            if (i == 42) {
+                throw X86Lab::Error("Test", 0);
+            }
+        });
+    } catch (X86Lab::Error const&) {
+        thrown = true;
+    }
+    TEST_ASSERT(thrown);
+}
+
+// Check parallelMemcpy on sizes that are not a multiple of the chunk size.
+DECLARE_TEST(testParallelMemcpy) {
+    for (u64 const size : {u64(0), u64(100), u64(48 * 1024 * 1024 + 17)}) {
+        std::vector<u8> src(size);
+        for (u64 i(0); i < size; ++i) {
+            src[i] = i * 7;
+        }
+        std::vector<u8> dest(size);
+        X86Lab::Util::parallelMemcpy(dest.data(), src.data(), size);
+        TEST_ASSERT(dest == src);
+    }
+}
+
+// Check that only the pages touched after an mmap are reported as populated.
+DECLARE_TEST(testPopulatedPages) {
+    u64 const size(16 * X86Lab::PAGE_SIZE);
+    int const prot(PROT_READ | PROT_WRITE);
+    int const flags(MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+    u8 * const mem(static_cast<u8*>(::mmap(NULL, size, prot, flags, -1, 0)));
+    TEST_ASSERT(mem != MAP_FAILED);
+    mem[3 * X86Lab::PAGE_SIZE] = 1;
+    mem[7 * X86Lab::PAGE_SIZE + 123] = 1;
+    std::vector<bool> const populated(
+        X86Lab::Util::Host::populatedPages(mem, size));
+    TEST_ASSERT(populated.size() == 16);
+    for (u64 i(0); i < populated.size(); ++i) {
+        TEST_ASSERT(populated[i] == (i == 3 || i == 7));
+    }
+    ::munmap(mem, size);
+}
+}
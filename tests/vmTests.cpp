@@ -1,38 +1,13 @@
 #include <x86lab/vm.hpp>
 #include <x86lab/code.hpp>
 #include <x86lab/test.hpp>
-#include <fstream>
 #include <random>
+#include <sched.h>
+#include <thread>
 
 // Various tests for the X86Lab::Vm.
 
 namespace X86Lab::Test::Vm {
-// Helper function to create a VM and load the given code to memory.
-// @param startMode: The cpu mode the VM should start in.
-// @param assembly: The assembly code to assemble and load into the Vm.
-// @param memorySize: The size of the physical memory in bytes.
-// @return: A unique_ptr for the instantiated VM.
-static std::unique_ptr<X86Lab::Vm> createVmAndLoadCode(
-    X86Lab::Vm::CpuMode const startMode,
-    std::string const& assembly,
-    u64 const memorySize = X86Lab::PAGE_SIZE) {
-
-    // Create a temporary file to write the code into, it will be used as input
-    // file for the assembler.
-    Util::TempFile source("/tmp/x86lab_testcode");
-    std::ofstream file(source.ostream());
-    if (!file) {
-        throw X86Lab::Error("Cannot open temporary file", errno);
-    }
-    file << assembly;
-    file.close();
-
-    Code const code(source.path());
-    std::unique_ptr<X86Lab::Vm> vm(new X86Lab::Vm(startMode, memorySize));
-    vm->loadCode(code);
-    return vm;
-}
-
 // The simplest test there is: Execute a few NOPs and make sure as well as
 // RFALGS are as expected.
 DECLARE_TEST(testReadRipAndRflags) {
@@ -1435,4 +1410,356 @@ DECLARE_TEST(testReadOpmaskRegisters) {
         runVm(1);
     }
 }
+
+// Test that the thread stepping a VM is pinned to the cpu requested in the VM's
+// placement.
+DECLARE_TEST(testVcpuPinning) {
+    std::string const assembly(R"(
+        BITS 64
+        nop
+        nop
+        hlt
+    )");
+
+    // Save the current affinity of the thread so that it can be restored at the
+    // end of the test.
+    cpu_set_t origCpuSet;
+    TEST_ASSERT(!::sched_getaffinity(0, sizeof(origCpuSet), &origCpuSet));
+
+    // Pin on the last cpu this thread is allowed to run on.
+    u32 cpu(CPU_SETSIZE - 1);
+    while (!CPU_ISSET(cpu, &origCpuSet)) {
+        cpu--;
+    }
+
+    X86Lab::Vm::Placement placement;
+    placement.cpu = cpu;
+    placement.prefault = true;
+    std::unique_ptr<X86Lab::Vm> const vm(
+        createVmAndLoadCode(X86Lab::Vm::CpuMode::LongMode,
+                            assembly,
+                            X86Lab::PAGE_SIZE,
+                            placement));
+    TEST_ASSERT(vm->placement().cpu == cpu);
+
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    TEST_ASSERT(::sched_getcpu() == static_cast<int>(cpu));
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    TEST_ASSERT(::sched_getcpu() == static_cast<int>(cpu));
+
+    TEST_ASSERT(!::sched_setaffinity(0, sizeof(origCpuSet), &origCpuSet));
+}
+
+// Check that a Vm and its clones can be backed by huge pages. Whether the host
+// allocates them depends on its configuration.
+DECLARE_TEST(testHugePages) {
+    X86Lab::Vm::Placement placement;
+    placement.hugePages = true;
+    placement.prefault = true;
+    TEST_ASSERT(placement.toString().ends_with(" prefault=1 hugepages=1"));
+    u64 const memSize(8 << 20);
+    X86Lab::Vm vm(X86Lab::Vm::CpuMode::LongMode, memSize, placement);
+    u64 const value(0xdeadbeefcafe);
+    vm.writePhysicalMemory(memSize - sizeof(value), &value, sizeof(value));
+    TEST_ASSERT(!(vm.hugePageBytes() % (1 << 21)));
+
+    std::unique_ptr<X86Lab::Vm> const clone(vm.clone(placement));
+    std::vector<u8> const data(
+        clone->readPhysicalMemory(memSize - sizeof(value), sizeof(value)));
+    TEST_ASSERT(!std::memcmp(data.data(), &value, sizeof(value)));
+    TEST_ASSERT(!(clone->hugePageBytes() % (1 << 21)));
+}
+
+// Check that the extended state can be set and read back, and that it is part of
+// the State returned by getState().
+DECLARE_TEST(testSetExtendedState) {
+    std::unique_ptr<X86Lab::Vm> const vm(
+        new X86Lab::Vm(X86Lab::Vm::CpuMode::LongMode, X86Lab::PAGE_SIZE));
+    X86Lab::Vm::State::ExtendedState state(vm->getExtendedState());
+    // The segments set up by the Vm for long mode.
+    TEST_ASSERT(state.cs.l);
+    TEST_ASSERT(state.cs.present);
+
+    for (u8 i(0); i < X86Lab::Vm::State::ExtendedState::NumDrRegs; ++i) {
+        state.dr[i] = 0x1000 * (i + 1);
+    }
+    state.fpu.fcw = 0x027f;
+    state.fpu.st[0] = {.mantissa = 0xc000000000000000, .signExponent = 0x3fff};
+    // LSTAR and SYSENTER_EIP.
+    for (u8 i(0); i < X86Lab::Vm::State::ExtendedState::NumMsrs; ++i) {
+        u32 const msr(X86Lab::Vm::State::ExtendedState::Msrs[i]);
+        if (msr == 0xc0000082) {
+            state.msrs[i] = 0xdeadbeefcafe;
+        } else if (msr == 0x176) {
+            state.msrs[i] = 0x12345678;
+        }
+    }
+    vm->setExtendedState(state);
+
+    X86Lab::Vm::State::ExtendedState const readBack(vm->getExtendedState());
+    TEST_ASSERT(readBack == state);
+    TEST_ASSERT(vm->getState()->extendedState() == state);
+}
+
+// Check that scanWorkingSet() reports the pages read and written since the
+// previous scan.
+DECLARE_TEST(testScanWorkingSet) {
+    std::string const assembly(R"(
+        BITS 64
+
+        mov     rax, [0x2000]
+        mov     rbx, [0x2000]
+        mov     [0x3000], rax
+        nop
+        hlt
+    )");
+    u64 const memSize(4 * X86Lab::PAGE_SIZE);
+    std::unique_ptr<X86Lab::Vm> const vm(
+        createVmAndLoadCode(X86Lab::Vm::CpuMode::LongMode, assembly, memSize));
+
+    // Check the result of a scan.
+    // @param accessed: The expected accessed pages among the first 4.
+    // @param dirty: The expected dirty pages among the first 4.
+    auto const checkScan([&](std::vector<bool> const& accessed,
+                             std::vector<bool> const& dirty) {
+        std::optional<X86Lab::Vm::WorkingSet> const ws(vm->scanWorkingSet());
+        TEST_ASSERT(!!ws);
+        // The pages after the requested memory hold the page tables, which
+        // are not accessed through a mapping.
+        for (u64 i(0); i < ws->accessed.size(); ++i) {
+            TEST_ASSERT(ws->accessed[i] == (i < 4 && accessed[i]));
+            TEST_ASSERT(ws->dirty[i] == (i < 4 && dirty[i]));
+        }
+    });
+
+    // Clear the bits that might have been set before running the code.
+    TEST_ASSERT(!!vm->scanWorkingSet());
+
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    checkScan({true, false, true, false}, {false, false, false, false});
+    // The same accesses are reported again since the previous scan cleared
+    // the bits.
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    checkScan({true, false, true, false}, {false, false, false, false});
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    checkScan({true, false, false, true}, {false, false, false, true});
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    checkScan({true, false, false, false}, {false, false, false, false});
+    // Nothing was touched since the last scan.
+    std::optional<X86Lab::Vm::WorkingSet> const ws(vm->scanWorkingSet());
+    TEST_ASSERT(!!ws && !ws->numAccessed() && !ws->numDirty());
+
+    // Only 4-level paging is supported.
+    std::unique_ptr<X86Lab::Vm> const realModeVm(
+        createVmAndLoadCode(X86Lab::Vm::CpuMode::RealMode, assembly));
+    TEST_ASSERT(!realModeVm->scanWorkingSet());
+}
+
+// Check that setMemoryType() sets the PAT, PCD and PWT bits of the leaves
+// mapping a range and rejects invalid ranges.
+DECLARE_TEST(testSetMemoryType) {
+    std::string const assembly(R"(
+        BITS 64
+
+        mov     rax, [0x2000]
+        mov     [0x3000], rax
+        hlt
+    )");
+    u64 const memSize(4 * X86Lab::PAGE_SIZE);
+    std::unique_ptr<X86Lab::Vm> const vm(
+        createVmAndLoadCode(X86Lab::Vm::CpuMode::LongMode, assembly, memSize));
+
+    // The PAT is programmed when creating the Vm.
+    X86Lab::Vm::State::ExtendedState const extendedState(
+        vm->getExtendedState());
+    for (u8 i(0); i < X86Lab::Vm::State::ExtendedState::NumMsrs; ++i) {
+        if (X86Lab::Vm::State::ExtendedState::Msrs[i] == 0x277) {
+            TEST_ASSERT(extendedState.msrs[i] == X86Lab::Vm::PatValue);
+        }
+    }
+
+    // Get the leaf entry of the identity mapping mapping a physical address.
+    auto const leafEntry([&](u64 const addr) {
+        std::unique_ptr<X86Lab::Vm::State> const state(vm->getState());
+        u8 const * const mem(state->memory().data.get());
+        u64 table(vm->getRegisters().cr3 & ~0xFFFULL);
+        u64 entry(0);
+        for (u8 level(4); !!level; --level) {
+            u64 const index((addr >> (12 + (level - 1) * 9)) & 0x1FF);
+            entry = reinterpret_cast<u64 const*>(mem + table)[index];
+            table = entry & 0x000FFFFFFFFFF000ULL;
+        }
+        return entry;
+    });
+    // PAT, PCD and PWT bits of a 4KiB page.
+    u64 const pat(1 << 7);
+    u64 const pcd(1 << 4);
+    u64 const pwt(1 << 3);
+    u64 const typeMask(pat | pcd | pwt);
+    TEST_ASSERT(!(leafEntry(0x2000) & typeMask));
+
+    vm->setMemoryType(0x2000, X86Lab::PAGE_SIZE,
+                      X86Lab::Vm::MemoryType::WriteCombining);
+    TEST_ASSERT((leafEntry(0x2000) & typeMask) == pat);
+    TEST_ASSERT(!(leafEntry(0x1000) & typeMask));
+    TEST_ASSERT(!(leafEntry(0x3000) & typeMask));
+    vm->setMemoryType(0x2000, 2 * X86Lab::PAGE_SIZE,
+                      X86Lab::Vm::MemoryType::Uncacheable);
+    TEST_ASSERT((leafEntry(0x2000) & typeMask) == (pcd | pwt));
+    TEST_ASSERT((leafEntry(0x3000) & typeMask) == (pcd | pwt));
+
+    // The code still runs with uncacheable memory.
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+
+    vm->setMemoryType(0x2000, 2 * X86Lab::PAGE_SIZE,
+                      X86Lab::Vm::MemoryType::WriteBack);
+    TEST_ASSERT(!(leafEntry(0x2000) & typeMask));
+    TEST_ASSERT(!(leafEntry(0x3000) & typeMask));
+
+    // Invalid ranges.
+    auto const throws([&](u64 const offset, u64 const size) {
+        try {
+            vm->setMemoryType(offset, size,
+                              X86Lab::Vm::MemoryType::WriteCombining);
+        } catch (X86Lab::Error const&) {
+            return true;
+        }
+        return false;
+    });
+    TEST_ASSERT(throws(0x2001, X86Lab::PAGE_SIZE));
+    TEST_ASSERT(throws(0x2000, 1));
+    TEST_ASSERT(throws(0x2000, 4 * X86Lab::PAGE_SIZE));
+
+    // Memory types require paging.
+    std::unique_ptr<X86Lab::Vm> const realModeVm(
+        createVmAndLoadCode(X86Lab::Vm::CpuMode::RealMode, assembly));
+    bool thrown(false);
+    try {
+        realModeVm->setMemoryType(0, X86Lab::PAGE_SIZE,
+                                  X86Lab::Vm::MemoryType::Uncacheable);
+    } catch (X86Lab::Error const&) {
+        thrown = true;
+    }
+    TEST_ASSERT(thrown);
+}
+
+// Check that page tables pointing to themselves are walked once when scanning
+// the working set and setting memory types.
+DECLARE_TEST(testSelfReferencingPageTables) {
+    std::string const assembly(R"(
+        BITS 64
+
+        nop
+    )");
+    u64 const memSize(4 * X86Lab::PAGE_SIZE);
+    std::unique_ptr<X86Lab::Vm> const vm(
+        createVmAndLoadCode(X86Lab::Vm::CpuMode::LongMode, assembly, memSize));
+    // All the entries of the PML4 at 0x1000 point to itself, present, writable
+    // and accessed. Without leaves, nothing is mapped.
+    u64 const pml4(0x1000);
+    std::vector<u64> const entries(512, pml4 | (1 << 5) | 0x3);
+    vm->writePhysicalMemory(pml4, entries.data(),
+                            entries.size() * sizeof(u64));
+    X86Lab::Vm::State::Registers regs(vm->getRegisters());
+    regs.cr3 = pml4;
+    vm->setRegisters(regs);
+
+    std::optional<X86Lab::Vm::WorkingSet> const ws(vm->scanWorkingSet());
+    TEST_ASSERT(!!ws && !ws->numAccessed() && !ws->numDirty());
+    vm->setMemoryType(0x2000, X86Lab::PAGE_SIZE,
+                      X86Lab::Vm::MemoryType::Uncacheable);
+    // The accessed bits were cleared by the scan.
+    std::vector<u8> const raw(
+        vm->readPhysicalMemory(pml4, entries.size() * sizeof(u64)));
+    std::vector<u64> cleared(entries.size());
+    std::memcpy(cleared.data(), raw.data(), raw.size());
+    TEST_ASSERT(cleared == std::vector<u64>(entries.size(), pml4 | 0x3));
+}
+
+// Check that clones run independently from their parent and from each other,
+// in parallel, and see the parent's memory as of the time they were created.
+DECLARE_TEST(testClone) {
+    std::string const assembly(R"(
+        BITS 64
+
+        mov     rax, [0x2000]
+        add     rax, [0x3000]
+        mov     [0x2000], rax
+        hlt
+    )");
+    u64 const memSize(4 * X86Lab::PAGE_SIZE);
+    std::unique_ptr<X86Lab::Vm> const vm(
+        createVmAndLoadCode(X86Lab::Vm::CpuMode::LongMode, assembly, memSize));
+
+    auto const write([](X86Lab::Vm& target, u64 const addr, u64 const value) {
+        target.writePhysicalMemory(addr, &value, sizeof(value));
+    });
+    auto const read([](X86Lab::Vm const& target, u64 const addr) {
+        std::unique_ptr<X86Lab::Vm::State> const state(target.getState());
+        u64 value;
+        std::memcpy(&value, state->memory().data.get() + addr, sizeof(value));
+        return value;
+    });
+    // Run a Vm up to the hlt, which is not executed.
+    auto const run([](X86Lab::Vm& target) {
+        while (target.instructionPointer() < 0x18) {
+            target.step();
+        }
+    });
+
+    // Prepare the state the clones start from. The page at 0x1000 is never
+    // accessed by the clones.
+    write(*vm, 0x1000, 7);
+    write(*vm, 0x2000, 40);
+    TEST_ASSERT(vm->step() == X86Lab::Vm::OperatingState::Runnable);
+    X86Lab::Vm::State::Registers const regs(vm->getRegisters());
+    TEST_ASSERT(regs.rax == 40);
+
+    // Each clone adds its own value, in its own thread.
+    u64 const numClones(4);
+    std::vector<std::unique_ptr<X86Lab::Vm>> clones;
+    for (u64 i(0); i < numClones; ++i) {
+        clones.push_back(vm->clone());
+        TEST_ASSERT(clones.back()->getRegisters() == regs);
+        TEST_ASSERT(clones.back()->operatingState() ==
+                    X86Lab::Vm::OperatingState::Runnable);
+        write(*clones.back(), 0x3000, i + 1);
+    }
+    std::vector<std::thread> threads;
+    for (std::unique_ptr<X86Lab::Vm> const& clone : clones) {
+        threads.emplace_back([&]() { run(*clone); });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (u64 i(0); i < numClones; ++i) {
+        TEST_ASSERT(read(*clones[i], 0x2000) == 40 + i + 1);
+        TEST_ASSERT(read(*clones[i], 0x1000) == 7);
+    }
+
+    // The parent is not affected by its clones and its clones are not
+    // affected by the parent running after them.
+    TEST_ASSERT(read(*vm, 0x2000) == 40);
+    TEST_ASSERT(read(*vm, 0x3000) == 0);
+    write(*vm, 0x3000, 100);
+    run(*vm);
+    TEST_ASSERT(read(*vm, 0x2000) == 140);
+    TEST_ASSERT(read(*clones[0], 0x2000) == 41);
+
+    // Cloning after the parent ran, as well as cloning a clone, starts from
+    // their current memory.
+    std::unique_ptr<X86Lab::Vm> const late(vm->clone());
+    TEST_ASSERT(read(*late, 0x2000) == 140);
+    TEST_ASSERT(read(*late, 0x1000) == 7);
+    std::unique_ptr<X86Lab::Vm> const nested(clones[1]->clone());
+    TEST_ASSERT(read(*nested, 0x2000) == 42);
+    TEST_ASSERT(read(*nested, 0x3000) == 2);
+
+    // Destroying clones does not affect the other Vms.
+    clones.clear();
+    write(*late, 0x2000, 1);
+    TEST_ASSERT(read(*late, 0x2000) == 1);
+    TEST_ASSERT(read(*vm, 0x2000) == 140);
+}
 }
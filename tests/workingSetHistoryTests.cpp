@@ -0,0 +1,71 @@
+#include <x86lab/workingsethistory.hpp>
+#include <x86lab/test.hpp>
+
+// Tests for the X86Lab::WorkingSetHistory.
+
+namespace X86Lab::Test::WorkingSetHistory {
+// Build a working set.
+// @param numPages: The number of pages of the working set.
+// @param accessed: The indices of the accessed pages.
+// @param dirty: The indices of the dirty pages.
+// @return: The working set.
+static X86Lab::Vm::WorkingSet makeWorkingSet(u64 const numPages,
+                                             std::vector<u64> const& accessed,
+                                             std::vector<u64> const& dirty) {
+    X86Lab::Vm::WorkingSet ws({
+        .accessed = std::vector<bool>(numPages, false),
+        .dirty = std::vector<bool>(numPages, false),
+    });
+    for (u64 const page : accessed) {
+        ws.accessed[page] = true;
+    }
+    for (u64 const page : dirty) {
+        ws.dirty[page] = true;
+    }
+    return ws;
+}
+
+// Check that samples only keep the touched pages.
+DECLARE_TEST(testWorkingSetHistorySamples) {
+    X86Lab::WorkingSetHistory history(16);
+    history.append(1, makeWorkingSet(16, {0, 3, 15}, {3}));
+    history.append(4, makeWorkingSet(16, {}, {}));
+    TEST_ASSERT(history.size() == 2);
+    TEST_ASSERT(history.numPages() == 16);
+    TEST_ASSERT(history.sample(0).step == 1);
+    TEST_ASSERT(history.sample(0).accessed == std::vector<u64>({0, 3, 15}));
+    TEST_ASSERT(history.sample(0).dirty == std::vector<u64>({3}));
+    TEST_ASSERT(history.sample(1).step == 4);
+    TEST_ASSERT(history.sample(1).accessed.empty());
+    TEST_ASSERT(history.sample(1).dirty.empty());
+    // Two samples and four page indices.
+    TEST_ASSERT(history.storageBytes() ==
+                2 * sizeof(X86Lab::WorkingSetHistory::Sample) +
+                4 * sizeof(u64));
+}
+
+// Check that the footprint of a range of steps counts each page once.
+DECLARE_TEST(testWorkingSetHistoryFootprint) {
+    X86Lab::WorkingSetHistory history(8);
+    history.append(1, makeWorkingSet(8, {0, 1}, {}));
+    history.append(2, makeWorkingSet(8, {0, 2}, {2}));
+    history.append(5, makeWorkingSet(8, {0, 2, 3}, {2, 3}));
+    history.append(6, makeWorkingSet(8, {7}, {7}));
+
+    X86Lab::WorkingSetHistory::Footprint fp(history.footprint(0, 100));
+    TEST_ASSERT(fp.numSamples == 4);
+    TEST_ASSERT(fp.numAccessed == 5);
+    TEST_ASSERT(fp.numDirty == 3);
+
+    fp = history.footprint(2, 5);
+    TEST_ASSERT(fp.numSamples == 2);
+    TEST_ASSERT(fp.numAccessed == 3);
+    TEST_ASSERT(fp.numDirty == 2);
+
+    // No sample between steps 3 and 4.
+    fp = history.footprint(3, 4);
+    TEST_ASSERT(fp.numSamples == 0);
+    TEST_ASSERT(fp.numAccessed == 0);
+    TEST_ASSERT(fp.numDirty == 0);
+}
+}